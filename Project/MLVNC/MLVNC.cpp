@@ -1,8 +1,12 @@
 #include "../ggivnc/config.h"
 #include "MLVNC.h"
+#include "../ggivnc/vnc-engine.h"
 #include <QDebug>
 // #include "../ggivnc/MLVNCBuffer.h"
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/signals2/connection.hpp>
@@ -11,16 +15,45 @@
 
 typedef boost::signals2::signal <void()> BufferRenderedSignalType;
 
-extern int ggivnc_main( int argc, char *argv[] );
+typedef boost::signals2::signal
+    <void( const ggivnc::Frame& )> FrameRenderedSignalType;
+typedef boost::signals2::signal<void( int )> SessionEndedSignalType;
+
+extern struct vnc_session* createGgivncSession();
+extern void destroyGgivncSession( struct vnc_session* session );
+extern int runGgivncSession( struct vnc_session* session,
+    int argc, char *argv[] );
 extern int ggi_main(int argc, char **argv);
-extern void setGgivncTargetFrameBuffer( unsigned char* buf );
-extern void setGgivncPixFormat( const std::string& pixformat );
+extern void setGgivncTargetFrameBuffer( struct vnc_session* session,
+    unsigned char* buf );
+extern void setGgivncPixFormat( struct vnc_session* session,
+    const std::string& pixformat );
+extern void setGgivncDefMode( struct vnc_session* session,
+    const std::string& defmode );
 extern void setFlyggiPixFormat( const std::string& pixformat );
-extern void setGgivncRenderStop( bool stop );
+extern void setGgivncRenderStop( struct vnc_session* session, bool stop );
+extern void setGgivncHoldUpdates( struct vnc_session* session, bool hold );
+extern void ackGgivncFrame( struct vnc_session* session, unsigned int frame );
+extern bool sendGgivncKey( struct vnc_session* session, bool down,
+    uint32_t keysym );
+extern bool sendGgivncPointer( struct vnc_session* session,
+    int buttons, int x, int y );
+extern int sendGgivncInput( struct vnc_session* session,
+    const ggivnc::Input* events, int count );
+extern void getGgivncMetrics( struct vnc_session* session,
+    struct vnc_metrics& snapshot );
+extern int preconnectGgivnc( const std::string& host, int port );
 
 extern boost::signals2::connection connectToGgivncBufferRenderedSignal
     (
-    const BufferRenderedSignalType::slot_type& aSlot
+    struct vnc_session* session,
+    const FrameRenderedSignalType::slot_type& aSlot
+    );
+
+extern boost::signals2::connection connectToGgivncSessionEndedSignal
+    (
+    struct vnc_session* session,
+    const SessionEndedSignalType::slot_type& aSlot
     );
 
 extern boost::signals2::connection connectToFlyggiBufferRenderedSignal
@@ -38,21 +71,22 @@ void MLVNC::startRender()
     switch( mColorFormat )
     {
     case RGB16:
-        setGgivncPixFormat( "r5g6b5" );
+        setGgivncPixFormat( mSession, "r5g6b5" );
         break;
     case RGB888:
-        // Note: libggi is not endian-independent as RGB888
-        // Need to reverse the order and may has endian order problem.
-        // TODO: add cobra to determnie the order
-        setGgivncPixFormat( "b8g8r8" );
-        // setFlyggiPixFormat( "r8g8b8" );
+        // libggi stores 24-bit pixels little endian on all hosts, so
+        // the low byte (red in b8g8r8) comes first in memory.
+        setGgivncPixFormat( mSession, "b8g8r8" );
+        break;
+    case BGR888:
+        setGgivncPixFormat( mSession, "r8g8b8" );
         break;
     case RGB32:
-        setGgivncPixFormat( "p8r8g8b8" );
+        setGgivncPixFormat( mSession, "p8r8g8b8" );
         // setFlyggiPixFormat( "p8r8g8b8" );
         break;
     default:
-        setGgivncPixFormat( "r5g6b5" );
+        setGgivncPixFormat( mSession, "r5g6b5" );
         break;
     }
 
@@ -102,12 +136,10 @@ void MLVNC::startRender()
     }
     ggiDefmode += "]";
 
-    setenv( "GGI_DEFMODE", ggiDefmode.c_str() , 1 );
+    setGgivncDefMode( mSession, ggiDefmode );
 
     qDebug() << "[MLVNC] startRender: " << ggiDefmode.c_str();
 
-    setGgivncRenderStop( false );
-
     std::string serverAddr( mHost + "::" + boost::lexical_cast<std::string>( mPort ) );
     char* ggivncArgv[] =
     {
@@ -115,20 +147,114 @@ void MLVNC::startRender()
         "-ddd",
         const_cast<char*>( serverAddr.c_str() )
     };
-    ggivnc_main( COUNT_OF_ARRAY( ggivncArgv ) , ggivncArgv );
+    if( mEngine )
+    {
+        addGgivncEngineSession( mEngine, mSession,
+            COUNT_OF_ARRAY( ggivncArgv ), ggivncArgv );
+        return;
+    }
+    runGgivncSession( mSession, COUNT_OF_ARRAY( ggivncArgv ), ggivncArgv );
     // set environment
     //ggi_main( 2, aa);
 }
 
 void MLVNC::stopRender()
 {
-    setGgivncRenderStop( true );
+    setGgivncRenderStop( mSession, true );
+    if( mEngine )
+    {
+        removeGgivncEngineSession( mEngine, mSession );
+    }
 }
 
-void MLVNC::onHandleGgivncSignal()
+void MLVNC::setEngine( struct vnc_engine* engine )
 {
-     qDebug() << "Calling mVncEvent";
-     mVncEvent();
+    mEngine = engine;
+}
+
+void MLVNC::onHandleGgivncSignal( const ggivnc::Frame& frame )
+{
+    VncFrame changed;
+    int right = 0;
+    int bottom = 0;
+
+    changed.number = frame.number;
+    changed.x = frame.width;
+    changed.y = frame.height;
+    for( int i = 0; i < frame.dirtyCount; ++i )
+    {
+        const ggivnc::Rect& r = frame.dirty[i];
+
+        changed.x = std::min( changed.x, r.x );
+        changed.y = std::min( changed.y, r.y );
+        right = std::max( right, r.x + r.width );
+        bottom = std::max( bottom, r.y + r.height );
+    }
+    changed.width = std::max( right - changed.x, 0 );
+    changed.height = std::max( bottom - changed.y, 0 );
+
+    mVncEvent( changed );
+}
+
+void MLVNC::onHandleGgivncEnded( int status )
+{
+    qDebug() << "[MLVNC] stopped: " << status;
+    mStopped( status );
+}
+
+void MLVNC::ackFrame( unsigned int frameNumber )
+{
+    ackGgivncFrame( mSession, frameNumber );
+}
+
+bool MLVNC::sendKeyEvents( int key_down, int key_code, int key_extra )
+{
+    (void)key_extra;
+    return sendGgivncKey( mSession, key_down != 0, (uint32_t)key_code );
+}
+
+bool MLVNC::sendPointerEvents( int buttons, int x, int y )
+{
+    return sendGgivncPointer( mSession, buttons, x, y );
+}
+
+int MLVNC::sendInputEvents( const std::vector<ggivnc::Input>& events )
+{
+    if( events.empty() )
+    {
+        return 0;
+    }
+    return sendGgivncInput( mSession, &events[0], (int)events.size() );
+}
+
+void MLVNC::setHoldUpdates( bool hold )
+{
+    setGgivncHoldUpdates( mSession, hold );
+}
+
+void MLVNC::getMetrics( struct vnc_metrics& snapshot ) const
+{
+    getGgivncMetrics( mSession, snapshot );
+}
+
+std::string MLVNC::getMetricsReport() const
+{
+    struct vnc_metrics snapshot;
+    std::vector<char> buf( 4096 );
+    int len;
+
+    getGgivncMetrics( mSession, snapshot );
+    len = metrics_format( &snapshot, &buf[0], buf.size() );
+    if( len < 0 )
+    {
+        return std::string();
+    }
+    if( len >= static_cast<int>( buf.size() ) )
+    {
+        buf.resize( len + 1 );
+        metrics_format( &snapshot, &buf[0], buf.size() );
+    }
+    return std::string( &buf[0], len );
 }
 
 void MLVNC::setFrameBufWidth( int width )
@@ -159,12 +285,26 @@ boost::signals2::connection MLVNC::connectToMlvncEvent
     return mVncEvent.connect( aSlot );
 }
 
+boost::signals2::connection MLVNC::connectToMlvncStopped
+    (
+    const StoppedSignalType::slot_type& aSlot
+    )
+{
+    return mStopped.connect( aSlot );
+}
+
 void MLVNC::connect( const std::string& aHost, int aPort )
 {
     mHost = aHost;
     mPort = aPort;
 }
 
+bool MLVNC::preconnect( const std::string& aHost, int aPort )
+{
+    connect( aHost, aPort );
+    return preconnectGgivnc( aHost, aPort ) == 0;
+}
+
 void MLVNC::setUpdateFPS( int frame_per_second )
 {
     mFps = frame_per_second;
@@ -178,12 +318,12 @@ void MLVNC::repaint()
 
 void MLVNC::disconnect()
 {
-
+    stopRender();
 }
 
 void MLVNC::setFrameBufferPtr( unsigned char* buffer )
 {
-    setGgivncTargetFrameBuffer( buffer );
+    setGgivncTargetFrameBuffer( mSession, buffer );
 }
 
 void MLVNC::setColorDepth( MLVNCColorDepth color_depth )
@@ -198,7 +338,11 @@ void MLVNC::setColorFormat( MLVNCColorFormat color_format )
 
 MLVNC::~MLVNC()
 {
-
+    if( mEngine )
+    {
+        removeGgivncEngineSession( mEngine, mSession );
+    }
+    destroyGgivncSession( mSession );
 }
 
 MLVNC::MLVNC()
@@ -208,6 +352,8 @@ MLVNC::MLVNC()
     , mScreenHeight( 1080 )
     , mFrameBufferWidth( 1920 )
     , mFrameBufferHeight( 1080 )
+    , mSession( createGgivncSession() )
+    , mEngine( NULL )
 {
 
 }
@@ -218,7 +364,8 @@ void MLVNC::pwrp()
 
 void MLVNC::init()
 {
-    connectToGgivncBufferRenderedSignal( boost::bind( &MLVNC::onHandleGgivncSignal,this ) );
+    connectToGgivncBufferRenderedSignal( mSession, boost::bind( &MLVNC::onHandleGgivncSignal,this, _1 ) );
+    connectToGgivncSessionEndedSignal( mSession, boost::bind( &MLVNC::onHandleGgivncEnded, this, _1 ) );
     // connectToFlyggiBufferRenderedSignal( boost::bind( &MLVNC::onHandleGgivncSignal,this ) );
 }
 
@@ -13,8 +13,16 @@
 #include <ggi/ggi.h>
 #include <functional>
 #include <string>
+#include <vector>
 #include <boost/signals2/signal.hpp>
 #include <boost/signals2/connection.hpp>
+extern "C" {
+#include "../ggivnc/vnc-metrics.h"
+}
+#include "../ggivnc/vnc-viewer.h"
+
+struct vnc_session;
+struct vnc_engine;
 
 namespace MLLibrary {
 
@@ -25,8 +33,20 @@ class MLVNC: virtual public MLLibraryBase {
     // Types 
     //------------------------------------------------------------------------
 public:    
-    typedef boost::signals2::signal <void()> VNCSignalType;
-    typedef boost::function<void()> VNCHandler;
+    //! A rendered frame; x, y, width and height bound the area that
+    //! changed since the last frame handed out
+    struct VncFrame
+    {
+        unsigned int number;
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    typedef boost::signals2::signal <void( const VncFrame& )> VNCSignalType;
+    typedef boost::signals2::signal <void( int )> StoppedSignalType;
+    typedef boost::function<void( const VncFrame& )> VNCHandler;
 
     enum MLVNCColorDepth
     {
@@ -43,8 +63,9 @@ public:
     enum MLVNCColorFormat
     {
        RGB16,   // RGB565
-       RGB888,
-       RGB32    // XRGB8888
+       RGB888,  // bytes R, G, B
+       RGB32,   // XRGB8888
+       BGR888   // bytes B, G, R
     };
 
     //------------------------------------------------------------------------
@@ -55,6 +76,9 @@ public:
     virtual void pwrp();
     virtual void init();
     virtual void pwrdn();
+    //! The default viewer. Each MLVNC is a viewer of its own, create
+    //! more of them to show several servers at once; run startRender
+    //! of each on a separate thread.
     static MLVNC* getInstance()
     {
         if( !mInstance )
@@ -68,9 +92,23 @@ public:
     MLVNC();
     virtual ~MLVNC();
     void connect( const std::string& aHost, int aPort = 5900 );
+    //! Start connecting to the server in the background, so that
+    //! startRender finds the connection open and the server greeting
+    //! already received. Also remembers the server as connect does.
+    bool preconnect( const std::string& aHost, int aPort = 5900 );
+    //! Same as stopRender.
     void disconnect();
     void startRender();
+    //! Stop the viewer, from any thread. It drops the connection
+    //! without waiting for the server, startRender returns and the
+    //! stopped signal follows within milliseconds.
     void stopRender();
+
+    //! Run the viewer on engine, shared with other viewers, instead of
+    //! on the thread calling startRender. startRender then returns once
+    //! connected and stopRender ends the session. Set before
+    //! startRender, NULL to run on the calling thread again.
+    void setEngine( struct vnc_engine* engine );
     void setUpdateFPS(int frame_per_second);
     void repaint();
     void setFrameBufWidth( int width );
@@ -80,10 +118,34 @@ public:
     void setColorDepth( MLVNCColorDepth color_depth );
     void setColorFormat( MLVNCColorFormat color_format );
     void setFrameBufferPtr( unsigned char* buffer );
-    //void sendKeyEvents(int key_down, int key_code, int key_extra = 0);
-    //void sendPointerEvents(int buttons, int x, int y);
-    void onHandleGgivncSignal();
+    //! Input for the server, from any thread. key_code is an X keysym,
+    //! key_extra is unused. buttons and x, y are as in the RFB protocol,
+    //! in framebuffer pixels. The time from here to the frame showing
+    //! the result ends up in the input_*_ns metrics. Events are queued
+    //! without locking and sent in batches, false if the queue is full.
+    bool sendKeyEvents( int key_down, int key_code, int key_extra = 0 );
+    bool sendPointerEvents( int buttons, int x, int y );
+    //! Queue many events at once, returns how many fit in the queue.
+    int sendInputEvents( const std::vector<ggivnc::Input>& events );
+    void onHandleGgivncSignal( const ggivnc::Frame& frame );
+    void onHandleGgivncEnded( int status );
+    //! Tell the viewer that a frame has been presented. Once frames are
+    //! acknowledged, updates arriving while the consumer is busy are
+    //! merged into the next frame instead of being signalled one by one.
+    void ackFrame( unsigned int frameNumber );
+    //! Also hold back requesting updates from the server while the
+    //! consumer is busy. Takes effect on the next connection.
+    void setHoldUpdates( bool hold );
+    //! Copy the metrics of the current session. Safe to call from any
+    //! thread while rendering.
+    void getMetrics( struct vnc_metrics& snapshot ) const;
+    //! The same metrics as "name value" lines, histograms as count,
+    //! mean, p50, p90, p99 and max.
+    std::string getMetricsReport() const;
     boost::signals2::connection connectToMlvncEvent( const VNCSignalType::slot_type& aSlot );
+    //! Called once the viewer has stopped and released the connection,
+    //! with 0 for a clean end or stop, on the thread that ran it.
+    boost::signals2::connection connectToMlvncStopped( const StoppedSignalType::slot_type& aSlot );
     
 private:
 
@@ -92,6 +154,7 @@ private:
     static MLVNC* mInstance;
     unsigned char* mFrameBuffer;
     VNCSignalType mVncEvent;
+    StoppedSignalType mStopped;
     int mFrameBufferWidth;
     int mFrameBufferHeight;
     int mScreenWidth;
@@ -101,6 +164,8 @@ private:
     std::string mHost;
     int mPort;
     int mFps;
+    struct vnc_session* mSession;
+    struct vnc_engine* mEngine;
 };
 
 } /* End of namespace MLLibrary */
@@ -13,11 +13,13 @@ VncImageProvider::VncImageProvider( int width, int height, int depth ,QImage::Fo
 
 QImage VncImageProvider::requestImage(const QString &id, QSize *size, const QSize &requestedSize)
 {
+    // The id is the frame number; fetching it means it is on its way
+    // to the screen and the viewer may hand out the next one.
+    MLLibrary::MLVNC::getInstance()->ackFrame( id.toUInt() );
     return mImage;
 }
 
-void VncImageProvider::slotNewFrameReady()
+void VncImageProvider::slotNewFrameReady( const MLLibrary::MLVNC::VncFrame& frame )
 {
-    static int nextFrameNumber = 0;
-    emit signalNewFrameReady( nextFrameNumber++ );
+    emit signalNewFrameReady( frame.number );
 }
@@ -3,6 +3,7 @@
 
 #include <QObject>
 #include <QQuickImageProvider>
+#include "MLVNC.h"
 
 class VncImageProvider : public QObject, public QQuickImageProvider
 {
@@ -13,7 +14,7 @@ public:
     unsigned char* getFrameBuffer(){ return reinterpret_cast<unsigned char*>( mRawData.data() ); }
 
 public slots:
-    void slotNewFrameReady();
+    void slotNewFrameReady( const MLLibrary::MLVNC::VncFrame& frame );
 
 signals:
     Q_SIGNAL void signalNewFrameReady( int frameNumber );
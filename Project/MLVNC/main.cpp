@@ -11,6 +11,7 @@
 #include <QDebug>
 #include "VncThread.h"
 #include <MLVNC.h>
+#include <boost/bind.hpp>
 #include "vncstop.h"
 
 
@@ -31,7 +32,7 @@ int main( int argc, char *argv[] )
     MLLibrary::MLVNC::getInstance()->setFrameBufHeight( h );
     MLLibrary::MLVNC::getInstance()->setColorFormat( MLLibrary::MLVNC::RGB888 );
     MLLibrary::MLVNC::getInstance()->setColorDepth( MLLibrary::MLVNC::MLVNC_24BIT );
-    MLLibrary::MLVNC::getInstance()->connectToMlvncEvent( boost::bind( &VncImageProvider::slotNewFrameReady, imageProvider ) );
+    MLLibrary::MLVNC::getInstance()->connectToMlvncEvent( boost::bind( &VncImageProvider::slotNewFrameReady, imageProvider, _1 ) );
     MLLibrary::MLVNC::getInstance()->setFrameBufferPtr( imageProvider->getFrameBuffer() );
     
     QQuickView *viewer = new QQuickView();
@@ -2,4 +2,4 @@ TEMPLATE = subdirs
 
 # build must be last:
 CONFIG += ordered
-SUBDIRS += MLVNC
+SUBDIRS += ggivnc MLVNC
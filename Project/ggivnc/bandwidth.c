@@ -30,10 +30,13 @@
 
 #include "config.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "vnc.h"
 #include "vnc-debug.h"
+#include "vnc-metrics.h"
 
 static int32_t low_bw_enc[] = {
 	1,	/* copyrect */
@@ -116,11 +119,29 @@ static int32_t high_bw_enc[] = {
 
 #define COUNTOF(x) (int)(sizeof(x) / sizeof(x[0]))
 
-/* The following bandwidth boundaries are the result of hand waving... */
+/* Updates smaller than this say more about latency than throughput, so
+ * they are merged with the following ones before being used as a
+ * throughput sample.
+ */
+#define BW_MIN_SAMPLE 20000
+
+/* A response slower than this is the server waiting for something to
+ * change on the screen, not the network.
+ */
+#define BW_MAX_RTT 2000.0
+
+#define BW_MAX_TIERS 8
+#define BW_ALPHA 0.25
+#define BW_HYSTERESIS 0.2
+
+/* The bandwidth boundaries are the result of hand waving, the round trip
+ * bounds push high latency links toward the better compressing tiers.
+ * Use --bw-tiers to tune them for a particular deployment.
+ */
 static const struct bw_table def_bw_table[] = {
-	{ 10000,  low_bw_enc,  COUNTOF(low_bw_enc) },
-	{ 100000, mid_bw_enc,  COUNTOF(mid_bw_enc) },
-	{ 0,      high_bw_enc, COUNTOF(high_bw_enc) }
+	{ 10000,  400, low_bw_enc,  COUNTOF(low_bw_enc) },
+	{ 100000, 150, mid_bw_enc,  COUNTOF(mid_bw_enc) },
+	{ 0,      0,   high_bw_enc, COUNTOF(high_bw_enc) }
 };
 
 static inline void
@@ -135,15 +156,44 @@ tv_diff(struct timeval *tv2, struct timeval *tv1)
 		tv2->tv_usec -= tv1->tv_usec;
 }
 
+/* Is the estimate within the bounds of tier i, scaled by margin? */
 static int
-match_bw(struct connection *cx, int bw)
+within_tier(struct connection *cx, int i, double margin)
 {
+	const struct bw_table *tier = &cx->bw_table[i];
+
+	if (!tier->bandwidth)
+		return 1;
+	if (cx->bw.rate < tier->bandwidth * margin)
+		return 1;
+	if (tier->rtt && cx->bw.rtt > tier->rtt / margin)
+		return 1;
+	return 0;
+}
+
+/* Leaving the current tier, in either direction, takes passing the
+ * bound in question by the hysteresis fraction. Otherwise an estimate
+ * hovering around a bound flips the encodings back and forth.
+ */
+static int
+match_bw(struct connection *cx)
+{
+	double h = cx->bw_config.hysteresis;
+	int cur = cx->bw.idx - 1;
 	int i;
 
-	for (i = 0; cx->bw_table[i].bandwidth; ++i)
-		if (bw < cx->bw_table[i].bandwidth)
-			break;
+	if (cur < 0) {
+		for (i = 0; !within_tier(cx, i, 1.0); ++i);
+		return i;
+	}
 
+	for (i = 0; i < cur; ++i) {
+		if (within_tier(cx, i, 1.0 - h))
+			return i;
+	}
+	if (within_tier(cx, cur, 1.0 + h))
+		return cur;
+	for (i = cur + 1; !within_tier(cx, i, 1.0); ++i);
 	return i;
 }
 
@@ -171,61 +221,141 @@ bandwidth_end(struct connection *cx)
 	tv_diff(&tv, &cx->bw.start);
 	t = tv.tv_sec + tv.tv_usec / 1000000.0;
 
-	if (cx->bw.count > 20000 ||
-		cx->history.sample[cx->history.index].count + cx->bw.count > 20000)
+	/* Leave out the time spent decoding, that is not the network. */
+	if (cx->cost.update_ns < t * 0.9e9)
+		t -= cx->cost.update_ns / 1e9;
+	else
+		t *= 0.1;
+	cx->cost.update_ns = 0.0;
+
+	debug(2, "last %.0f Bps, bytes %d, time %.3f\n",
+		cx->bw.count / t, cx->bw.count, t);
+
+	cx->bw.pending.count += cx->bw.count;
+	cx->bw.pending.interval += t;
+
+	if ((cx->bw.pending.count >= BW_MIN_SAMPLE || !cx->bw.rate) &&
+		cx->bw.pending.interval > 0)
 	{
-		cx->history.index =
-			(cx->history.index + 1) % COUNTOF(cx->history.sample);
-		cx->history.total.count -=
-			cx->history.sample[cx->history.index].count;
-		cx->history.total.interval -=
-			cx->history.sample[cx->history.index].interval;
-		cx->history.sample[cx->history.index].count = 0.0;
-		cx->history.sample[cx->history.index].interval = 0.0;
+		double sample =
+			cx->bw.pending.count / cx->bw.pending.interval;
+
+		if (cx->bw.rate)
+			cx->bw.rate +=
+				cx->bw_config.alpha * (sample - cx->bw.rate);
+		else
+			cx->bw.rate = sample;
+		cx->bw.pending.count = 0.0;
+		cx->bw.pending.interval = 0.0;
 	}
 
-	cx->history.sample[cx->history.index].count += cx->bw.count;
-	cx->history.sample[cx->history.index].interval += t;
-	cx->history.total.count += cx->bw.count;
-	cx->history.total.interval += t;
+	if (!cx->bw.rate)
+		return 0;
 
-	cx->bw.estimate = cx->history.total.count / cx->history.total.interval;
-	idx = match_bw(cx, cx->bw.estimate);
+	cx->bw.estimate = cx->bw.rate;
+	idx = match_bw(cx);
 
-	debug(2, "%d Bps (last %.0f Bps, bytes %d, time %.3f)\n",
-		cx->bw.estimate, cx->bw.count / t, cx->bw.count, t);
+	debug(2, "%d Bps, rtt %.1f ms\n", cx->bw.estimate, cx->bw.rtt);
 
 	if (cx->bw.idx != idx + 1) {
-		cx->encoding_count = cx->bw_table[idx].count;
-		cx->encoding = cx->bw_table[idx].encoding;
+		debug(1, "bandwidth tier %d (%d Bps, rtt %.1f ms)\n",
+			idx, cx->bw.estimate, cx->bw.rtt);
 		cx->bw.idx = idx + 1;
-		return vnc_set_encodings(cx);
+		return cost_select(cx, &cx->bw_table[idx], 1);
 	}
 
-	return 0;
+	return cost_select(cx, &cx->bw_table[idx], 0);
+}
+
+void
+bandwidth_request(struct connection *cx)
+{
+	if (cx->bw.requested)
+		return;
+	ggCurTime(&cx->bw.request);
+	cx->bw.requested = 1;
+}
+
+/* Input sent with an update request in flight is likely what the server
+ * responds to, so time the response from the input instead.
+ */
+void
+bandwidth_input(struct connection *cx)
+{
+	if (cx->bw.requested)
+		ggCurTime(&cx->bw.request);
+}
+
+/* An update is arriving. The time since the request is the round trip
+ * plus however long the server waited for a change, so the estimate is
+ * the minimum over the last few responses.
+ */
+void
+bandwidth_response(struct connection *cx)
+{
+	struct timeval tv;
+	double rtt;
+	int i;
+
+	if (!cx->bw.requested)
+		return;
+	cx->bw.requested = 0;
+
+	ggCurTime(&tv);
+	tv_diff(&tv, &cx->bw.request);
+	rtt = tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+	if (rtt > BW_MAX_RTT)
+		return;
+	metrics_record(&cx->metrics.update_rtt_ns, (uint64_t)(rtt * 1e6));
+
+	cx->bw.rtt_index = (cx->bw.rtt_index + 1) % COUNTOF(cx->bw.rtt_sample);
+	cx->bw.rtt_sample[cx->bw.rtt_index] = rtt;
+
+	for (i = 0; i < COUNTOF(cx->bw.rtt_sample); ++i) {
+		if (cx->bw.rtt_sample[i] >= 0 && cx->bw.rtt_sample[i] < rtt)
+			rtt = cx->bw.rtt_sample[i];
+	}
+	cx->bw.rtt = rtt;
 }
 
 int
 bandwidth_init(struct connection *cx)
 {
+	const struct bw_table *tiers = def_bw_table;
+	int tier_count;
 	int i = 0;
 
-	cx->bw_table = malloc(sizeof(def_bw_table));
+	memset(&cx->bw, 0, sizeof(cx->bw));
+	for (i = 0; i < COUNTOF(cx->bw.rtt_sample); ++i)
+		cx->bw.rtt_sample[i] = -1.0;
+
+	if (cx->bw_config.tiers)
+		tiers = cx->bw_config.tiers;
+	else {
+		cx->bw_config.alpha = BW_ALPHA;
+		cx->bw_config.hysteresis = BW_HYSTERESIS;
+	}
+
+	for (tier_count = 1; tiers[tier_count - 1].bandwidth; ++tier_count);
+
+	cx->bw_table = malloc(tier_count * sizeof(*cx->bw_table));
 	if (!cx->bw_table)
 		return -1;
-	memset(cx->bw_table, 0, sizeof(def_bw_table));
+	memset(cx->bw_table, 0, tier_count * sizeof(*cx->bw_table));
 
+	i = 0;
 	do {
 		int j;
 		cx->bw_table[i].encoding = malloc(
-			def_bw_table[i].count *
+			tiers[i].count *
 				sizeof(*cx->bw_table[i].encoding));
 		if (!cx->bw_table[i].encoding)
 			goto err;
 
-		cx->bw_table[i].bandwidth = def_bw_table[i].bandwidth;
-		for (j = 0; j < def_bw_table[i].count; ++j) {
-			int32_t encoding = def_bw_table[i].encoding[j];
+		cx->bw_table[i].bandwidth = tiers[i].bandwidth;
+		cx->bw_table[i].rtt = tiers[i].rtt;
+		for (j = 0; j < tiers[i].count; ++j) {
+			int32_t encoding = tiers[i].encoding[j];
 			int k;
 			for (k = 0; k < cx->allowed_encodings; ++k) {
 				if (encoding == cx->allow_encoding[k])
@@ -253,7 +383,12 @@ bandwidth_init(struct connection *cx)
 			cx->bw_table[i].encoding[cx->bw_table[i].count++] =
 				encoding;
 		}
-	} while(def_bw_table[i++].bandwidth);
+	} while(tiers[i++].bandwidth);
+
+	if (cost_init(cx)) {
+		bandwidth_fini(cx);
+		return -1;
+	}
 
 	return 0;
 
@@ -270,9 +405,15 @@ bandwidth_fini(struct connection *cx)
 {
 	int i = 0;
 
+	cost_fini(cx);
+
 	if (!cx->bw_table)
 		return;
 
+	/* Don't leave the connection with a freed encoding list. */
+	cx->encoding_count = cx->allowed_encodings;
+	cx->encoding = cx->allow_encoding;
+
 	do
 		free(cx->bw_table[i].encoding);
 	while(cx->bw_table[i++].bandwidth);
@@ -280,3 +421,165 @@ bandwidth_fini(struct connection *cx)
 	free(cx->bw_table);
 	cx->bw_table = NULL;
 }
+
+static void
+free_tiers(struct bw_table *tiers)
+{
+	int i;
+
+	for (i = 0; i < BW_MAX_TIERS; ++i) {
+		if (tiers[i].encoding)
+			free(tiers[i].encoding);
+	}
+	free(tiers);
+}
+
+static int
+parse_tier(struct bw_table *tier, char *str)
+{
+	char encodings[768];
+	char *enc;
+	char *end;
+	int count = 1;
+
+	if (sscanf(str, "%d %d %767s",
+		&tier->bandwidth, &tier->rtt, encodings) != 3)
+	{
+		return -1;
+	}
+	if (tier->bandwidth < 0 || tier->rtt < 0)
+		return -1;
+
+	for (enc = encodings; (enc = strchr(enc, ',')); ++enc)
+		++count;
+
+	tier->encoding = malloc(count * sizeof(*tier->encoding));
+	if (!tier->encoding)
+		return -1;
+
+	for (enc = encodings; enc; enc = end) {
+		end = strchr(enc, ',');
+		if (end)
+			*end++ = '\0';
+		if (find_encoding(enc, &tier->encoding[tier->count])) {
+			debug(0, "unknown encoding %s\n", enc);
+			return -1;
+		}
+		++tier->count;
+	}
+
+	return 0;
+}
+
+/* Read encoding tiers from a file, with lines
+ *
+ *	tier <bandwidth> <rtt> <encoding>,<encoding>,...
+ *	alpha <weight>
+ *	hysteresis <percent>
+ *
+ * Tiers go from the slowest link to the fastest, bandwidth in bytes per
+ * second and rtt in milliseconds. Only the last tier, which must be
+ * present, has no bounds (0 0). alpha is the weight of a new sample in
+ * the throughput average. A '#' starts a comment.
+ */
+int
+bandwidth_load(struct connection *cx, const char *file)
+{
+	FILE *f;
+	char line[1024];
+	struct bw_table *tiers;
+	int count = 0;
+	int lineno = 0;
+	double alpha = BW_ALPHA;
+	double hysteresis = BW_HYSTERESIS * 100;
+	int i;
+
+	f = fopen(file, "rt");
+	if (!f) {
+		debug(0, "error opening bandwidth tiers file: %s\n", file);
+		return -1;
+	}
+
+	tiers = calloc(BW_MAX_TIERS, sizeof(*tiers));
+	if (!tiers) {
+		fclose(f);
+		debug(0, "error allocating bandwidth tiers memory\n");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char key[16];
+		char *p;
+		int pos;
+
+		++lineno;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		if (sscanf(line, " %15s%n", key, &pos) != 1)
+			continue;
+		p = line + pos;
+
+		if (!strcmp(key, "tier")) {
+			if (count == BW_MAX_TIERS)
+				goto bad;
+			if (parse_tier(&tiers[count++], p))
+				goto bad;
+		}
+		else if (!strcmp(key, "alpha")) {
+			if (sscanf(p, "%lf", &alpha) != 1)
+				goto bad;
+			if (alpha <= 0.0 || alpha > 1.0)
+				goto bad;
+		}
+		else if (!strcmp(key, "hysteresis")) {
+			if (sscanf(p, "%lf", &hysteresis) != 1)
+				goto bad;
+			if (hysteresis < 0.0 || hysteresis >= 100.0)
+				goto bad;
+		}
+		else
+			goto bad;
+	}
+	if (ferror(f)) {
+		debug(0, "error reading bandwidth tiers file: %s\n", file);
+		goto err;
+	}
+	fclose(f);
+
+	for (i = 0; i < count - 1; ++i) {
+		if (!tiers[i].bandwidth)
+			break;
+	}
+	if (!count || i < count - 1 ||
+		tiers[count - 1].bandwidth || tiers[count - 1].rtt)
+	{
+		debug(0, "%s: only the last tier must have no bounds\n",
+			file);
+		free_tiers(tiers);
+		return -1;
+	}
+
+	bandwidth_unload(cx);
+	cx->bw_config.tiers = tiers;
+	cx->bw_config.alpha = alpha;
+	cx->bw_config.hysteresis = hysteresis / 100.0;
+	return 0;
+
+bad:
+	debug(0, "%s:%d: bad bandwidth tier line\n", file, lineno);
+err:
+	fclose(f);
+	free_tiers(tiers);
+	return -1;
+}
+
+void
+bandwidth_unload(struct connection *cx)
+{
+	if (!cx->bw_config.tiers)
+		return;
+
+	free_tiers(cx->bw_config.tiers);
+	cx->bw_config.tiers = NULL;
+}
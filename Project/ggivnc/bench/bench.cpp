@@ -0,0 +1,731 @@
+/*
+******************************************************************************
+
+   Decoder benchmarks.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <boost/bind/bind.hpp>
+#include <benchmark/benchmark.h>
+
+#include "vnc-viewer.h"
+#include "bench.h"
+
+extern "C" {
+#include "vnc-metrics.h"
+#include "vnc-pixel.h"
+#include "vnc-kernel.h"
+}
+
+// Each benchmark runs the viewer library against the synthetic server
+// of server.c, on the loopback interface. The server has one update
+// encoded up front and answers every request with it, the viewer holds
+// back its next request until the frame is acked, so one iteration is
+// one update going through read, decode and present.
+namespace {
+
+// RFB encoding numbers, for the per encoding metrics of the viewer.
+const int wireEncoding[BENCH_ENCODINGS] =
+{
+    0, 1, 2, 4, 5, 6, 8, 15, 16, 7, 7, 7, 7
+};
+
+struct Options
+{
+    int width;
+    int height;
+    std::string format;
+    std::vector<std::string> images;
+    std::vector<std::string> replays;
+    std::string latency;
+
+    Options()
+        : width( 1280 )
+        , height( 720 )
+    {
+    }
+};
+
+Options options;
+std::vector<bench_image*> images;
+int failures;
+
+// Stop a benchmark on an error that is ours, a decoder gone wrong or a
+// viewer that stalls, and make the run fail for it.
+void fail( benchmark::State& state, const char* error )
+{
+    ++failures;
+    state.SkipWithError( error );
+}
+
+class FrameSink
+{
+public:
+    FrameSink()
+        : mNumber( 0 )
+        , mFrames( 0 )
+        , mEnded( false )
+        , mWidth( 0 )
+        , mHeight( 0 )
+    {
+    }
+
+    void onFrame( const ggivnc::Frame& frame )
+    {
+        std::lock_guard<std::mutex> guard( mLock );
+
+        if( !mFrames++ )
+        {
+            // The first frame is the whole picture, keep it to check.
+            mWidth = frame.width;
+            mHeight = frame.height;
+            mFirst.resize( frame.width * frame.height );
+            for( int y = 0; y < frame.height; ++y )
+            {
+                memcpy( &mFirst[y * frame.width],
+                    frame.buffer + y * frame.stride, frame.width * 4 );
+            }
+        }
+        mNumber = frame.number;
+        mCond.notify_all();
+    }
+
+    void onEnd( int )
+    {
+        std::lock_guard<std::mutex> guard( mLock );
+
+        mEnded = true;
+        mCond.notify_all();
+    }
+
+    //! Wait for a frame after last. Returns false on timeout or end.
+    bool wait( unsigned int last, unsigned int& number )
+    {
+        std::unique_lock<std::mutex> guard( mLock );
+
+        mCond.wait_for( guard, std::chrono::seconds( 10 ),
+            [&]{ return mEnded || ( mFrames && mNumber != last ); } );
+        if( mEnded || !mFrames || mNumber == last )
+        {
+            return false;
+        }
+        number = mNumber;
+        return true;
+    }
+
+    //! Wait for the viewer to end, however long that takes.
+    void waitEnd()
+    {
+        std::unique_lock<std::mutex> guard( mLock );
+
+        mCond.wait( guard, [&]{ return mEnded; } );
+    }
+
+    //! Compare the first frame with the picture. Local pixels are
+    //! p8r8g8b8, which any wire format with 8 bits per color converts
+    //! to exactly.
+    bool matches( const bench_image* img )
+    {
+        std::lock_guard<std::mutex> guard( mLock );
+        const uint8_t* rgb = img->rgb;
+
+        if( mWidth != img->width || mHeight != img->height )
+        {
+            return false;
+        }
+        for( size_t i = 0; i < mFirst.size(); ++i, rgb += 3 )
+        {
+            uint32_t expect = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+            if( ( mFirst[i] & 0xffffff ) != expect )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mCond;
+    unsigned int mNumber;
+    unsigned int mFrames;
+    bool mEnded;
+    int mWidth;
+    int mHeight;
+    std::vector<uint32_t> mFirst;
+};
+
+void benchDecode( benchmark::State& state,
+    enum bench_encoding encoding, const bench_image* img )
+{
+    const bench_encoding_info& info = bench_encodings[encoding];
+    std::string port;
+    std::vector<char*> argv;
+    bench_server* server;
+    bench_format format;
+    struct vnc_metrics before, after;
+    FrameSink sink;
+    ggivnc::Viewer viewer;
+    unsigned int frame = 0;
+    uint64_t bytes, pixels, updates, decodeNs;
+    int serverPort;
+
+    if( !info.available )
+    {
+        state.SkipWithError( "not built in" );
+        return;
+    }
+
+    server = bench_server_start( img, encoding, 0, &serverPort );
+    if( !server )
+    {
+        fail( state, "cannot start the server" );
+        return;
+    }
+    port = "127.0.0.1::" + std::to_string( serverPort );
+
+    argv.push_back( const_cast<char*>( "ggivnc" ) );
+    argv.push_back( const_cast<char*>( "-e" ) );
+    argv.push_back( const_cast<char*>( info.option ) );
+    if( !options.format.empty() )
+    {
+        argv.push_back( const_cast<char*>( "-f" ) );
+        argv.push_back( const_cast<char*>( options.format.c_str() ) );
+    }
+    argv.push_back( const_cast<char*>( port.c_str() ) );
+    argv.push_back( NULL );
+
+    viewer.setFormat( "p8r8g8b8" );
+    viewer.setHoldUpdates( true );
+    viewer.setFrameHandler(
+        boost::bind( &FrameSink::onFrame, &sink, boost::placeholders::_1 ) );
+    viewer.setEndHandler(
+        boost::bind( &FrameSink::onEnd, &sink, boost::placeholders::_1 ) );
+
+    if( viewer.open( (int)argv.size() - 1, &argv[0] ) )
+    {
+        fail( state, "cannot connect" );
+        bench_server_stop( server );
+        return;
+    }
+
+    if( !sink.wait( 0, frame ) )
+    {
+        const char* error = bench_server_error( server );
+        fail( state, error ? error : "no first frame" );
+        viewer.close();
+        bench_server_stop( server );
+        return;
+    }
+
+    bench_server_format( server, &format );
+    if( info.lossless && format.r_max == 255 && format.g_max == 255
+        && format.b_max == 255 && !sink.matches( img ) )
+    {
+        fail( state, "decoded frame differs from the picture" );
+        viewer.close();
+        bench_server_stop( server );
+        return;
+    }
+
+    viewer.ackFrame( frame );
+    viewer.getMetrics( before );
+
+    for( auto _ : state )
+    {
+        if( !sink.wait( frame, frame ) )
+        {
+            const char* error = bench_server_error( server );
+            fail( state, error ? error : "viewer stalled" );
+            break;
+        }
+        viewer.ackFrame( frame );
+    }
+
+    // Frames may merge updates, count what the viewer went through.
+    viewer.getMetrics( after );
+    bench_server_stats( server, &bytes, &pixels );
+    updates = after.updates - before.updates;
+    decodeNs = after.encoding[wireEncoding[encoding]].decode_ns.sum
+        - before.encoding[wireEncoding[encoding]].decode_ns.sum;
+
+    state.SetBytesProcessed( after.bytes_in - before.bytes_in );
+    state.counters["pixels"] = benchmark::Counter(
+        (double)( updates * pixels ), benchmark::Counter::kIsRate );
+    state.counters["update_bytes"] = (double)bytes;
+    if( decodeNs )
+    {
+        // Decoding alone, in thread cpu time.
+        state.counters["decode_pixels"] =
+            1e9 * ( updates * pixels ) / decodeNs;
+    }
+
+    viewer.close();
+    bench_server_stop( server );
+}
+
+// One iteration is a whole recorded session, played back as fast as
+// the viewer takes it. Opening the viewer is not timed.
+void benchReplay( benchmark::State& state, const std::string& file )
+{
+    struct vnc_metrics metrics;
+    uint64_t bytes = 0, pixels = 0;
+
+    for( auto _ : state )
+    {
+        FrameSink sink;
+        ggivnc::Viewer viewer;
+        char* argv[] =
+        {
+            const_cast<char*>( "ggivnc" ),
+            const_cast<char*>( "--replay" ),
+            const_cast<char*>( file.c_str() ),
+            NULL
+        };
+
+        state.PauseTiming();
+        viewer.setFormat( "p8r8g8b8" );
+        viewer.setEndHandler(
+            boost::bind( &FrameSink::onEnd, &sink,
+                boost::placeholders::_1 ) );
+        if( viewer.open( 3, argv ) )
+        {
+            fail( state, "cannot replay" );
+            break;
+        }
+        state.ResumeTiming();
+
+        sink.waitEnd();
+
+        state.PauseTiming();
+        viewer.getMetrics( metrics );
+        bytes += metrics.bytes_in;
+        for( size_t i = 0;
+            i < sizeof( metrics.encoding ) / sizeof( metrics.encoding[0] );
+            ++i )
+        {
+            pixels += metrics.encoding[i].pixels;
+        }
+        viewer.close();
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed( bytes );
+    state.counters["pixels"] = benchmark::Counter(
+        (double)pixels, benchmark::Counter::kIsRate );
+}
+
+// One iteration is a whole --latency-bench run against the server in
+// echo mode, which answers each pointer move with an update. Every
+// frame is acked as it comes, so all steps from input to ack count.
+void benchLatency( benchmark::State& state,
+    enum bench_encoding encoding, const bench_image* img )
+{
+    const bench_encoding_info& info = bench_encodings[encoding];
+    static const char* const step[] =
+    {
+        "update", "decoded", "presented", "acked"
+    };
+    struct vnc_metrics metrics;
+    const struct metrics_hist* hist[4];
+
+    memset( &metrics, 0, sizeof( metrics ) );
+    if( !info.available )
+    {
+        state.SkipWithError( "not built in" );
+        return;
+    }
+
+    for( auto _ : state )
+    {
+        FrameSink sink;
+        ggivnc::Viewer viewer;
+        std::string port;
+        std::vector<char*> argv;
+        bench_server* server;
+        int serverPort;
+
+        state.PauseTiming();
+        server = bench_server_start( img, encoding, 1, &serverPort );
+        if( !server )
+        {
+            fail( state, "cannot start the server" );
+            break;
+        }
+        port = "127.0.0.1::" + std::to_string( serverPort );
+
+        argv.push_back( const_cast<char*>( "ggivnc" ) );
+        argv.push_back( const_cast<char*>( "-e" ) );
+        argv.push_back( const_cast<char*>( info.option ) );
+        if( !options.format.empty() )
+        {
+            argv.push_back( const_cast<char*>( "-f" ) );
+            argv.push_back( const_cast<char*>( options.format.c_str() ) );
+        }
+        argv.push_back( const_cast<char*>( "--latency-bench" ) );
+        argv.push_back( const_cast<char*>( options.latency.c_str() ) );
+        argv.push_back( const_cast<char*>( port.c_str() ) );
+        argv.push_back( NULL );
+
+        viewer.setFormat( "p8r8g8b8" );
+        viewer.setFrameHandler( [&]( const ggivnc::Frame& frame )
+            {
+                sink.onFrame( frame );
+                viewer.ackFrame( frame.number );
+            } );
+        viewer.setEndHandler(
+            boost::bind( &FrameSink::onEnd, &sink,
+                boost::placeholders::_1 ) );
+        if( viewer.open( (int)argv.size() - 1, &argv[0] ) )
+        {
+            fail( state, "cannot connect" );
+            bench_server_stop( server );
+            break;
+        }
+        state.ResumeTiming();
+
+        sink.waitEnd();
+
+        state.PauseTiming();
+        viewer.getMetrics( metrics );
+        viewer.close();
+        if( bench_server_error( server ) )
+        {
+            fail( state, bench_server_error( server ) );
+            bench_server_stop( server );
+            break;
+        }
+        bench_server_stop( server );
+        state.ResumeTiming();
+    }
+
+    hist[0] = &metrics.input_update_ns;
+    hist[1] = &metrics.input_decode_ns;
+    hist[2] = &metrics.input_present_ns;
+    hist[3] = &metrics.input_ack_ns;
+    for( int i = 0; i < 4; ++i )
+    {
+        std::string name = step[i];
+
+        state.counters[name + "_p50_ms"] =
+            metrics_percentile( hist[i], 0.5 ) / 1e6;
+        state.counters[name + "_p99_ms"] =
+            metrics_percentile( hist[i], 0.99 ) / 1e6;
+    }
+    state.counters["moves"] = (double)metrics.input_update_ns.count;
+}
+
+// The 3-byte cpixels of ZRLE and TRLE, unpacked to 32-bit local pixels
+// in every combination of wire and local byte order, and checked. The
+// local byte order differs from the host's on a reverse endian visual.
+void benchCpixel( benchmark::State& state,
+    bool wireBig, bool localBig, int shift )
+{
+    const int count = 4096;
+    std::vector<uint8_t> wire( 3 * count );
+    std::vector<uint32_t> expect( count );
+    std::vector<uint32_t> local( count );
+    const struct pixel_ops* ops =
+        pixel_ops_lookup( 3, wireBig, wireBig != localBig, shift );
+    uint32_t seed = 1;
+
+    if( !ops )
+    {
+        fail( state, "no kernels" );
+        return;
+    }
+
+    for( int i = 0; i < count; ++i )
+    {
+        const uint8_t* c = &wire[3 * i];
+        uint32_t value;
+        uint8_t bytes[4];
+
+        for( int j = 0; j < 3; ++j )
+        {
+            seed = seed * 1103515245 + 12345;
+            wire[3 * i + j] = seed >> 16;
+        }
+        value = wireBig
+            ? (uint32_t)c[0] << 16 | c[1] << 8 | c[2]
+            : (uint32_t)c[2] << 16 | c[1] << 8 | c[0];
+        value <<= shift;
+        for( int j = 0; j < 4; ++j )
+        {
+            bytes[j] = value >> ( localBig ? 24 - 8 * j : 8 * j );
+        }
+        memcpy( &expect[i], bytes, 4 );
+    }
+
+    ops->unpack( &local[0], &wire[0], count );
+    if( local != expect || ops->get( &wire[0] ) != expect[0] )
+    {
+        fail( state, "cpixels unpacked wrong" );
+        return;
+    }
+
+    for( auto _ : state )
+    {
+        ops->unpack( &local[0], &wire[0], count );
+        benchmark::DoNotOptimize( &local[0] );
+    }
+    state.SetItemsProcessed( state.iterations() * count );
+}
+
+bool addImageFile( const std::string& path )
+{
+    bench_image* img = new bench_image();
+
+    if( bench_image_load( img, path.c_str(),
+        options.width, options.height ) )
+    {
+        fprintf( stderr, "cannot load %s\n", path.c_str() );
+        delete img;
+        return false;
+    }
+    images.push_back( img );
+    return true;
+}
+
+// A file, or every .ppm file in a directory.
+bool addImages( const std::string& path )
+{
+    std::vector<std::string> files;
+    DIR* dir = opendir( path.c_str() );
+    struct dirent* entry;
+
+    if( !dir )
+    {
+        return addImageFile( path );
+    }
+    while( ( entry = readdir( dir ) ) )
+    {
+        size_t len = strlen( entry->d_name );
+        if( len > 4 && !strcmp( entry->d_name + len - 4, ".ppm" ) )
+        {
+            files.push_back( path + "/" + entry->d_name );
+        }
+    }
+    closedir( dir );
+
+    std::sort( files.begin(), files.end() );
+    for( size_t i = 0; i < files.size(); ++i )
+    {
+        if( !addImageFile( files[i] ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void usage()
+{
+    fprintf( stderr,
+"usage: ggivnc_bench [options] [benchmark options]\n"
+"  --size=<w>x<h>      picture size, 1280x720 by default\n"
+"  --images=<path>     also decode this PPM (P6) picture, or all of them\n"
+"                      in a directory, e.g. screenshots of real sessions\n"
+"  --format=<pixfmt>   wire pixel format, as -f of ggivnc\n"
+"  --replay=<file>     also play back this session, recorded with\n"
+"                      ggivnc --record, as fast as possible\n"
+"  --latency=<count>[,<ms>]\n"
+"                      also measure input to photon latency in each\n"
+"                      encoding, as ggivnc --latency-bench does, against\n"
+"                      a server that answers every pointer move\n" );
+}
+
+// Take out the options of our own, leave the rest to the library.
+bool parseOptions( int& argc, char* argv[] )
+{
+    int out = 1;
+
+    for( int i = 1; i < argc; ++i )
+    {
+        const char* arg = argv[i];
+
+        if( !strncmp( arg, "--size=", 7 ) )
+        {
+            if( sscanf( arg + 7, "%dx%d",
+                    &options.width, &options.height ) != 2
+                || options.width <= 0 || options.width > 8192
+                || options.height <= 0 || options.height > 8192 )
+            {
+                fprintf( stderr, "bad size\n" );
+                return false;
+            }
+        }
+        else if( !strncmp( arg, "--images=", 9 ) )
+        {
+            options.images.push_back( arg + 9 );
+        }
+        else if( !strncmp( arg, "--format=", 9 ) )
+        {
+            options.format = arg + 9;
+        }
+        else if( !strncmp( arg, "--replay=", 9 ) )
+        {
+            options.replays.push_back( arg + 9 );
+        }
+        else if( !strncmp( arg, "--latency=", 10 ) )
+        {
+            options.latency = arg + 10;
+        }
+        else if( !strcmp( arg, "--help" ) )
+        {
+            usage();
+            argv[out++] = argv[i];
+        }
+        else
+        {
+            argv[out++] = argv[i];
+        }
+    }
+    argc = out;
+    argv[argc] = NULL;
+    return true;
+}
+
+} /* End of anonymous namespace */
+
+int main( int argc, char* argv[] )
+{
+    static const char* const synthetic[] = { "desktop", "photo" };
+
+    if( !parseOptions( argc, argv ) )
+    {
+        usage();
+        return 2;
+    }
+
+    for( size_t i = 0; i < sizeof( synthetic ) / sizeof( synthetic[0] ); ++i )
+    {
+        bench_image* img = new bench_image();
+        if( bench_image_synthetic( img, synthetic[i],
+            options.width, options.height ) )
+        {
+            fprintf( stderr, "out of memory\n" );
+            return 1;
+        }
+        images.push_back( img );
+    }
+    for( size_t i = 0; i < options.images.size(); ++i )
+    {
+        if( !addImages( options.images[i] ) )
+        {
+            return 2;
+        }
+    }
+
+    for( int e = 0; e < BENCH_ENCODINGS; ++e )
+    {
+        enum bench_encoding encoding = (enum bench_encoding)e;
+
+        for( size_t i = 0; i < images.size(); ++i )
+        {
+            // A scroll is a scroll, whatever the picture.
+            if( encoding == BENCH_COPYRECT && i )
+            {
+                break;
+            }
+            std::string name = std::string( "decode/" )
+                + bench_encodings[e].name + "/" + images[i]->name;
+            benchmark::RegisterBenchmark( name.c_str(),
+                    benchDecode, encoding, images[i] )
+                ->UseRealTime()
+                ->Unit( benchmark::kMillisecond );
+        }
+    }
+
+    for( int wireBig = 0; wireBig < 2; ++wireBig )
+    {
+        for( int localBig = 0; localBig < 2; ++localBig )
+        {
+            for( int shift = 0; shift <= 8; shift += 8 )
+            {
+                std::string name = std::string( "cpixel/" )
+                    + ( wireBig ? "big" : "little" ) + "-wire/"
+                    + ( localBig ? "big" : "little" ) + "-local/"
+                    + ( shift ? "high" : "low" );
+                benchmark::RegisterBenchmark( name.c_str(),
+                    benchCpixel, wireBig, localBig, shift );
+            }
+        }
+    }
+
+    for( size_t i = 0; i < options.replays.size(); ++i )
+    {
+        const std::string& file = options.replays[i];
+        std::string name = "replay/"
+            + file.substr( file.find_last_of( '/' ) + 1 );
+        benchmark::RegisterBenchmark( name.c_str(), benchReplay, file )
+            ->UseRealTime()
+            ->Unit( benchmark::kMillisecond );
+    }
+
+    for( int e = 0; e < BENCH_ENCODINGS && !options.latency.empty(); ++e )
+    {
+        std::string name = std::string( "latency/" )
+            + bench_encodings[e].name + "/" + images[0]->name;
+        benchmark::RegisterBenchmark( name.c_str(),
+                benchLatency, (enum bench_encoding)e, images[0] )
+            ->Iterations( 1 )
+            ->UseRealTime()
+            ->Unit( benchmark::kMillisecond );
+    }
+
+    benchmark::Initialize( &argc, argv );
+    if( benchmark::ReportUnrecognizedArguments( argc, argv ) )
+    {
+        return 2;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    for( size_t i = 0; i < images.size(); ++i )
+    {
+        bench_image_free( images[i] );
+        delete images[i];
+    }
+    if( failures )
+    {
+        fprintf( stderr, "%d benchmarks failed\n", failures );
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*
+******************************************************************************
+
+   Decoder benchmarks, shared declarations.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The decoder benchmarks run the viewer library against a synthetic
+ * RFB server on the loopback interface. The server encodes one picture
+ * up front and then answers every update request with the same update,
+ * so the viewer side is all that is measured. In echo mode it answers
+ * incremental requests only once input comes in, for --latency-bench.
+ */
+
+/* A picture to encode, 8-bit RGB, width * 3 bytes per line. */
+struct bench_image {
+	char *name;
+	int width;
+	int height;
+	uint8_t *rgb;
+};
+
+/* Generate a synthetic picture, "desktop" (windows, text, flat colors)
+ * or "photo" (smooth gradients with noise). Returns non-zero if kind
+ * is unknown or on allocation failure.
+ */
+int bench_image_synthetic(struct bench_image *img,
+	const char *kind, int width, int height);
+
+/* Load a binary PPM (P6, maxval 255), e.g. a screenshot of a recorded
+ * session, tiled or cropped to width x height.
+ */
+int bench_image_load(struct bench_image *img,
+	const char *path, int width, int height);
+
+void bench_image_free(struct bench_image *img);
+
+/* The pixel format the viewer asked for, as in SetPixelFormat. */
+struct bench_format {
+	int bpp;
+	int depth;
+	int big_endian;
+	int true_color;
+	int r_max, g_max, b_max;
+	int r_shift, g_shift, b_shift;
+};
+
+enum bench_encoding {
+	BENCH_RAW,
+	BENCH_COPYRECT,
+	BENCH_RRE,
+	BENCH_CORRE,
+	BENCH_HEXTILE,
+	BENCH_ZLIB,
+	BENCH_ZLIBHEX,
+	BENCH_TRLE,
+	BENCH_ZRLE,
+	BENCH_TIGHT_BASIC,
+	BENCH_TIGHT_PALETTE,
+	BENCH_TIGHT_GRADIENT,
+	BENCH_TIGHT_JPEG,
+	BENCH_ENCODINGS
+};
+
+struct bench_encoding_info {
+	const char *name;	/* of the benchmark */
+	const char *option;	/* for the -e option of the viewer */
+	int lossless;		/* decoded frame must equal the picture */
+	int available;		/* zero if the build can't decode it */
+};
+
+extern const struct bench_encoding_info bench_encodings[BENCH_ENCODINGS];
+
+/* A growing byte buffer. failed is set once it could not grow. */
+struct bench_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+/* One FramebufferUpdate message, ready to go on the wire. */
+struct bench_update {
+	struct bench_buf msg;
+	uint64_t pixels;	/* drawn by the rectangles */
+};
+
+struct bench_encoder;
+
+/* An encoder for one picture, in one encoding and pixel format. Zlib
+ * streams live as long as the encoder, as they do on a real server.
+ */
+struct bench_encoder *bench_encoder_new(enum bench_encoding encoding,
+	const struct bench_format *format, const struct bench_image *img);
+void bench_encoder_free(struct bench_encoder *enc);
+
+/* Encode the picture as one update. Every zlib stream used is fully
+ * flushed at its last use in the update, so the second update encoded
+ * no longer refers to earlier data and may be sent over and over.
+ * The first one may start the streams and must be sent once, first.
+ */
+int bench_encode(struct bench_encoder *enc, struct bench_update *update);
+
+void bench_update_free(struct bench_update *update);
+
+/* Convert rgb to a pixel value of the format, as the viewer stores it
+ * in a frame of the same format.
+ */
+uint32_t bench_pixel(const struct bench_format *format, const uint8_t *rgb);
+
+/* A server for one viewer connection, on a thread of its own. */
+struct bench_server;
+
+/* Listen on a loopback port, returned in port, for one viewer. With
+ * echo, updates after the first one are sent in answer to input.
+ */
+struct bench_server *bench_server_start(const struct bench_image *img,
+	enum bench_encoding encoding, int echo, int *port);
+
+/* Wire bytes and pixels of the update sent over and over, once the
+ * first one went out. Zero before that.
+ */
+void bench_server_stats(struct bench_server *server,
+	uint64_t *bytes, uint64_t *pixels);
+
+/* The format the viewer asked for, once it did. */
+int bench_server_format(struct bench_server *server,
+	struct bench_format *format);
+
+/* The error that stopped the server, or NULL. */
+const char *bench_server_error(struct bench_server *server);
+
+void bench_server_stop(struct bench_server *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_H */
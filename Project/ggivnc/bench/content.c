@@ -0,0 +1,292 @@
+/*
+******************************************************************************
+
+   Decoder benchmarks, pictures to encode.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bench.h"
+
+/* xorshift32, the pictures must be the same from run to run */
+static uint32_t
+next_random(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void
+fill_box(struct bench_image *img, int x, int y, int w, int h, uint32_t rgb)
+{
+	int i, j;
+	uint8_t *p;
+
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > img->width)
+		w = img->width - x;
+	if (y + h > img->height)
+		h = img->height - y;
+
+	for (j = 0; j < h; ++j) {
+		p = img->rgb + ((y + j) * img->width + x) * 3;
+		for (i = 0; i < w; ++i) {
+			*p++ = rgb >> 16;
+			*p++ = rgb >> 8;
+			*p++ = rgb;
+		}
+	}
+}
+
+/* Lines of 7x11 "glyphs" of random dots in an 8x14 grid, with ragged
+ * line ends, much like text in a terminal or an editor.
+ */
+static void
+fill_text(struct bench_image *img, int x, int y, int w, int h,
+	uint32_t ink, uint32_t *seed)
+{
+	int line, col, cols, gx, gy;
+	uint32_t bits;
+
+	for (line = 0; (line + 1) * 14 <= h; ++line) {
+		cols = w / 8;
+		cols -= next_random(seed) % (cols / 2 + 1);
+		for (col = 0; col < cols; ++col) {
+			if (next_random(seed) % 7 == 0)
+				continue; /* a space */
+			for (gy = 0; gy < 11; ++gy) {
+				bits = next_random(seed);
+				for (gx = 0; gx < 7; ++gx) {
+					if ((bits >> (gx * 3) & 7) > 2)
+						continue;
+					fill_box(img, x + col * 8 + gx,
+						y + line * 14 + 2 + gy,
+						1, 1, ink);
+				}
+			}
+		}
+	}
+}
+
+static void
+draw_desktop(struct bench_image *img)
+{
+	uint32_t seed = 0x2545f491;
+	int i, x, y, w, h;
+
+	fill_box(img, 0, 0, img->width, img->height, 0x3a6ea5);
+
+	for (i = 0; i < 6; ++i) {
+		w = img->width / 4 + next_random(&seed) % (img->width / 2 + 1);
+		h = img->height / 4 + next_random(&seed) % (img->height / 2 + 1);
+		x = next_random(&seed) % (img->width - w + 1);
+		y = next_random(&seed) % (img->height - h + 1);
+
+		fill_box(img, x, y, w, h, 0x404040);
+		fill_box(img, x + 1, y + 1, w - 2, 20, 0x0a246a);
+		fill_text(img, x + 6, y + 3, w / 3, 14, 0xffffff, &seed);
+		fill_box(img, x + w - 19, y + 4, 14, 14, 0xd4d0c8);
+		fill_box(img, x + 1, y + 21, w - 2, h - 22, 0xffffff);
+		fill_text(img, x + 4, y + 24, w - 8, h - 28,
+			i & 1 ? 0x000000 : 0x202080, &seed);
+	}
+
+	/* task bar with a few icons */
+	fill_box(img, 0, img->height - 30, img->width, 30, 0xd4d0c8);
+	for (x = 4; x + 24 < img->width / 2; x += 28)
+		fill_box(img, x, img->height - 27, 24, 24,
+			next_random(&seed) & 0xffffff);
+}
+
+static void
+draw_photo(struct bench_image *img)
+{
+	uint32_t seed = 0x9e3779b9;
+	uint8_t *p = img->rgb;
+	double r, g, b;
+	int x, y;
+
+	for (y = 0; y < img->height; ++y) {
+		for (x = 0; x < img->width; ++x) {
+			r = 128 + 90 * sin(x * 0.011 + y * 0.004);
+			g = 128 + 90 * sin(x * 0.003 - y * 0.013 + 1.0);
+			b = 128 + 90 * cos((x + y) * 0.007);
+			r += (int)(next_random(&seed) % 13) - 6;
+			g += (int)(next_random(&seed) % 13) - 6;
+			b += (int)(next_random(&seed) % 13) - 6;
+			*p++ = r < 0 ? 0 : r > 255 ? 255 : r;
+			*p++ = g < 0 ? 0 : g > 255 ? 255 : g;
+			*p++ = b < 0 ? 0 : b > 255 ? 255 : b;
+		}
+	}
+}
+
+static int
+image_alloc(struct bench_image *img, const char *name, int width, int height)
+{
+	memset(img, 0, sizeof(*img));
+	if (width <= 0 || height <= 0 || width > 0xffff || height > 0xffff)
+		return -1;
+
+	img->name = strdup(name);
+	img->rgb = malloc((size_t)width * height * 3);
+	if (!img->name || !img->rgb) {
+		bench_image_free(img);
+		return -1;
+	}
+	img->width = width;
+	img->height = height;
+	return 0;
+}
+
+int
+bench_image_synthetic(struct bench_image *img,
+	const char *kind, int width, int height)
+{
+	if (strcmp(kind, "desktop") && strcmp(kind, "photo"))
+		return -1;
+	if (image_alloc(img, kind, width, height))
+		return -1;
+
+	if (!strcmp(kind, "desktop"))
+		draw_desktop(img);
+	else
+		draw_photo(img);
+	return 0;
+}
+
+/* Next number in a PPM header, skipping white space and comments. */
+static int
+ppm_number(FILE *f)
+{
+	int c;
+	int n = 0;
+
+	do {
+		c = getc(f);
+		if (c == '#') {
+			while (c != '\n' && c != EOF)
+				c = getc(f);
+		}
+	} while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+
+	if (c < '0' || c > '9')
+		return -1;
+	while (c >= '0' && c <= '9') {
+		n = n * 10 + c - '0';
+		if (n > 0xffff)
+			return -1;
+		c = getc(f);
+	}
+	return n;
+}
+
+int
+bench_image_load(struct bench_image *img,
+	const char *path, int width, int height)
+{
+	FILE *f;
+	const char *name;
+	const char *dot;
+	char *base;
+	uint8_t *src = NULL;
+	int src_w, src_h, maxval;
+	int x, y;
+
+	memset(img, 0, sizeof(*img));
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	if (getc(f) != 'P' || getc(f) != '6')
+		goto fail;
+	src_w = ppm_number(f);
+	src_h = ppm_number(f);
+	maxval = ppm_number(f);
+	if (src_w <= 0 || src_h <= 0 || maxval != 255)
+		goto fail;
+
+	src = malloc((size_t)src_w * src_h * 3);
+	if (!src)
+		goto fail;
+	if (fread(src, 3, (size_t)src_w * src_h, f) != (size_t)src_w * src_h)
+		goto fail;
+	fclose(f);
+	f = NULL;
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	dot = strrchr(name, '.');
+	base = strndup(name, dot ? (size_t)(dot - name) : strlen(name));
+	if (!base || image_alloc(img, base, width, height)) {
+		free(base);
+		goto fail;
+	}
+	free(base);
+
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; x += src_w) {
+			int w = width - x < src_w ? width - x : src_w;
+			memcpy(img->rgb + (y * width + x) * 3,
+				src + (y % src_h) * src_w * 3, w * 3);
+		}
+	}
+
+	free(src);
+	return 0;
+
+fail:
+	free(src);
+	if (f)
+		fclose(f);
+	return -1;
+}
+
+void
+bench_image_free(struct bench_image *img)
+{
+	free(img->name);
+	free(img->rgb);
+	memset(img, 0, sizeof(*img));
+}
@@ -0,0 +1,1342 @@
+/*
+******************************************************************************
+
+   Decoder benchmarks, the encoders of the synthetic server.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if defined HAVE_JPEG && defined HAVE_JPEGLIB
+#define BENCH_JPEG 1
+#include <jpeglib.h>
+#endif
+
+#include "bench.h"
+
+#ifdef HAVE_ZLIB
+#define ZLIB 1
+#else
+#define ZLIB 0
+#endif
+#ifdef BENCH_JPEG
+#define JPEG 1
+#else
+#define JPEG 0
+#endif
+
+const struct bench_encoding_info bench_encodings[BENCH_ENCODINGS] = {
+	{ "raw",            "raw",      1, 1    },
+	{ "copyrect",       "copyrect", 0, 1    },
+	{ "rre",            "rre",      1, 1    },
+	{ "corre",          "corre",    1, 1    },
+	{ "hextile",        "hextile",  1, 1    },
+	{ "zlib",           "zlib",     1, ZLIB },
+	{ "zlibhex",        "zlibhex",  1, ZLIB },
+	{ "trle",           "trle",     1, ZLIB },
+	{ "zrle",           "zrle",     1, ZLIB },
+	{ "tight_basic",    "tight",    1, ZLIB },
+	{ "tight_palette",  "tight",    1, ZLIB },
+	{ "tight_gradient", "tight",    1, ZLIB },
+	{ "tight_jpeg",     "tight",    0, JPEG },
+};
+
+#define CORRE_TILE	64
+#define TIGHT_TILE	128
+#define TIGHT_MIN_TO_COMPRESS 12
+
+struct subrect {
+	int x, y, w, h;
+	uint32_t pixel;
+};
+
+enum tight_kind {
+	TIGHT_FILL,
+	TIGHT_COPY,
+	TIGHT_PALETTE,
+	TIGHT_GRADIENT,
+	TIGHT_JPEG
+};
+
+struct hextile_state {
+	int bg_valid;
+	int fg_valid;
+	uint32_t bg;
+	uint32_t fg;
+};
+
+struct bench_encoder {
+	enum bench_encoding encoding;
+	struct bench_format format;
+	const struct bench_image *img;
+	uint32_t *pixels;	/* the picture in the wire format */
+	int width;
+	int height;
+	int bpp;		/* bytes per pixel */
+	int cpixel;		/* bytes per ZRLE/TRLE cpixel */
+	int cpixel_shift;
+	int tpixel888;		/* Tight sends R, G, B bytes */
+	int updates;
+
+	struct subrect *subrects;
+	int max_subrects;
+	uint8_t *done;
+	uint32_t *sorted;
+	size_t scratch;
+
+	struct bench_buf tmp;
+	struct bench_buf ztmp;
+#ifdef HAVE_ZLIB
+	z_stream zs[4];
+	int zs_init[4];
+#endif
+};
+
+static uint8_t *
+buf_grow(struct bench_buf *b, size_t more)
+{
+	uint8_t *data;
+	size_t size;
+
+	if (b->failed)
+		return NULL;
+	if (b->len + more <= b->size)
+		return b->data + b->len;
+
+	size = b->size ? b->size : 4096;
+	while (size < b->len + more)
+		size *= 2;
+	data = realloc(b->data, size);
+	if (!data) {
+		b->failed = 1;
+		return NULL;
+	}
+	b->data = data;
+	b->size = size;
+	return b->data + b->len;
+}
+
+static void
+put(struct bench_buf *b, const void *src, size_t len)
+{
+	uint8_t *dst = buf_grow(b, len);
+
+	if (!dst)
+		return;
+	memcpy(dst, src, len);
+	b->len += len;
+}
+
+static void
+put8(struct bench_buf *b, uint8_t v)
+{
+	put(b, &v, 1);
+}
+
+static void
+put16(struct bench_buf *b, uint16_t v)
+{
+	uint8_t c[2];
+
+	c[0] = v >> 8;
+	c[1] = v;
+	put(b, c, 2);
+}
+
+static void
+put32(struct bench_buf *b, uint32_t v)
+{
+	uint8_t c[4];
+
+	c[0] = v >> 24;
+	c[1] = v >> 16;
+	c[2] = v >> 8;
+	c[3] = v;
+	put(b, c, 4);
+}
+
+static void
+put_rect(struct bench_buf *b, int x, int y, int w, int h, int32_t encoding)
+{
+	put16(b, x);
+	put16(b, y);
+	put16(b, w);
+	put16(b, h);
+	put32(b, encoding);
+}
+
+uint32_t
+bench_pixel(const struct bench_format *format, const uint8_t *rgb)
+{
+	return (uint32_t)((rgb[0] * format->r_max + 127) / 255)
+			<< format->r_shift
+		| (uint32_t)((rgb[1] * format->g_max + 127) / 255)
+			<< format->g_shift
+		| (uint32_t)((rgb[2] * format->b_max + 127) / 255)
+			<< format->b_shift;
+}
+
+static void
+put_pixel(struct bench_encoder *enc, struct bench_buf *b, uint32_t pixel)
+{
+	uint8_t c[4];
+	int i;
+
+	for (i = 0; i < enc->bpp; ++i) {
+		if (enc->format.big_endian)
+			c[i] = pixel >> (enc->bpp - 1 - i) * 8;
+		else
+			c[i] = pixel >> i * 8;
+	}
+	put(b, c, enc->bpp);
+}
+
+/* The three significant bytes of a 32-bit pixel, for ZRLE and TRLE. */
+static void
+put_cpixel(struct bench_encoder *enc, struct bench_buf *b, uint32_t pixel)
+{
+	uint8_t c[3];
+
+	if (enc->cpixel != 3) {
+		put_pixel(enc, b, pixel);
+		return;
+	}
+
+	pixel >>= enc->cpixel_shift;
+	if (enc->format.big_endian) {
+		c[0] = pixel >> 16;
+		c[1] = pixel >> 8;
+		c[2] = pixel;
+	}
+	else {
+		c[0] = pixel;
+		c[1] = pixel >> 8;
+		c[2] = pixel >> 16;
+	}
+	put(b, c, 3);
+}
+
+/* R, G and B bytes for 8 bits per color in 32 bits, for Tight. */
+static void
+put_tpixel(struct bench_encoder *enc, struct bench_buf *b, uint32_t pixel)
+{
+	uint8_t c[3];
+
+	if (!enc->tpixel888) {
+		put_pixel(enc, b, pixel);
+		return;
+	}
+
+	c[0] = pixel >> enc->format.r_shift;
+	c[1] = pixel >> enc->format.g_shift;
+	c[2] = pixel >> enc->format.b_shift;
+	put(b, c, 3);
+}
+
+static inline const uint32_t *
+block(const struct bench_encoder *enc, int x, int y)
+{
+	return enc->pixels + y * enc->width + x;
+}
+
+/* Up to max distinct colors of a block in palette. Returns how many,
+ * or max + 1 if there are more.
+ */
+static int
+block_palette(const struct bench_encoder *enc, int x, int y, int w, int h,
+	uint32_t *palette, int max)
+{
+	const uint32_t *px = block(enc, x, y);
+	uint32_t last;
+	int n = 0;
+	int i, j, k;
+
+	last = px[0] + 1;
+	for (j = 0; j < h; ++j, px += enc->width) {
+		for (i = 0; i < w; ++i) {
+			if (px[i] == last)
+				continue;
+			last = px[i];
+			for (k = 0; k < n; ++k) {
+				if (palette[k] == last)
+					break;
+			}
+			if (k < n)
+				continue;
+			if (n == max)
+				return max + 1;
+			palette[n++] = last;
+		}
+	}
+	return n;
+}
+
+static int
+palette_index(const uint32_t *palette, int n, uint32_t pixel)
+{
+	int k;
+
+	for (k = 0; k < n; ++k) {
+		if (palette[k] == pixel)
+			return k;
+	}
+	return 0;
+}
+
+static int
+reserve_scratch(struct bench_encoder *enc, size_t pixels)
+{
+	uint8_t *done;
+	uint32_t *sorted;
+
+	if (pixels <= enc->scratch)
+		return 0;
+
+	done = realloc(enc->done, pixels);
+	if (!done)
+		return -1;
+	enc->done = done;
+	sorted = realloc(enc->sorted, pixels * sizeof(*sorted));
+	if (!sorted)
+		return -1;
+	enc->sorted = sorted;
+	enc->scratch = pixels;
+	return 0;
+}
+
+static int
+compare_pixels(const void *a, const void *b)
+{
+	uint32_t pa = *(const uint32_t *)a;
+	uint32_t pb = *(const uint32_t *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static uint32_t
+most_common(struct bench_encoder *enc, int x, int y, int w, int h)
+{
+	const uint32_t *px = block(enc, x, y);
+	uint32_t best;
+	int best_count = 0;
+	int count;
+	int i, n = w * h;
+
+	for (i = 0; i < h; ++i)
+		memcpy(enc->sorted + i * w, px + i * enc->width, w * 4);
+	qsort(enc->sorted, n, sizeof(*enc->sorted), compare_pixels);
+
+	best = enc->sorted[0];
+	for (i = 0; i < n; i += count) {
+		for (count = 1; i + count < n; ++count) {
+			if (enc->sorted[i + count] != enc->sorted[i])
+				break;
+		}
+		if (count > best_count) {
+			best_count = count;
+			best = enc->sorted[i];
+		}
+	}
+	return best;
+}
+
+/* Cover what is not background in a block with solid rectangles,
+ * greedily, first as wide and then as high as possible. Returns how
+ * many, or -1 if more than max (unless max is negative).
+ */
+static int
+find_subrects(struct bench_encoder *enc, int x, int y, int w, int h,
+	uint32_t bg, int max)
+{
+	const uint32_t *px = block(enc, x, y);
+	const int stride = enc->width;
+	struct subrect *sr;
+	uint32_t pixel;
+	int n = 0;
+	int i, j, rw, rh, k;
+
+	memset(enc->done, 0, w * h);
+
+	for (j = 0; j < h; ++j) {
+		for (i = 0; i < w; ++i) {
+			pixel = px[j * stride + i];
+			if (pixel == bg || enc->done[j * w + i])
+				continue;
+
+			for (rw = 1; i + rw < w; ++rw) {
+				if (px[j * stride + i + rw] != pixel)
+					break;
+				if (enc->done[j * w + i + rw])
+					break;
+			}
+			for (rh = 1; j + rh < h; ++rh) {
+				for (k = 0; k < rw; ++k) {
+					if (px[(j + rh) * stride + i + k] != pixel)
+						break;
+					if (enc->done[(j + rh) * w + i + k])
+						break;
+				}
+				if (k < rw)
+					break;
+			}
+			for (k = 0; k < rh; ++k)
+				memset(&enc->done[(j + k) * w + i], 1, rw);
+
+			if (max >= 0 && n == max)
+				return -1;
+			if (n == enc->max_subrects) {
+				int more = enc->max_subrects
+					? 2 * enc->max_subrects : 1024;
+				sr = realloc(enc->subrects, more * sizeof(*sr));
+				if (!sr)
+					return -1;
+				enc->subrects = sr;
+				enc->max_subrects = more;
+			}
+			sr = &enc->subrects[n++];
+			sr->x = i;
+			sr->y = j;
+			sr->w = rw;
+			sr->h = rh;
+			sr->pixel = pixel;
+		}
+	}
+	return n;
+}
+
+#ifdef HAVE_ZLIB
+/* Deflate len bytes at src onto out, with a sync flush, or a full flush
+ * when this is the last use of the stream in the update.
+ */
+static int
+compress_to(struct bench_encoder *enc, int stream,
+	struct bench_buf *out, const uint8_t *src, size_t len, int last)
+{
+	z_stream *zs = &enc->zs[stream];
+	int res;
+
+	if (!enc->zs_init[stream]) {
+		memset(zs, 0, sizeof(*zs));
+		if (deflateInit(zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+			return -1;
+		enc->zs_init[stream] = 1;
+	}
+
+	zs->next_in = (Bytef *)src;
+	zs->avail_in = len;
+	do {
+		if (!buf_grow(out, len / 2 + 1024))
+			return -1;
+		zs->next_out = out->data + out->len;
+		zs->avail_out = out->size - out->len;
+		res = deflate(zs, last ? Z_FULL_FLUSH : Z_SYNC_FLUSH);
+		if (res != Z_OK && res != Z_BUF_ERROR)
+			return -1;
+		out->len = out->size - zs->avail_out;
+	} while (!zs->avail_out);
+
+	return 0;
+}
+#endif
+
+static int
+encode_raw(struct bench_encoder *enc, struct bench_update *update,
+	int x, int y, int w, int h)
+{
+	struct bench_buf *b = &update->msg;
+	const uint32_t *px;
+	int i, j;
+
+	put_rect(b, x, y, w, h, 0);
+	for (j = 0; j < h; ++j) {
+		px = block(enc, x, y + j);
+		for (i = 0; i < w; ++i)
+			put_pixel(enc, b, px[i]);
+	}
+	update->pixels += (uint64_t)w * h;
+	return 1;
+}
+
+/* Scroll everything up, after a first update with the picture. */
+static int
+encode_copyrect(struct bench_encoder *enc, struct bench_update *update)
+{
+	struct bench_buf *b = &update->msg;
+	int step = enc->height / 8;
+
+	if (!enc->updates || !step)
+		return encode_raw(enc, update, 0, 0, enc->width, enc->height);
+
+	put_rect(b, 0, 0, enc->width, enc->height - step, 1);
+	put16(b, 0);
+	put16(b, step);
+	update->pixels += (uint64_t)enc->width * (enc->height - step);
+	return 1;
+}
+
+static int
+encode_rre(struct bench_encoder *enc, struct bench_update *update,
+	int x, int y, int w, int h, int compact)
+{
+	struct bench_buf *b = &update->msg;
+	struct subrect *sr;
+	uint32_t bg;
+	int n, i;
+
+	bg = most_common(enc, x, y, w, h);
+	n = find_subrects(enc, x, y, w, h, bg, -1);
+	if (n < 0)
+		return -1;
+
+	put_rect(b, x, y, w, h, compact ? 4 : 2);
+	put32(b, n);
+	put_pixel(enc, b, bg);
+	for (i = 0, sr = enc->subrects; i < n; ++i, ++sr) {
+		put_pixel(enc, b, sr->pixel);
+		if (compact) {
+			put8(b, sr->x);
+			put8(b, sr->y);
+			put8(b, sr->w);
+			put8(b, sr->h);
+		}
+		else {
+			put16(b, sr->x);
+			put16(b, sr->y);
+			put16(b, sr->w);
+			put16(b, sr->h);
+		}
+	}
+	update->pixels += (uint64_t)w * h;
+	return 1;
+}
+
+static int
+encode_corre(struct bench_encoder *enc, struct bench_update *update)
+{
+	int x, y, w, h;
+	int rects = 0;
+
+	for (y = 0; y < enc->height; y += CORRE_TILE) {
+		h = enc->height - y < CORRE_TILE ? enc->height - y : CORRE_TILE;
+		for (x = 0; x < enc->width; x += CORRE_TILE) {
+			w = enc->width - x < CORRE_TILE
+				? enc->width - x : CORRE_TILE;
+			if (encode_rre(enc, update, x, y, w, h, 1) < 0)
+				return -1;
+			++rects;
+		}
+	}
+	return rects;
+}
+
+/* One hextile tile onto out, subencoding byte first. Returns the
+ * subencoding.
+ */
+static int
+hextile_tile(struct bench_encoder *enc, struct hextile_state *st,
+	struct bench_buf *out, int x, int y, int w, int h)
+{
+	const uint32_t *px;
+	struct subrect *sr;
+	uint32_t palette[3];
+	uint32_t bg;
+	int flags;
+	int size;
+	int mono;
+	int n, i, j;
+
+	n = block_palette(enc, x, y, w, h, palette, 2);
+	if (n == 1) {
+		if (st->bg_valid && st->bg == palette[0]) {
+			put8(out, 0);
+			return 0;
+		}
+		put8(out, 2);
+		put_pixel(enc, out, palette[0]);
+		st->bg = palette[0];
+		st->bg_valid = 1;
+		return 2;
+	}
+
+	bg = most_common(enc, x, y, w, h);
+	n = find_subrects(enc, x, y, w, h, bg, 255);
+	if (n > 0) {
+		mono = 1;
+		for (i = 1; i < n; ++i) {
+			if (enc->subrects[i].pixel != enc->subrects[0].pixel)
+				mono = 0;
+		}
+
+		flags = 8;
+		size = 2;
+		if (!st->bg_valid || st->bg != bg) {
+			flags |= 2;
+			size += enc->bpp;
+		}
+		if (mono) {
+			if (!st->fg_valid || st->fg != enc->subrects[0].pixel) {
+				flags |= 4;
+				size += enc->bpp;
+			}
+			size += 2 * n;
+		}
+		else {
+			flags |= 16;
+			size += (2 + enc->bpp) * n;
+		}
+
+		if (size < 1 + enc->bpp * w * h) {
+			put8(out, flags);
+			if (flags & 2)
+				put_pixel(enc, out, bg);
+			if (flags & 4)
+				put_pixel(enc, out, enc->subrects[0].pixel);
+			put8(out, n);
+			for (i = 0, sr = enc->subrects; i < n; ++i, ++sr) {
+				if (flags & 16)
+					put_pixel(enc, out, sr->pixel);
+				put8(out, sr->x << 4 | sr->y);
+				put8(out, (sr->w - 1) << 4 | (sr->h - 1));
+			}
+			st->bg = bg;
+			st->bg_valid = 1;
+			if (flags & 4)
+				st->fg = enc->subrects[0].pixel;
+			st->fg_valid = mono;
+			return flags;
+		}
+	}
+
+	put8(out, 1);
+	for (j = 0; j < h; ++j) {
+		px = block(enc, x, y + j);
+		for (i = 0; i < w; ++i)
+			put_pixel(enc, out, px[i]);
+	}
+	st->bg_valid = 0;
+	st->fg_valid = 0;
+	return 1;
+}
+
+static int
+encode_hextile(struct bench_encoder *enc, struct bench_update *update)
+{
+	struct hextile_state st;
+	int x, y, w, h;
+
+	memset(&st, 0, sizeof(st));
+	put_rect(&update->msg, 0, 0, enc->width, enc->height, 5);
+	for (y = 0; y < enc->height; y += 16) {
+		h = enc->height - y < 16 ? enc->height - y : 16;
+		for (x = 0; x < enc->width; x += 16) {
+			w = enc->width - x < 16 ? enc->width - x : 16;
+			hextile_tile(enc, &st, &update->msg, x, y, w, h);
+		}
+	}
+	update->pixels += (uint64_t)enc->width * enc->height;
+	return 1;
+}
+
+/* Runs of one color in a block, in raster order. */
+static int
+next_run(const struct bench_encoder *enc, int x, int y, int w, int h,
+	int pos, uint32_t *pixel)
+{
+	const uint32_t *px = block(enc, x, y);
+	int len = 1;
+
+	*pixel = px[pos / w * enc->width + pos % w];
+	for (++pos; pos < w * h; ++pos, ++len) {
+		if (px[pos / w * enc->width + pos % w] != *pixel)
+			break;
+	}
+	return len;
+}
+
+static inline int
+run_length_bytes(int len)
+{
+	return (len - 1) / 255 + 1;
+}
+
+static void
+put_run_length(struct bench_buf *b, int len)
+{
+	int v = len - 1;
+
+	while (v >= 255) {
+		put8(b, 255);
+		v -= 255;
+	}
+	put8(b, v);
+}
+
+/* One TRLE or ZRLE tile, with the smallest of the subencodings. */
+static void
+rle_tile(struct bench_encoder *enc, struct bench_buf *out,
+	int x, int y, int w, int h)
+{
+	const uint32_t *px;
+	uint32_t palette[128];
+	uint32_t pixel;
+	int cp = enc->cpixel;
+	int n, bits = 0;
+	int kind, best;
+	int plain = 0, palette_rle = 0;
+	int pos, len;
+	int i, j, k, shift;
+	uint8_t byte;
+
+	n = block_palette(enc, x, y, w, h, palette, 127);
+	if (n == 1) {
+		put8(out, 1);
+		put_cpixel(enc, out, palette[0]);
+		return;
+	}
+
+	for (pos = 0; pos < w * h; pos += len) {
+		len = next_run(enc, x, y, w, h, pos, &pixel);
+		plain += cp + run_length_bytes(len);
+		palette_rle += len == 1 ? 1 : 1 + run_length_bytes(len);
+	}
+
+	kind = 0;
+	best = w * h * cp;
+	if (plain < best) {
+		kind = 128;
+		best = plain;
+	}
+	if (n <= 127 && n * cp + palette_rle < best) {
+		kind = 128 + n;
+		best = n * cp + palette_rle;
+	}
+	if (n <= 16) {
+		bits = n == 2 ? 1 : n <= 4 ? 2 : 4;
+		if (n * cp + (w * bits + 7) / 8 * h <= best)
+			kind = n;
+	}
+
+	put8(out, kind);
+	if (kind == 0) {
+		for (j = 0; j < h; ++j) {
+			px = block(enc, x, y + j);
+			for (i = 0; i < w; ++i)
+				put_cpixel(enc, out, px[i]);
+		}
+		return;
+	}
+	if (kind == 128) {
+		for (pos = 0; pos < w * h; pos += len) {
+			len = next_run(enc, x, y, w, h, pos, &pixel);
+			put_cpixel(enc, out, pixel);
+			put_run_length(out, len);
+		}
+		return;
+	}
+
+	for (k = 0; k < n; ++k)
+		put_cpixel(enc, out, palette[k]);
+
+	if (kind > 128) {
+		for (pos = 0; pos < w * h; pos += len) {
+			len = next_run(enc, x, y, w, h, pos, &pixel);
+			k = palette_index(palette, n, pixel);
+			if (len == 1) {
+				put8(out, k);
+				continue;
+			}
+			put8(out, k | 0x80);
+			put_run_length(out, len);
+		}
+		return;
+	}
+
+	for (j = 0; j < h; ++j) {
+		px = block(enc, x, y + j);
+		byte = 0;
+		shift = 8 - bits;
+		for (i = 0; i < w; ++i) {
+			byte |= palette_index(palette, n, px[i]) << shift;
+			shift -= bits;
+			if (shift < 0) {
+				put8(out, byte);
+				byte = 0;
+				shift = 8 - bits;
+			}
+		}
+		if (shift != 8 - bits)
+			put8(out, byte);
+	}
+}
+
+static void
+rle_tiles(struct bench_encoder *enc, struct bench_buf *out, int size)
+{
+	int x, y, w, h;
+
+	for (y = 0; y < enc->height; y += size) {
+		h = enc->height - y < size ? enc->height - y : size;
+		for (x = 0; x < enc->width; x += size) {
+			w = enc->width - x < size ? enc->width - x : size;
+			rle_tile(enc, out, x, y, w, h);
+		}
+	}
+}
+
+static int
+encode_trle(struct bench_encoder *enc, struct bench_update *update)
+{
+	put_rect(&update->msg, 0, 0, enc->width, enc->height, 15);
+	rle_tiles(enc, &update->msg, 16);
+	update->pixels += (uint64_t)enc->width * enc->height;
+	return 1;
+}
+
+#ifdef HAVE_ZLIB
+static int
+encode_zlib(struct bench_encoder *enc, struct bench_update *update)
+{
+	struct bench_buf *b = &update->msg;
+	const uint32_t *px;
+	int i, j;
+
+	enc->tmp.len = 0;
+	for (j = 0; j < enc->height; ++j) {
+		px = block(enc, 0, j);
+		for (i = 0; i < enc->width; ++i)
+			put_pixel(enc, &enc->tmp, px[i]);
+	}
+	enc->ztmp.len = 0;
+	if (enc->tmp.failed || compress_to(enc, 0,
+		&enc->ztmp, enc->tmp.data, enc->tmp.len, 1))
+	{
+		return -1;
+	}
+
+	put_rect(b, 0, 0, enc->width, enc->height, 6);
+	put32(b, enc->ztmp.len);
+	put(b, enc->ztmp.data, enc->ztmp.len);
+	update->pixels += (uint64_t)enc->width * enc->height;
+	return 1;
+}
+
+static int
+encode_zrle(struct bench_encoder *enc, struct bench_update *update)
+{
+	struct bench_buf *b = &update->msg;
+
+	enc->tmp.len = 0;
+	rle_tiles(enc, &enc->tmp, 64);
+	enc->ztmp.len = 0;
+	if (enc->tmp.failed || compress_to(enc, 0,
+		&enc->ztmp, enc->tmp.data, enc->tmp.len, 1))
+	{
+		return -1;
+	}
+
+	put_rect(b, 0, 0, enc->width, enc->height, 16);
+	put32(b, enc->ztmp.len);
+	put(b, enc->ztmp.data, enc->ztmp.len);
+	update->pixels += (uint64_t)enc->width * enc->height;
+	return 1;
+}
+
+/* Hextile tiles, raw ones deflated on stream 0 and those with more
+ * than a few bytes of subrectangles on stream 1.
+ */
+static int
+encode_zlibhex(struct bench_encoder *enc, struct bench_update *update)
+{
+	struct bench_buf *b = &update->msg;
+	struct hextile_state st;
+	size_t *start;
+	uint8_t *zlib;
+	int tiles_x = (enc->width + 15) / 16;
+	int tiles = tiles_x * ((enc->height + 15) / 16);
+	int last[2] = { -1, -1 };
+	int x, y, w, h, t;
+	size_t len;
+
+	start = malloc((tiles + 1) * sizeof(*start));
+	zlib = malloc(tiles);
+	if (!start || !zlib) {
+		free(start);
+		free(zlib);
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	enc->tmp.len = 0;
+	for (t = 0; t < tiles; ++t) {
+		x = t % tiles_x * 16;
+		y = t / tiles_x * 16;
+		w = enc->width - x < 16 ? enc->width - x : 16;
+		h = enc->height - y < 16 ? enc->height - y : 16;
+		start[t] = enc->tmp.len;
+		if (hextile_tile(enc, &st, &enc->tmp, x, y, w, h) == 1)
+			zlib[t] = 0x20;
+		else if (enc->tmp.len - start[t] > 17)
+			zlib[t] = 0x40;
+		else
+			zlib[t] = 0;
+		if (zlib[t])
+			last[zlib[t] >> 6] = t;
+	}
+	start[tiles] = enc->tmp.len;
+
+	put_rect(b, 0, 0, enc->width, enc->height, 8);
+	for (t = 0; t < tiles && !enc->tmp.failed; ++t) {
+		len = start[t + 1] - start[t];
+		if (!zlib[t]) {
+			put(b, enc->tmp.data + start[t], len);
+			continue;
+		}
+		enc->ztmp.len = 0;
+		if (compress_to(enc, zlib[t] >> 6, &enc->ztmp,
+			enc->tmp.data + start[t] + 1, len - 1,
+			t == last[zlib[t] >> 6]))
+		{
+			break;
+		}
+		if (zlib[t] == 0x20)
+			put8(b, 0x20);
+		else
+			put8(b, 0x40 | enc->tmp.data[start[t]]);
+		put16(b, enc->ztmp.len);
+		put(b, enc->ztmp.data, enc->ztmp.len);
+	}
+
+	free(start);
+	free(zlib);
+	if (t < tiles || enc->tmp.failed)
+		return -1;
+	update->pixels += (uint64_t)enc->width * enc->height;
+	return 1;
+}
+
+static void
+put_compact(struct bench_buf *b, size_t len)
+{
+	if (len < 0x80) {
+		put8(b, len);
+		return;
+	}
+	put8(b, 0x80 | (len & 0x7f));
+	if (len < 0x4000) {
+		put8(b, len >> 7);
+		return;
+	}
+	put8(b, 0x80 | ((len >> 7) & 0x7f));
+	put8(b, len >> 14);
+}
+
+#ifdef BENCH_JPEG
+static int
+jpeg_rect(struct bench_encoder *enc, struct bench_buf *out,
+	int x, int y, int w, int h)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char *mem = NULL;
+	unsigned long size = 0;
+	JSAMPROW row;
+	int j;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &mem, &size);
+	cinfo.image_width = w;
+	cinfo.image_height = h;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 75, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	for (j = 0; j < h; ++j) {
+		row = enc->img->rgb + ((y + j) * enc->width + x) * 3;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	put_compact(out, size);
+	put(out, mem, size);
+	free(mem);
+	return 0;
+}
+#endif
+
+static enum tight_kind
+tight_kind(struct bench_encoder *enc, int x, int y, int w, int h,
+	uint32_t *palette, int *colors, size_t *len)
+{
+	*colors = block_palette(enc, x, y, w, h, palette, 256);
+	*len = 0;
+	if (*colors == 1)
+		return TIGHT_FILL;
+
+	switch (enc->encoding) {
+	case BENCH_TIGHT_PALETTE:
+		if (*colors > 256)
+			break;
+		*len = *colors == 2 ? (w + 7) / 8 * h : w * h;
+		return TIGHT_PALETTE;
+	case BENCH_TIGHT_GRADIENT:
+		*len = 3 * w * h;
+		return TIGHT_GRADIENT;
+	case BENCH_TIGHT_JPEG:
+		return TIGHT_JPEG;
+	default:
+		break;
+	}
+	*len = (enc->tpixel888 ? 3 : enc->bpp) * w * h;
+	return TIGHT_COPY;
+}
+
+static void
+tight_gradient(struct bench_encoder *enc, struct bench_buf *out,
+	int x, int y, int w, int h)
+{
+	const uint32_t *px;
+	const int shift[3] = {
+		enc->format.r_shift, enc->format.g_shift, enc->format.b_shift
+	};
+	int c, i, j, cur, left, up, up_left, predict;
+
+	for (j = 0; j < h; ++j) {
+		px = block(enc, x, y + j);
+		for (i = 0; i < w; ++i) {
+			for (c = 0; c < 3; ++c) {
+				cur = px[i] >> shift[c] & 0xff;
+				left = i ? px[i - 1] >> shift[c] & 0xff : 0;
+				up = j ? px[i - enc->width] >> shift[c] & 0xff : 0;
+				up_left = i && j
+					? px[i - 1 - enc->width] >> shift[c] & 0xff
+					: 0;
+				if (!j)
+					predict = left;
+				else if (!i)
+					predict = up;
+				else {
+					predict = left + up - up_left;
+					if (predict < 0)
+						predict = 0;
+					if (predict > 255)
+						predict = 255;
+				}
+				put8(out, cur - predict);
+			}
+		}
+	}
+}
+
+static int
+encode_tight(struct bench_encoder *enc, struct bench_update *update)
+{
+	struct bench_buf *b = &update->msg;
+	const uint32_t *px;
+	uint32_t palette[257];
+	int tiles_x = (enc->width + TIGHT_TILE - 1) / TIGHT_TILE;
+	int tiles = tiles_x * ((enc->height + TIGHT_TILE - 1) / TIGHT_TILE);
+	int last[3] = { -1, -1, -1 };
+	int x, y, w, h, t, i, j;
+	int colors, stream, shift;
+	enum tight_kind kind;
+	size_t len;
+	uint8_t byte;
+
+	/* Find the last use of each stream, to flush it fully there. */
+	for (t = 0; t < tiles; ++t) {
+		x = t % tiles_x * TIGHT_TILE;
+		y = t / tiles_x * TIGHT_TILE;
+		w = enc->width - x < TIGHT_TILE ? enc->width - x : TIGHT_TILE;
+		h = enc->height - y < TIGHT_TILE ? enc->height - y : TIGHT_TILE;
+		kind = tight_kind(enc, x, y, w, h, palette, &colors, &len);
+		if (len >= TIGHT_MIN_TO_COMPRESS)
+			last[kind - TIGHT_COPY] = t;
+	}
+
+	for (t = 0; t < tiles; ++t) {
+		x = t % tiles_x * TIGHT_TILE;
+		y = t / tiles_x * TIGHT_TILE;
+		w = enc->width - x < TIGHT_TILE ? enc->width - x : TIGHT_TILE;
+		h = enc->height - y < TIGHT_TILE ? enc->height - y : TIGHT_TILE;
+		kind = tight_kind(enc, x, y, w, h, palette, &colors, &len);
+
+		put_rect(b, x, y, w, h, 7);
+		update->pixels += (uint64_t)w * h;
+
+		if (kind == TIGHT_FILL) {
+			put8(b, 0x80);
+			put_tpixel(enc, b, palette[0]);
+			continue;
+		}
+#ifdef BENCH_JPEG
+		if (kind == TIGHT_JPEG) {
+			put8(b, 0x90);
+			if (jpeg_rect(enc, b, x, y, w, h))
+				return -1;
+			continue;
+		}
+#endif
+
+		enc->tmp.len = 0;
+		stream = kind - TIGHT_COPY;
+		switch (kind) {
+		case TIGHT_COPY:
+			put8(b, 0x00);
+			for (j = 0; j < h; ++j) {
+				px = block(enc, x, y + j);
+				for (i = 0; i < w; ++i)
+					put_tpixel(enc, &enc->tmp, px[i]);
+			}
+			break;
+		case TIGHT_PALETTE:
+			put8(b, 0x40 | stream << 4);
+			put8(b, 1);
+			put8(b, colors - 1);
+			for (i = 0; i < colors; ++i)
+				put_tpixel(enc, b, palette[i]);
+			for (j = 0; j < h; ++j) {
+				px = block(enc, x, y + j);
+				if (colors > 2) {
+					for (i = 0; i < w; ++i)
+						put8(&enc->tmp, palette_index(
+							palette, colors, px[i]));
+					continue;
+				}
+				byte = 0;
+				shift = 7;
+				for (i = 0; i < w; ++i) {
+					if (px[i] == palette[1])
+						byte |= 1 << shift;
+					if (--shift < 0) {
+						put8(&enc->tmp, byte);
+						byte = 0;
+						shift = 7;
+					}
+				}
+				if (shift != 7)
+					put8(&enc->tmp, byte);
+			}
+			break;
+		case TIGHT_GRADIENT:
+			put8(b, 0x40 | stream << 4);
+			put8(b, 2);
+			tight_gradient(enc, &enc->tmp, x, y, w, h);
+			break;
+		default:
+			return -1;
+		}
+
+		if (enc->tmp.failed)
+			return -1;
+		if (enc->tmp.len < TIGHT_MIN_TO_COMPRESS) {
+			put(b, enc->tmp.data, enc->tmp.len);
+			continue;
+		}
+		enc->ztmp.len = 0;
+		if (compress_to(enc, stream, &enc->ztmp,
+			enc->tmp.data, enc->tmp.len, t == last[stream]))
+		{
+			return -1;
+		}
+		put_compact(b, enc->ztmp.len);
+		put(b, enc->ztmp.data, enc->ztmp.len);
+	}
+
+	return tiles;
+}
+#endif /* HAVE_ZLIB */
+
+struct bench_encoder *
+bench_encoder_new(enum bench_encoding encoding,
+	const struct bench_format *format, const struct bench_image *img)
+{
+	struct bench_encoder *enc;
+	uint32_t mask;
+	size_t i, n;
+
+	if (!bench_encodings[encoding].available)
+		return NULL;
+	if (!format->true_color)
+		return NULL;
+	if (format->bpp != 8 && format->bpp != 16 && format->bpp != 32)
+		return NULL;
+
+	enc = calloc(1, sizeof(*enc));
+	if (!enc)
+		return NULL;
+
+	enc->encoding = encoding;
+	enc->format = *format;
+	enc->img = img;
+	enc->width = img->width;
+	enc->height = img->height;
+	enc->bpp = format->bpp / 8;
+
+	enc->cpixel = enc->bpp;
+	if (format->bpp == 32 && format->depth <= 24) {
+		mask = (uint32_t)format->r_max << format->r_shift
+			| (uint32_t)format->g_max << format->g_shift
+			| (uint32_t)format->b_max << format->b_shift;
+		if (!(mask & 0xff000000))
+			enc->cpixel = 3;
+		else if (!(mask & 0xff)) {
+			enc->cpixel = 3;
+			enc->cpixel_shift = 8;
+		}
+	}
+	enc->tpixel888 = format->bpp == 32 && format->depth == 24
+		&& format->r_max == 255 && format->g_max == 255
+		&& format->b_max == 255;
+
+	/* Tight sends gradients and JPEG as R, G and B bytes. */
+	if ((encoding == BENCH_TIGHT_GRADIENT || encoding == BENCH_TIGHT_JPEG)
+		&& !enc->tpixel888)
+	{
+		goto fail;
+	}
+
+	n = (size_t)img->width * img->height;
+	enc->pixels = malloc(n * sizeof(*enc->pixels));
+	if (!enc->pixels)
+		goto fail;
+	for (i = 0; i < n; ++i)
+		enc->pixels[i] = bench_pixel(format, img->rgb + i * 3);
+
+	if (reserve_scratch(enc, n))
+		goto fail;
+
+	return enc;
+
+fail:
+	bench_encoder_free(enc);
+	return NULL;
+}
+
+void
+bench_encoder_free(struct bench_encoder *enc)
+{
+#ifdef HAVE_ZLIB
+	int i;
+#endif
+
+	if (!enc)
+		return;
+
+#ifdef HAVE_ZLIB
+	for (i = 0; i < 4; ++i) {
+		if (enc->zs_init[i])
+			deflateEnd(&enc->zs[i]);
+	}
+#endif
+	free(enc->pixels);
+	free(enc->subrects);
+	free(enc->done);
+	free(enc->sorted);
+	free(enc->tmp.data);
+	free(enc->ztmp.data);
+	free(enc);
+}
+
+int
+bench_encode(struct bench_encoder *enc, struct bench_update *update)
+{
+	struct bench_buf *b = &update->msg;
+	int rects;
+
+	b->len = 0;
+	b->failed = 0;
+	update->pixels = 0;
+
+	put8(b, 0);	/* FramebufferUpdate */
+	put8(b, 0);
+	put16(b, 0);	/* rectangles, filled in below */
+
+	switch (enc->encoding) {
+	case BENCH_RAW:
+		rects = encode_raw(enc, update, 0, 0, enc->width, enc->height);
+		break;
+	case BENCH_COPYRECT:
+		rects = encode_copyrect(enc, update);
+		break;
+	case BENCH_RRE:
+		rects = encode_rre(enc, update,
+			0, 0, enc->width, enc->height, 0);
+		break;
+	case BENCH_CORRE:
+		rects = encode_corre(enc, update);
+		break;
+	case BENCH_HEXTILE:
+		rects = encode_hextile(enc, update);
+		break;
+	case BENCH_TRLE:
+		rects = encode_trle(enc, update);
+		break;
+#ifdef HAVE_ZLIB
+	case BENCH_ZLIB:
+		rects = encode_zlib(enc, update);
+		break;
+	case BENCH_ZLIBHEX:
+		rects = encode_zlibhex(enc, update);
+		break;
+	case BENCH_ZRLE:
+		rects = encode_zrle(enc, update);
+		break;
+	case BENCH_TIGHT_BASIC:
+	case BENCH_TIGHT_PALETTE:
+	case BENCH_TIGHT_GRADIENT:
+	case BENCH_TIGHT_JPEG:
+		rects = encode_tight(enc, update);
+		break;
+#endif
+	default:
+		rects = -1;
+		break;
+	}
+
+	if (rects < 0 || rects > 0xffff || b->failed)
+		return -1;
+
+	b->data[2] = rects >> 8;
+	b->data[3] = rects;
+	++enc->updates;
+	return 0;
+}
+
+void
+bench_update_free(struct bench_update *update)
+{
+	free(update->msg.data);
+	memset(update, 0, sizeof(*update));
+}
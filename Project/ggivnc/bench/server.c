@@ -0,0 +1,478 @@
+/*
+******************************************************************************
+
+   Decoder benchmarks, a synthetic RFB server.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct bench_server {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int listen_fd;
+	int fd;
+
+	const struct bench_image *img;
+	enum bench_encoding encoding;
+	struct bench_encoder *enc;
+	struct bench_update first;
+	struct bench_update repeat;
+	int sent;
+
+	/* Echo mode, incremental requests wait for input. */
+	int echo;
+	int held;		/* a request is waiting */
+	int changed;		/* input came with no request waiting */
+
+	/* protected by lock, as is fd until accepted */
+	int stopping;
+	struct bench_format format;
+	int have_format;
+	uint64_t bytes;
+	uint64_t pixels;
+	char error[128];
+};
+
+static void
+server_error(struct bench_server *server, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	pthread_mutex_lock(&server->lock);
+	if (!server->error[0])
+		vsnprintf(server->error, sizeof(server->error), fmt, ap);
+	pthread_mutex_unlock(&server->lock);
+	va_end(ap);
+}
+
+static int
+read_all(struct bench_server *server, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t res;
+
+	while (len) {
+		res = recv(server->fd, p, len, 0);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int
+skip(struct bench_server *server, size_t len)
+{
+	uint8_t buf[256];
+	size_t chunk;
+
+	while (len) {
+		chunk = len < sizeof(buf) ? len : sizeof(buf);
+		if (read_all(server, buf, chunk))
+			return -1;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int
+write_all(struct bench_server *server, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t res;
+
+	while (len) {
+		res = send(server->fd, p, len, MSG_NOSIGNAL);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int
+handshake(struct bench_server *server)
+{
+	static const uint8_t security[] = { 1, 1 };	/* None */
+	static const uint8_t result[] = { 0, 0, 0, 0 };
+	static const char name[] = "ggivnc bench";
+	uint8_t version[12];
+	uint8_t init[24];
+	uint8_t byte;
+
+	if (write_all(server, "RFB 003.008\n", 12))
+		return -1;
+	if (read_all(server, version, sizeof(version)))
+		return -1;
+	if (memcmp(version, "RFB 003.008\n", 12)) {
+		server_error(server, "viewer did not accept RFB 3.8");
+		return -1;
+	}
+
+	if (write_all(server, security, sizeof(security)))
+		return -1;
+	if (read_all(server, &byte, 1))
+		return -1;
+	if (write_all(server, result, sizeof(result)))
+		return -1;
+	if (read_all(server, &byte, 1))	/* ClientInit */
+		return -1;
+
+	init[0] = server->img->width >> 8;
+	init[1] = server->img->width;
+	init[2] = server->img->height >> 8;
+	init[3] = server->img->height;
+	init[4] = 32;		/* bpp */
+	init[5] = 24;		/* depth */
+	init[6] = 0;		/* little endian */
+	init[7] = 1;		/* true color */
+	init[8] = 0;		/* red max */
+	init[9] = 255;
+	init[10] = 0;		/* green max */
+	init[11] = 255;
+	init[12] = 0;		/* blue max */
+	init[13] = 255;
+	init[14] = 16;		/* shifts */
+	init[15] = 8;
+	init[16] = 0;
+	init[17] = init[18] = init[19] = 0;
+	init[20] = init[21] = init[22] = 0;
+	init[23] = sizeof(name) - 1;
+	if (write_all(server, init, sizeof(init)))
+		return -1;
+	return write_all(server, name, sizeof(name) - 1);
+}
+
+static int
+set_pixel_format(struct bench_server *server)
+{
+	struct bench_format format;
+	uint8_t msg[19];
+
+	if (read_all(server, msg, sizeof(msg)))
+		return -1;
+	if (server->sent) {
+		server_error(server, "pixel format changed midway");
+		return -1;
+	}
+
+	format.bpp = msg[3];
+	format.depth = msg[4];
+	format.big_endian = msg[5];
+	format.true_color = msg[6];
+	format.r_max = msg[7] << 8 | msg[8];
+	format.g_max = msg[9] << 8 | msg[10];
+	format.b_max = msg[11] << 8 | msg[12];
+	format.r_shift = msg[13];
+	format.g_shift = msg[14];
+	format.b_shift = msg[15];
+
+	pthread_mutex_lock(&server->lock);
+	server->format = format;
+	server->have_format = 1;
+	pthread_mutex_unlock(&server->lock);
+
+	bench_encoder_free(server->enc);
+	server->enc = NULL;
+	return 0;
+}
+
+/* Encode the first update, and the one to repeat, on the first request,
+ * when the pixel format is settled.
+ */
+static int
+prepare(struct bench_server *server)
+{
+	const struct bench_encoding_info *info =
+		&bench_encodings[server->encoding];
+
+	if (server->enc)
+		return 0;
+
+	server->enc = bench_encoder_new(server->encoding,
+		&server->format, server->img);
+	if (!server->enc) {
+		server_error(server,
+			"%s not supported in this pixel format", info->name);
+		return -1;
+	}
+	if (bench_encode(server->enc, &server->first)
+		|| bench_encode(server->enc, &server->repeat))
+	{
+		server_error(server, "%s encoder failed", info->name);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+send_update(struct bench_server *server)
+{
+	struct bench_update *update;
+
+	update = server->sent ? &server->repeat : &server->first;
+	if (write_all(server, update->msg.data, update->msg.len))
+		return -1;
+	if (server->sent)
+		return 0;
+
+	server->sent = 1;
+	pthread_mutex_lock(&server->lock);
+	server->bytes = server->repeat.msg.len;
+	server->pixels = server->repeat.pixels;
+	pthread_mutex_unlock(&server->lock);
+	return 0;
+}
+
+/* In echo mode, an incremental request is only answered once there is
+ * input, as a server that draws the pointer into the framebuffer does.
+ */
+static int
+update_request(struct bench_server *server)
+{
+	uint8_t msg[9];
+
+	if (read_all(server, msg, sizeof(msg)))
+		return -1;
+	if (prepare(server))
+		return -1;
+
+	if (server->echo && server->sent && msg[0] && !server->changed) {
+		server->held = 1;
+		return 0;
+	}
+	server->changed = 0;
+	return send_update(server);
+}
+
+static int
+input(struct bench_server *server, size_t len)
+{
+	if (skip(server, len))
+		return -1;
+	if (!server->echo)
+		return 0;
+	if (!server->held) {
+		server->changed = 1;
+		return 0;
+	}
+	server->held = 0;
+	return send_update(server);
+}
+
+static int
+client_message(struct bench_server *server)
+{
+	uint8_t type;
+	uint8_t msg[7];
+
+	if (read_all(server, &type, 1))
+		return -1;
+
+	switch (type) {
+	case 0:		/* SetPixelFormat */
+		return set_pixel_format(server);
+	case 2:		/* SetEncodings */
+		if (read_all(server, msg, 3))
+			return -1;
+		return skip(server, 4 * (msg[1] << 8 | msg[2]));
+	case 3:		/* FramebufferUpdateRequest */
+		return update_request(server);
+	case 4:		/* KeyEvent */
+		return input(server, 7);
+	case 5:		/* PointerEvent */
+		return input(server, 5);
+	case 6:		/* ClientCutText */
+		if (read_all(server, msg, 7))
+			return -1;
+		return skip(server, (uint32_t)msg[3] << 24 | msg[4] << 16
+			| msg[5] << 8 | msg[6]);
+	}
+
+	server_error(server, "unexpected client message %u", type);
+	return -1;
+}
+
+static void *
+server_thread(void *arg)
+{
+	struct bench_server *server = arg;
+	int fd;
+
+	fd = accept(server->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return NULL;
+
+	pthread_mutex_lock(&server->lock);
+	server->fd = fd;
+	if (server->stopping)
+		shutdown(fd, SHUT_RDWR);
+	pthread_mutex_unlock(&server->lock);
+
+	if (handshake(server))
+		return NULL;
+	while (!client_message(server));
+	return NULL;
+}
+
+struct bench_server *
+bench_server_start(const struct bench_image *img,
+	enum bench_encoding encoding, int echo, int *port)
+{
+	struct bench_server *server;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	server = calloc(1, sizeof(*server));
+	if (!server)
+		return NULL;
+
+	server->img = img;
+	server->encoding = encoding;
+	server->echo = echo;
+	server->fd = -1;
+	server->format.bpp = 32;
+	server->format.depth = 24;
+	server->format.true_color = 1;
+	server->format.r_max = 255;
+	server->format.g_max = 255;
+	server->format.b_max = 255;
+	server->format.r_shift = 16;
+	server->format.g_shift = 8;
+	server->format.b_shift = 0;
+	pthread_mutex_init(&server->lock, NULL);
+
+	server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server->listen_fd < 0)
+		goto fail;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)))
+		goto fail;
+	if (listen(server->listen_fd, 1))
+		goto fail;
+	if (getsockname(server->listen_fd, (struct sockaddr *)&addr, &len))
+		goto fail;
+	*port = ntohs(addr.sin_port);
+
+	if (pthread_create(&server->thread, NULL, server_thread, server))
+		goto fail;
+	return server;
+
+fail:
+	if (server->listen_fd >= 0)
+		close(server->listen_fd);
+	pthread_mutex_destroy(&server->lock);
+	free(server);
+	return NULL;
+}
+
+void
+bench_server_stats(struct bench_server *server,
+	uint64_t *bytes, uint64_t *pixels)
+{
+	pthread_mutex_lock(&server->lock);
+	*bytes = server->bytes;
+	*pixels = server->pixels;
+	pthread_mutex_unlock(&server->lock);
+}
+
+int
+bench_server_format(struct bench_server *server, struct bench_format *format)
+{
+	int have;
+
+	pthread_mutex_lock(&server->lock);
+	*format = server->format;
+	have = server->have_format;
+	pthread_mutex_unlock(&server->lock);
+	return have;
+}
+
+const char *
+bench_server_error(struct bench_server *server)
+{
+	const char *error;
+
+	pthread_mutex_lock(&server->lock);
+	error = server->error[0] ? server->error : NULL;
+	pthread_mutex_unlock(&server->lock);
+	return error;
+}
+
+void
+bench_server_stop(struct bench_server *server)
+{
+	if (!server)
+		return;
+
+	/* Wake up the thread in accept or recv. */
+	pthread_mutex_lock(&server->lock);
+	server->stopping = 1;
+	shutdown(server->listen_fd, SHUT_RDWR);
+	if (server->fd >= 0)
+		shutdown(server->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&server->lock);
+	pthread_join(server->thread, NULL);
+
+	close(server->listen_fd);
+	if (server->fd >= 0)
+		close(server->fd);
+	bench_encoder_free(server->enc);
+	bench_update_free(&server->first);
+	bench_update_free(&server->repeat);
+	pthread_mutex_destroy(&server->lock);
+	free(server);
+}
@@ -0,0 +1,626 @@
+/*
+******************************************************************************
+
+   VNC viewer connection setup.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#ifdef HAVE_WINSOCK2_H
+# include <winsock2.h>
+#endif
+#ifdef HAVE_WS2TCPIP_H
+# include <ws2tcpip.h>
+#endif
+#endif
+
+#include <ggi/gg.h>
+
+#include "vnc.h"
+#include "vnc-debug.h"
+
+/* Connection attempts to the resolved addresses are started this far
+ * apart, unless the previous attempt fails before that (RFC 8305).
+ */
+#define ATTEMPT_DELAY	250
+#define MAX_ADDRS	16
+
+/* Resolved addresses are reused for this long. */
+#define CACHE_TTL	60000
+
+/* A preconnected socket that has not been picked up this long after
+ * the server greeted is assumed to be stale.
+ */
+#define WARM_TTL	30000
+#define GREETING_WAIT	5000
+
+struct net_addr {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t len;
+	struct sockaddr_storage sa;
+};
+
+struct addr_cache {
+	struct addr_cache *next;
+	char *server;
+	int port;
+	int family;
+	uint32_t expire;
+	int count;
+	struct net_addr addr[MAX_ADDRS];
+};
+
+enum {
+	WARM_NONE,
+	WARM_PENDING,
+	WARM_READY
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	struct addr_cache *cache;
+
+	/* The connection opened by net_preconnect. */
+	int state;
+	char *server;
+	int port;
+	int family;
+	int sfd;
+	uint32_t greeted;
+} net = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL,
+	WARM_NONE,
+	NULL,
+	0,
+	0,
+	-1,
+	0
+};
+
+static uint32_t
+now_ms(void)
+{
+	struct timeval tv;
+
+	ggCurTime(&tv);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int
+in_progress(void)
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EINPROGRESS || errno == EINTR;
+#endif
+}
+
+static int
+set_nonblock(int fd)
+{
+#if defined(F_GETFL)
+	long flags = fcntl(fd, F_GETFL);
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#elif defined(FIONBIO)
+	u_long flags = 1;
+	return ioctlsocket(fd, FIONBIO, &flags);
+#else
+	return 0;
+#endif
+}
+
+static struct addr_cache *
+cache_find(const char *server, int port, int family)
+{
+	struct addr_cache *entry;
+
+	for (entry = net.cache; entry; entry = entry->next) {
+		if (entry->port == port && entry->family == family &&
+			!strcmp(entry->server, server))
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Order the addresses as getaddrinfo sorted them, but alternate the
+ * address families so that a broken IPv6 (or IPv4) path only ever
+ * delays the other family by one attempt.
+ */
+static int
+interleave(struct addrinfo *gai, struct net_addr *addr)
+{
+	struct addrinfo *ai;
+	struct addrinfo *head[2] = { NULL, NULL };
+	int count = 0;
+	int first;
+	int turn;
+
+	if (!gai)
+		return 0;
+	first = gai->ai_family;
+
+	for (ai = gai; ai; ai = ai->ai_next) {
+		int k = ai->ai_family != first;
+		if (!head[k])
+			head[k] = ai;
+	}
+
+	turn = 0;
+	while ((head[0] || head[1]) && count < MAX_ADDRS) {
+		if (!head[turn])
+			turn = !turn;
+		ai = head[turn];
+		if (ai->ai_addrlen <= sizeof(addr[count].sa)) {
+			addr[count].family = ai->ai_family;
+			addr[count].socktype = ai->ai_socktype;
+			addr[count].protocol = ai->ai_protocol;
+			addr[count].len = ai->ai_addrlen;
+			memcpy(&addr[count].sa, ai->ai_addr, ai->ai_addrlen);
+			++count;
+		}
+		for (ai = ai->ai_next; ai; ai = ai->ai_next) {
+			if ((ai->ai_family != first) == turn)
+				break;
+		}
+		head[turn] = ai;
+		turn = !turn;
+	}
+
+	return count;
+}
+
+static int
+resolve(const char *server, int port, int family, struct net_addr *addr)
+{
+	struct addr_cache *entry;
+	struct addrinfo hints;
+	struct addrinfo *gai;
+	char str_port[20];
+	uint32_t now = now_ms();
+	int count;
+	int res;
+
+	pthread_mutex_lock(&net.lock);
+	entry = cache_find(server, port, family);
+	if (entry && (int32_t)(entry->expire - now) > 0) {
+		count = entry->count;
+		memcpy(addr, entry->addr, count * sizeof(*addr));
+		pthread_mutex_unlock(&net.lock);
+		debug(1, "%s: %d cached addresses\n", server, count);
+		return count;
+	}
+	pthread_mutex_unlock(&net.lock);
+
+	memset(&hints, '\0', sizeof(hints));
+#ifdef AI_ADDRCONFIG
+	hints.ai_flags = AI_ADDRCONFIG;
+#endif
+	hints.ai_socktype = SOCK_STREAM;
+	switch (family) {
+	case 4:
+		debug(1, "Using IPv4 only\n");
+		hints.ai_family = PF_INET;
+		break;
+#ifdef PF_INET6
+	case 6:
+		debug(1, "Using IPv6 only\n");
+		hints.ai_family = PF_INET6;
+		break;
+#endif
+	}
+
+	snprintf(str_port, sizeof(str_port), "%d", port);
+
+	res = getaddrinfo(server, str_port, &hints, &gai);
+	if (res) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+		return -1;
+	}
+	count = interleave(gai, addr);
+	freeaddrinfo(gai);
+
+	pthread_mutex_lock(&net.lock);
+	entry = cache_find(server, port, family);
+	if (!entry) {
+		entry = malloc(sizeof(*entry));
+		if (entry) {
+			entry->server = strdup(server);
+			if (!entry->server) {
+				free(entry);
+				entry = NULL;
+			}
+		}
+		if (entry) {
+			entry->port = port;
+			entry->family = family;
+			entry->next = net.cache;
+			net.cache = entry;
+		}
+	}
+	if (entry) {
+		entry->expire = now + CACHE_TTL;
+		entry->count = count;
+		memcpy(entry->addr, addr, count * sizeof(*addr));
+	}
+	pthread_mutex_unlock(&net.lock);
+
+	return count;
+}
+
+/* Try the winning address first the next time. */
+static void
+promote(const char *server, int port, int family, const struct net_addr *addr)
+{
+	struct addr_cache *entry;
+	struct net_addr winner;
+	int i;
+
+	pthread_mutex_lock(&net.lock);
+	entry = cache_find(server, port, family);
+	if (entry) {
+		for (i = 0; i < entry->count; ++i) {
+			if (entry->addr[i].len == addr->len &&
+				!memcmp(&entry->addr[i].sa, &addr->sa, addr->len))
+			{
+				break;
+			}
+		}
+		if (i && i < entry->count) {
+			winner = entry->addr[i];
+			memmove(&entry->addr[1], &entry->addr[0],
+				i * sizeof(winner));
+			entry->addr[0] = winner;
+		}
+	}
+	pthread_mutex_unlock(&net.lock);
+}
+
+static int
+start_attempt(const struct net_addr *addr)
+{
+	int fd;
+
+	fd = socket(addr->family, addr->socktype, addr->protocol);
+	if (fd == -1) {
+		debug(1, "socket\n");
+		return -1;
+	}
+	if (set_nonblock(fd)) {
+		close(fd);
+		return -1;
+	}
+	if (!connect(fd, (const struct sockaddr *)&addr->sa, addr->len))
+		return fd;
+	if (in_progress())
+		return fd;
+	debug(1, "connect\n");
+	close(fd);
+	return -1;
+}
+
+/* Race connection attempts to the addresses, staggered by
+ * ATTEMPT_DELAY, and return the first socket that connects. The
+ * socket is left non-blocking. Gives up when cancel_fd, if not -1,
+ * becomes readable.
+ */
+static int
+race(const struct net_addr *addr, int count, int *winner, int cancel_fd)
+{
+	int fd[MAX_ADDRS];
+	int started = 0;
+	int pending = 0;
+	uint32_t next = now_ms();
+	int sfd = -1;
+	int i;
+
+	while (sfd == -1) {
+		uint32_t now = now_ms();
+		struct timeval tv;
+		fd_set rfds, wfds, efds;
+		int maxfd = cancel_fd;
+		int res;
+
+		if (started < count && (int32_t)(next - now) <= 0) {
+			debug(2, "connect attempt %d\n", started);
+			fd[started] = start_attempt(&addr[started]);
+			if (fd[started] != -1) {
+				++pending;
+				next = now + ATTEMPT_DELAY;
+			}
+			++started;
+			continue;
+		}
+		if (!pending) {
+			if (started < count) {
+				next = now;
+				continue;
+			}
+			break;
+		}
+
+		FD_ZERO(&rfds);
+		if (cancel_fd != -1)
+			FD_SET(cancel_fd, &rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		for (i = 0; i < started; ++i) {
+			if (fd[i] == -1)
+				continue;
+			FD_SET(fd[i], &wfds);
+			FD_SET(fd[i], &efds);
+			if (fd[i] > maxfd)
+				maxfd = fd[i];
+		}
+		if (started < count) {
+			tv.tv_sec = (next - now) / 1000;
+			tv.tv_usec = (next - now) % 1000 * 1000;
+		}
+		res = select(maxfd + 1, &rfds, &wfds, &efds,
+			started < count ? &tv : NULL);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			debug(1, "select error %d \"%s\"\n",
+				errno, strerror(errno));
+			break;
+		}
+		if (cancel_fd != -1 && FD_ISSET(cancel_fd, &rfds)) {
+			debug(1, "connect cancelled\n");
+			break;
+		}
+
+		for (i = 0; i < started; ++i) {
+			int err = 0;
+#ifdef HAVE_SOCKLEN_T
+			socklen_t len = sizeof(err);
+#else
+			int len = sizeof(err);
+#endif
+			if (fd[i] == -1)
+				continue;
+			if (!FD_ISSET(fd[i], &wfds) && !FD_ISSET(fd[i], &efds))
+				continue;
+			if (getsockopt(fd[i], SOL_SOCKET, SO_ERROR,
+				(char *)&err, &len) || err)
+			{
+				debug(1, "connect attempt %d failed\n", i);
+				close(fd[i]);
+				fd[i] = -1;
+				--pending;
+				/* Don't wait for the delay to run out. */
+				next = now_ms();
+				continue;
+			}
+			sfd = fd[i];
+			fd[i] = -1;
+			*winner = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < started; ++i) {
+		if (fd[i] != -1)
+			close(fd[i]);
+	}
+
+	return sfd;
+}
+
+int
+net_connect(const char *server, int port, int family, int cancel_fd)
+{
+	struct net_addr addr[MAX_ADDRS];
+	int count;
+	int winner;
+	int sfd;
+
+	count = resolve(server, port, family, addr);
+	if (count <= 0)
+		return -1;
+
+	sfd = race(addr, count, &winner, cancel_fd);
+	if (sfd == -1)
+		return -1;
+
+	debug(1, "connected using address %d of %d\n", winner + 1, count);
+	promote(server, port, family, &addr[winner]);
+	return sfd;
+}
+
+/* Wait until the server has sent the start of its ProtocolVersion
+ * message, without consuming it.
+ */
+static int
+wait_greeting(int sfd)
+{
+	uint32_t end = now_ms() + GREETING_WAIT;
+	char rfb[4];
+
+	for (;;) {
+		int32_t left = end - now_ms();
+		struct timeval tv;
+		fd_set rfds;
+		int res;
+
+		if (left <= 0)
+			return -1;
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = left % 1000 * 1000;
+		FD_ZERO(&rfds);
+		FD_SET(sfd, &rfds);
+		res = select(sfd + 1, &rfds, NULL, NULL, &tv);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		res = recv(sfd, rfb, sizeof(rfb), MSG_PEEK);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		if (memcmp(rfb, "RFB ", res))
+			return -1;
+		if (res == sizeof(rfb))
+			return 0;
+		/* Partial greeting, give it a moment. */
+		ggUSleep(1000);
+	}
+}
+
+static void *
+preconnect(void *arg)
+{
+	int sfd;
+
+	(void)arg;
+
+	sfd = net_connect(net.server, net.port, net.family, -1);
+	if (sfd != -1 && wait_greeting(sfd)) {
+		debug(1, "no greeting from %s\n", net.server);
+		close(sfd);
+		sfd = -1;
+	}
+
+	pthread_mutex_lock(&net.lock);
+	net.sfd = sfd;
+	net.greeted = now_ms();
+	net.state = WARM_READY;
+	pthread_cond_broadcast(&net.done);
+	pthread_mutex_unlock(&net.lock);
+
+	return NULL;
+}
+
+static void
+drop_warm(void)
+{
+	if (net.sfd != -1)
+		close(net.sfd);
+	net.sfd = -1;
+	free(net.server);
+	net.server = NULL;
+	net.state = WARM_NONE;
+}
+
+int
+net_preconnect(const char *server, int port, int family)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	char *copy;
+	int res;
+
+	copy = strdup(server);
+	if (!copy)
+		return -1;
+
+	pthread_mutex_lock(&net.lock);
+	while (net.state == WARM_PENDING)
+		pthread_cond_wait(&net.done, &net.lock);
+	drop_warm();
+	net.server = copy;
+	net.port = port;
+	net.family = family;
+	net.state = WARM_PENDING;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	res = pthread_create(&thread, &attr, preconnect, NULL);
+	pthread_attr_destroy(&attr);
+	if (res) {
+		debug(1, "cannot start preconnect thread\n");
+		drop_warm();
+	}
+	pthread_mutex_unlock(&net.lock);
+
+	return res ? -1 : 0;
+}
+
+int
+net_take_preconnected(const char *server, int port, int family)
+{
+	int sfd = -1;
+
+	pthread_mutex_lock(&net.lock);
+	if (net.state == WARM_NONE ||
+		net.port != port || net.family != family ||
+		strcmp(net.server, server))
+	{
+		pthread_mutex_unlock(&net.lock);
+		return -1;
+	}
+
+	while (net.state == WARM_PENDING)
+		pthread_cond_wait(&net.done, &net.lock);
+
+	if ((int32_t)(now_ms() - net.greeted) < WARM_TTL) {
+		sfd = net.sfd;
+		net.sfd = -1;
+	}
+	else
+		debug(1, "preconnected socket is stale\n");
+	drop_warm();
+	pthread_mutex_unlock(&net.lock);
+
+	if (sfd != -1)
+		debug(1, "using preconnected socket\n");
+	return sfd;
+}
@@ -0,0 +1,461 @@
+/*
+******************************************************************************
+
+   VNC viewer pixel format conversion.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ggi/ggi.h>
+
+#include "vnc-convert.h"
+#include "vnc-pool.h"
+#include "vnc-surface.h"
+#include "vnc-debug.h"
+
+enum {
+	CONVERT_NONE,		/* not planned yet */
+	CONVERT_CROSSBLIT,	/* no plan possible, use libggi */
+	CONVERT_COPY,		/* same format */
+	CONVERT_SHUFFLE,	/* 8-bit channels, rearrange bytes */
+	CONVERT_MAP,		/* 32-bit source, shift and mask */
+	CONVERT_LUT		/* 8-bit or 16-bit source, table lookup */
+};
+
+static const char *kind_names[] = {
+	"none", "crossblit", "copy", "shuffle", "map", "lut"
+};
+
+/* Boxes smaller than this are not worth waking the workers for. */
+#define CONVERT_MT_PIXELS (128 * 1024)
+#define CONVERT_MT_ROWS   16
+
+struct job {
+	const struct convert *cv;
+	const uint8_t *src;
+	uint8_t *dst;
+	int src_stride;
+	int dst_stride;
+	int w, h;
+	int bands;
+};
+
+static int
+mask_bits(ggi_pixel mask)
+{
+	int bits = 0;
+
+	for (; mask; mask &= mask - 1)
+		++bits;
+	return bits;
+}
+
+static int
+truecolor(const ggi_pixelformat *pf)
+{
+	return pf->red_mask && pf->green_mask && pf->blue_mask
+		&& !pf->clut_mask;
+}
+
+static void
+channels(const ggi_pixelformat *pf, ggi_pixel *mask, int *shift)
+{
+	mask[0] = pf->red_mask;
+	mask[1] = pf->green_mask;
+	mask[2] = pf->blue_mask;
+	shift[0] = pf->red_shift;
+	shift[1] = pf->green_shift;
+	shift[2] = pf->blue_shift;
+}
+
+static int
+same_format(const ggi_pixelformat *a, const ggi_pixelformat *b)
+{
+	return a->size == b->size
+		&& a->depth == b->depth
+		&& a->red_mask == b->red_mask
+		&& a->green_mask == b->green_mask
+		&& a->blue_mask == b->blue_mask
+		&& a->clut_mask == b->clut_mask
+		&& a->red_shift == b->red_shift
+		&& a->green_shift == b->green_shift
+		&& a->blue_shift == b->blue_shift
+		&& a->flags == b->flags;
+}
+
+/* Where in memory bits 8 * k and up of a pixel are stored. */
+static int
+byte_index(int k, int size, int reverse)
+{
+	int big = 0;
+
+#ifdef GGI_BIG_ENDIAN
+	/* 24-bit modes are always little endian in GGI */
+	big = size != 3;
+#endif
+	if (reverse)
+		big = !big;
+	return big ? size - 1 - k : k;
+}
+
+/* Byte number of an 8-bit byte aligned channel, or -1. */
+static int
+channel_byte(ggi_pixel mask)
+{
+	int k;
+
+	for (k = 0; k < 4; ++k) {
+		if (mask == (ggi_pixel)0xff << (8 * k))
+			return k;
+	}
+	return -1;
+}
+
+static int
+plan_shuffle(struct convert *cv, const ggi_pixel *src_mask,
+	const ggi_pixel *dst_mask)
+{
+	int reverse = !!(cv->dst.flags & GGI_PF_REVERSE_ENDIAN);
+	int c, s, d;
+
+	if (cv->src_size != 4)
+		return -1;
+	if (cv->dst_size != 3 && cv->dst_size != 4)
+		return -1;
+
+	memset(cv->shuffle, 0x80, sizeof(cv->shuffle));
+	for (c = 0; c < 3; ++c) {
+		s = channel_byte(src_mask[c]);
+		d = channel_byte(dst_mask[c]);
+		if (s < 0 || d < 0 || d >= cv->dst_size)
+			return -1;
+		cv->shuffle[byte_index(d, cv->dst_size, reverse)] =
+			byte_index(s, 4, 0);
+	}
+
+	cv->kind = CONVERT_SHUFFLE;
+	return 0;
+}
+
+/* Shifting the source channel to the top and back down to the
+ * destination leaves neighbouring source bits in the low bits of a
+ * wider destination channel, so this only handles narrowing.
+ */
+static int
+plan_map(struct convert *cv,
+	const ggi_pixel *src_mask, const int *src_shift,
+	const ggi_pixel *dst_mask, const int *dst_shift)
+{
+	int c;
+
+	if (cv->src_size != 4)
+		return -1;
+	if (cv->dst_size != 2 && cv->dst_size != 4)
+		return -1;
+
+	for (c = 0; c < 3; ++c) {
+		if (mask_bits(dst_mask[c]) > mask_bits(src_mask[c]))
+			return -1;
+		if (src_shift[c] < 0 || src_shift[c] > 31)
+			return -1;
+		if (dst_shift[c] < 0 || dst_shift[c] > 31)
+			return -1;
+		cv->map.lshift[c] = src_shift[c];
+		cv->map.rshift[c] = dst_shift[c];
+		cv->map.mask[c] = dst_mask[c];
+	}
+
+	cv->reverse = !!(cv->dst.flags & GGI_PF_REVERSE_ENDIAN);
+	cv->kind = CONVERT_MAP;
+	return 0;
+}
+
+static int
+plan_lut(struct convert *cv,
+	const ggi_pixel *src_mask, const int *src_shift,
+	const ggi_pixel *dst_mask, const int *dst_shift)
+{
+	int entries;
+	uint32_t top, pixel;
+	int bits, n;
+	int i, c;
+
+	if (cv->src_size != 1 && cv->src_size != 2)
+		return -1;
+
+	entries = 1 << (8 * cv->src_size);
+	cv->lut = (uint32_t *)malloc(entries * sizeof(*cv->lut));
+	if (!cv->lut)
+		return -1;
+
+	for (i = 0; i < entries; ++i) {
+		pixel = 0;
+		for (c = 0; c < 3; ++c) {
+			/* msb of the channel to bit 31, then repeat
+			 * the channel bits below it to widen it
+			 */
+			top = (i & src_mask[c]) << src_shift[c];
+			bits = mask_bits(src_mask[c]);
+			for (n = bits; n < 32; n *= 2)
+				top |= top >> n;
+			pixel |= (top >> dst_shift[c]) & dst_mask[c];
+		}
+
+		if (cv->dst.flags & GGI_PF_REVERSE_ENDIAN) {
+			switch (cv->dst_size) {
+			case 2:
+				pixel = GGI_BYTEREV16(pixel);
+				break;
+			case 3:
+				pixel = ((pixel & 0xff) << 16)
+					| (pixel & 0xff00)
+					| ((pixel >> 16) & 0xff);
+				break;
+			case 4:
+				pixel = GGI_BYTEREV32(pixel);
+				break;
+			}
+		}
+		cv->lut[i] = pixel;
+	}
+
+	cv->kind = CONVERT_LUT;
+	return 0;
+}
+
+static void
+convert_plan(struct convert *cv,
+	const ggi_pixelformat *src, const ggi_pixelformat *dst)
+{
+	ggi_pixel src_mask[3], dst_mask[3];
+	int src_shift[3], dst_shift[3];
+
+	if (cv->kind != CONVERT_NONE
+		&& same_format(&cv->src, src)
+		&& same_format(&cv->dst, dst))
+	{
+		return;
+	}
+
+	convert_reset(cv);
+	cv->src = *src;
+	cv->dst = *dst;
+	cv->src_size = src->size / 8;
+	cv->dst_size = dst->size / 8;
+	cv->kind = CONVERT_CROSSBLIT;
+
+	if ((src->size & 7) || (dst->size & 7))
+		goto done;
+
+	if (same_format(src, dst)) {
+		cv->kind = CONVERT_COPY;
+		goto done;
+	}
+
+	/* The wire stem is always in host byte order. */
+	if (!truecolor(src) || !truecolor(dst) || src->flags)
+		goto done;
+	if (dst->flags & ~GGI_PF_REVERSE_ENDIAN)
+		goto done;
+
+	channels(src, src_mask, src_shift);
+	channels(dst, dst_mask, dst_shift);
+
+	if (!plan_shuffle(cv, src_mask, dst_mask))
+		goto done;
+	if (!plan_map(cv, src_mask, src_shift, dst_mask, dst_shift))
+		goto done;
+	plan_lut(cv, src_mask, src_shift, dst_mask, dst_shift);
+
+done:
+	debug(1, "convert %d to %d bpp: %s\n",
+		src->size, dst->size, kind_names[cv->kind]);
+}
+
+#define LUT_ROW(in_t, out_t)					\
+	do {							\
+		const in_t *in = (const in_t *)src;		\
+		out_t *out = (out_t *)dst;			\
+		for (x = 0; x < w; ++x)				\
+			out[x] = lut[in[x]];			\
+	} while (0)
+
+#define LUT_ROW_24(in_t)					\
+	do {							\
+		const in_t *in = (const in_t *)src;		\
+		for (x = 0; x < w; ++x, dst += 3) {		\
+			pixel = lut[in[x]];			\
+			dst[0] = pixel;				\
+			dst[1] = pixel >> 8;			\
+			dst[2] = pixel >> 16;			\
+		}						\
+	} while (0)
+
+static void
+lut_row(const struct convert *cv, uint8_t *dst, const uint8_t *src, int w)
+{
+	const uint32_t *lut = cv->lut;
+	uint32_t pixel;
+	int x;
+
+	switch (cv->src_size * 8 + cv->dst_size) {
+	case 8 + 1:  LUT_ROW(uint8_t, uint8_t);   break;
+	case 8 + 2:  LUT_ROW(uint8_t, uint16_t);  break;
+	case 8 + 3:  LUT_ROW_24(uint8_t);         break;
+	case 8 + 4:  LUT_ROW(uint8_t, uint32_t);  break;
+	case 16 + 1: LUT_ROW(uint16_t, uint8_t);  break;
+	case 16 + 2: LUT_ROW(uint16_t, uint16_t); break;
+	case 16 + 3: LUT_ROW_24(uint16_t);        break;
+	case 16 + 4: LUT_ROW(uint16_t, uint32_t); break;
+	}
+}
+
+static void
+convert_row(const struct convert *cv, uint8_t *dst, const uint8_t *src,
+	int w)
+{
+	switch (cv->kind) {
+	case CONVERT_COPY:
+		memcpy(dst, src, w * cv->src_size);
+		break;
+
+	case CONVERT_SHUFFLE:
+		if (cv->dst_size == 3)
+			kernels.shuffle_32_24(dst, src, w, cv->shuffle);
+		else
+			kernels.shuffle_32(dst, src, w, cv->shuffle);
+		break;
+
+	case CONVERT_MAP:
+		if (cv->dst_size == 2) {
+			kernels.map_32_16((uint16_t *)dst,
+				(const uint32_t *)src, w, &cv->map);
+			if (cv->reverse)
+				kernels.reverse_16(dst, dst, w);
+		}
+		else {
+			kernels.map_32_32((uint32_t *)dst,
+				(const uint32_t *)src, w, &cv->map);
+			if (cv->reverse)
+				kernels.reverse_32(dst, dst, w);
+		}
+		break;
+
+	case CONVERT_LUT:
+		lut_row(cv, dst, src, w);
+		break;
+	}
+}
+
+static void
+convert_band(const struct job *job, int band)
+{
+	int y = job->h * band / job->bands;
+	int end = job->h * (band + 1) / job->bands;
+	const uint8_t *src = job->src + y * job->src_stride;
+	uint8_t *dst = job->dst + y * job->dst_stride;
+
+	for (; y < end; ++y) {
+		convert_row(job->cv, dst, src, job->w);
+		src += job->src_stride;
+		dst += job->dst_stride;
+	}
+}
+
+static void
+convert_task(void *arg, int band)
+{
+	convert_band((const struct job *)arg, band);
+}
+
+static void
+convert_run(struct job *job)
+{
+	job->bands = 1;
+	if (job->w * job->h >= CONVERT_MT_PIXELS) {
+		job->bands = pool_workers() + 1;
+		if (job->bands > job->h / CONVERT_MT_ROWS)
+			job->bands = job->h / CONVERT_MT_ROWS;
+		if (job->bands < 1)
+			job->bands = 1;
+	}
+
+	if (job->bands == 1) {
+		convert_band(job, 0);
+		return;
+	}
+
+	pool_run(convert_task, job, job->bands);
+}
+
+void
+convert_blit(struct convert *cv,
+	ggi_visual_t src, int sx, int sy, int w, int h,
+	ggi_visual_t dst, int dx, int dy)
+{
+	struct surface in, out;
+	struct job job;
+
+	surface_bind(&in, src);
+	surface_bind(&out, dst);
+
+	if (in.base && out.base)
+		convert_plan(cv,
+			ggiGetPixelFormat(src), ggiGetPixelFormat(dst));
+
+	if (!in.base || !out.base || cv->kind == CONVERT_CROSSBLIT) {
+		ggiCrossBlit(src, sx, sy, w, h, dst, dx, dy);
+		return;
+	}
+
+	if (!surface_clip(&in, &sx, &sy, &w, &h, &dx, &dy))
+		return;
+	if (!surface_clip(&out, &dx, &dy, &w, &h, &sx, &sy))
+		return;
+
+	job.cv = cv;
+	job.src = surface_at(&in, sx, sy);
+	job.dst = surface_at(&out, dx, dy);
+	job.src_stride = in.stride;
+	job.dst_stride = out.stride;
+	job.w = w;
+	job.h = h;
+
+	convert_run(&job);
+}
+
+void
+convert_reset(struct convert *cv)
+{
+	free(cv->lut);
+	cv->lut = NULL;
+	cv->kind = CONVERT_NONE;
+}
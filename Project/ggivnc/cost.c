@@ -0,0 +1,343 @@
+/*
+******************************************************************************
+
+   Decode cost aware encoding selection.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vnc.h"
+#include "vnc-debug.h"
+#include "vnc-metrics.h"
+
+#define COUNTOF(x) (int)(sizeof(x) / sizeof(x[0]))
+
+/* Weight kept by the old sums for each new rectangle. */
+#define COST_DECAY 0.97
+
+/* Rectangles needed before an encoding is compared with others. */
+#define COST_MIN_SAMPLES 8
+
+/* Seconds before a measurement is too old to go by, and before an
+ * encoding that did not get any samples when probed is tried again.
+ */
+#define COST_STALE 60
+
+/* Updates to prefer a probed encoding, and updates between probes. */
+#define COST_PROBE 4
+#define COST_PROBE_INTERVAL 32
+
+static double
+cpu_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+	{
+		struct timeval tv;
+
+		ggCurTime(&tv);
+		return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+	}
+}
+
+static inline double
+consumed(struct connection *cx)
+{
+	return cx->cost.received - (cx->input.wpos - cx->input.rpos);
+}
+
+static inline int
+candidate(int32_t encoding)
+{
+	/* copyrect is used by the server where it can be, whatever else
+	 * is preferred, so there is nothing to choose there.
+	 */
+	return 0 <= encoding && encoding <= 16 && encoding != 1;
+}
+
+void
+cost_rect_start(struct connection *cx, int encoding, int pixels)
+{
+	struct decode_cost *cost = &cx->cost;
+
+	cost->active = 1;
+	cost->encoding = encoding;
+	cost->pixels = pixels;
+	cost->consumed = consumed(cx);
+	cost->spent = 0;
+	cost->paused = 0;
+	cost->start = cpu_ns();
+}
+
+/* A hosted session shares its thread with others, and may move to
+ * another thread between steps. Only the time in its own steps counts,
+ * and the thread cpu clock is only compared with itself within a step.
+ */
+void
+cost_pause(struct connection *cx)
+{
+	struct decode_cost *cost = &cx->cost;
+	double t;
+
+	if (!cost->active || cost->paused)
+		return;
+	t = cpu_ns() - cost->start;
+	if (t > 0)
+		cost->spent += t;
+	cost->paused = 1;
+}
+
+void
+cost_resume(struct connection *cx)
+{
+	struct decode_cost *cost = &cx->cost;
+
+	if (!cost->active || !cost->paused)
+		return;
+	cost->paused = 0;
+	cost->start = cpu_ns();
+}
+
+void
+cost_rect_end(struct connection *cx)
+{
+	struct decode_cost *cost = &cx->cost;
+	struct enc_cost *e = &cost->enc[cost->encoding];
+	struct metrics_encoding *m = &cx->metrics.encoding[cost->encoding];
+	double p, b, t;
+
+	cost->active = 0;
+
+	t = cost->paused ? 0 : cpu_ns() - cost->start;
+	b = consumed(cx) - cost->consumed;
+	p = cost->pixels;
+	if (t < 0)
+		t = 0;
+	t += cost->spent;
+	cost->update_ns += t;
+
+	metrics_add(&m->rects, 1);
+	metrics_add(&m->pixels, cost->pixels);
+	metrics_add(&m->bytes, (uint64_t)b);
+	metrics_record(&m->decode_ns, (uint64_t)t);
+
+	if (!p || !candidate(cost->encoding) || !cx->bw.counting)
+		return;
+
+	e->pp = e->pp * COST_DECAY + p * p;
+	e->pb = e->pb * COST_DECAY + p * b;
+	e->bb = e->bb * COST_DECAY + b * b;
+	e->tp = e->tp * COST_DECAY + t * p;
+	e->tb = e->tb * COST_DECAY + t * b;
+	e->pixels = e->pixels * COST_DECAY + p;
+	e->bytes = e->bytes * COST_DECAY + b;
+	++e->samples;
+	ggCurTime(&e->last);
+}
+
+/* Fit the decode time of an encoding per pixel and per byte, and return
+ * the time per pixel for the wire bytes per pixel it has been seeing.
+ */
+static int
+cost_model(const struct enc_cost *e, double *ns_pixel, double *bytes_pixel)
+{
+	double det;
+	double a = -1.0;
+	double b = -1.0;
+
+	if (e->samples < COST_MIN_SAMPLES || !e->pixels)
+		return -1;
+
+	det = e->pp * e->bb - e->pb * e->pb;
+	if (det > 1e-9 * e->pp * e->bb) {
+		a = (e->tp * e->bb - e->tb * e->pb) / det;
+		b = (e->tb * e->pp - e->tp * e->pb) / det;
+	}
+	if (b < 0.0 || !e->bb) {
+		/* Bytes follow pixels (raw) or say nothing. */
+		a = e->tp / e->pp;
+		b = 0.0;
+	}
+	else if (a < 0.0) {
+		a = 0.0;
+		b = e->tb / e->bb;
+	}
+
+	*bytes_pixel = e->bytes / e->pixels;
+	*ns_pixel = a + b * *bytes_pixel;
+	return 0;
+}
+
+/* Order the encodings of tier so that the one with the least estimated
+ * transfer plus decode time goes first, and tell the server if that
+ * changes the list. Now and then an encoding without recent
+ * measurements is put first for a few updates to get some.
+ */
+int
+cost_select(struct connection *cx, const struct bw_table *tier, int force)
+{
+	struct decode_cost *cost = &cx->cost;
+	struct timeval now;
+	int32_t front = -1;
+	int32_t probe = -1;
+	int32_t best_encoding = -1;
+	int32_t in_use = cost->front;
+	double best = 0.0;
+	int32_t *tmp;
+	int first = -1;
+	int i, j;
+
+	ggCurTime(&now);
+	++cost->updates;
+
+	if (cost->probing && --cost->probing)
+		front = cost->front;
+
+	for (i = 0; in_use < 0 && i < tier->count; ++i) {
+		if (candidate(tier->encoding[i]))
+			in_use = tier->encoding[i];
+	}
+
+	for (i = 0; front < 0 && i < tier->count; ++i) {
+		int32_t encoding = tier->encoding[i];
+		struct enc_cost *e;
+		double ns_pixel, bytes_pixel, ns;
+
+		if (!candidate(encoding))
+			continue;
+		e = &cost->enc[encoding];
+
+		if (e->samples && now.tv_sec - e->last.tv_sec < COST_STALE &&
+			!cost_model(e, &ns_pixel, &bytes_pixel))
+		{
+			ns = ns_pixel + bytes_pixel * 1e9 / cx->bw.rate;
+			debug(2, "%s: %.1f ns/pixel decode, %.2f bytes/pixel, "
+				"%.1f ns/pixel total\n",
+				lookup_encoding(encoding),
+				ns_pixel, bytes_pixel, ns);
+			if (best_encoding < 0 || ns < best) {
+				best = ns;
+				best_encoding = encoding;
+			}
+			continue;
+		}
+
+		if (probe < 0 && encoding != in_use &&
+			now.tv_sec - e->probed.tv_sec >= COST_STALE)
+		{
+			probe = encoding;
+		}
+	}
+
+	if (front < 0 && probe >= 0 && cost->updates >= cost->next_probe) {
+		debug(1, "probing %s\n", lookup_encoding(probe));
+		cost->enc[probe].probed = now;
+		cost->next_probe = cost->updates + COST_PROBE_INTERVAL;
+		cost->probing = COST_PROBE;
+		front = probe;
+	}
+	if (front < 0)
+		front = best_encoding;
+	cost->front = front;
+
+	if (tier->count > cost->capacity)
+		return -1;
+
+	/* The tier order, with front moved up to the first candidate. */
+	for (i = 0, j = 0; i < tier->count; ++i) {
+		int32_t encoding = tier->encoding[i];
+		if (first < 0 && candidate(encoding)) {
+			first = j;
+			if (front >= 0)
+				cost->next[j++] = front;
+		}
+		if (encoding != front)
+			cost->next[j++] = encoding;
+	}
+
+	if (!force && j == cx->encoding_count &&
+		!memcmp(cost->next, cx->encoding, j * sizeof(*cost->next)))
+	{
+		return 0;
+	}
+
+	if (front >= 0)
+		debug(1, "preferring %s\n", lookup_encoding(front));
+
+	tmp = cost->order;
+	cost->order = cost->next;
+	cost->next = tmp;
+	cx->encoding = cost->order;
+	cx->encoding_count = j;
+	return vnc_set_encodings(cx);
+}
+
+int
+cost_init(struct connection *cx)
+{
+	struct decode_cost *cost = &cx->cost;
+	int capacity = 0;
+	int i = 0;
+
+	cost_fini(cx);
+
+	do {
+		if (capacity < cx->bw_table[i].count)
+			capacity = cx->bw_table[i].count;
+	} while (cx->bw_table[i++].bandwidth);
+
+	cost->order = malloc(capacity * sizeof(*cost->order));
+	cost->next = malloc(capacity * sizeof(*cost->next));
+	if (!cost->order || !cost->next) {
+		cost_fini(cx);
+		return -1;
+	}
+	cost->capacity = capacity;
+	cost->front = -1;
+
+	return 0;
+}
+
+void
+cost_fini(struct connection *cx)
+{
+	struct decode_cost *cost = &cx->cost;
+
+	if (cost->order)
+		free(cost->order);
+	if (cost->next)
+		free(cost->next);
+	memset(cost, 0, sizeof(*cost));
+}
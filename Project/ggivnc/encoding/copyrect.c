@@ -50,10 +50,7 @@ vnc_copyrect(struct connection *cx)
 	x = get16_hilo(&cx->input.data[cx->input.rpos + 0]);
 	y = get16_hilo(&cx->input.data[cx->input.rpos + 2]);
 
-	if (cx->wire_stem)
-		ggiCopyBox(cx->wire_stem, x, y, cx->w, cx->h, cx->x, cx->y);
-	else
-		ggiCopyBox(cx->stem, x, y, cx->w, cx->h, cx->x, cx->y);
+	surface_copy(&cx->surface, x, y, cx->w, cx->h, cx->x, cx->y);
 
 	--cx->rects;
 	cx->input.rpos += 4;
@@ -40,151 +40,31 @@
 
 struct corre {
 	int32_t rects;
-	ggi_visual_t stem;
+	const struct pixel_ops *ops;
 };
 
 static int
-corre_stem_change(struct connection *cx)
-{
-	struct corre *corre = cx->encoding_def[corre_encoding].priv;
-
-	corre->stem = cx->wire_stem ? cx->wire_stem : cx->stem;
-	return 0;
-}
-
-static int
-vnc_corre_rect_8(struct connection *cx)
-{
-	struct corre *corre = cx->encoding_def[corre_encoding].priv;
-	ggi_pixel pixel;
-	uint16_t x, y, w, h;
-
-	while (corre->rects) {
-		if (cx->input.wpos < cx->input.rpos + 5) {
-			cx->action = vnc_corre_rect_8;
-			return 0;
-		}
-
-		pixel = cx->input.data[cx->input.rpos++];
-		x = cx->input.data[cx->input.rpos++];
-		y = cx->input.data[cx->input.rpos++];
-		w = cx->input.data[cx->input.rpos++];
-		h = cx->input.data[cx->input.rpos++];
-
-		ggiSetGCForeground(corre->stem, pixel);
-		ggiDrawBox(corre->stem, cx->x + x, cx->y + y, w, h);
-		--corre->rects;
-	}
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
-static int
-vnc_corre_8(struct connection *cx)
-{
-	struct corre *corre = cx->encoding_def[corre_encoding].priv;
-	ggi_pixel pixel;
-
-	if (cx->input.wpos < cx->input.rpos + 1) {
-		cx->action = vnc_corre_8;
-		return 0;
-	}
-
-	pixel = cx->input.data[cx->input.rpos++];
-
-	ggiSetGCForeground(corre->stem, pixel);
-	ggiDrawBox(corre->stem, cx->x, cx->y, cx->w, cx->h);
-
-	return vnc_corre_rect_8(cx);
-}
-
-static int
-vnc_corre_rect_16(struct connection *cx)
-{
-	struct corre *corre = cx->encoding_def[corre_encoding].priv;
-	ggi_pixel pixel;
-	uint16_t x, y, w, h;
-
-	while (corre->rects) {
-		if (cx->input.wpos < cx->input.rpos + 6) {
-			cx->action = vnc_corre_rect_16;
-			return 0;
-		}
-
-		if (cx->wire_endian != cx->local_endian)
-			pixel = get16_r(&cx->input.data[cx->input.rpos]);
-		else
-			pixel = get16(&cx->input.data[cx->input.rpos]);
-		cx->input.rpos += 2;
-		x = cx->input.data[cx->input.rpos++];
-		y = cx->input.data[cx->input.rpos++];
-		w = cx->input.data[cx->input.rpos++];
-		h = cx->input.data[cx->input.rpos++];
-
-		ggiSetGCForeground(corre->stem, pixel);
-		ggiDrawBox(corre->stem, cx->x + x, cx->y + y, w, h);
-		--corre->rects;
-	}
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
-static int
-vnc_corre_16(struct connection *cx)
-{
-	struct corre *corre = cx->encoding_def[corre_encoding].priv;
-	ggi_pixel pixel;
-
-	if (cx->input.wpos < cx->input.rpos + 2) {
-		cx->action = vnc_corre_16;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get16_r(&cx->input.data[cx->input.rpos]);
-	else
-		pixel = get16(&cx->input.data[cx->input.rpos]);
-	cx->input.rpos += 2;
-
-	ggiSetGCForeground(corre->stem, pixel);
-	ggiDrawBox(corre->stem, cx->x, cx->y, cx->w, cx->h);
-
-	return vnc_corre_rect_16(cx);
-}
-
-static int
-vnc_corre_rect_32(struct connection *cx)
+vnc_corre_rect(struct connection *cx)
 {
 	struct corre *corre = cx->encoding_def[corre_encoding].priv;
+	const struct pixel_ops *ops = corre->ops;
 	ggi_pixel pixel;
 	uint16_t x, y, w, h;
 
 	while (corre->rects) {
-		if (cx->input.wpos < cx->input.rpos + 8) {
-			cx->action = vnc_corre_rect_32;
+		if (cx->input.wpos < cx->input.rpos + ops->size + 4) {
+			cx->action = vnc_corre_rect;
 			return 0;
 		}
 
-		if (cx->wire_endian != cx->local_endian)
-			pixel = get32_r(&cx->input.data[cx->input.rpos]);
-		else
-			pixel = get32(&cx->input.data[cx->input.rpos]);
-		cx->input.rpos += 4;
+		pixel = ops->get(&cx->input.data[cx->input.rpos]);
+		cx->input.rpos += ops->size;
 		x = cx->input.data[cx->input.rpos++];
 		y = cx->input.data[cx->input.rpos++];
 		w = cx->input.data[cx->input.rpos++];
 		h = cx->input.data[cx->input.rpos++];
 
-		ggiSetGCForeground(corre->stem, pixel);
-		ggiDrawBox(corre->stem, cx->x + x, cx->y + y, w, h);
+		surface_fill(&cx->surface, cx->x + x, cx->y + y, w, h, pixel);
 		--corre->rects;
 	}
 
@@ -196,26 +76,23 @@ vnc_corre_rect_32(struct connection *cx)
 }
 
 static int
-vnc_corre_32(struct connection *cx)
+vnc_corre_bg(struct connection *cx)
 {
 	struct corre *corre = cx->encoding_def[corre_encoding].priv;
+	const struct pixel_ops *ops = corre->ops;
 	ggi_pixel pixel;
 
-	if (cx->input.wpos < cx->input.rpos + 4) {
-		cx->action = vnc_corre_32;
+	if (cx->input.wpos < cx->input.rpos + ops->size) {
+		cx->action = vnc_corre_bg;
 		return 0;
 	}
 
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get32_r(&cx->input.data[cx->input.rpos]);
-	else
-		pixel = get32(&cx->input.data[cx->input.rpos]);
-	cx->input.rpos += 4;
+	pixel = ops->get(&cx->input.data[cx->input.rpos]);
+	cx->input.rpos += ops->size;
 
-	ggiSetGCForeground(corre->stem, pixel);
-	ggiDrawBox(corre->stem, cx->x, cx->y, cx->w, cx->h);
+	surface_fill(&cx->surface, cx->x, cx->y, cx->w, cx->h, pixel);
 
-	return vnc_corre_rect_32(cx);
+	return vnc_corre_rect(cx);
 }
 
 static int
@@ -232,15 +109,11 @@ corre_rect(struct connection *cx)
 
 	cx->input.rpos += 4;
 
-	cx->stem_change = corre_stem_change;
-	cx->stem_change(cx);
+	cx->stem_change = NULL;
 
-	switch (GT_SIZE(cx->wire_mode.graphtype)) {
-	case  8: return vnc_corre_8(cx);
-	case 16: return vnc_corre_16(cx);
-	case 32: return vnc_corre_32(cx);
-	}
-	return 1;
+	corre->ops = cx->pixel_ops;
+
+	return vnc_corre_bg(cx);
 }
 
 static void
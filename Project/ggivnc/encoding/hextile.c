@@ -43,25 +43,14 @@ struct hextile {
 	uint16_t y;
 	uint16_t w;
 	uint16_t h;
-	ggi_visual_t stem;
 	uint8_t subencoding;
 	ggi_pixel bg;
 	ggi_pixel fg;
 	int rects;
+	const struct pixel_ops *ops;
 };
 
-static int vnc_hextile_8(struct connection *cx);
-static int vnc_hextile_16(struct connection *cx);
-static int vnc_hextile_32(struct connection *cx);
-
-static int
-hextile_stem_change(struct connection *cx)
-{
-	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-
-	hextile->stem = cx->wire_stem ? cx->wire_stem : cx->stem;
-	return 0;
-}
+static int vnc_hextile_tile(struct connection *cx);
 
 static inline int
 tile_header_complete(struct connection *cx, int bpp)
@@ -170,301 +159,58 @@ vnc_hextile_next(struct connection *cx)
 }
 
 static int
-vnc_hextile_raw_8(struct connection *cx)
-{
-	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-	int bytes = hextile->w * hextile->h;
-
-	if (cx->input.wpos < cx->input.rpos + bytes) {
-		cx->action = vnc_hextile_raw_8;
-		return 0;
-	}
-
-	ggiPutBox(hextile->stem,
-		hextile->x, hextile->y, hextile->w, hextile->h,
-		cx->input.data + cx->input.rpos);
-	cx->input.rpos += bytes;
-
-	if (cx->action == vnc_hextile_raw_8) {
-		if (!vnc_hextile_next(cx))
-			return vnc_hextile_done(cx);
-	}
-	cx->action = vnc_hextile_8;
-	return 1;
-}
-
-static int
-vnc_hextile_subrects_8(struct connection *cx)
-{
-	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-	int x, y, w, h;
-	ggi_pixel pixel;
-	int size = 2;
-
-	if (hextile->subencoding & 16)
-		++size;
-
-	while (hextile->rects) {
-		if (cx->input.wpos < cx->input.rpos + size) {
-			cx->action = vnc_hextile_subrects_8;
-			return 0;
-		}
-
-		if (hextile->subencoding & 16) {
-			pixel = cx->input.data[cx->input.rpos++];
-			ggiSetGCForeground(hextile->stem, pixel);
-		}
-
-		x =  cx->input.data[cx->input.rpos] >> 4;
-		y =  cx->input.data[cx->input.rpos++] & 0xf;
-		w = (cx->input.data[cx->input.rpos] >> 4) + 1;
-		h = (cx->input.data[cx->input.rpos++] & 0xf) + 1;
-
-		ggiDrawBox(hextile->stem,
-			hextile->x + x, hextile->y + y, w, h);
-
-		--hextile->rects;
-	}
-
-	/* Restore fg for coming tiles, does not seem to
-	 * happen for the RealVNC codebase, but it is correct
-	 * to do so, at least the way I read the spec.
-	 */
-	ggiSetGCForeground(hextile->stem, hextile->fg);
-
-	if (cx->action == vnc_hextile_subrects_8) {
-		if (!vnc_hextile_next(cx))
-			return vnc_hextile_done(cx);
-	}
-
-	cx->action = vnc_hextile_8;
-	return 1;
-}
-
-static int
-vnc_hextile_8(struct connection *cx)
-{
-	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-
-	do {
-		if (!tile_header_complete(cx, 1)) {
-			if (cx->action == vnc_hextile)
-				cx->action = vnc_hextile_8;
-			return 0;
-		}
-		hextile->subencoding = cx->input.data[cx->input.rpos++];
-		if (hextile->subencoding & 1) {
-			if (!vnc_hextile_raw_8(cx))
-				return 0;
-			continue;
-		}
-		if (hextile->subencoding & 2)
-			hextile->bg = cx->input.data[cx->input.rpos++];
-		ggiSetGCForeground(hextile->stem, hextile->bg);
-		ggiDrawBox(hextile->stem,
-			hextile->x, hextile->y,
-			hextile->w, hextile->h);
-		if (hextile->subencoding & 4)
-			hextile->fg = cx->input.data[cx->input.rpos++];
-		ggiSetGCForeground(hextile->stem, hextile->fg);
-		if (hextile->subencoding & 8) {
-			hextile->rects = cx->input.data[cx->input.rpos++];
-			if (!vnc_hextile_subrects_8(cx))
-				return 0;
-			continue;
-		}
-	} while (vnc_hextile_next(cx));
-
-	vnc_hextile_done(cx);
-	return 1;
-}
-
-static int
-vnc_hextile_raw_16(struct connection *cx)
-{
-	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-	int bytes = 2 * hextile->w * hextile->h;
-	uint16_t buf[256];
-
-	if (cx->input.wpos < cx->input.rpos + bytes) {
-		cx->action = vnc_hextile_raw_16;
-		return 0;
-	}
-
-	memcpy(buf, cx->input.data + cx->input.rpos, bytes);
-	if (cx->wire_endian != cx->local_endian)
-		buffer_reverse_16((uint8_t *)buf, bytes);
-	ggiPutBox(hextile->stem,
-		hextile->x, hextile->y, hextile->w, hextile->h, buf);
-	cx->input.rpos += bytes;
-
-	if (cx->action == vnc_hextile_raw_16) {
-		if (!vnc_hextile_next(cx))
-			return vnc_hextile_done(cx);
-	}
-	cx->action = vnc_hextile_16;
-	return 1;
-}
-
-static int
-vnc_hextile_subrects_16(struct connection *cx)
+vnc_hextile_raw(struct connection *cx)
 {
 	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-	int x, y, w, h;
-	ggi_pixel pixel;
-	int size = 2;
-
-	if (hextile->subencoding & 16)
-		size += 2;
-
-	while (hextile->rects) {
-		if (cx->input.wpos < cx->input.rpos + size) {
-			cx->action = vnc_hextile_subrects_16;
-			return 0;
-		}
-
-		if (hextile->subencoding & 16) {
-			if (cx->wire_endian != cx->local_endian)
-				pixel = get16_r(
-					&cx->input.data[cx->input.rpos]);
-			else
-				pixel = get16(
-					&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 2;
-			ggiSetGCForeground(hextile->stem, pixel);
-		}
-
-		x =  cx->input.data[cx->input.rpos] >> 4;
-		y =  cx->input.data[cx->input.rpos++] & 0xf;
-		w = (cx->input.data[cx->input.rpos] >> 4) + 1;
-		h = (cx->input.data[cx->input.rpos++] & 0xf) + 1;
-
-		ggiDrawBox(hextile->stem,
-			hextile->x + x, hextile->y + y, w, h);
-
-		--hextile->rects;
-	}
-
-	/* Restore fg for coming tiles, does not seem to
-	 * happen for the RealVNC codebase, but it is correct
-	 * to do so, at least the way I read the spec.
-	 */
-	ggiSetGCForeground(hextile->stem, hextile->fg);
-
-	if (cx->action == vnc_hextile_subrects_16) {
-		if (!vnc_hextile_next(cx))
-			return vnc_hextile_done(cx);
-	}
-
-	cx->action = vnc_hextile_16;
-	return 1;
-}
-
-static int
-vnc_hextile_16(struct connection *cx)
-{
-	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-
-	do {
-		if (!tile_header_complete(cx, 2)) {
-			if (cx->action == vnc_hextile)
-				cx->action = vnc_hextile_16;
-			return 0;
-		}
-		hextile->subencoding = cx->input.data[cx->input.rpos++];
-		if (hextile->subencoding & 1) {
-			if (!vnc_hextile_raw_16(cx))
-				return 0;
-			continue;
-		}
-		if (hextile->subencoding & 2) {
-			if (cx->wire_endian != cx->local_endian)
-				hextile->bg = get16_r(
-					&cx->input.data[cx->input.rpos]);
-			else
-				hextile->bg = get16(
-					&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 2;
-		}
-		ggiSetGCForeground(hextile->stem, hextile->bg);
-		ggiDrawBox(hextile->stem,
-			hextile->x, hextile->y,
-			hextile->w, hextile->h);
-		if (hextile->subencoding & 4) {
-			if (cx->wire_endian != cx->local_endian)
-				hextile->fg = get16_r(
-					&cx->input.data[cx->input.rpos]);
-			else
-				hextile->fg = get16(
-					&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 2;
-		}
-		ggiSetGCForeground(hextile->stem, hextile->fg);
-		if (hextile->subencoding & 8) {
-			hextile->rects = cx->input.data[cx->input.rpos++];
-			if (!vnc_hextile_subrects_16(cx))
-				return 0;
-			continue;
-		}
-	} while (vnc_hextile_next(cx));
-
-	vnc_hextile_done(cx);
-	return 1;
-}
-
-static int
-vnc_hextile_raw_32(struct connection *cx)
-{
-	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
-	int bytes = 4 * hextile->w * hextile->h;
+	const struct pixel_ops *ops = hextile->ops;
+	int pixels = hextile->w * hextile->h;
+	int bytes = ops->size * pixels;
 	uint32_t buf[256];
+	void *src;
 
 	if (cx->input.wpos < cx->input.rpos + bytes) {
-		cx->action = vnc_hextile_raw_32;
+		cx->action = vnc_hextile_raw;
 		return 0;
 	}
 
-	memcpy(buf, cx->input.data + cx->input.rpos, bytes);
-	if (cx->wire_endian != cx->local_endian)
-		buffer_reverse_32((uint8_t *)buf, bytes);
-	ggiPutBox(hextile->stem,
-		hextile->x, hextile->y, hextile->w, hextile->h,	buf);
+	src = cx->input.data + cx->input.rpos;
+	if (!ops->native) {
+		ops->unpack(buf, src, pixels);
+		src = buf;
+	}
+	surface_put(&cx->surface,
+		hextile->x, hextile->y, hextile->w, hextile->h, src);
 	cx->input.rpos += bytes;
 
-	if (cx->action == vnc_hextile_raw_32) {
+	if (cx->action == vnc_hextile_raw) {
 		if (!vnc_hextile_next(cx))
 			return vnc_hextile_done(cx);
 	}
-	cx->action = vnc_hextile_32;
+	cx->action = vnc_hextile_tile;
 	return 1;
 }
 
 static int
-vnc_hextile_subrects_32(struct connection *cx)
+vnc_hextile_subrects(struct connection *cx)
 {
 	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
+	const struct pixel_ops *ops = hextile->ops;
+	ggi_pixel pixel = hextile->fg;
 	int x, y, w, h;
-	ggi_pixel pixel;
 	int size = 2;
 
 	if (hextile->subencoding & 16)
-		size += 4;
+		size += ops->size;
 
 	while (hextile->rects) {
 		if (cx->input.wpos < cx->input.rpos + size) {
-			cx->action = vnc_hextile_subrects_32;
+			cx->action = vnc_hextile_subrects;
 			return 0;
 		}
 
 		if (hextile->subencoding & 16) {
-			if (cx->wire_endian != cx->local_endian)
-				pixel = get32_r(
-					&cx->input.data[cx->input.rpos]);
-			else
-				pixel = get32(
-					&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 4;
-			ggiSetGCForeground(hextile->stem, pixel);
+			pixel = ops->get(&cx->input.data[cx->input.rpos]);
+			cx->input.rpos += ops->size;
 		}
 
 		x =  cx->input.data[cx->input.rpos] >> 4;
@@ -472,70 +218,53 @@ vnc_hextile_subrects_32(struct connection *cx)
 		w = (cx->input.data[cx->input.rpos] >> 4) + 1;
 		h = (cx->input.data[cx->input.rpos++] & 0xf) + 1;
 
-		ggiDrawBox(hextile->stem,
-			hextile->x + x, hextile->y + y, w, h);
+		surface_fill(&cx->surface,
+			hextile->x + x, hextile->y + y, w, h, pixel);
 
 		--hextile->rects;
 	}
 
-	/* Restore fg for coming tiles, does not seem to
-	 * happen for the RealVNC codebase, but it is correct
-	 * to do so, at least the way I read the spec.
-	 */
-	ggiSetGCForeground(hextile->stem, hextile->fg);
-
-	if (cx->action == vnc_hextile_subrects_32) {
+	if (cx->action == vnc_hextile_subrects) {
 		if (!vnc_hextile_next(cx))
 			return vnc_hextile_done(cx);
 	}
 
-	cx->action = vnc_hextile_32;
+	cx->action = vnc_hextile_tile;
 	return 1;
 }
 
 static int
-vnc_hextile_32(struct connection *cx)
+vnc_hextile_tile(struct connection *cx)
 {
 	struct hextile *hextile = cx->encoding_def[hextile_encoding].priv;
+	const struct pixel_ops *ops = hextile->ops;
 
 	do {
-		if (!tile_header_complete(cx, 4)) {
+		if (!tile_header_complete(cx, ops->size)) {
 			if (cx->action == vnc_hextile)
-				cx->action = vnc_hextile_32;
+				cx->action = vnc_hextile_tile;
 			return 0;
 		}
 		hextile->subencoding = cx->input.data[cx->input.rpos++];
 		if (hextile->subencoding & 1) {
-			if (!vnc_hextile_raw_32(cx))
+			if (!vnc_hextile_raw(cx))
 				return 0;
 			continue;
 		}
 		if (hextile->subencoding & 2) {
-			if (cx->wire_endian != cx->local_endian)
-				hextile->bg = get32_r(
-					&cx->input.data[cx->input.rpos]);
-			else
-				hextile->bg = get32(
-					&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 4;
+			hextile->bg = ops->get(&cx->input.data[cx->input.rpos]);
+			cx->input.rpos += ops->size;
 		}
-		ggiSetGCForeground(hextile->stem, hextile->bg);
-		ggiDrawBox(hextile->stem,
+		surface_fill(&cx->surface,
 			hextile->x, hextile->y,
-			hextile->w, hextile->h);
+			hextile->w, hextile->h, hextile->bg);
 		if (hextile->subencoding & 4) {
-			if (cx->wire_endian != cx->local_endian)
-				hextile->fg = get32_r(
-					&cx->input.data[cx->input.rpos]);
-			else
-				hextile->fg = get32(
-					&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 4;
+			hextile->fg = ops->get(&cx->input.data[cx->input.rpos]);
+			cx->input.rpos += ops->size;
 		}
-		ggiSetGCForeground(hextile->stem, hextile->fg);
 		if (hextile->subencoding & 8) {
 			hextile->rects = cx->input.data[cx->input.rpos++];
-			if (!vnc_hextile_subrects_32(cx))
+			if (!vnc_hextile_subrects(cx))
 				return 0;
 			continue;
 		}
@@ -556,17 +285,12 @@ hextile_rect(struct connection *cx)
 	hextile->y = cx->y - 16;
 	vnc_hextile_next(cx);
 
-	cx->stem_change = hextile_stem_change;
-	cx->stem_change(cx);
+	cx->stem_change = NULL;
 
+	hextile->ops = cx->pixel_ops;
 	cx->action = vnc_hextile;
 
-	switch (GT_SIZE(cx->wire_mode.graphtype)) {
-	case  8: return vnc_hextile_8(cx);
-	case 16: return vnc_hextile_16(cx);
-	case 32: return vnc_hextile_32(cx);
-	}
-	return 1;
+	return vnc_hextile_tile(cx);
 }
 
 static void
@@ -40,38 +40,24 @@
 int
 vnc_raw(struct connection *cx)
 {
+	const struct pixel_ops *ops = cx->pixel_ops;
 	int bytes;
-	ggi_visual_t stem;
-	int bpp;
 
 	debug(2, "raw\n");
 
-	stem = cx->wire_stem ? cx->wire_stem : cx->stem;
-	bpp = GT_SIZE(cx->wire_mode.graphtype) / 8;
-
-	bytes = bpp * cx->w * cx->h;
+	bytes = ops->size * cx->w * cx->h;
 
 	if (cx->input.wpos < cx->input.rpos + bytes)
 		return 0;
 
-	if (cx->wire_endian != cx->local_endian) {
-		/* Should be handled by a crossblit, but that's not
-		 * supported by libggi. Yet...
-		 */
-		ggi_mode mode;
-		ggiGetMode(stem, &mode);
-
-		switch (GT_SIZE(mode.graphtype)) {
-		case 16:
-			buffer_reverse_16(cx->input.data + cx->input.rpos, bytes);
-			break;
-		case 32:
-			buffer_reverse_32(cx->input.data + cx->input.rpos, bytes);
-			break;
-		}
-	}
-
-	ggiPutBox(stem,
+	/* Should be handled by a crossblit, but that's not
+	 * supported by libggi. Yet...
+	 */
+	if (!ops->native)
+		ops->unpack(cx->input.data + cx->input.rpos,
+			cx->input.data + cx->input.rpos, cx->w * cx->h);
+
+	surface_put(&cx->surface,
 		cx->x, cx->y, cx->w, cx->h, cx->input.data + cx->input.rpos);
 
 	--cx->rects;
@@ -40,95 +40,32 @@
 
 struct rre {
 	int32_t rects;
-	ggi_visual_t stem;
+	const struct pixel_ops *ops;
 };
 
 static int
-rre_stem_change(struct connection *cx)
-{
-	struct rre *rre = cx->encoding_def[rre_encoding].priv;
-
-	rre->stem = cx->wire_stem ? cx->wire_stem : cx->stem;
-	return 0;
-}
-
-static int
-vnc_rre_rect_8(struct connection *cx)
-{
-	struct rre *rre = cx->encoding_def[rre_encoding].priv;
-	ggi_pixel pixel;
-	uint16_t x, y, w, h;
-
-	while (rre->rects) {
-		if (cx->input.wpos < cx->input.rpos + 9) {
-			cx->action = vnc_rre_rect_8;
-			return 0;
-		}
-
-		pixel = cx->input.data[cx->input.rpos++];
-		x = get16_hilo(&cx->input.data[cx->input.rpos + 0]);
-		y = get16_hilo(&cx->input.data[cx->input.rpos + 2]);
-		w = get16_hilo(&cx->input.data[cx->input.rpos + 4]);
-		h = get16_hilo(&cx->input.data[cx->input.rpos + 6]);
-		cx->input.rpos += 8;
-
-		ggiSetGCForeground(rre->stem, pixel);
-		ggiDrawBox(rre->stem, cx->x + x, cx->y + y, w, h);
-		--rre->rects;
-	}
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
-static int
-vnc_rre_8(struct connection *cx)
-{
-	struct rre *rre = cx->encoding_def[rre_encoding].priv;
-	ggi_pixel pixel;
-
-	if (cx->input.wpos < cx->input.rpos + 1) {
-		cx->action = vnc_rre_8;
-		return 0;
-	}
-
-	pixel = cx->input.data[cx->input.rpos++];
-
-	ggiSetGCForeground(rre->stem, pixel);
-	ggiDrawBox(rre->stem, cx->x, cx->y, cx->w, cx->h);
-
-	return vnc_rre_rect_8(cx);
-}
-
-static int
-vnc_rre_rect_16(struct connection *cx)
+vnc_rre_rect(struct connection *cx)
 {
 	struct rre *rre = cx->encoding_def[rre_encoding].priv;
+	const struct pixel_ops *ops = rre->ops;
 	ggi_pixel pixel;
 	uint16_t x, y, w, h;
 
 	while (rre->rects) {
-		if (cx->input.wpos < cx->input.rpos + 10) {
-			cx->action = vnc_rre_rect_16;
+		if (cx->input.wpos < cx->input.rpos + ops->size + 8) {
+			cx->action = vnc_rre_rect;
 			return 0;
 		}
 
-		if (cx->wire_endian != cx->local_endian)
-			pixel = get16_r(&cx->input.data[cx->input.rpos]);
-		else
-			pixel = get16(&cx->input.data[cx->input.rpos]);
-		cx->input.rpos += 2;
+		pixel = ops->get(&cx->input.data[cx->input.rpos]);
+		cx->input.rpos += ops->size;
 		x = get16_hilo(&cx->input.data[cx->input.rpos + 0]);
 		y = get16_hilo(&cx->input.data[cx->input.rpos + 2]);
 		w = get16_hilo(&cx->input.data[cx->input.rpos + 4]);
 		h = get16_hilo(&cx->input.data[cx->input.rpos + 6]);
 		cx->input.rpos += 8;
 
-		ggiSetGCForeground(rre->stem, pixel);
-		ggiDrawBox(rre->stem, cx->x + x, cx->y + y, w, h);
+		surface_fill(&cx->surface, cx->x + x, cx->y + y, w, h, pixel);
 		--rre->rects;
 	}
 
@@ -140,87 +77,25 @@ vnc_rre_rect_16(struct connection *cx)
 }
 
 static int
-vnc_rre_16(struct connection *cx)
+vnc_rre_bg(struct connection *cx)
 {
 	struct rre *rre = cx->encoding_def[rre_encoding].priv;
+	const struct pixel_ops *ops = rre->ops;
 	ggi_pixel pixel;
 
-	if (cx->input.wpos < cx->input.rpos + 2) {
-		cx->action = vnc_rre_16;
+	if (cx->input.wpos < cx->input.rpos + ops->size) {
+		cx->action = vnc_rre_bg;
 		return 0;
 	}
 
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get16_r(&cx->input.data[cx->input.rpos]);
-	else
-		pixel = get16(&cx->input.data[cx->input.rpos]);
-	cx->input.rpos += 2;
-
-	ggiSetGCForeground(rre->stem, pixel);
-	ggiDrawBox(rre->stem, cx->x, cx->y, cx->w, cx->h);
-
-	return vnc_rre_rect_16(cx);
-}
-
-static int
-vnc_rre_rect_32(struct connection *cx)
-{
-	struct rre *rre = cx->encoding_def[rre_encoding].priv;
-	ggi_pixel pixel;
-	uint16_t x, y, w, h;
-
-	while (rre->rects) {
-		if (cx->input.wpos < cx->input.rpos + 12) {
-			cx->action = vnc_rre_rect_32;
-			return 0;
-		}
-
-		if (cx->wire_endian != cx->local_endian)
-			pixel = get32_r(&cx->input.data[cx->input.rpos]);
-		else
-			pixel = get32(&cx->input.data[cx->input.rpos]);
-		cx->input.rpos += 4;
-		x = get16_hilo(&cx->input.data[cx->input.rpos + 0]);
-		y = get16_hilo(&cx->input.data[cx->input.rpos + 2]);
-		w = get16_hilo(&cx->input.data[cx->input.rpos + 4]);
-		h = get16_hilo(&cx->input.data[cx->input.rpos + 6]);
-		cx->input.rpos += 8;
-
-		ggiSetGCForeground(rre->stem, pixel);
-		ggiDrawBox(rre->stem, cx->x + x, cx->y + y, w, h);
-		--rre->rects;
-	}
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
-static int
-vnc_rre_32(struct connection *cx)
-{
-	struct rre *rre = cx->encoding_def[rre_encoding].priv;
-	ggi_pixel pixel;
-
-	if (cx->input.wpos < cx->input.rpos + 4) {
-		cx->action = vnc_rre_32;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get32_r(&cx->input.data[cx->input.rpos]);
-	else
-		pixel = get32(&cx->input.data[cx->input.rpos]);
-	cx->input.rpos += 4;
+	pixel = ops->get(&cx->input.data[cx->input.rpos]);
+	cx->input.rpos += ops->size;
 
 	debug(3, "rre rects %d bg=%08x\n", rre->rects, pixel);
 
-	ggiSetGCForeground(rre->stem, pixel);
-	ggiDrawBox(rre->stem, cx->x, cx->y, cx->w, cx->h);
+	surface_fill(&cx->surface, cx->x, cx->y, cx->w, cx->h, pixel);
 
-	return vnc_rre_rect_32(cx);
+	return vnc_rre_rect(cx);
 }
 
 static int
@@ -236,15 +111,11 @@ rre_rect(struct connection *cx)
 	rre->rects = get32_hilo(&cx->input.data[cx->input.rpos]);
 	cx->input.rpos += 4;
 
-	cx->stem_change = rre_stem_change;
-	cx->stem_change(cx);
+	cx->stem_change = NULL;
 
-	switch (GT_SIZE(cx->wire_mode.graphtype) / 8) {
-	case 1: return vnc_rre_8(cx);
-	case 2: return vnc_rre_16(cx);
-	case 4: return vnc_rre_32(cx);
-	}
-	return 1;
+	rre->ops = cx->pixel_ops;
+
+	return vnc_rre_bg(cx);
 }
 
 static void
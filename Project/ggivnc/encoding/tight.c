@@ -57,6 +57,7 @@
 #include "vnc-compat.h"
 #include "vnc-endian.h"
 #include "vnc-debug.h"
+#include "vnc-metrics.h"
 
 #ifdef HAVE_JPEG
 #if defined HAVE_TURBOJPEG
@@ -81,6 +82,8 @@ struct tight {
 	uint8_t filter;
 	int palette_size;
 	ggi_pixel palette[256];
+	const struct pixel_ops *ops;
+	struct buffer unpacked;
 	action_t *fill;
 	action_t *jpeg;
 	action_t *copy;
@@ -255,7 +258,7 @@ tight_drain_inflate(struct connection *cx)
 	ztrm->next_in = &cx->input.data[cx->input.rpos];
 	ztrm->avail_out = cx->work.size - cx->work.wpos;
 	ztrm->next_out = &cx->work.data[cx->work.wpos];
-	res = inflate(ztrm, Z_SYNC_FLUSH);
+	res = metrics_inflate(&cx->metrics, ztrm, Z_SYNC_FLUSH);
 	switch (res) {
 	case Z_NEED_DICT:
 	case Z_DATA_ERROR:
@@ -292,23 +295,37 @@ tight_bit_palette(struct connection *cx)
 
 	src = &cx->work.data[cx->work.rpos];
 
-	for (y = 0; y < cx->h; ++y) {
-		shift = 7;
-		for (x = 0; x < cx->w; ++x) {
-			ggiPutPixel(tight->stem, cx->x + x, cx->y + y,
-				tight->palette[(*src >> shift) & 1]);
-			if (--shift < 0) {
-				shift = 7;
-				++src;
-			}
+	/* The 888 stem holds packed 24-bit pixels, which have no
+	 * matching kernels.
+	 */
+	if (tight->bpp != 3) {
+		if (buffer_reserve(&tight->unpacked,
+			tight->ops->local_size * cx->w * cx->h))
+		{
+			return close_connection(cx, -1);
 		}
-		if (shift != 7)
-			++src;
+		tight->ops->unpack_palette(tight->unpacked.data, src,
+			tight->palette, cx->w, cx->h, 1);
+		surface_put(&cx->surface, cx->x, cx->y, cx->w, cx->h,
+			tight->unpacked.data);
 	}
-
-	if (tight->bpp == 3)
+	else {
+		for (y = 0; y < cx->h; ++y) {
+			shift = 7;
+			for (x = 0; x < cx->w; ++x) {
+				ggiPutPixel(tight->stem, cx->x + x, cx->y + y,
+					tight->palette[(*src >> shift) & 1]);
+				if (--shift < 0) {
+					shift = 7;
+					++src;
+				}
+			}
+			if (shift != 7)
+				++src;
+		}
 		ggiCrossBlit(tight->stem, cx->x, cx->y, cx->w, cx->h,
 			tight->xblt_stem, cx->x, cx->y);
+	}
 
 	cx->work.rpos = 0;
 	cx->work.wpos = 0;
@@ -340,15 +357,29 @@ tight_byte_palette(struct connection *cx)
 
 	src = &cx->work.data[cx->work.rpos];
 
-	for (y = 0; y < cx->h; ++y) {
-		for (x = 0; x < cx->w; ++x)
-			ggiPutPixel(tight->stem, cx->x + x, cx->y + y,
-				tight->palette[*src++]);
+	/* The 888 stem holds packed 24-bit pixels, which have no
+	 * matching kernels.
+	 */
+	if (tight->bpp != 3) {
+		if (buffer_reserve(&tight->unpacked,
+			tight->ops->local_size * cx->w * cx->h))
+		{
+			return close_connection(cx, -1);
+		}
+		tight->ops->unpack_palette(tight->unpacked.data, src,
+			tight->palette, cx->w, cx->h, 8);
+		surface_put(&cx->surface, cx->x, cx->y, cx->w, cx->h,
+			tight->unpacked.data);
 	}
-
-	if (tight->bpp == 3)
+	else {
+		for (y = 0; y < cx->h; ++y) {
+			for (x = 0; x < cx->w; ++x)
+				ggiPutPixel(tight->stem, cx->x + x, cx->y + y,
+					tight->palette[*src++]);
+		}
 		ggiCrossBlit(tight->stem, cx->x, cx->y, cx->w, cx->h,
 			tight->xblt_stem, cx->x, cx->y);
+	}
 
 	cx->work.rpos = 0;
 	cx->work.wpos = 0;
@@ -399,7 +430,7 @@ tight_inflate(struct connection *cx)
 		ztrm->avail_out = cx->work.size - cx->work.wpos;
 		ztrm->next_out = &cx->work.data[cx->work.wpos];
 
-		res = inflate(ztrm, flush);
+		res = metrics_inflate(&cx->metrics, ztrm, flush);
 		switch (res) {
 		case Z_NEED_DICT:
 		case Z_DATA_ERROR:
@@ -432,46 +463,20 @@ tight_inflate(struct connection *cx)
 }
 
 static int
-tight_fill_8(struct connection *cx)
+tight_fill(struct connection *cx)
 {
 	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	debug(3, "tight_fill_8\n");
+	const struct pixel_ops *ops = tight->ops;
+	debug(3, "tight_fill\n");
 
-	if (cx->input.wpos < cx->input.rpos + 1) {
+	if (cx->input.wpos < cx->input.rpos + ops->size) {
 		cx->action = tight->fill;
 		return 0;
 	}
 
-	ggiSetGCForeground(tight->stem, cx->input.data[cx->input.rpos++]);
-	ggiDrawBox(tight->stem, cx->x, cx->y, cx->w, cx->h);
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
-static int
-tight_fill_16(struct connection *cx)
-{
-	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	uint16_t pixel;
-	debug(3, "tight_fill_16\n");
-
-	if (cx->input.wpos < cx->input.rpos + 2) {
-		cx->action = tight->fill;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get16_r(&cx->input.data[cx->input.rpos]);
-	else
-		pixel = get16(&cx->input.data[cx->input.rpos]);
-	cx->input.rpos += 2;
-
-	ggiSetGCForeground(tight->stem, pixel);
-	ggiDrawBox(tight->stem, cx->x, cx->y, cx->w, cx->h);
+	surface_fill(&cx->surface, cx->x, cx->y, cx->w, cx->h,
+		ops->get(&cx->input.data[cx->input.rpos]));
+	cx->input.rpos += ops->size;
 
 	--cx->rects;
 
@@ -514,78 +519,24 @@ tight_fill_888(struct connection *cx)
 }
 
 static int
-tight_fill_32(struct connection *cx)
-{
-	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	uint32_t pixel;
-	debug(3, "tight_fill_32\n");
-
-	if (cx->input.wpos < cx->input.rpos + 4) {
-		cx->action = tight->fill;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get32_r(&cx->input.data[cx->input.rpos]);
-	else
-		pixel = get32(&cx->input.data[cx->input.rpos]);
-	cx->input.rpos += 4;
-
-	ggiSetGCForeground(tight->stem, pixel);
-	ggiDrawBox(tight->stem, cx->x, cx->y, cx->w, cx->h);
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
-static int
-tight_copy_8(struct connection *cx)
-{
-	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	int bytes = cx->w * cx->h;
-
-	debug(3, "tight_copy_8\n");
-
-	if (cx->work.wpos < cx->work.rpos + bytes) {
-		cx->action = tight_inflate;
-		return 0;
-	}
-
-	ggiPutBox(tight->stem,
-		cx->x, cx->y, cx->w, cx->h, cx->work.data + cx->work.rpos);
-	cx->work.rpos = 0;
-	cx->work.wpos = 0;
-
-	if (tight->length)
-		return tight_drain_inflate(cx);
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
-static int
-tight_copy_16(struct connection *cx)
+tight_copy(struct connection *cx)
 {
 	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	int bytes = 2 * cx->w * cx->h;
+	const struct pixel_ops *ops = tight->ops;
+	int bytes = ops->size * cx->w * cx->h;
 
-	debug(3, "tight_copy_16\n");
+	debug(3, "tight_copy\n");
 
 	if (cx->work.wpos < cx->work.rpos + bytes) {
 		cx->action = tight_inflate;
 		return 0;
 	}
 
-	if (cx->wire_endian != cx->local_endian)
-		buffer_reverse_16(cx->work.data, bytes);
+	if (!ops->native)
+		ops->unpack(cx->work.data + cx->work.rpos,
+			cx->work.data + cx->work.rpos, cx->w * cx->h);
 
-	ggiPutBox(tight->stem,
+	surface_put(&cx->surface,
 		cx->x, cx->y, cx->w, cx->h, cx->work.data + cx->work.rpos);
 	cx->work.rpos = 0;
 	cx->work.wpos = 0;
@@ -631,37 +582,6 @@ tight_copy_888(struct connection *cx)
 	return 1;
 }
 
-static int
-tight_copy_32(struct connection *cx)
-{
-	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	int bytes = 4 * cx->w * cx->h;
-
-	debug(3, "tight_copy_32\n");
-
-	if (cx->work.wpos < cx->work.rpos + bytes) {
-		cx->action = tight_inflate;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian)
-		buffer_reverse_32(cx->work.data, bytes);
-
-	ggiPutBox(tight->stem,
-		cx->x, cx->y, cx->w, cx->h, cx->work.data + cx->work.rpos);
-	cx->work.rpos = 0;
-	cx->work.wpos = 0;
-
-	if (tight->length)
-		return tight_drain_inflate(cx);
-
-	--cx->rects;
-
-	remove_dead_data(&cx->input);
-	cx->action = vnc_update_rect;
-	return 1;
-}
-
 static int
 tight_length(struct connection *cx)
 {
@@ -750,12 +670,12 @@ tight_basic(struct connection *cx)
 }
 
 static int
-tight_palette_8(struct connection *cx)
+tight_palette(struct connection *cx)
 {
 	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	int i;
+	const struct pixel_ops *ops = tight->ops;
 
-	debug(3, "tight_palette_8\n");
+	debug(3, "tight_palette\n");
 
 	if (cx->input.wpos < cx->input.rpos + 1) {
 		cx->action = tight->pal;
@@ -763,52 +683,17 @@ tight_palette_8(struct connection *cx)
 	}
 	tight->palette_size = cx->input.data[cx->input.rpos] + 1;
 
-	if (cx->input.wpos < cx->input.rpos + 1 + tight->palette_size) {
-		cx->action = tight->pal;
-		return 0;
-	}
-
-	for (i = 0; i < tight->palette_size; ++i)
-		tight->palette[i] = cx->input.data[++cx->input.rpos];
-	++cx->input.rpos;
-
-	return tight_basic(cx);
-}
-
-static int
-tight_palette_16(struct connection *cx)
-{
-	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	int i;
-
-	debug(3, "tight_palette_16\n");
-
-	if (cx->input.wpos < cx->input.rpos + 1) {
-		cx->action = tight->pal;
-		return 0;
-	}
-	tight->palette_size = cx->input.data[cx->input.rpos] + 1;
-
-	if (cx->input.wpos < cx->input.rpos + 1 + 2 * tight->palette_size) {
+	if (cx->input.wpos <
+		cx->input.rpos + 1 + ops->size * tight->palette_size)
+	{
 		cx->action = tight->pal;
 		return 0;
 	}
 
 	++cx->input.rpos;
-	if (cx->wire_endian != cx->local_endian) {
-		for (i = 0; i < tight->palette_size; ++i) {
-			tight->palette[i] =
-				get16_r(&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 2;
-		}
-	}
-	else {
-		for (i = 0; i < tight->palette_size; ++i) {
-			tight->palette[i] =
-				get16(&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 2;
-		}
-	}
+	ops->get_palette(tight->palette,
+		&cx->input.data[cx->input.rpos], tight->palette_size);
+	cx->input.rpos += ops->size * tight->palette_size;
 
 	return tight_basic(cx);
 }
@@ -848,44 +733,6 @@ tight_palette_888(struct connection *cx)
 	return tight_basic(cx);
 }
 
-static int
-tight_palette_32(struct connection *cx)
-{
-	struct tight *tight = cx->encoding_def[tight_encoding].priv;
-	int i;
-
-	debug(3, "tight_palette_32\n");
-
-	if (cx->input.wpos < cx->input.rpos + 1) {
-		cx->action = tight->pal;
-		return 0;
-	}
-	tight->palette_size = cx->input.data[cx->input.rpos] + 1;
-
-	if (cx->input.wpos < cx->input.rpos + 1 + 4 * tight->palette_size) {
-		cx->action = tight->pal;
-		return 0;
-	}
-
-	++cx->input.rpos;
-	if (cx->wire_endian != cx->local_endian) {
-		for (i = 0; i < tight->palette_size; ++i) {
-			tight->palette[i] =
-				get32_r(&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 4;
-		}
-	}
-	else {
-		for (i = 0; i < tight->palette_size; ++i) {
-			tight->palette[i] =
-				get32(&cx->input.data[cx->input.rpos]);
-			cx->input.rpos += 4;
-		}
-	}
-
-	return tight_basic(cx);
-}
-
 static inline uint16_t
 bound_16(ggi_pixel mask, ggi_pixel left, ggi_pixel up, ggi_pixel left_up)
 {
@@ -1018,7 +865,7 @@ tight_gradient_16(struct connection *cx)
 		buf += cx->w;
 	}
 
-	ggiPutBox(tight->stem,
+	surface_put(&cx->surface,
 		cx->x, cx->y, cx->w, cx->h, cx->work.data + cx->work.rpos);
 	cx->work.rpos = 0;
 	cx->work.wpos = 0;
@@ -1168,7 +1015,7 @@ tight_gradient_32(struct connection *cx)
 		buf += cx->w;
 	}
 
-	ggiPutBox(tight->stem,
+	surface_put(&cx->surface,
 		cx->x, cx->y, cx->w, cx->h, cx->work.data + cx->work.rpos);
 	cx->work.rpos = 0;
 	cx->work.wpos = 0;
@@ -1766,24 +1613,26 @@ tight_rect(struct connection *cx)
 
 	tight->stem = cx->wire_stem ? cx->wire_stem : cx->stem;
 	cx->stem_change = tight_stem_change;
+	tight->ops = cx->pixel_ops;
 
 	switch (GT_SIZE(cx->wire_mode.graphtype)) {
 	case  8:
 		tight->bpp           = 1;
-		tight->fill          = tight_fill_8;
+		tight->fill          = tight_fill;
 		tight->jpeg          = tight_jpeg_8;
-		tight->copy          = tight_copy_8;
-		tight->pal           = tight_palette_8;
+		tight->copy          = tight_copy;
+		tight->pal           = tight_palette;
 		tight->gradient      = tight_gradient_8;
 		break;
 	case 16:
 		tight->bpp           = 2;
-		tight->fill          = tight_fill_16;
+		tight->fill          = tight_fill;
 		tight->jpeg          = tight_jpeg_16;
-		tight->copy          = tight_copy_16;
-		tight->pal           = tight_palette_16;
+		tight->copy          = tight_copy;
+		tight->pal           = tight_palette;
 		tight->gradient      = tight_gradient_16;
 		break;
+	case 24: /* packed local visual, 32-bit on the wire */
 	case 32:
 		pf = ggiGetPixelFormat(tight->stem);
 		if (((pf->red_mask   << pf->red_shift)   == 0xff000000) &&
@@ -1807,10 +1656,10 @@ tight_rect(struct connection *cx)
 			break;
 		}
 		tight->bpp           = 4;
-		tight->fill          = tight_fill_32;
+		tight->fill          = tight_fill;
 		tight->jpeg          = tight_jpeg_32;
-		tight->copy          = tight_copy_32;
-		tight->pal           = tight_palette_32;
+		tight->copy          = tight_copy;
+		tight->pal           = tight_palette;
 		tight->gradient      = tight_gradient_32;
 		break;
 	}
@@ -1860,6 +1709,9 @@ tight_end(struct connection *cx)
 		free(tight->xblt888.data);
 #endif /* HAVE_JPEG */
 
+	if (tight->unpacked.data)
+		free(tight->unpacked.data);
+
 	inflateEnd(&tight->ztrm[3]);
 	inflateEnd(&tight->ztrm[2]);
 	inflateEnd(&tight->ztrm[1]);
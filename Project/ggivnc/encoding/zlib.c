@@ -38,6 +38,7 @@
 #include "vnc.h"
 #include "vnc-endian.h"
 #include "vnc-debug.h"
+#include "vnc-metrics.h"
 
 struct zlib {
 	z_stream zstr;
@@ -84,7 +85,7 @@ vnc_inflate(struct connection *cx)
 		zlib->zstr.avail_out = cx->work.size - cx->work.wpos;
 		zlib->zstr.next_out = &cx->work.data[cx->work.wpos];
 
-		res = inflate(&zlib->zstr, flush);
+		res = metrics_inflate(&cx->metrics, &zlib->zstr, flush);
 		switch (res) {
 		case Z_NEED_DICT:
 		case Z_DATA_ERROR:
@@ -38,6 +38,7 @@
 #include "vnc.h"
 #include "vnc-endian.h"
 #include "vnc-debug.h"
+#include "vnc-metrics.h"
 
 struct zlibhex {
 	z_stream zstr[2];
@@ -83,7 +84,7 @@ vnc_zlibhex_inflate(struct connection *cx)
 		zhex->ztream->avail_out = cx->work.size - cx->work.wpos;
 		zhex->ztream->next_out = &cx->work.data[cx->work.wpos];
 
-		res = inflate(zhex->ztream, flush);
+		res = metrics_inflate(&cx->metrics, zhex->ztream, flush);
 		switch (res) {
 		case Z_NEED_DICT:
 		case Z_DATA_ERROR:
@@ -214,7 +215,7 @@ zlibhex_rect(struct connection *cx)
 	int wpos;
 	debug(2, "zlibhex\n");
 
-	zhex->bpp = GT_SIZE(cx->wire_mode.graphtype) / 8;
+	zhex->bpp = cx->pixel_ops->size;
 	cx->action = zhex->hextile =
 		cx->encoding_def[hextile_encoding].action;
 	wpos = cx->input.wpos;
@@ -38,6 +38,7 @@
 #include "vnc.h"
 #include "vnc-endian.h"
 #include "vnc-debug.h"
+#include "vnc-metrics.h"
 
 struct zrle {
 	uint32_t length;
@@ -45,7 +46,6 @@ struct zrle {
 
 	ggi_coord p;
 	ggi_coord s;
-	ggi_visual_t stem;
 
 	uint8_t subencoding;
 	uint8_t palette_size;
@@ -53,24 +53,9 @@ struct zrle {
 	uint8_t *unpacked;
 	action_t *action;
 	int rle;
-	action_t *tile;
-	action_t *raw;
-	action_t *solid;
-	action_t *packed_palette;
-	action_t *plain_rle;
-	int (*parse_palette)(struct connection *cx, action_t *action);
-	uint32_t (*get24)(const uint8_t *buf);
+	const struct pixel_ops *ops;
 };
 
-static int
-zrle_stem_change(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-
-	zrle->stem = cx->wire_stem ? cx->wire_stem : cx->stem;
-	return 0;
-}
-
 static int zrle_tile(struct connection *cx);
 
 static int
@@ -155,7 +140,7 @@ zrle_drain_inflate(struct connection *cx)
 	zrle->zstr.next_in = &cx->input.data[cx->input.rpos];
 	zrle->zstr.avail_out = sizeof(tmp);
 	zrle->zstr.next_out = tmp;
-	res = inflate(&zrle->zstr, flush);
+	res = metrics_inflate(&cx->metrics, &zrle->zstr, flush);
 	switch (res) {
 	case Z_NEED_DICT:
 	case Z_DATA_ERROR:
@@ -180,294 +165,31 @@ zrle_drain_inflate(struct connection *cx)
 }
 
 static int
-zrle_raw_8(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int bytes = zrle->s.x * zrle->s.y;
-
-	debug(3, "zrle_raw_8\n");
-
-	if (cx->work.wpos < cx->work.rpos + bytes) {
-		zrle->action = zrle->raw;
-		return 0;
-	}
-
-	ggiPutBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
-		cx->work.data + cx->work.rpos);
-	cx->work.rpos += bytes;
-
-	if (zrle->action == zrle->raw) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_raw_16(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int bytes = 2 * zrle->s.x * zrle->s.y;
-	uint16_t *buf;
-
-	debug(3, "zrle_raw_16\n");
-
-	if (cx->work.wpos < cx->work.rpos + bytes) {
-		zrle->action = zrle->raw;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian) {
-		buf = (uint16_t *)zrle->unpacked;
-		for (; bytes; bytes -= 2) {
-			*buf++ = get16_r(&cx->work.data[cx->work.rpos]);
-			cx->work.rpos += 2;
-		}
-	}
-	else {
-		memcpy(zrle->unpacked, &cx->work.data[cx->work.rpos], bytes);
-		cx->work.rpos += bytes;
-	}
-	ggiPutBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
-		zrle->unpacked);
-
-	if (zrle->action == zrle->raw) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_raw_24(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int bytes = 3 * zrle->s.x * zrle->s.y;
-	uint32_t *buf;
-
-	debug(3, "zrle_raw_24\n");
-
-	if (cx->work.wpos < cx->work.rpos + bytes) {
-		zrle->action = zrle->raw;
-		return 0;
-	}
-
-	buf = (uint32_t *)zrle->unpacked;
-	for (; bytes; bytes -= 3) {
-		*buf++ = zrle->get24(&cx->work.data[cx->work.rpos]);
-		cx->work.rpos += 3;
-	}
-	ggiPutBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
-		zrle->unpacked);
-
-	if (zrle->action == zrle->raw) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_raw_32(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int bytes = 4 * zrle->s.x * zrle->s.y;
-	uint32_t *buf;
-
-	debug(3, "zrle_raw_32\n");
-
-	if (cx->work.wpos < cx->work.rpos + bytes) {
-		zrle->action = zrle->raw;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian) {
-		buf = (uint32_t *)zrle->unpacked;
-		for (; bytes; bytes -= 4) {
-			*buf++ = get32_r(&cx->work.data[cx->work.rpos]);
-			cx->work.rpos += 4;
-		}
-	}
-	else {
-		memcpy(zrle->unpacked, &cx->work.data[cx->work.rpos], bytes);
-		cx->work.rpos += bytes;
-	}
-	ggiPutBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
-		zrle->unpacked);
-
-	if (zrle->action == zrle->raw) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_solid_8(struct connection *cx)
+zrle_raw(struct connection *cx)
 {
 	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-
-	debug(3, "zrle_solid_8\n");
-
-	if (cx->work.wpos < cx->work.rpos + 1) {
-		zrle->action = zrle->solid;
-		return 0;
-	}
-
-	ggiSetGCForeground(zrle->stem, cx->work.data[cx->work.rpos++]);
-	ggiDrawBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y);
-
-	if (zrle->action == zrle->solid) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_solid_16(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	uint16_t pixel;
-	debug(3, "zrle_solid_16\n");
-
-	if (cx->work.wpos < cx->work.rpos + 2) {
-		zrle->action = zrle->solid;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get16_r(&cx->work.data[cx->work.rpos]);
-	else
-		pixel = get16(&cx->work.data[cx->work.rpos]);
-	cx->work.rpos += 2;
-	ggiSetGCForeground(zrle->stem, pixel);
-	ggiDrawBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y);
-
-	if (zrle->action == zrle->solid) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_solid_24(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	uint32_t pixel;
-	debug(3, "zrle_solid_24\n");
-
-	if (cx->work.wpos < cx->work.rpos + 3) {
-		zrle->action = zrle->solid;
-		return 0;
-	}
-
-	pixel = zrle->get24(&cx->work.data[cx->work.rpos]);
-	cx->work.rpos += 3;
-	ggiSetGCForeground(zrle->stem, pixel);
-	ggiDrawBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y);
-
-	if (zrle->action == zrle->solid) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_solid_32(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	uint32_t pixel;
-	debug(3, "zrle_solid_32\n");
-
-	if (cx->work.wpos < cx->work.rpos + 4) {
-		zrle->action = zrle->solid;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian)
-		pixel = get32_r(&cx->work.data[cx->work.rpos]);
-	else
-		pixel = get32(&cx->work.data[cx->work.rpos]);
-	cx->work.rpos += 4;
-	ggiSetGCForeground(zrle->stem, pixel);
-	ggiDrawBox(zrle->stem, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y);
-
-	if (zrle->action == zrle->solid) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_packed_palette_8(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int extra;
-	int x;
-	int y;
-	uint8_t mask;
-	int shift;
-	int step;
+	const struct pixel_ops *ops = zrle->ops;
+	int pixels = zrle->s.x * zrle->s.y;
+	int bytes = ops->size * pixels;
 	uint8_t *src;
-	uint8_t *dst;
 
-	debug(3, "zrle_packed_palette_8\n");
+	debug(3, "zrle_raw\n");
 
-	if (zrle->subencoding == 2) {
-		step = 1;
-		extra = (zrle->s.x + 7) / 8 * zrle->s.y;
-	}
-	else if (zrle->subencoding <= 4) {
-		step = 2;
-		extra = (zrle->s.x + 3) / 4 * zrle->s.y;
-	}
-	else {
-		step = 4;
-		extra = (zrle->s.x + 1) / 2 * zrle->s.y;
-	}
-
-	if (cx->work.wpos < cx->work.rpos + extra) {
-		zrle->action = zrle->packed_palette;
+	if (cx->work.wpos < cx->work.rpos + bytes) {
+		zrle->action = zrle_raw;
 		return 0;
 	}
 
-	mask = 0xff >> (8 - step);
 	src = &cx->work.data[cx->work.rpos];
-	dst = zrle->unpacked;
-
-	for (y = 0; y < zrle->s.y; ++y) {
-		shift = 8 - step;
-		for (x = 0; x < zrle->s.x; ++x) {
-			*dst++ = zrle->palette[(*src >> shift) & mask];
-			shift -= step;
-			if (shift < 0) {
-				shift = 8 - step;
-				++src;
-			}
-		}
-		if (shift != 8 - step)
-			++src;
+	if (!ops->native) {
+		ops->unpack(zrle->unpacked, src, pixels);
+		src = zrle->unpacked;
 	}
+	surface_put(&cx->surface, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
+		src);
+	cx->work.rpos += bytes;
 
-	ggiPutBox(zrle->stem,
-		zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
-		zrle->unpacked);
-
-	cx->work.rpos += extra;
-
-	if (zrle->action == zrle->packed_palette) {
+	if (zrle->action == zrle_raw) {
 		if (!zrle_next(cx))
 			return zrle_done(cx);
 		zrle->action = zrle_tile;
@@ -476,63 +198,23 @@ zrle_packed_palette_8(struct connection *cx)
 }
 
 static int
-zrle_packed_palette_16(struct connection *cx)
+zrle_solid(struct connection *cx)
 {
 	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int extra;
-	int x;
-	int y;
-	uint8_t mask;
-	int shift;
-	int step;
-	uint8_t *src;
-	uint16_t *dst;
+	const struct pixel_ops *ops = zrle->ops;
 
-	debug(3, "zrle_packed_palette_16\n");
+	debug(3, "zrle_solid\n");
 
-	if (zrle->subencoding == 2) {
-		step = 1;
-		extra = (zrle->s.x + 7) / 8 * zrle->s.y;
-	}
-	else if (zrle->subencoding <= 4) {
-		step = 2;
-		extra = (zrle->s.x + 3) / 4 * zrle->s.y;
-	}
-	else {
-		step = 4;
-		extra = (zrle->s.x + 1) / 2 * zrle->s.y;
-	}
-
-	if (cx->work.wpos < cx->work.rpos + extra) {
-		zrle->action = zrle->packed_palette;
+	if (cx->work.wpos < cx->work.rpos + ops->size) {
+		zrle->action = zrle_solid;
 		return 0;
 	}
 
-	mask = 0xff >> (8 - step);
-	src = &cx->work.data[cx->work.rpos];
-	dst = (uint16_t *)zrle->unpacked;
-
-	for (y = 0; y < zrle->s.y; ++y) {
-		shift = 8 - step;
-		for (x = 0; x < zrle->s.x; ++x) {
-			*dst++ = zrle->palette[(*src >> shift) & mask];
-			shift -= step;
-			if (shift < 0) {
-				shift = 8 - step;
-				++src;
-			}
-		}
-		if (shift != 8 - step)
-			++src;
-	}
-
-	ggiPutBox(zrle->stem,
-		zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
-		zrle->unpacked);
+	surface_fill(&cx->surface, zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
+		ops->get(&cx->work.data[cx->work.rpos]));
+	cx->work.rpos += ops->size;
 
-	cx->work.rpos += extra;
-
-	if (zrle->action == zrle->packed_palette) {
+	if (zrle->action == zrle_solid) {
 		if (!zrle_next(cx))
 			return zrle_done(cx);
 		zrle->action = zrle_tile;
@@ -541,19 +223,13 @@ zrle_packed_palette_16(struct connection *cx)
 }
 
 static int
-zrle_packed_palette_32(struct connection *cx)
+zrle_packed_palette(struct connection *cx)
 {
 	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
 	int extra;
-	int x;
-	int y;
-	uint8_t mask;
-	int shift;
 	int step;
-	uint8_t *src;
-	uint32_t *dst;
 
-	debug(3, "zrle_packed_palette_32\n");
+	debug(3, "zrle_packed_palette\n");
 
 	if (zrle->subencoding == 2) {
 		step = 1;
@@ -569,198 +245,21 @@ zrle_packed_palette_32(struct connection *cx)
 	}
 
 	if (cx->work.wpos < cx->work.rpos + extra) {
-		zrle->action = zrle->packed_palette;
+		zrle->action = zrle_packed_palette;
 		return 0;
 	}
 
-	mask = 0xff >> (8 - step);
-	src = &cx->work.data[cx->work.rpos];
-	dst = (uint32_t *)zrle->unpacked;
-
-	for (y = 0; y < zrle->s.y; ++y) {
-		shift = 8 - step;
-		for (x = 0; x < zrle->s.x; ++x) {
-			*dst++ = zrle->palette[(*src >> shift) & mask];
-			shift -= step;
-			if (shift < 0) {
-				shift = 8 - step;
-				++src;
-			}
-		}
-		if (shift != 8 - step)
-			++src;
-	}
+	zrle->ops->unpack_palette(zrle->unpacked,
+		&cx->work.data[cx->work.rpos], zrle->palette,
+		zrle->s.x, zrle->s.y, step);
 
-	ggiPutBox(zrle->stem,
+	surface_put(&cx->surface,
 		zrle->p.x, zrle->p.y, zrle->s.x, zrle->s.y,
 		zrle->unpacked);
 
 	cx->work.rpos += extra;
 
-	if (zrle->action == zrle->packed_palette) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_plain_rle_8(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int run_length;
-	int rpos;
-	int start_x;
-
-	debug(3, "zrle_plain_rle_8\n");
-
-	do {
-		if (cx->work.wpos < cx->work.rpos + 2) {
-			zrle->action = zrle->plain_rle;
-			return 0;
-		}
-
-		rpos = cx->work.rpos + 1;
-		run_length = 0;
-		while (cx->work.data[rpos] == 255) {
-			run_length += 255;
-			if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
-				return close_connection(cx, -1);
-			if (cx->work.wpos < ++rpos + 1) {
-				zrle->action = zrle->plain_rle;
-				return 0;
-			}
-		}
-		run_length += cx->work.data[rpos++] + 1;
-		if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
-			return close_connection(cx, -1);
-		ggiSetGCForeground(zrle->stem, cx->work.data[cx->work.rpos]);
-		cx->work.rpos = rpos;
-
-		if (zrle->rle / zrle->s.x ==
-				(zrle->rle + run_length) / zrle->s.x)
-		{
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x + zrle->rle % zrle->s.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
-			zrle->rle += run_length;
-			continue;
-		}
-
-		start_x = zrle->rle % zrle->s.x;
-		if (start_x) {
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x + start_x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x - start_x);
-			zrle->rle += zrle->s.x - start_x;
-			run_length -= zrle->s.x - start_x;
-		}
-		if (run_length > zrle->s.x) {
-			ggiDrawBox(zrle->stem,
-				zrle->p.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x,
-				run_length / zrle->s.x);
-			zrle->rle += run_length / zrle->s.x * zrle->s.x;
-			run_length %= zrle->s.x;
-		}
-		if (run_length)
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
-
-		zrle->rle += run_length;
-	} while (zrle->rle < zrle->s.x * zrle->s.y);
-	
-	if (zrle->action == zrle->plain_rle) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_plain_rle_16(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int run_length;
-	int rpos;
-	int start_x;
-	uint16_t pixel;
-
-	debug(3, "zrle_plain_rle_16\n");
-
-	do {
-		if (cx->work.wpos < cx->work.rpos + 3) {
-			zrle->action = zrle->plain_rle;
-			return 0;
-		}
-
-		rpos = cx->work.rpos + 2;
-		run_length = 0;
-		while (cx->work.data[rpos] == 255) {
-			run_length += 255;
-			if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
-				return close_connection(cx, -1);
-			if (cx->work.wpos < ++rpos + 1) {
-				zrle->action = zrle->plain_rle;
-				return 0;
-			}
-		}
-		run_length += cx->work.data[rpos++] + 1;
-		if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
-			return close_connection(cx, -1);
-		if (cx->wire_endian != cx->local_endian)
-			pixel = get16_r(&cx->work.data[cx->work.rpos]);
-		else
-			pixel = get16(&cx->work.data[cx->work.rpos]);
-		ggiSetGCForeground(zrle->stem, pixel);
-		cx->work.rpos = rpos;
-
-		if (zrle->rle / zrle->s.x ==
-			(zrle->rle + run_length) / zrle->s.x)
-		{
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x + zrle->rle % zrle->s.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
-			zrle->rle += run_length;
-			continue;
-		}
-
-		start_x = zrle->rle % zrle->s.x;
-		if (start_x) {
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x + start_x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x - start_x);
-			zrle->rle += zrle->s.x - start_x;
-			run_length -= zrle->s.x - start_x;
-		}
-		if (run_length > zrle->s.x) {
-			ggiDrawBox(zrle->stem,
-				zrle->p.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x,
-				run_length / zrle->s.x);
-			zrle->rle += run_length / zrle->s.x * zrle->s.x;
-			run_length %= zrle->s.x;
-		}
-		if (run_length)
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
-
-		zrle->rle += run_length;
-	} while (zrle->rle < zrle->s.x * zrle->s.y);
-	
-	if (zrle->action == zrle->plain_rle) {
+	if (zrle->action == zrle_packed_palette) {
 		if (!zrle_next(cx))
 			return zrle_done(cx);
 		zrle->action = zrle_tile;
@@ -769,163 +268,79 @@ zrle_plain_rle_16(struct connection *cx)
 }
 
 static int
-zrle_plain_rle_24(struct connection *cx)
+zrle_plain_rle(struct connection *cx)
 {
 	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
+	const struct pixel_ops *ops = zrle->ops;
 	int run_length;
 	int rpos;
 	int start_x;
-	uint32_t pixel;
+	ggi_pixel pixel;
 
-	debug(3, "zrle_plain_rle_24\n");
+	debug(3, "zrle_plain_rle\n");
 
 	do {
-		if (cx->work.wpos < cx->work.rpos + 4) {
-			zrle->action = zrle->plain_rle;
+		if (cx->work.wpos < cx->work.rpos + ops->size + 1) {
+			zrle->action = zrle_plain_rle;
 			return 0;
 		}
 
-		rpos = cx->work.rpos + 3;
+		rpos = cx->work.rpos + ops->size;
 		run_length = 0;
 		while (cx->work.data[rpos] == 255) {
 			run_length += 255;
 			if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
 				return close_connection(cx, -1);
 			if (cx->work.wpos < ++rpos + 1) {
-				zrle->action = zrle->plain_rle;
+				zrle->action = zrle_plain_rle;
 				return 0;
 			}
 		}
 		run_length += cx->work.data[rpos++] + 1;
 		if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
 			return close_connection(cx, -1);
-		pixel = zrle->get24(&cx->work.data[cx->work.rpos]);
-		ggiSetGCForeground(zrle->stem, pixel);
+		pixel = ops->get(&cx->work.data[cx->work.rpos]);
 		cx->work.rpos = rpos;
 
 		if (zrle->rle / zrle->s.x ==
 			(zrle->rle + run_length) / zrle->s.x)
 		{
-			ggiDrawHLine(zrle->stem,
+			surface_hline(&cx->surface,
 				zrle->p.x + zrle->rle % zrle->s.x,
 				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
+				run_length, pixel);
 			zrle->rle += run_length;
 			continue;
 		}
 
 		start_x = zrle->rle % zrle->s.x;
 		if (start_x) {
-			ggiDrawHLine(zrle->stem,
+			surface_hline(&cx->surface,
 				zrle->p.x + start_x,
 				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x - start_x);
+				zrle->s.x - start_x, pixel);
 			zrle->rle += zrle->s.x - start_x;
 			run_length -= zrle->s.x - start_x;
 		}
 		if (run_length > zrle->s.x) {
-			ggiDrawBox(zrle->stem,
+			surface_fill(&cx->surface,
 				zrle->p.x,
 				zrle->p.y + zrle->rle / zrle->s.x,
 				zrle->s.x,
-				run_length / zrle->s.x);
+				run_length / zrle->s.x, pixel);
 			zrle->rle += run_length / zrle->s.x * zrle->s.x;
 			run_length %= zrle->s.x;
 		}
 		if (run_length)
-			ggiDrawHLine(zrle->stem,
+			surface_hline(&cx->surface,
 				zrle->p.x,
 				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
+				run_length, pixel);
 
 		zrle->rle += run_length;
 	} while (zrle->rle < zrle->s.x * zrle->s.y);
 	
-	if (zrle->action == zrle->plain_rle) {
-		if (!zrle_next(cx))
-			return zrle_done(cx);
-		zrle->action = zrle_tile;
-	}
-	return 1;
-}
-
-static int
-zrle_plain_rle_32(struct connection *cx)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int run_length;
-	int rpos;
-	int start_x;
-	uint32_t pixel;
-
-	debug(3, "zrle_plain_rle_32\n");
-
-	do {
-		if (cx->work.wpos < cx->work.rpos + 5) {
-			zrle->action = zrle->plain_rle;
-			return 0;
-		}
-
-		rpos = cx->work.rpos + 4;
-		run_length = 0;
-		while (cx->work.data[rpos] == 255) {
-			run_length += 255;
-			if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
-				return close_connection(cx, -1);
-			if (cx->work.wpos < ++rpos + 1) {
-				zrle->action = zrle->plain_rle;
-				return 0;
-			}
-		}
-		run_length += cx->work.data[rpos++] + 1;
-		if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
-			return close_connection(cx, -1);
-		if (cx->wire_endian != cx->local_endian)
-			pixel = get32_r(&cx->work.data[cx->work.rpos]);
-		else
-			pixel = get32(&cx->work.data[cx->work.rpos]);
-		ggiSetGCForeground(zrle->stem, pixel);
-		cx->work.rpos = rpos;
-
-		if (zrle->rle / zrle->s.x ==
-			(zrle->rle + run_length) / zrle->s.x)
-		{
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x + zrle->rle % zrle->s.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
-			zrle->rle += run_length;
-			continue;
-		}
-
-		start_x = zrle->rle % zrle->s.x;
-		if (start_x) {
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x + start_x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x - start_x);
-			zrle->rle += zrle->s.x - start_x;
-			run_length -= zrle->s.x - start_x;
-		}
-		if (run_length > zrle->s.x) {
-			ggiDrawBox(zrle->stem,
-				zrle->p.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x,
-				run_length / zrle->s.x);
-			zrle->rle += run_length / zrle->s.x * zrle->s.x;
-			run_length %= zrle->s.x;
-		}
-		if (run_length)
-			ggiDrawHLine(zrle->stem,
-				zrle->p.x,
-				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
-
-		zrle->rle += run_length;
-	} while (zrle->rle < zrle->s.x * zrle->s.y);
-	
-	if (zrle->action == zrle->plain_rle) {
+	if (zrle->action == zrle_plain_rle) {
 		if (!zrle_next(cx))
 			return zrle_done(cx);
 		zrle->action = zrle_tile;
@@ -940,6 +355,7 @@ zrle_palette_rle(struct connection *cx)
 	int run_length;
 	int rpos;
 	int start_x;
+	ggi_pixel pixel;
 	uint8_t color;
 
 	debug(3, "zrle_palette_rle\n");
@@ -959,7 +375,7 @@ zrle_palette_rle(struct connection *cx)
 
 		if (!(cx->work.data[cx->work.rpos] & 0x80)) {
 			++cx->work.rpos;
-			ggiPutPixel(zrle->stem,
+			surface_pixel(&cx->surface,
 				zrle->p.x + zrle->rle % zrle->s.x,
 				zrle->p.y + zrle->rle / zrle->s.x,
 				zrle->palette[color]);
@@ -986,43 +402,43 @@ zrle_palette_rle(struct connection *cx)
 		run_length += cx->work.data[rpos++] + 1;
 		if (zrle->rle + run_length > zrle->s.x * zrle->s.y)
 			return close_connection(cx, -1);
-		ggiSetGCForeground(zrle->stem, zrle->palette[color]);
+		pixel = zrle->palette[color];
 		cx->work.rpos = rpos;
 
 		if (zrle->rle / zrle->s.x ==
 			(zrle->rle + run_length) / zrle->s.x)
 		{
-			ggiDrawHLine(zrle->stem,
+			surface_hline(&cx->surface,
 				zrle->p.x + zrle->rle % zrle->s.x,
 				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
+				run_length, pixel);
 			zrle->rle += run_length;
 			continue;
 		}
 
 		start_x = zrle->rle % zrle->s.x;
 		if (start_x) {
-			ggiDrawHLine(zrle->stem,
+			surface_hline(&cx->surface,
 				zrle->p.x + start_x,
 				zrle->p.y + zrle->rle / zrle->s.x,
-				zrle->s.x - start_x);
+				zrle->s.x - start_x, pixel);
 			zrle->rle += zrle->s.x - start_x;
 			run_length -= zrle->s.x - start_x;
 		}
 		if (run_length > zrle->s.x) {
-			ggiDrawBox(zrle->stem,
+			surface_fill(&cx->surface,
 				zrle->p.x,
 				zrle->p.y + zrle->rle / zrle->s.x,
 				zrle->s.x,
-				run_length / zrle->s.x);
+				run_length / zrle->s.x, pixel);
 			zrle->rle += run_length / zrle->s.x * zrle->s.x;
 			run_length %= zrle->s.x;
 		}
 		if (run_length)
-			ggiDrawHLine(zrle->stem,
+			surface_hline(&cx->surface,
 				zrle->p.x,
 				zrle->p.y + zrle->rle / zrle->s.x,
-				run_length);
+				run_length, pixel);
 
 		zrle->rle += run_length;
 	} while (zrle->rle < zrle->s.x * zrle->s.y);
@@ -1036,108 +452,22 @@ zrle_palette_rle(struct connection *cx)
 }
 
 static int
-zrle_palette_8(struct connection *cx, action_t *action)
+zrle_palette(struct connection *cx, action_t *action)
 {
 	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int i;
+	int bytes = zrle->ops->size * zrle->palette_size;
 
-	debug(3, "zrle_palette_8\n");
+	debug(3, "zrle_palette\n");
 
-	if (cx->work.wpos < cx->work.rpos + zrle->palette_size) {
-		--cx->work.rpos;
-		zrle->action = zrle_tile;
-		return 0;
-	}
-
-	for (i = 0; i < zrle->palette_size; ++i)
-		zrle->palette[i] = cx->work.data[cx->work.rpos++];
-
-	return action(cx);
-}
-
-static int
-zrle_palette_16(struct connection *cx, action_t *action)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int i;
-
-	debug(3, "zrle_palette_16\n");
-
-	if (cx->work.wpos < cx->work.rpos + 2 * zrle->palette_size) {
-		--cx->work.rpos;
-		zrle->action = zrle_tile;
-		return 0;
-	}
-
-	if (cx->wire_endian != cx->local_endian) {
-		for (i = 0; i < zrle->palette_size; ++i) {
-			zrle->palette[i] =
-				get16_r(&cx->work.data[cx->work.rpos]);
-			cx->work.rpos += 2;
-		}
-	}
-	else {
-		for (i = 0; i < zrle->palette_size; ++i) {
-			zrle->palette[i] =
-				get16(&cx->work.data[cx->work.rpos]);
-			cx->work.rpos += 2;
-		}
-	}
-
-	return action(cx);
-}
-
-static int
-zrle_palette_24(struct connection *cx, action_t *action)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int i;
-
-	debug(3, "zrle_palette_24\n");
-
-	if (cx->work.wpos < cx->work.rpos + 3 * zrle->palette_size) {
-		--cx->work.rpos;
-		zrle->action = zrle_tile;
-		return 0;
-	}
-
-	for (i = 0; i < zrle->palette_size; ++i) {
-		zrle->palette[i] =
-			zrle->get24(&cx->work.data[cx->work.rpos]);
-		cx->work.rpos += 3;
-	}
-
-	return action(cx);
-}
-
-static int
-zrle_palette_32(struct connection *cx, action_t *action)
-{
-	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	int i;
-
-	debug(3, "zrle_palette_32\n");
-
-	if (cx->work.wpos < cx->work.rpos + 4 * zrle->palette_size) {
+	if (cx->work.wpos < cx->work.rpos + bytes) {
 		--cx->work.rpos;
 		zrle->action = zrle_tile;
 		return 0;
 	}
 
-	if (cx->wire_endian != cx->local_endian) {
-		for (i = 0; i < zrle->palette_size; ++i) {
-			zrle->palette[i] =
-				get32_r(&cx->work.data[cx->work.rpos]);
-			cx->work.rpos += 4;
-		}
-	}
-	else {
-		for (i = 0; i < zrle->palette_size; ++i) {
-			zrle->palette[i] =
-				get32(&cx->work.data[cx->work.rpos]);
-			cx->work.rpos += 4;
-		}
-	}
+	zrle->ops->get_palette(zrle->palette,
+		&cx->work.data[cx->work.rpos], zrle->palette_size);
+	cx->work.rpos += bytes;
 
 	return action(cx);
 }
@@ -1157,31 +487,31 @@ zrle_tile(struct connection *cx)
 		zrle->subencoding = cx->work.data[cx->work.rpos++];
 
 		if (zrle->subencoding == 0) {
-			if (!zrle->raw(cx))
+			if (!zrle_raw(cx))
 				return 0;
 			continue;
 		}
 		if (zrle->subencoding == 1) {
-			if (!zrle->solid(cx))
+			if (!zrle_solid(cx))
 				return 0;
 			continue;
 		}
 		if (zrle->subencoding <= 16) {
 			zrle->palette_size = zrle->subencoding;
-			if (!zrle->parse_palette(cx, zrle->packed_palette))
+			if (!zrle_palette(cx, zrle_packed_palette))
 				return 0;
 			continue;
 		}
 		if (zrle->subencoding == 128) {
 			zrle->rle = 0;
-			if (!zrle->plain_rle(cx))
+			if (!zrle_plain_rle(cx))
 				return 0;
 			continue;
 		}
 		if (zrle->subencoding >= 130) {
 			zrle->rle = 0;
 			zrle->palette_size = zrle->subencoding - 128;
-			if (!zrle->parse_palette(cx, zrle_palette_rle))
+			if (!zrle_palette(cx, zrle_palette_rle))
 				return 0;
 			continue;
 		}
@@ -1230,7 +560,7 @@ zrle_inflate(struct connection *cx)
 		zrle->zstr.avail_out = cx->work.size - cx->work.wpos;
 		zrle->zstr.next_out = &cx->work.data[cx->work.wpos];
 
-		res = inflate(&zrle->zstr, flush);
+		res = metrics_inflate(&cx->metrics, &zrle->zstr, flush);
 		switch (res) {
 		case Z_NEED_DICT:
 		case Z_DATA_ERROR:
@@ -1266,8 +596,6 @@ static int
 zrle_rect(struct connection *cx)
 {
 	struct zrle *zrle = cx->encoding_def[zrle_encoding].priv;
-	ggi_pixel mask;
-	const ggi_pixelformat *pf;
 
 	debug(2, "zrle\n");
 
@@ -1281,72 +609,10 @@ zrle_rect(struct connection *cx)
 	zrle->p.y = cx->y - 64;
 	zrle_next(cx);
 
-	cx->stem_change = zrle_stem_change;
-	cx->stem_change(cx);
-
-	switch (GT_SIZE(cx->wire_mode.graphtype)) {
-	case  8:
-		zrle->raw            = zrle_raw_8;
-		zrle->solid          = zrle_solid_8;
-		zrle->packed_palette = zrle_packed_palette_8;
-		zrle->plain_rle      = zrle_plain_rle_8;
-		zrle->parse_palette  = zrle_palette_8;
-		break;
-	case 16:
-		zrle->raw            = zrle_raw_16;
-		zrle->solid          = zrle_solid_16;
-		zrle->packed_palette = zrle_packed_palette_16;
-		zrle->plain_rle      = zrle_plain_rle_16;
-		zrle->parse_palette  = zrle_palette_16;
-		break;
-	case 32:
-		pf = ggiGetPixelFormat(zrle->stem);
-		mask = pf->red_mask | pf->green_mask | pf->blue_mask;
-		if (!(mask & 0xff000000)) {
-			if (cx->wire_endian != cx->local_endian) {
-				if (cx->wire_endian)
-					zrle->get24 = get24bl_r;
-				else
-					zrle->get24 = get24ll_r;
-			}
-			else {
-				if (cx->wire_endian)
-					zrle->get24 = get24bl;
-				else
-					zrle->get24 = get24ll;
-			}
-			zrle->raw            = zrle_raw_24;
-			zrle->solid          = zrle_solid_24;
-			zrle->plain_rle      = zrle_plain_rle_24;
-			zrle->parse_palette  = zrle_palette_24;
-		}
-		else if (!(mask & 0xff)) {
-			if (cx->wire_endian != cx->local_endian) {
-				if (cx->wire_endian)
-					zrle->get24 = get24bh_r;
-				else
-					zrle->get24 = get24lh_r;
-			}
-			else {
-				if (cx->wire_endian)
-					zrle->get24 = get24bh;
-				else
-					zrle->get24 = get24lh;
-			}
-			zrle->raw            = zrle_raw_24;
-			zrle->solid          = zrle_solid_24;
-			zrle->plain_rle      = zrle_plain_rle_24;
-			zrle->parse_palette  = zrle_palette_24;
-		}
-		else {
-			zrle->raw            = zrle_raw_32;
-			zrle->solid          = zrle_solid_32;
-			zrle->plain_rle      = zrle_plain_rle_32;
-			zrle->parse_palette  = zrle_palette_32;
-		}
-		zrle->packed_palette = zrle_packed_palette_32;
-		break;
-	}
+	cx->stem_change = NULL;
+
+	/* ZRLE sends compact 3-byte cpixels when the color fits. */
+	zrle->ops = cx->cpixel_ops;
 	zrle->action = zrle_tile;
 
 	return zrle_inflate(cx);
@@ -0,0 +1,678 @@
+/*
+******************************************************************************
+
+   VNC viewer engine, many sessions on a few threads.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+extern "C" {
+#include "vnc-metrics.h"
+}
+#include "vnc-engine.h"
+#include "vnc-debug.h"
+
+#define ENGINE_THREADS	64
+#define TICK_NS		1000000000ULL
+#define BALANCE_MIN	0.10	/* of a core, smaller imbalance is ignored */
+#define BALANCE_RATIO	1.25	/* hottest loop against the coldest */
+#define SETTLE_TICKS	5	/* before a moved session may move again */
+
+extern int runGgivncSession(struct vnc_session *session,
+	int argc, char *argv[]);
+extern uint64_t getGgivncSessionDeadline(struct vnc_session *session);
+extern int stepGgivncSession(struct vnc_session *session,
+	struct timeval *tv);
+extern int endGgivncSession(struct vnc_session *session, int result);
+extern int getGgivncSessionFd(struct vnc_session *session,
+	int *want_read, int *want_write);
+extern void setGgivncSessionHosted(struct vnc_session *session,
+	bool hosted);
+extern void setGgivncSessionWake(struct vnc_session *session,
+	void (*wake)(void *data), void *data);
+extern void getGgivncMetrics(struct vnc_session *session,
+	struct vnc_metrics &snapshot);
+
+struct shard;
+
+/* A session on the engine. It is on the list of exactly one loop, or on
+ * the inbox of one, and only that loop steps it. Fields marked as such
+ * are under engine->lock, the rest belong to the loop.
+ */
+struct hosted {
+	struct hosted *next;		/* on the loop or inbox, locked */
+	struct hosted *all_next;	/* locked */
+	struct vnc_session *session;
+	struct shard *shard;		/* locked */
+	struct shard *move_to;		/* locked */
+	int remove;			/* locked */
+	int done;			/* locked */
+	int result;			/* locked */
+	int settle;			/* ticks until it may move, locked */
+	int poll_index;			/* in shard->fds, or -1 */
+
+	uint64_t busy_ns;
+	uint64_t wait_ns;
+	uint64_t bytes_in;
+	uint64_t frames;
+
+	/* Published each tick, locked. */
+	double load;
+	double bytes_per_sec;
+	double frames_per_sec;
+	double max_wait_ms;
+};
+
+struct shard {
+	struct vnc_engine *engine;
+	int index;
+	pthread_t thread;
+	int wake[2];
+	struct hosted *sessions;	/* the loop's own */
+	struct hosted *inbox;		/* locked */
+	int count;			/* sessions and inbox, locked */
+	double load;			/* locked */
+	struct pollfd *fds;		/* wake pipe, then the sessions */
+	int fds_size;
+};
+
+struct vnc_engine {
+	pthread_mutex_t lock;
+	pthread_cond_t ended;
+	int threads;
+	int started;
+	int stopping;
+	uint64_t migrations;
+	struct hosted *all;
+	struct shard shard[ENGINE_THREADS];
+};
+
+static void
+shard_wake(void *data)
+{
+	struct shard *sh = (struct shard *)data;
+	char c = 0;
+
+	/* A full pipe is as good as a written one. */
+	if (write(sh->wake[1], &c, 1) < 0)
+		return;
+}
+
+static void
+unlink_hosted(struct hosted **list, struct hosted *h)
+{
+	for (; *list; list = &(*list)->next) {
+		if (*list == h) {
+			*list = h->next;
+			h->next = NULL;
+			return;
+		}
+	}
+}
+
+/* Under engine->lock. */
+static void
+finish(struct hosted *h, int result)
+{
+	struct vnc_engine *engine = h->shard->engine;
+
+	h->done = 1;
+	h->result = result;
+	h->shard->count--;
+	h->load = 0;
+	h->bytes_per_sec = 0;
+	h->frames_per_sec = 0;
+	pthread_cond_broadcast(&engine->ended);
+}
+
+/* Take in new and moved sessions, and let go of the ones asked to
+ * move or stop. Returns 0 once the engine stops and nothing is left.
+ */
+static int
+shard_sync(struct shard *sh)
+{
+	struct vnc_engine *engine = sh->engine;
+	struct hosted *h, *next;
+	int res;
+
+	pthread_mutex_lock(&engine->lock);
+
+	while ((h = sh->inbox)) {
+		sh->inbox = h->next;
+		h->next = sh->sessions;
+		sh->sessions = h;
+		setGgivncSessionWake(h->session, shard_wake, sh);
+		debug(2, "engine: session %p on loop %d\n",
+			(void *)h->session, sh->index);
+	}
+
+	for (h = sh->sessions; h; h = next) {
+		next = h->next;
+		if (h->remove) {
+			unlink_hosted(&sh->sessions, h);
+			setGgivncSessionWake(h->session, NULL, NULL);
+			pthread_mutex_unlock(&engine->lock);
+			res = endGgivncSession(h->session, 0);
+			pthread_mutex_lock(&engine->lock);
+			finish(h, res);
+			continue;
+		}
+		if (!h->move_to)
+			continue;
+
+		unlink_hosted(&sh->sessions, h);
+		setGgivncSessionWake(h->session, NULL, NULL);
+		sh->count--;
+		sh->load -= h->load;
+		h->shard = h->move_to;
+		h->move_to = NULL;
+		h->shard->count++;
+		h->shard->load += h->load;
+		h->next = h->shard->inbox;
+		h->shard->inbox = h;
+		shard_wake(h->shard);
+		debug(1, "engine: session %p from loop %d to %d\n",
+			(void *)h->session, sh->index, h->shard->index);
+	}
+
+	res = !engine->stopping || sh->sessions || sh->inbox;
+	pthread_mutex_unlock(&engine->lock);
+
+	return res;
+}
+
+/* Move one session from the hottest loop to the coldest when they
+ * are far enough apart, picking the one that evens them out best.
+ * Under engine->lock.
+ */
+static void
+balance(struct vnc_engine *engine)
+{
+	struct shard *hot = &engine->shard[0];
+	struct shard *cold = &engine->shard[0];
+	struct hosted *h, *best = NULL;
+	double gap, best_gap;
+	int i;
+
+	for (i = 1; i < engine->threads; ++i) {
+		if (engine->shard[i].load > hot->load)
+			hot = &engine->shard[i];
+		if (engine->shard[i].load < cold->load)
+			cold = &engine->shard[i];
+	}
+
+	gap = hot->load - cold->load;
+	if (gap < BALANCE_MIN || hot->load < cold->load * BALANCE_RATIO)
+		return;
+	if (hot->count < 2)
+		return;
+
+	/* Moving load l leaves a gap of |gap - 2l|. */
+	best_gap = gap;
+	for (h = engine->all; h; h = h->all_next) {
+		if (h->shard != hot || h->done || h->remove || h->move_to)
+			continue;
+		if (h->settle)
+			continue;
+		if (fabs(gap - 2 * h->load) < best_gap) {
+			best_gap = fabs(gap - 2 * h->load);
+			best = h;
+		}
+	}
+	if (!best)
+		return;
+
+	best->move_to = cold;
+	best->settle = SETTLE_TICKS;
+	++engine->migrations;
+	shard_wake(hot);
+}
+
+/* Publish what the sessions of the loop did since the last tick. */
+static void
+shard_tick(struct shard *sh, uint64_t elapsed)
+{
+	struct vnc_engine *engine = sh->engine;
+	struct vnc_metrics *m;
+	struct hosted *h;
+	double load = 0;
+	double sec = elapsed / 1e9;
+
+	m = (struct vnc_metrics *)malloc(sizeof(*m));
+	if (!m)
+		return;
+
+	for (h = sh->sessions; h; h = h->next) {
+		getGgivncMetrics(h->session, *m);
+
+		pthread_mutex_lock(&engine->lock);
+		/* Smooth over two ticks, so one burst does not move it. */
+		h->load = (h->load + (double)h->busy_ns / elapsed) / 2;
+		h->bytes_per_sec = (m->bytes_in - h->bytes_in) / sec;
+		h->frames_per_sec = (m->frames - h->frames) / sec;
+		h->max_wait_ms = h->wait_ns / 1e6;
+		if (h->settle)
+			--h->settle;
+		pthread_mutex_unlock(&engine->lock);
+
+		load += h->load;
+		h->busy_ns = 0;
+		h->wait_ns = 0;
+		h->bytes_in = m->bytes_in;
+		h->frames = m->frames;
+	}
+
+	free(m);
+
+	pthread_mutex_lock(&engine->lock);
+	sh->load = load;
+	for (h = sh->inbox; h; h = h->next)
+		sh->load += h->load;
+	if (sh->index == 0)
+		balance(engine);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+/* Make room to poll the wake pipe and count sessions. */
+static int
+shard_fds(struct shard *sh, int count)
+{
+	struct pollfd *fds;
+
+	if (count + 1 <= sh->fds_size)
+		return 0;
+	fds = (struct pollfd *)realloc(sh->fds,
+		(count + 1) * 2 * sizeof(*fds));
+	if (!fds)
+		return -1;
+	sh->fds = fds;
+	sh->fds_size = (count + 1) * 2;
+	return 0;
+}
+
+static void *
+shard_main(void *arg)
+{
+	struct shard *sh = (struct shard *)arg;
+	struct vnc_engine *engine = sh->engine;
+	struct hosted *h, *next;
+	struct pollfd wake_only, *fds;
+	struct timeval zero;
+	uint64_t now, start, tick, last, wake, deadline;
+	int fd, nfds, count, want_read, want_write;
+	int res, woken, ready;
+	char buf[64];
+
+	last = metrics_clock();
+	tick = last + TICK_NS;
+
+	while (shard_sync(sh)) {
+		count = 0;
+		for (h = sh->sessions; h; h = h->next)
+			++count;
+		fds = sh->fds;
+		if (shard_fds(sh, count)) {
+			/* Go on with the sessions that fit. */
+			count = sh->fds_size ? sh->fds_size - 1 : 0;
+			if (!fds)
+				fds = &wake_only;
+		}
+		else
+			fds = sh->fds;
+
+		fds[0].fd = sh->wake[0];
+		fds[0].events = POLLIN;
+		nfds = 1;
+		wake = tick;
+
+		for (h = sh->sessions; h; h = h->next) {
+			h->poll_index = -1;
+			deadline = getGgivncSessionDeadline(h->session);
+			if (deadline && deadline < wake)
+				wake = deadline;
+			fd = getGgivncSessionFd(h->session,
+				&want_read, &want_write);
+			if (fd < 0 || (!want_read && !want_write))
+				continue;
+			if (nfds > count)
+				continue;
+			fds[nfds].fd = fd;
+			fds[nfds].events = (want_read ? POLLIN : 0)
+				| (want_write ? POLLOUT : 0);
+			fds[nfds].revents = 0;
+			h->poll_index = nfds++;
+		}
+
+		now = metrics_clock();
+		if (now >= wake)
+			now = wake;
+
+		fds[0].revents = 0;
+		/* Round up, not to spin until a deadline that is close. */
+		res = poll(fds, nfds, (wake - now + 999999) / 1000000);
+		if (res < 0) {
+			for (fd = 0; fd < nfds; ++fd)
+				fds[fd].revents = 0;
+		}
+
+		woken = fds[0].revents & POLLIN;
+		if (woken) {
+			while (read(sh->wake[0], buf, sizeof(buf)) > 0);
+		}
+
+		now = metrics_clock();
+		for (h = sh->sessions; h; h = next) {
+			next = h->next;
+			ready = h->poll_index >= 0 &&
+				fds[h->poll_index].revents;
+			deadline = getGgivncSessionDeadline(h->session);
+			if (!woken && !ready && (!deadline || deadline > now))
+				continue;
+
+			start = metrics_clock();
+			if (start - now > h->wait_ns)
+				h->wait_ns = start - now;
+
+			zero.tv_sec = zero.tv_usec = 0;
+			res = stepGgivncSession(h->session, &zero);
+			h->busy_ns += metrics_clock() - start;
+			if (res == -1)
+				continue;
+
+			debug(1, "engine: session %p ended\n",
+				(void *)h->session);
+			pthread_mutex_lock(&engine->lock);
+			unlink_hosted(&sh->sessions, h);
+			pthread_mutex_unlock(&engine->lock);
+			setGgivncSessionWake(h->session, NULL, NULL);
+			res = endGgivncSession(h->session, res);
+			pthread_mutex_lock(&engine->lock);
+			finish(h, res);
+			pthread_mutex_unlock(&engine->lock);
+		}
+
+		now = metrics_clock();
+		if (now >= tick) {
+			shard_tick(sh, now - last);
+			last = now;
+			tick = now + TICK_NS;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+stop_shards(struct vnc_engine *engine)
+{
+	int i;
+
+	pthread_mutex_lock(&engine->lock);
+	engine->stopping = 1;
+	pthread_mutex_unlock(&engine->lock);
+
+	for (i = 0; i < engine->started; ++i) {
+		shard_wake(&engine->shard[i]);
+		pthread_join(engine->shard[i].thread, NULL);
+	}
+	for (i = 0; i < engine->threads; ++i) {
+		close(engine->shard[i].wake[0]);
+		close(engine->shard[i].wake[1]);
+		free(engine->shard[i].fds);
+	}
+}
+
+struct vnc_engine *
+createGgivncEngine(int threads)
+{
+	struct vnc_engine *engine;
+	struct shard *sh;
+	int i;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > ENGINE_THREADS)
+		threads = ENGINE_THREADS;
+
+	engine = (struct vnc_engine *)calloc(1, sizeof(*engine));
+	if (!engine)
+		return NULL;
+	pthread_mutex_init(&engine->lock, NULL);
+	pthread_cond_init(&engine->ended, NULL);
+
+	for (i = 0; i < threads; ++i) {
+		sh = &engine->shard[i];
+		sh->engine = engine;
+		sh->index = i;
+		if (pipe(sh->wake))
+			break;
+		fcntl(sh->wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(sh->wake[1], F_SETFL, O_NONBLOCK);
+		engine->threads = i + 1;
+	}
+
+	for (i = 0; i < engine->threads; ++i) {
+		if (pthread_create(&engine->shard[i].thread, NULL,
+			shard_main, &engine->shard[i]))
+		{
+			break;
+		}
+		engine->started = i + 1;
+	}
+
+	if (engine->started < threads)
+		debug(1, "engine: %d of %d loops\n", engine->started, threads);
+	if (!engine->started) {
+		stop_shards(engine);
+		pthread_cond_destroy(&engine->ended);
+		pthread_mutex_destroy(&engine->lock);
+		free(engine);
+		return NULL;
+	}
+	/* Only place sessions on running loops. */
+	engine->threads = engine->started;
+
+	return engine;
+}
+
+void
+destroyGgivncEngine(struct vnc_engine *engine)
+{
+	struct hosted *h;
+
+	if (!engine)
+		return;
+
+	pthread_mutex_lock(&engine->lock);
+	for (h = engine->all; h; h = h->all_next)
+		h->remove = 1;
+	pthread_mutex_unlock(&engine->lock);
+
+	stop_shards(engine);
+
+	while ((h = engine->all)) {
+		engine->all = h->all_next;
+		free(h);
+	}
+	pthread_cond_destroy(&engine->ended);
+	pthread_mutex_destroy(&engine->lock);
+	free(engine);
+}
+
+int
+addGgivncEngineSession(struct vnc_engine *engine,
+	struct vnc_session *session, int argc, char *argv[])
+{
+	struct hosted *h;
+	struct shard *sh, *s;
+	int status;
+	int i;
+
+	h = (struct hosted *)calloc(1, sizeof(*h));
+	if (!h)
+		return 2;
+
+	setGgivncSessionHosted(session, true);
+	status = runGgivncSession(session, argc, argv);
+	if (status != -1) {
+		setGgivncSessionHosted(session, false);
+		free(h);
+		return status;
+	}
+	h->session = session;
+
+	pthread_mutex_lock(&engine->lock);
+	sh = &engine->shard[0];
+	for (i = 1; i < engine->threads; ++i) {
+		s = &engine->shard[i];
+		if (s->load < sh->load ||
+			(s->load == sh->load && s->count < sh->count))
+		{
+			sh = s;
+		}
+	}
+	h->shard = sh;
+	h->next = sh->inbox;
+	sh->inbox = h;
+	sh->count++;
+	h->all_next = engine->all;
+	engine->all = h;
+	pthread_mutex_unlock(&engine->lock);
+
+	shard_wake(sh);
+	return 0;
+}
+
+int
+removeGgivncEngineSession(struct vnc_engine *engine,
+	struct vnc_session *session)
+{
+	struct hosted **link;
+	struct hosted *h;
+	int result;
+
+	pthread_mutex_lock(&engine->lock);
+	for (link = &engine->all; *link; link = &(*link)->all_next) {
+		if ((*link)->session == session)
+			break;
+	}
+	h = *link;
+	if (!h) {
+		pthread_mutex_unlock(&engine->lock);
+		return -1;
+	}
+
+	h->remove = 1;
+	while (!h->done) {
+		/* A session on the move is woken by the loop taking it in. */
+		shard_wake(h->shard);
+		pthread_cond_wait(&engine->ended, &engine->lock);
+	}
+
+	/* Unlink by search again, others may have gone meanwhile. */
+	for (link = &engine->all; *link != h; link = &(*link)->all_next);
+	*link = h->all_next;
+	result = h->result;
+	pthread_mutex_unlock(&engine->lock);
+
+	setGgivncSessionHosted(session, false);
+	free(h);
+	return result;
+}
+
+void
+getGgivncEngineStats(struct vnc_engine *engine, struct engine_stats *stats)
+{
+	struct hosted *h;
+	double sum = 0, squares = 0;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&engine->lock);
+	stats->threads = engine->threads;
+	stats->migrations = engine->migrations;
+	for (i = 0; i < engine->threads; ++i)
+		stats->load += engine->shard[i].load;
+	for (h = engine->all; h; h = h->all_next) {
+		if (h->done)
+			continue;
+		stats->sessions++;
+		stats->bytes_per_sec += h->bytes_per_sec;
+		stats->frames_per_sec += h->frames_per_sec;
+		sum += h->frames_per_sec;
+		squares += h->frames_per_sec * h->frames_per_sec;
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	/* (sum x)^2 / (n sum x^2), 1 when all get the same, 1/n when
+	 * one gets everything.
+	 */
+	stats->fairness = 1;
+	if (squares > 0)
+		stats->fairness = sum * sum / (stats->sessions * squares);
+
+	pool_stats(&stats->pool);
+}
+
+int
+getGgivncEngineSessionStats(struct vnc_engine *engine,
+	struct vnc_session *session, struct engine_session_stats *stats)
+{
+	struct hosted *h;
+
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&engine->lock);
+	for (h = engine->all; h; h = h->all_next) {
+		if (h->session == session)
+			break;
+	}
+	if (h) {
+		stats->thread = h->shard->index;
+		stats->running = !h->done;
+		stats->load = h->load;
+		stats->bytes_per_sec = h->bytes_per_sec;
+		stats->frames_per_sec = h->frames_per_sec;
+		stats->max_wait_ms = h->max_wait_ms;
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	return h ? 0 : -1;
+}
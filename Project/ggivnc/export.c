@@ -0,0 +1,522 @@
+/*
+******************************************************************************
+
+   VNC viewer frame export to shared memory.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create */
+#endif
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#endif
+
+#include "vnc-export.h"
+#include "vnc-debug.h"
+
+#define PAGE_ROUND(n)	(((n) + 4095) & ~(uint64_t)4095)
+#define HEADER_SIZE	PAGE_ROUND(sizeof(struct export_header))
+#define MAX_SLOTS	64
+
+/* Damage of one published frame, to bring its slot up to date when the
+ * slot comes around again.
+ */
+struct damage {
+	int boxes;
+	struct export_rect box[EXPORT_BOXES];
+};
+
+struct frame_export {
+	char *name;
+	int fd;
+	int event_fd;
+	int writable;
+	uint8_t *base;
+	uint64_t size;
+
+	/* Producer */
+	int slots;
+	int width, height, stride;
+	struct damage *damage;
+
+	/* Consumer */
+	uint32_t generation;
+};
+
+static inline struct export_header *
+header(struct frame_export *ex)
+{
+	return (struct export_header *)ex->base;
+}
+
+static inline struct export_slot *
+slot_at(struct frame_export *ex, uint64_t seq)
+{
+	struct export_header *hdr = header(ex);
+
+	return (struct export_slot *)(ex->base + HEADER_SIZE +
+		seq % hdr->slots * hdr->slot_size);
+}
+
+static void
+futex_wake(uint32_t *word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+	(void)word;
+#endif
+}
+
+static int
+map(struct frame_export *ex, uint64_t size)
+{
+	void *base;
+
+	base = mmap(NULL, size, PROT_READ | (ex->writable ? PROT_WRITE : 0),
+		MAP_SHARED, ex->fd, 0);
+	if (base == MAP_FAILED) {
+		debug(1, "export: mmap %s\n", strerror(errno));
+		return -1;
+	}
+	if (ex->base)
+		munmap(ex->base, ex->size);
+	ex->base = base;
+	ex->size = size;
+	return 0;
+}
+
+struct frame_export *
+export_create(const char *name, int slots)
+{
+	struct frame_export *ex;
+
+	ex = calloc(1, sizeof(*ex));
+	if (!ex)
+		return NULL;
+	ex->fd = -1;
+	ex->event_fd = -1;
+	ex->writable = 1;
+
+	if (slots < 2)
+		slots = 2;
+	if (slots > MAX_SLOTS)
+		slots = MAX_SLOTS;
+	ex->slots = slots;
+	ex->damage = calloc(slots, sizeof(*ex->damage));
+	if (!ex->damage)
+		goto err;
+
+	if (name) {
+		ex->name = strdup(name);
+		if (!ex->name)
+			goto err;
+		ex->fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	}
+	else {
+#ifdef MFD_CLOEXEC
+		ex->fd = memfd_create("ggivnc-frames", MFD_CLOEXEC);
+#else
+		errno = ENOSYS;
+#endif
+	}
+	if (ex->fd == -1) {
+		debug(0, "export: cannot create %s: %s\n",
+			name ? name : "memfd", strerror(errno));
+		goto err;
+	}
+
+#ifdef __linux__
+	ex->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+
+	return ex;
+
+err:
+	export_destroy(ex);
+	return NULL;
+}
+
+/* Lay out the slots for frames of the given size, growing the memory
+ * if needed. Every slot then needs a full copy.
+ */
+static int
+layout(struct frame_export *ex, int width, int height, int stride)
+{
+	struct export_header *hdr;
+	uint64_t slot_size;
+	uint64_t size;
+	int i;
+
+	slot_size = PAGE_ROUND(EXPORT_SLOT_HEADER + (uint64_t)stride * height);
+	size = HEADER_SIZE + ex->slots * slot_size;
+
+	if (!ex->base || size > ex->size) {
+		if (ftruncate(ex->fd, size)) {
+			debug(0, "export: cannot grow to %llu bytes: %s\n",
+				(unsigned long long)size, strerror(errno));
+			return -1;
+		}
+		if (map(ex, size))
+			return -1;
+	}
+
+	hdr = header(ex);
+	if (!hdr->magic) {
+		hdr->version = EXPORT_VERSION;
+		hdr->slots = ex->slots;
+	}
+	__atomic_store_n(&hdr->generation, hdr->generation | 1,
+		__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	hdr->slot_size = slot_size;
+	hdr->size = ex->size;
+	for (i = 0; i < ex->slots; ++i) {
+		struct export_slot *slot = (struct export_slot *)
+			(ex->base + HEADER_SIZE + i * slot_size);
+		slot->version = 0;
+		slot->seq = 0;
+		ex->damage[i].boxes = -1;
+	}
+	ex->width = width;
+	ex->height = height;
+	ex->stride = stride;
+
+	__atomic_store_n(&hdr->generation, hdr->generation + 1,
+		__ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->magic, EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+	debug(1, "export: %d slots of %dx%d, %llu bytes\n",
+		ex->slots, width, height, (unsigned long long)ex->size);
+	return 0;
+}
+
+static void
+copy_box(struct frame_export *ex, uint8_t *dst, const uint8_t *src,
+	const struct export_rect *box, int bpp)
+{
+	int x = box->x, y = box->y, w = box->width, h = box->height;
+	int offset;
+
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > ex->width)
+		w = ex->width - x;
+	if (y + h > ex->height)
+		h = ex->height - y;
+	if (w <= 0 || h <= 0)
+		return;
+
+	offset = y * ex->stride + x * bpp;
+	dst += offset;
+	src += offset;
+	while (h--) {
+		memcpy(dst, src, w * bpp);
+		dst += ex->stride;
+		src += ex->stride;
+	}
+}
+
+int
+export_publish(struct frame_export *ex, const uint8_t *buffer,
+	int width, int height, int stride, int bpp, const char *format,
+	const struct export_rect *box, int boxes, uint64_t timestamp)
+{
+	struct export_header *hdr;
+	struct export_slot *slot;
+	struct damage *damage;
+	uint8_t *dst;
+	uint64_t seq, version;
+	uint64_t one = 1;
+	int full;
+	int i, j;
+
+	if (!buffer || stride <= 0)
+		return -1;
+	if (!ex->base || width != ex->width || height != ex->height ||
+		stride != ex->stride)
+	{
+		if (layout(ex, width, height, stride))
+			return -1;
+	}
+
+	hdr = header(ex);
+	seq = hdr->seq + 1;
+	slot = slot_at(ex, seq);
+	dst = (uint8_t *)slot + EXPORT_SLOT_HEADER;
+
+	damage = &ex->damage[seq % ex->slots];
+	if (boxes < 0 || boxes > EXPORT_BOXES)
+		damage->boxes = -1;
+	else {
+		damage->boxes = boxes;
+		memcpy(damage->box, box, boxes * sizeof(*box));
+	}
+
+	version = slot->version;
+	__atomic_store_n(&slot->version, version + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* The slot last held frame seq - slots, so it misses what changed
+	 * in the frames since, which is what the damage ring remembers.
+	 */
+	full = !slot->seq;
+	for (i = 0; i < ex->slots && !full; ++i)
+		full = ex->damage[i].boxes < 0;
+	if (full)
+		memcpy(dst, buffer, (size_t)stride * height);
+	else {
+		for (i = 0; i < ex->slots; ++i) {
+			for (j = 0; j < ex->damage[i].boxes; ++j)
+				copy_box(ex, dst, buffer,
+					&ex->damage[i].box[j], bpp);
+		}
+	}
+
+	slot->seq = seq;
+	slot->timestamp = timestamp;
+	slot->width = width;
+	slot->height = height;
+	slot->stride = stride;
+	slot->bpp = bpp;
+	strncpy(slot->format, format, sizeof(slot->format) - 1);
+	slot->format[sizeof(slot->format) - 1] = '\0';
+	slot->boxes = damage->boxes;
+	if (damage->boxes > 0)
+		memcpy(slot->box, damage->box,
+			damage->boxes * sizeof(*damage->box));
+
+	__atomic_store_n(&slot->version, version + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->futex, (uint32_t)seq, __ATOMIC_RELEASE);
+	futex_wake(&hdr->futex);
+	if (ex->event_fd != -1 && write(ex->event_fd, &one, sizeof(one)) < 0)
+		debug(3, "export: eventfd full\n");
+
+	return 0;
+}
+
+int
+export_fd(struct frame_export *ex)
+{
+	return ex->fd;
+}
+
+int
+export_event_fd(struct frame_export *ex)
+{
+	return ex->event_fd;
+}
+
+void
+export_destroy(struct frame_export *ex)
+{
+	if (!ex)
+		return;
+
+	if (ex->base && ex->writable) {
+		__atomic_store_n(&header(ex)->closed, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&header(ex)->futex, 1, __ATOMIC_RELEASE);
+		futex_wake(&header(ex)->futex);
+	}
+	if (ex->base)
+		munmap(ex->base, ex->size);
+	if (ex->fd != -1)
+		close(ex->fd);
+	if (ex->event_fd != -1)
+		close(ex->event_fd);
+	if (ex->name && ex->writable)
+		shm_unlink(ex->name);
+	free(ex->name);
+	free(ex->damage);
+	free(ex);
+}
+
+char *
+export_shm_name(const char *name, size_t len)
+{
+	int slash = len && *name == '/';
+	char *shm_name = malloc(len + 2);
+
+	if (!shm_name)
+		return NULL;
+	shm_name[0] = '/';
+	memcpy(shm_name + 1, name + slash, len - slash);
+	shm_name[1 + len - slash] = '\0';
+	return shm_name;
+}
+
+struct frame_export *
+export_attach(const char *name, int fd)
+{
+	struct frame_export *ex;
+	struct stat st;
+	char *shm_name;
+
+	ex = calloc(1, sizeof(*ex));
+	if (!ex)
+		return NULL;
+	ex->event_fd = -1;
+	ex->fd = -1;
+	if (name) {
+		shm_name = export_shm_name(name, strlen(name));
+		if (!shm_name)
+			goto err;
+		ex->fd = shm_open(shm_name, O_RDONLY, 0);
+		free(shm_name);
+	}
+	else
+		ex->fd = fd;
+	if (ex->fd == -1)
+		goto err;
+
+	if (fstat(ex->fd, &st) || st.st_size < (off_t)HEADER_SIZE) {
+		debug(1, "export: nothing published yet\n");
+		goto err;
+	}
+	if (map(ex, st.st_size))
+		goto err;
+	if (__atomic_load_n(&header(ex)->magic, __ATOMIC_ACQUIRE)
+			!= EXPORT_MAGIC ||
+		header(ex)->version != EXPORT_VERSION)
+	{
+		debug(1, "export: not a frame export\n");
+		goto err;
+	}
+
+	return ex;
+
+err:
+	if (ex->base)
+		munmap(ex->base, ex->size);
+	if (name && ex->fd != -1)
+		close(ex->fd);
+	free(ex);
+	return NULL;
+}
+
+void
+export_detach(struct frame_export *ex)
+{
+	export_destroy(ex);
+}
+
+uint64_t
+export_wait(struct frame_export *ex, uint64_t seq, int timeout_ms)
+{
+	struct export_header *hdr = header(ex);
+	uint64_t now;
+	uint32_t word;
+#ifdef __linux__
+	struct timespec ts;
+#endif
+
+	for (;;) {
+		word = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+			return 0;
+		now = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		if (now != seq || !timeout_ms)
+			return now;
+
+#ifdef __linux__
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+		if (syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, word,
+			timeout_ms < 0 ? NULL : &ts, NULL, 0) &&
+			errno == ETIMEDOUT)
+		{
+			timeout_ms = 0;
+		}
+#else
+		(void)word;
+		usleep(1000);
+		if (timeout_ms > 0)
+			--timeout_ms;
+#endif
+	}
+}
+
+const struct export_slot *
+export_slot(struct frame_export *ex, uint64_t seq, uint64_t *version)
+{
+	struct export_header *hdr = header(ex);
+	const struct export_slot *slot;
+	uint64_t last;
+
+	ex->generation = __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+	if (ex->generation & 1)
+		return NULL;
+	if (hdr->size > ex->size) {
+		if (map(ex, hdr->size))
+			return NULL;
+		hdr = header(ex);
+	}
+
+	last = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+	if (!seq || seq > last || last - seq >= hdr->slots)
+		return NULL;
+
+	slot = slot_at(ex, seq);
+	*version = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+	if ((*version & 1) || slot->seq != seq)
+		return NULL;
+	return slot;
+}
+
+int
+export_still_valid(struct frame_export *ex,
+	const struct export_slot *slot, uint64_t version)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->version, __ATOMIC_RELAXED) == version &&
+		__atomic_load_n(&header(ex)->generation, __ATOMIC_RELAXED)
+			== ex->generation;
+}
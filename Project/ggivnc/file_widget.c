@@ -28,11 +28,24 @@
 ******************************************************************************
 */
 
+#if defined __linux__ && !defined _GNU_SOURCE
+#define _GNU_SOURCE /* fallocate */
+#endif
+
 #include "config.h"
 
+#include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include <ggi/gii.h>
 #include <ggi/gii-events.h>
 #include <ggi/gii-keyboard.h>
@@ -49,6 +62,15 @@
 
 #define DIRECTORY 1
 
+/* Chunks kept in flight when no --file-window is given, and the
+ * limits of the adaptive chunk size.
+ */
+#define FILE_WINDOW        4
+#define FILE_WINDOW_MAX    64
+#define FILE_CHUNK_INITIAL 32768
+#define FILE_CHUNK_MIN     4096
+#define FILE_CHUNK_MAX     262144
+
 struct file_entry {
 	int flags;
 	char *filename;
@@ -80,6 +102,39 @@ struct file_transfer {
 	FILE *upload;
 	int wait_remote;
 	int done;
+
+	/* Windowed transfer state (v2 protocol only). The server answers
+	 * download requests and upload data messages in order, so the
+	 * oldest outstanding chunk is always found at head.
+	 */
+	int window;
+	int in_flight;
+	int head;
+	int eof;
+	uint32_t chunk;
+	uint64_t rtt_min;
+	uint64_t sent[FILE_WINDOW_MAX];
+	uint32_t sent_size[FILE_WINDOW_MAX];
+
+	/* Upload source mapped in place of reading it through stdio. */
+	const uint8_t *map;
+	size_t map_size;
+	size_t map_pos;
+
+	/* Set when the server has answered the compression support
+	 * request with a yes. Chunks are then deflated in both
+	 * directions, each direction with one stream for the whole
+	 * connection that is flushed (Z_SYNC_FLUSH) after every chunk.
+	 */
+	int compress;
+#ifdef HAVE_ZLIB
+	int compress_asked;
+	int inflating;
+	int deflating;
+	z_stream inflater;
+	z_stream deflater;
+	struct buffer zbuf;
+#endif
 };
 
 static int file_v1_upload_resync(struct connection *cx);
@@ -394,6 +449,53 @@ file_v1_list_data_dummy(struct connection *cx)
 	return 1;
 }
 
+/* Reserve the whole file up front, so that the file system can lay it
+ * out in one go instead of growing it chunk by chunk. The size is kept,
+ * a short download must not end up with a tail of zeros.
+ */
+static void
+file_download_preallocate(struct file_transfer *ft)
+{
+#if defined __linux__ && defined FALLOC_FL_KEEP_SIZE
+	if (!ft->download || !ft->total)
+		return;
+
+	if (fallocate(fileno(ft->download), FALLOC_FL_KEEP_SIZE, 0, ft->total))
+		debug(2, "fallocate: %s\n", strerror(errno));
+#endif
+}
+
+/* Hand back whatever was preallocated beyond what was written, be the
+ * download complete, short, failed or cancelled.
+ */
+static void
+file_download_trim(struct file_transfer *ft)
+{
+#if defined __linux__ && defined FALLOC_FL_PUNCH_HOLE
+	struct stat st;
+
+	if (!ft->total)
+		return;
+	fflush(ft->download);
+	if (fstat(fileno(ft->download), &st) || st.st_size >= ft->total)
+		return;
+	if (fallocate(fileno(ft->download),
+		FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		st.st_size, ft->total - st.st_size))
+	{
+		debug(2, "fallocate: %s\n", strerror(errno));
+	}
+#endif
+}
+
+static void
+file_download_close(struct file_transfer *ft)
+{
+	file_download_trim(ft);
+	fclose(ft->download);
+	ft->download = NULL;
+}
+
 static int
 file_v1_download_data(struct connection *cx)
 {
@@ -440,8 +542,7 @@ file_v1_download_data(struct connection *cx)
 		if (ft->download) {
 			set_feedback(cx, "Download complete");
 
-			fclose(ft->download);
-			ft->download = NULL;
+			file_download_close(ft);
 		}
 
 		cx->encoding_def[tight_file].action = vnc_unexpected;
@@ -477,8 +578,7 @@ file_v1_download_data(struct connection *cx)
 			if (!ferror(ft->download))
 				continue;
 			set_feedback(cx, "Error writing to download file");
-			fclose(ft->download);
-			ft->download = NULL;
+			file_download_close(ft);
 		}
 	}
 
@@ -514,8 +614,7 @@ file_v1_download_failed(struct connection *cx)
 
 	if (ft->download) {
 		set_feedback(cx, "Download failed");
-		fclose(ft->download);
-		ft->download = NULL;
+		file_download_close(ft);
 	}
 
 	cx->encoding_def[tight_file].action = vnc_unexpected;
@@ -562,8 +661,7 @@ file_v1_last_request_failed(struct connection *cx)
 
 	if (ft->download) {
 		set_feedback(cx, "Request failed");
-		fclose(ft->download);
-		ft->download = NULL;
+		file_download_close(ft);
 	}
 
 	cx->encoding_def[tight_file].action = vnc_unexpected;
@@ -1030,15 +1128,181 @@ file_list_reply(struct connection *cx)
 	return 1;
 }
 
+#ifdef HAVE_ZLIB
+static int
+file_compression_reply(struct connection *cx)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+	uint32_t len;
+
+	debug(2, "file_compression_reply\n");
+
+	if (cx->input.wpos < cx->input.rpos + 4)
+		return vnc_unexpected(cx);
+
+	switch (get32_hilo(&cx->input.data[cx->input.rpos])) {
+	case 0xfc000101:
+		if (cx->input.wpos < cx->input.rpos + 5)
+			return 0;
+		ft->compress = cx->input.data[cx->input.rpos + 4] == 1;
+		cx->input.rpos += 5;
+		break;
+	case 0xfc000119:
+		if (cx->input.wpos < cx->input.rpos + 8)
+			return 0;
+		len = get32_hilo(&cx->input.data[cx->input.rpos + 4]);
+		if (cx->input.wpos < cx->input.rpos + 8 + len)
+			return 0;
+		ft->compress = 0;
+		cx->input.rpos += 8 + len;
+		break;
+	default:
+		return vnc_unexpected(cx);
+	}
+
+	debug(1, "file transfer compression %ssupported\n",
+		ft->compress ? "" : "not ");
+
+	cx->encoding_def[tight_file].action = file_list_reply;
+
+	remove_dead_data(&cx->input);
+	cx->action = vnc_wait;
+	return 1;
+}
+
+static int
+file_compression_request(struct connection *cx)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+	uint8_t fcr[4];
+
+	insert32_hilo(fcr, 0xfc000100);
+
+	if (safe_write(cx, fcr, sizeof(fcr))) {
+		debug(1, "write failed\n");
+		close_connection(cx, -1);
+		return -1;
+	}
+
+	ft->compress_asked = 1;
+	return 0;
+}
+
+/* Inflate one chunk of len bytes that should expand to raw bytes. */
+static uint8_t *
+file_inflate(struct connection *cx, uint8_t *src, uint32_t len, uint32_t raw)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+	int res;
+
+	if (buffer_reserve(&ft->zbuf, raw + 1)) {
+		debug(1, "out of memory\n");
+		return NULL;
+	}
+
+	if (!ft->inflating) {
+		memset(&ft->inflater, 0, sizeof(ft->inflater));
+		if (inflateInit(&ft->inflater) != Z_OK) {
+			debug(1, "inflateInit failed\n");
+			return NULL;
+		}
+		ft->inflating = 1;
+	}
+
+	ft->inflater.next_in = src;
+	ft->inflater.avail_in = len;
+	ft->inflater.next_out = ft->zbuf.data;
+	ft->inflater.avail_out = raw + 1;
+
+	res = inflate(&ft->inflater, Z_SYNC_FLUSH);
+	switch (res) {
+	case Z_OK:
+	case Z_STREAM_END:
+	case Z_BUF_ERROR:
+		break;
+	default:
+		debug(1, "file inflate error %d\n", res);
+		return NULL;
+	}
+
+	if (ft->inflater.avail_in || ft->inflater.avail_out != 1) {
+		debug(1, "file chunk inflated to %u bytes, expected %u\n",
+			(unsigned)(raw + 1 - ft->inflater.avail_out),
+			(unsigned)raw);
+		return NULL;
+	}
+
+	return ft->zbuf.data;
+}
+
+/* Deflate one chunk, leaving the result in zbuf and its size in len. */
+static int
+file_deflate(struct connection *cx,
+	const uint8_t *src, uint32_t raw, uint32_t *len)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+	int size = raw + raw / 1000 + 64;
+	int used = 0;
+	int res;
+
+	if (!ft->deflating) {
+		memset(&ft->deflater, 0, sizeof(ft->deflater));
+		/* Favor speed, the upload must not become CPU bound on
+		 * the small devices we pull from and push to.
+		 */
+		if (deflateInit(&ft->deflater, Z_BEST_SPEED) != Z_OK) {
+			debug(1, "deflateInit failed\n");
+			return -1;
+		}
+		ft->deflating = 1;
+	}
+
+	ft->deflater.next_in = (Bytef *)src;
+	ft->deflater.avail_in = raw;
+
+	for (;;) {
+		if (buffer_reserve(&ft->zbuf, size)) {
+			debug(1, "out of memory\n");
+			return -1;
+		}
+		ft->deflater.next_out = ft->zbuf.data + used;
+		ft->deflater.avail_out = ft->zbuf.size - used;
+
+		res = deflate(&ft->deflater, Z_SYNC_FLUSH);
+		if (res != Z_OK && res != Z_BUF_ERROR) {
+			debug(1, "file deflate error %d\n", res);
+			return -1;
+		}
+
+		used = ft->zbuf.size - ft->deflater.avail_out;
+		if (ft->deflater.avail_out)
+			break;
+		size = ft->zbuf.size * 2;
+	}
+
+	*len = used;
+	return 0;
+}
+#endif /* HAVE_ZLIB */
+
 static int
 file_list_request(struct connection *cx, const char *dir)
 {
 	uint8_t *flr;
 	size_t len;
+#ifdef HAVE_ZLIB
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+	int ask = !ft->compress_asked;
+#endif
 
 	if (cx->file_transfer == 1)
 		return file_v1_list_request(cx, dir);
 
+#ifdef HAVE_ZLIB
+	if (ask && file_compression_request(cx))
+		return -1;
+#endif
+
 	len = strlen(dir);
 	flr = malloc(9 + len);
 	if (!flr) {
@@ -1062,20 +1326,104 @@ file_list_request(struct connection *cx, const char *dir)
 	free(flr);
 
 	cx->encoding_def[tight_file].action = file_list_reply;
+#ifdef HAVE_ZLIB
+	/* The compression reply comes in ahead of the list reply. */
+	if (ask)
+		cx->encoding_def[tight_file].action = file_compression_reply;
+#endif
 
 	return 0;
 }
 
+static void
+progress_update(struct connection *cx, uint32_t bytes)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
+	if (ft->feedback && ft->total) {
+		ggi_widget_t progress;
+		progress = ggiWidgetGetChild(ft->feedback, 0);
+		while (ggiWidgetGetChild(progress, 0))
+			progress = ggiWidgetGetChild(progress, 0);
+		GWT_SET_ICHANGED(progress);
+	}
+	ft->current += bytes;
+	if (ft->total)
+		ft->progress = (double)ft->current / ft->total;
+}
+
+static void
+window_start(struct connection *cx)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
+	ft->window = cx->file_window ? cx->file_window : FILE_WINDOW;
+	ft->in_flight = 0;
+	ft->head = 0;
+	ft->eof = 0;
+	ft->chunk = FILE_CHUNK_INITIAL;
+	ft->rtt_min = 0;
+}
+
+static void
+window_sent(struct file_transfer *ft, uint32_t size)
+{
+	int slot = (ft->head + ft->in_flight) % FILE_WINDOW_MAX;
+
+	ft->sent[slot] = metrics_clock();
+	ft->sent_size[slot] = size;
+	++ft->in_flight;
+}
+
+/* Retire the oldest chunk in flight and adapt the chunk size. With the
+ * window full, a reply takes about window * chunk / rate, so scaling
+ * the chunk by 2 * rtt_min / rtt settles where the transfer keeps
+ * about one minimal round trip worth of data queued. That is enough to
+ * fill the pipe without making framebuffer updates that share the
+ * connection wait behind a deep queue.
+ */
+static void
+window_done(struct file_transfer *ft)
+{
+	uint64_t rtt;
+	uint64_t target;
+
+	if (!ft->in_flight)
+		return;
+
+	rtt = metrics_clock() - ft->sent[ft->head];
+	if (!rtt)
+		rtt = 1;
+	if (!ft->rtt_min || rtt < ft->rtt_min)
+		ft->rtt_min = rtt;
+
+	target = (uint64_t)ft->sent_size[ft->head] * 2 * ft->rtt_min / rtt;
+	target = (3 * (uint64_t)ft->chunk + target) / 4;
+	if (target < FILE_CHUNK_MIN)
+		target = FILE_CHUNK_MIN;
+	if (target > FILE_CHUNK_MAX)
+		target = FILE_CHUNK_MAX;
+	ft->chunk = target & ~(FILE_CHUNK_MIN - 1);
+
+	debug(3, "chunk rtt %u us, min %u us, next chunk %u\n",
+		(unsigned)(rtt / 1000), (unsigned)(ft->rtt_min / 1000),
+		(unsigned)ft->chunk);
+
+	ft->head = (ft->head + 1) % FILE_WINDOW_MAX;
+	--ft->in_flight;
+}
+
 static int
 file_download_data_request(struct connection *cx)
 {
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
 	uint8_t fddr[9];
 
-	debug(2, "file_download_start_reply\n");
+	debug(2, "file_download_data_request %u\n", (unsigned)ft->chunk);
 
 	insert32_hilo(fddr, 0xfc00010e);
-	fddr[4] = 0;
-	insert32_hilo(&fddr[5], 32768);
+	fddr[4] = ft->compress;
+	insert32_hilo(&fddr[5], ft->chunk);
 
 	if (safe_write(cx, fddr, 9)) {
 		debug(1, "write failed\n");
@@ -1083,16 +1431,52 @@ file_download_data_request(struct connection *cx)
 		return -1;
 	}
 
+	window_sent(ft, ft->chunk);
 	cx->encoding_def[tight_file].action = file_download_data;
 	return 0;
 }
 
+/* Keep the window full of data requests until the server reports the
+ * end of the file.
+ */
+static int
+file_download_fill(struct connection *cx)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
+	while (ft->download && !ft->eof && ft->in_flight < ft->window) {
+		if (file_download_data_request(cx))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The transfer is over once the replies to all requests that were
+ * still in flight when it ended have been swallowed.
+ */
+static void
+file_download_drained(struct connection *cx)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
+	if (ft->in_flight)
+		return;
+
+	cx->encoding_def[tight_file].action = vnc_unexpected;
+	ft->wait_remote = 0;
+}
+
 static int
 file_download_start_reply(struct connection *cx)
 {
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
 	debug(2, "file_download_start_reply\n");
 
-	if (file_download_data_request(cx))
+	file_download_preallocate(ft);
+	window_start(cx);
+	if (file_download_fill(cx))
 		return -1;
 
 	cx->input.rpos += 4;
@@ -1122,31 +1506,35 @@ file_download_data_reply(struct connection *cx)
 	debug(2, "compression %0x, len %d, raw-len %d\n",
 		compression, len, raw);
 
-	if (compression)
+	if (compression && !ft->compress)
 		return close_connection(cx, -1);
-	if (len != raw)
+	if (!compression && len != raw)
 		return close_connection(cx, -1);
 
-	if (cx->input.wpos < cx->input.rpos + 13 + raw)
+	if (cx->input.wpos < cx->input.rpos + 13 + len)
 		return 0;
 
-	debug(2, "got file download data (raw %d)\n", raw);
+	debug(2, "got file download data (len %d, raw %d)\n", len, raw);
 
-	cx->input.rpos += 13 + raw;
+	window_done(ft);
+
+	data = &cx->input.data[cx->input.rpos + 13];
+	cx->input.rpos += 13 + len;
+
+#ifdef HAVE_ZLIB
+	/* Inflate even when the data is dropped, to keep the stream
+	 * in step with the server.
+	 */
+	if (compression) {
+		data = file_inflate(cx, data, len, raw);
+		if (!data)
+			return close_connection(cx, -1);
+	}
+#endif
 
 	if (ft->download) {
-		if (ft->feedback && ft->total) {
-			ggi_widget_t progress;
-			progress = ggiWidgetGetChild(ft->feedback, 0);
-			while (ggiWidgetGetChild(progress, 0))
-				progress = ggiWidgetGetChild(progress, 0);
-			GWT_SET_ICHANGED(progress);
-		}
-		ft->current += raw;
-		if (ft->total)
-			ft->progress = (double)ft->current / ft->total;
+		progress_update(cx, raw);
 
-		data = &cx->input.data[13];
 		while (raw) {
 			int res = fwrite(data, 1, raw, ft->download);
 			if (res == raw)
@@ -1156,15 +1544,14 @@ file_download_data_reply(struct connection *cx)
 			if (!ferror(ft->download))
 				continue;
 			set_feedback(cx, "Error writing to download file");
-			fclose(ft->download);
-			ft->download = NULL;
+			file_download_close(ft);
 			break;
 		}
-		
 	}
 
-	if (file_download_data_request(cx))
+	if (file_download_fill(cx))
 		return -1;
+	file_download_drained(cx);
 
 	remove_dead_data(&cx->input);
 	cx->action = vnc_wait;
@@ -1204,15 +1591,19 @@ file_download_data_end(struct connection *cx)
 	debug(1, "got file download end (mod %u), %s",
 		(int)mod, t >= 0 ? asctime(gmtime(&t)) : "neg date\n");
 
+	window_done(ft);
+	ft->eof = 1;
+
 	if (ft->download) {
 		set_feedback(cx, "Download complete");
 
-		fclose(ft->download);
-		ft->download = NULL;
+		file_download_close(ft);
 	}
 
-	cx->encoding_def[tight_file].action = vnc_unexpected;
-	ft->wait_remote = 0;
+	/* Requests sent past the end of the file are answered with
+	 * failures, keep listening until they are all in.
+	 */
+	file_download_drained(cx);
 
 	cx->input.rpos += 13;
 	remove_dead_data(&cx->input);
@@ -1244,14 +1635,15 @@ file_download_failed(struct connection *cx)
 	free(reason);
 	reason = NULL;
 
+	window_done(ft);
+	ft->eof = 1;
+
 	if (ft->download) {
 		set_feedback(cx, "Download failed");
-		fclose(ft->download);
-		ft->download = NULL;
+		file_download_close(ft);
 	}
 
-	cx->encoding_def[tight_file].action = vnc_unexpected;
-	ft->wait_remote = 0;
+	file_download_drained(cx);
 
 	cx->input.rpos += 8 + len;
 	remove_dead_data(&cx->input);
@@ -1401,9 +1793,6 @@ file_upload_end_request(struct connection *cx, time_t t)
 	uint32_t mod = t;
 #endif
 
-	if (!ft->upload)
-		return 0;
-
 	insert32_hilo(buf, 0xfc00010a);
 	insert16_hilo(&buf[4], 0);
 #ifdef GG_HAVE_INT64
@@ -1423,64 +1812,185 @@ file_upload_end_request(struct connection *cx, time_t t)
 		return -1;
 	}
 
+	ft->eof = 1;
+	window_sent(ft, 0);
 	cx->encoding_def[tight_file].action = file_upload_data;
 
 	return 0;
 }
 
+/* Map the upload source, chunks are then sent straight from the page
+ * cache. Falls back to stdio when the file can't be mapped.
+ */
+static void
+file_upload_map(struct file_transfer *ft)
+{
+#ifndef _WIN32
+	struct stat st;
+	void *map;
+
+	ft->map = NULL;
+	ft->map_pos = 0;
+
+	if (fstat(fileno(ft->upload), &st))
+		return;
+	if (!S_ISREG(st.st_mode) || st.st_size <= 0)
+		return;
+	if ((uint64_t)st.st_size > (size_t)-1)
+		return;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		fileno(ft->upload), 0);
+	if (map == MAP_FAILED) {
+		debug(2, "mmap: %s\n", strerror(errno));
+		return;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	ft->map = map;
+	ft->map_size = st.st_size;
+#endif
+}
+
+static void
+file_upload_close(struct file_transfer *ft)
+{
+#ifndef _WIN32
+	if (ft->map) {
+		munmap((void *)ft->map, ft->map_size);
+		ft->map = NULL;
+	}
+#endif
+	fclose(ft->upload);
+	ft->upload = NULL;
+}
+
 static int
 file_upload_data_request(struct connection *cx)
 {
 	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
-	uint8_t buf[13 + 4096];
+	uint8_t head[13];
+	uint8_t *buf = NULL;
+	const uint8_t *data;
+	uint32_t len;
 	size_t res;
 
-	if (!ft->upload)
-		return 0;
-
-	res = fread(buf + 13, 1, sizeof(buf) - 13, ft->upload);
-	if (ferror(ft->upload)) {
-		fclose(ft->upload);
-		ft->upload = NULL;
-		set_feedback(cx, "Upload failed with read error");
-		return file_upload_end_request(cx, time(NULL));
+	if (ft->map) {
+		res = ft->map_size - ft->map_pos;
+		if (res > ft->chunk)
+			res = ft->chunk;
+		data = ft->map + ft->map_pos;
+		ft->map_pos += res;
+	}
+	else {
+		buf = malloc(ft->chunk);
+		if (!buf) {
+			debug(1, "out of memory\n");
+			close_connection(cx, -1);
+			return -1;
+		}
+		res = fread(buf, 1, ft->chunk, ft->upload);
+		if (ferror(ft->upload)) {
+			free(buf);
+			file_upload_close(ft);
+			set_feedback(cx, "Upload failed with read error");
+			return file_upload_end_request(cx, time(NULL));
+		}
+		data = buf;
 	}
-	if (!res)
+	if (!res) {
+		free(buf);
 		return file_upload_end_request(cx, time(NULL));
+	}
+
+	len = res;
+#ifdef HAVE_ZLIB
+	if (ft->compress) {
+		if (file_deflate(cx, data, res, &len)) {
+			free(buf);
+			close_connection(cx, -1);
+			return -1;
+		}
+		data = ft->zbuf.data;
+	}
+#endif
 
-	insert32_hilo(buf, 0xfc000108);
-	buf[4] = 0;
-	insert32_hilo(&buf[5], res);
-	insert32_hilo(&buf[9], res);
+	insert32_hilo(head, 0xfc000108);
+	head[4] = ft->compress;
+	insert32_hilo(&head[5], len);
+	insert32_hilo(&head[9], res);
 
-	if (safe_write(cx, buf, 13 + res)) {
+	if (safe_write(cx, head, sizeof(head)) || safe_write(cx, data, len)) {
+		free(buf);
 		debug(1, "write failed\n");
 		close_connection(cx, -1);
 		return -1;
 	}
 
+	free(buf);
+
+	window_sent(ft, res);
 	cx->encoding_def[tight_file].action = file_upload_data;
 
-	if (ft->feedback && ft->total) {
-		ggi_widget_t progress;
-		progress = ggiWidgetGetChild(ft->feedback, 0);
-		while (ggiWidgetGetChild(progress, 0))
-			progress = ggiWidgetGetChild(progress, 0);
-		GWT_SET_ICHANGED(progress);
+	progress_update(cx, res);
+
+	return 0;
+}
+
+/* Keep the window full of upload data. New chunks are only queued once
+ * the output buffer has drained, so that update requests and input
+ * events never sit behind more than one chunk of file data.
+ */
+static int
+file_upload_fill(struct connection *cx)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
+	if (cx->write_drained == file_upload_fill)
+		cx->write_drained = NULL;
+
+	if (!ft)
+		return 0;
+
+	while (ft->upload && !ft->eof && ft->in_flight < ft->window) {
+		if (cx->output.wpos) {
+			cx->write_drained = file_upload_fill;
+			break;
+		}
+		if (file_upload_data_request(cx))
+			return -1;
 	}
-	ft->current += res;
-	if (ft->total)
-		ft->progress = (double)ft->current / ft->total;
 
 	return 0;
 }
 
+static void
+file_upload_drained(struct connection *cx)
+{
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
+	if (ft->in_flight)
+		return;
+
+	if (cx->write_drained == file_upload_fill)
+		cx->write_drained = NULL;
+	cx->encoding_def[tight_file].action = vnc_unexpected;
+	ft->wait_remote = 0;
+}
+
 static int
 file_upload_start_reply(struct connection *cx)
 {
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
 	debug(2, "file_upload_start_reply\n");
 
-	if (file_upload_data_request(cx))
+	if (ft->upload)
+		file_upload_map(ft);
+	window_start(cx);
+	if (file_upload_fill(cx))
 		return -1;
 
 	cx->input.rpos += 4;
@@ -1492,10 +2002,14 @@ file_upload_start_reply(struct connection *cx)
 static int
 file_upload_data_reply(struct connection *cx)
 {
+	struct file_transfer *ft = cx->encoding_def[tight_file].priv;
+
 	debug(2, "file_upload_data_reply\n");
 
-	if (file_upload_data_request(cx))
+	window_done(ft);
+	if (file_upload_fill(cx))
 		return -1;
+	file_upload_drained(cx);
 
 	cx->input.rpos += 4;
 	remove_dead_data(&cx->input);
@@ -1510,15 +2024,15 @@ file_upload_end_reply(struct connection *cx)
 
 	debug(2, "file_upload_end_reply\n");
 
-	cx->encoding_def[tight_file].action = vnc_unexpected;
-	ft->wait_remote = 0;
+	window_done(ft);
 
 	if (ft->upload) {
-		fclose(ft->upload);
-		ft->upload = NULL;
+		file_upload_close(ft);
 		set_feedback(cx, "Upload complete");
 	}
 
+	file_upload_drained(cx);
+
 	cx->input.rpos += 4;
 	remove_dead_data(&cx->input);
 	cx->action = vnc_wait;
@@ -1549,14 +2063,16 @@ file_upload_failed(struct connection *cx)
 	free(reason);
 	reason = NULL;
 
+	window_done(ft);
+	ft->eof = 1;
+
 	if (ft->upload) {
 		set_feedback(cx, "Upload failed");
-		fclose(ft->upload);
-		ft->upload = NULL;
+		file_upload_close(ft);
 	}
 
-	cx->encoding_def[tight_file].action = vnc_unexpected;
-	ft->wait_remote = 0;
+	/* The chunks already sent get failures of their own. */
+	file_upload_drained(cx);
 
 	cx->input.rpos += 8 + len;
 	remove_dead_data(&cx->input);
@@ -1978,9 +2494,18 @@ file_transfer_end(struct connection *cx)
 	}
 
 	if (ft->download)
-		fclose(ft->download);
+		file_download_close(ft);
 	if (ft->upload)
-		fclose(ft->upload);
+		file_upload_close(ft);
+	if (cx->write_drained == file_upload_fill)
+		cx->write_drained = NULL;
+#ifdef HAVE_ZLIB
+	if (ft->inflating)
+		inflateEnd(&ft->inflater);
+	if (ft->deflating)
+		deflateEnd(&ft->deflater);
+	free(ft->zbuf.data);
+#endif
 
 	free(cx->encoding_def[tight_file].priv);
 	cx->encoding_def[tight_file].priv = NULL;
@@ -0,0 +1,73 @@
+# The viewer sources, shared by the ggivnc library and by apps that
+# build the viewer in. Needs no Qt.
+
+SOURCES += $$PWD/encoding/copyrect.c \
+    $$PWD/encoding/corre.c \
+    $$PWD/encoding/desktop-size.c \
+    $$PWD/encoding/hextile.c \
+    $$PWD/encoding/lastrect.c \
+    $$PWD/encoding/raw.c \
+    $$PWD/encoding/rre.c \
+    $$PWD/encoding/tight.c \
+    $$PWD/encoding/trle.c \
+    $$PWD/encoding/wmvi.c \
+    $$PWD/encoding/zlib.c \
+    $$PWD/encoding/zlibhex.c \
+    $$PWD/encoding/zrle.c \
+    $$PWD/security/none.c \
+    $$PWD/security/securitytight.c \
+    $$PWD/security/vencrypt.c \
+    $$PWD/security/vnc-auth.c \
+    $$PWD/lib/giiEventPoll.c \
+    $$PWD/lib/ggiCrossBlit.c \
+    $$PWD/bandwidth.c \
+    $$PWD/conn_none.c \
+    $$PWD/connect.c \
+    $$PWD/convert.c \
+    $$PWD/cost.c \
+    $$PWD/export.c \
+    $$PWD/engine.cpp \
+    $$PWD/handshake.c \
+    $$PWD/inputq.c \
+    $$PWD/kernel.c \
+    $$PWD/latency.c \
+    $$PWD/metrics.c \
+    $$PWD/option.c \
+    $$PWD/pass_getpass.c \
+    $$PWD/pixel.cpp \
+    $$PWD/pool.c \
+    $$PWD/record.c \
+    $$PWD/surface.c \
+    $$PWD/thumbnail.c \
+    $$PWD/viewer.cpp \
+    $$PWD/vnc.cpp
+
+HEADERS += $$PWD/config.h \
+    $$PWD/handshake.h \
+    $$PWD/vnc.h \
+    $$PWD/vnc-compat.h \
+    $$PWD/vnc-convert.h \
+    $$PWD/vnc-debug.h \
+    $$PWD/vnc-endian.h \
+    $$PWD/vnc-engine.h \
+    $$PWD/vnc-export.h \
+    $$PWD/vnc-inputq.h \
+    $$PWD/vnc-kernel.h \
+    $$PWD/vnc-latency.h \
+    $$PWD/vnc-metrics.h \
+    $$PWD/vnc-pixel.h \
+    $$PWD/vnc-pool.h \
+    $$PWD/vnc-record.h \
+    $$PWD/vnc-surface.h \
+    $$PWD/vnc-thumbnail.h \
+    $$PWD/vnc-tls.h \
+    $$PWD/vnc-viewer.h
+
+INCLUDEPATH += $$PWD
+INCLUDEPATH += /opt/local/include
+INCLUDEPATH += $$PWD/../../../ggi-2.2.2-bundle/ggiconf/lib/
+INCLUDEPATH += $$PWD/../../../ggi-2.2.2-bundle/libggi-2.2.2/include
+INCLUDEPATH += $$PWD/../../../ggi-2.2.2-bundle/libgii-1.0.2/include
+DEPENDPATH += $$PWD/../../../ggi-2.2.2-bundle/ggiconf/lib
+
+macx: LIBS += -L/opt/local/lib -lgg -lgii -lggi -lz -lssl -lcrypto
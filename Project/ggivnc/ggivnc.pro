@@ -1,32 +1,12 @@
+# The viewer as a library, static and shared, without Qt and without
+# windows. See vnc-viewer.h for the interface.
 TEMPLATE = lib
+TARGET = ggivnc
 
-SOURCES += encoding/copyrect.c \
-    encoding/corre.c \
-    encoding/desktop-size.c \
-    encoding/hextile.c \
-    encoding/lastrect.c \
-    encoding/raw.c \
-    encoding/rre.c \
-    encoding/tight.c \
-    encoding/wmvi.c \
-    encoding/zlib.c \
-    encoding/zlibhex.c \
-    encoding/zrle.c \
-    bandwidth.c \
-    conn_none.c \
-    d3des.c \
-    pass_getpass.c \
-    vnc.cpp
+QT -= core gui
+CONFIG += static_and_shared build_all
 
-HEADERS += config.h \
-    d3des.h \
-    vnc.h
+include(ggivnc.pri)
 
-macx: LIBS += -L$$PWD/../../../ggi-2.2.2-bundle/ggiconf/lib/ -lgg -lgii -lggi -lz
-
-INCLUDEPATH += $$PWD/../../../ggi-2.2.2-bundle/ggiconf/lib/
-INCLUDEPATH += $$PWD/../../../ggi-2.2.2-bundle/libggi-2.2.2/include
-INCLUDEPATH += $$PWD/../../../ggi-2.2.2-bundle/libgii-1.0.2/include
-DEPENDPATH += $$PWD/../../../ggi-2.2.2-bundle/ggiconf/lib
-
-INCLUDEPATH += /opt/local/include
+unix: LIBS += -lpthread
+linux: LIBS += -lrt
@@ -519,6 +519,7 @@ vnc_handshake(struct connection *cx)
 {
 	fd_set rfds;
 	fd_set wfds;
+	int maxfd;
 	int res;
 
 	cx->action = vnc_version;
@@ -527,10 +528,16 @@ vnc_handshake(struct connection *cx)
 		FD_ZERO(&rfds);
 		if (cx->want_read)
 			FD_SET(cx->sfd, &rfds);
+		maxfd = cx->sfd;
+		if (cx->cancel_fd != -1) {
+			FD_SET(cx->cancel_fd, &rfds);
+			if (cx->cancel_fd > maxfd)
+				maxfd = cx->cancel_fd;
+		}
 		FD_ZERO(&wfds);
 		if (cx->want_write)
 			FD_SET(cx->sfd, &wfds);
-		res = select(cx->sfd + 1, &rfds, &wfds, NULL, NULL);
+		res = select(maxfd + 1, &rfds, &wfds, NULL, NULL);
 		if (res < 0) {
 			if (errno == EINTR)
 				continue;
@@ -538,6 +545,10 @@ vnc_handshake(struct connection *cx)
 				errno, strerror(errno));
 			return -1;
 		}
+		if (cx->cancel_fd != -1 && FD_ISSET(cx->cancel_fd, &rfds)) {
+			debug(1, "handshake cancelled\n");
+			return -1;
+		}
 		if (FD_ISSET(cx->sfd, &rfds))
 			cx->read_ready(cx);
 		if (FD_ISSET(cx->sfd, &wfds))
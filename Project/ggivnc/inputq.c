@@ -0,0 +1,149 @@
+/*
+******************************************************************************
+
+   VNC viewer input queue.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vnc-inputq.h"
+#include "vnc-debug.h"
+
+int
+inputq_init(struct inputq *q)
+{
+	int i;
+
+	for (i = 0; i < INPUTQ_SIZE; ++i)
+		q->cell[i].seq = i;
+	q->head = q->tail = 0;
+	q->signalled = 0;
+
+	if (pipe(q->fd)) {
+		q->fd[0] = q->fd[1] = -1;
+		return -1;
+	}
+	for (i = 0; i < 2; ++i) {
+		fcntl(q->fd[i], F_SETFL, O_NONBLOCK);
+		fcntl(q->fd[i], F_SETFD, FD_CLOEXEC);
+	}
+	return 0;
+}
+
+void
+inputq_fini(struct inputq *q)
+{
+	if (q->fd[0] == -1)
+		return;
+	close(q->fd[0]);
+	close(q->fd[1]);
+	q->fd[0] = q->fd[1] = -1;
+}
+
+int
+inputq_push(struct inputq *q, const void *msg, int size)
+{
+	struct inputq_cell *cell;
+	uint64_t pos, seq;
+	int64_t dif;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &q->cell[pos & (INPUTQ_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t)(seq - pos);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (dif < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+
+	cell->size = size;
+	memcpy(cell->msg, msg, size);
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_exchange_n(&q->signalled, 1, __ATOMIC_SEQ_CST))
+		return 0;
+	/* Fails only when the pipe is full, and so readable anyway. */
+	if (q->fd[1] != -1 && write(q->fd[1], "", 1) < 0)
+		debug(3, "input queue pipe full\n");
+	return 1;
+}
+
+void
+inputq_rearm(struct inputq *q)
+{
+	char buf[64];
+
+	/* Drain before taking the signal down. A push in between sees the
+	 * signal still up and skips the pipe, but the pop that follows
+	 * finds its event. The other way round, the drain could eat the
+	 * byte of a push that has already raised the signal again, and
+	 * nothing would wake the loop from then on.
+	 */
+	if (q->fd[0] != -1)
+		while (read(q->fd[0], buf, sizeof(buf)) > 0);
+	__atomic_exchange_n(&q->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+int
+inputq_pop(struct inputq *q, uint8_t *buf, int size, int *keys)
+{
+	struct inputq_cell *cell;
+	uint64_t seq;
+	int len = 0;
+
+	*keys = 0;
+	for (;;) {
+		cell = &q->cell[q->tail & (INPUTQ_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq != q->tail + 1 || len + cell->size > size)
+			break;
+
+		memcpy(buf + len, cell->msg, cell->size);
+		len += cell->size;
+		if (cell->msg[0] == 4)
+			++*keys;
+
+		__atomic_store_n(&cell->seq, q->tail + INPUTQ_SIZE,
+			__ATOMIC_RELEASE);
+		++q->tail;
+	}
+	return len;
+}
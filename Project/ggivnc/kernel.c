@@ -0,0 +1,748 @@
+/*
+******************************************************************************
+
+   VNC viewer CPU specific kernels.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ggi/ggi.h>
+
+#if defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined __GNUC__ || defined __clang__
+#define HAVE_VECTOR_KERNELS
+#endif
+
+#include "vnc-kernel.h"
+#include "vnc-debug.h"
+
+static const char *level_names[CPU_LEVELS] = {
+	"generic",
+	"vector",
+	"sse2",
+	"ssse3",
+	"avx2"
+};
+
+static void
+reverse_16_generic(void *dst, const void *src, int count)
+{
+	uint16_t pixel;
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+
+	for (; count > 0; --count, in += 2, out += 2) {
+		memcpy(&pixel, in, 2);
+		pixel = GGI_BYTEREV16(pixel);
+		memcpy(out, &pixel, 2);
+	}
+}
+
+static void
+reverse_32_generic(void *dst, const void *src, int count)
+{
+	uint32_t pixel;
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+
+	for (; count > 0; --count, in += 4, out += 4) {
+		memcpy(&pixel, in, 4);
+		pixel = GGI_BYTEREV32(pixel);
+		memcpy(out, &pixel, 4);
+	}
+}
+
+static void
+expand_bits_32_generic(uint32_t *dst, const uint8_t *src,
+	uint32_t bg, uint32_t fg, int count)
+{
+	int shift = 7;
+
+	while (count--) {
+		*dst++ = (*src >> shift) & 1 ? fg : bg;
+		if (--shift < 0) {
+			shift = 7;
+			++src;
+		}
+	}
+}
+
+static inline uint32_t
+map_pixel(uint32_t pixel, const struct channel_map *map)
+{
+	return (((pixel << map->lshift[0]) >> map->rshift[0]) & map->mask[0])
+		| (((pixel << map->lshift[1]) >> map->rshift[1]) & map->mask[1])
+		| (((pixel << map->lshift[2]) >> map->rshift[2]) & map->mask[2]);
+}
+
+static void
+map_32_16_generic(uint16_t *dst, const uint32_t *src, int count,
+	const struct channel_map *map)
+{
+	while (count-- > 0)
+		*dst++ = map_pixel(*src++, map);
+}
+
+static void
+map_32_32_generic(uint32_t *dst, const uint32_t *src, int count,
+	const struct channel_map *map)
+{
+	while (count-- > 0)
+		*dst++ = map_pixel(*src++, map);
+}
+
+static inline uint8_t
+shuffle_byte(const uint8_t *in, uint8_t index)
+{
+	return index & 0x80 ? 0 : in[index];
+}
+
+static void
+shuffle_32_generic(void *dst, const void *src, int count,
+	const uint8_t *shuffle)
+{
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+
+	for (; count > 0; --count, in += 4, out += 4) {
+		out[0] = shuffle_byte(in, shuffle[0]);
+		out[1] = shuffle_byte(in, shuffle[1]);
+		out[2] = shuffle_byte(in, shuffle[2]);
+		out[3] = shuffle_byte(in, shuffle[3]);
+	}
+}
+
+static void
+shuffle_32_24_generic(void *dst, const void *src, int count,
+	const uint8_t *shuffle)
+{
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	uint8_t pixel[4];
+
+	/* read the whole pixel first, so that dst may equal src */
+	for (; count > 0; --count, in += 4, out += 3) {
+		memcpy(pixel, in, 4);
+		out[0] = shuffle_byte(pixel, shuffle[0]);
+		out[1] = shuffle_byte(pixel, shuffle[1]);
+		out[2] = shuffle_byte(pixel, shuffle[2]);
+	}
+}
+
+static void
+box_32_generic(uint32_t *sum, const void *src, int count, int factor)
+{
+	const uint8_t *in = (const uint8_t *)src;
+	int i;
+
+	for (; count > 0; --count, sum += 4) {
+		for (i = 0; i < factor; ++i, in += 4) {
+			sum[0] += in[0];
+			sum[1] += in[1];
+			sum[2] += in[2];
+			sum[3] += in[3];
+		}
+	}
+}
+
+#ifdef HAVE_VECTOR_KERNELS
+
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+static void
+reverse_16_vector(void *dst, const void *src, int count)
+{
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	v8u16 v;
+
+	for (; count >= 8; count -= 8, in += 16, out += 16) {
+		memcpy(&v, in, 16);
+		v = (v << 8) | (v >> 8);
+		memcpy(out, &v, 16);
+	}
+	reverse_16_generic(out, in, count);
+}
+
+static void
+reverse_32_vector(void *dst, const void *src, int count)
+{
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	v4u32 v;
+
+	for (; count >= 4; count -= 4, in += 16, out += 16) {
+		memcpy(&v, in, 16);
+		v = (v << 24) | ((v << 8) & 0xff0000)
+			| ((v >> 8) & 0xff00) | (v >> 24);
+		memcpy(out, &v, 16);
+	}
+	reverse_32_generic(out, in, count);
+}
+
+static void
+map_32_32_vector(uint32_t *dst, const uint32_t *src, int count,
+	const struct channel_map *map)
+{
+	v4u32 v, out;
+
+	for (; count >= 4; count -= 4, src += 4, dst += 4) {
+		memcpy(&v, src, 16);
+		out  = ((v << map->lshift[0]) >> map->rshift[0]) & map->mask[0];
+		out |= ((v << map->lshift[1]) >> map->rshift[1]) & map->mask[1];
+		out |= ((v << map->lshift[2]) >> map->rshift[2]) & map->mask[2];
+		memcpy(dst, &out, 16);
+	}
+	map_32_32_generic(dst, src, count, map);
+}
+
+#endif /* HAVE_VECTOR_KERNELS */
+
+#ifdef HAVE_X86_KERNELS
+
+static TARGET("sse2") void
+reverse_16_sse2(void *dst, const void *src, int count)
+{
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m128i v;
+
+	for (; count >= 8; count -= 8, in += 16, out += 16) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)out, v);
+	}
+	reverse_16_generic(out, in, count);
+}
+
+static TARGET("sse2") void
+reverse_32_sse2(void *dst, const void *src, int count)
+{
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m128i v;
+
+	for (; count >= 4; count -= 4, in += 16, out += 16) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		/* swap the bytes in each word, then the words */
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128((__m128i *)out, v);
+	}
+	reverse_32_generic(out, in, count);
+}
+
+/* Expand 8 bits at a time into two vectors of four pixels. */
+static TARGET("sse2") void
+expand_bits_32_sse2(uint32_t *dst, const uint8_t *src,
+	uint32_t bg, uint32_t fg, int count)
+{
+	const __m128i bit_lo = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+	const __m128i bit_hi = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+	const __m128i vbg = _mm_set1_epi32(bg);
+	const __m128i diff = _mm_set1_epi32(bg ^ fg);
+	__m128i bits, lo, hi;
+
+	for (; count >= 8; count -= 8, dst += 8) {
+		bits = _mm_set1_epi32(*src++);
+		lo = _mm_cmpeq_epi32(_mm_and_si128(bits, bit_lo), bit_lo);
+		hi = _mm_cmpeq_epi32(_mm_and_si128(bits, bit_hi), bit_hi);
+		lo = _mm_xor_si128(vbg, _mm_and_si128(lo, diff));
+		hi = _mm_xor_si128(vbg, _mm_and_si128(hi, diff));
+		_mm_storeu_si128((__m128i *)dst, lo);
+		_mm_storeu_si128((__m128i *)(dst + 4), hi);
+	}
+	expand_bits_32_generic(dst, src, bg, fg, count);
+}
+
+struct channel_map_sse2 {
+	__m128i lshift[3];
+	__m128i rshift[3];
+	__m128i mask[3];
+};
+
+static TARGET("sse2") void
+load_channel_map_sse2(struct channel_map_sse2 *v,
+	const struct channel_map *map)
+{
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		v->lshift[i] = _mm_cvtsi32_si128(map->lshift[i]);
+		v->rshift[i] = _mm_cvtsi32_si128(map->rshift[i]);
+		v->mask[i] = _mm_set1_epi32(map->mask[i]);
+	}
+}
+
+static inline TARGET("sse2") __m128i
+map_4_sse2(__m128i v, const struct channel_map_sse2 *m)
+{
+	__m128i out;
+
+	out = _mm_and_si128(_mm_srl_epi32(_mm_sll_epi32(v,
+		m->lshift[0]), m->rshift[0]), m->mask[0]);
+	out = _mm_or_si128(out, _mm_and_si128(_mm_srl_epi32(_mm_sll_epi32(v,
+		m->lshift[1]), m->rshift[1]), m->mask[1]));
+	out = _mm_or_si128(out, _mm_and_si128(_mm_srl_epi32(_mm_sll_epi32(v,
+		m->lshift[2]), m->rshift[2]), m->mask[2]));
+	return out;
+}
+
+static TARGET("sse2") void
+map_32_16_sse2(uint16_t *dst, const uint32_t *src, int count,
+	const struct channel_map *map)
+{
+	struct channel_map_sse2 m;
+	__m128i lo, hi;
+
+	load_channel_map_sse2(&m, map);
+
+	for (; count >= 8; count -= 8, src += 8, dst += 8) {
+		lo = map_4_sse2(_mm_loadu_si128((const __m128i *)src), &m);
+		hi = map_4_sse2(_mm_loadu_si128((const __m128i *)(src + 4)), &m);
+		/* sign extend so that the saturating pack is exact */
+		lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+		hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+		_mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(lo, hi));
+	}
+	map_32_16_generic(dst, src, count, map);
+}
+
+static TARGET("sse2") void
+map_32_32_sse2(uint32_t *dst, const uint32_t *src, int count,
+	const struct channel_map *map)
+{
+	struct channel_map_sse2 m;
+	__m128i v;
+
+	load_channel_map_sse2(&m, map);
+
+	for (; count >= 4; count -= 4, src += 4, dst += 4) {
+		v = map_4_sse2(_mm_loadu_si128((const __m128i *)src), &m);
+		_mm_storeu_si128((__m128i *)dst, v);
+	}
+	map_32_32_generic(dst, src, count, map);
+}
+
+/* The bytes are widened to 16 bits, two pixels per vector, and only
+ * the sum of a whole run is widened to 32 bits. Each 16-bit lane gets
+ * at most 128 pixels before the two halves are folded, so nothing
+ * overflows for runs of up to 256 pixels.
+ */
+static TARGET("sse2") void
+box_32_sse2(uint32_t *sum, const void *src, int count, int factor)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const uint8_t *in = (const uint8_t *)src;
+	__m128i acc, v;
+	int32_t pixel;
+	int i;
+
+	for (; count > 0; --count, sum += 4) {
+		acc = zero;
+		for (i = factor; i >= 4; i -= 4, in += 16) {
+			v = _mm_loadu_si128((const __m128i *)in);
+			acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(v, zero));
+			acc = _mm_add_epi16(acc, _mm_unpackhi_epi8(v, zero));
+		}
+		for (; i > 0; --i, in += 4) {
+			memcpy(&pixel, in, 4);
+			v = _mm_cvtsi32_si128(pixel);
+			acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(v, zero));
+		}
+		acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+		acc = _mm_unpacklo_epi16(acc, zero);
+		v = _mm_loadu_si128((const __m128i *)sum);
+		_mm_storeu_si128((__m128i *)sum, _mm_add_epi32(v, acc));
+	}
+}
+
+static TARGET("ssse3") void
+reverse_16_ssse3(void *dst, const void *src, int count)
+{
+	const __m128i shuf = _mm_set_epi8(
+		14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m128i v;
+
+	for (; count >= 8; count -= 8, in += 16, out += 16) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, shuf));
+	}
+	reverse_16_generic(out, in, count);
+}
+
+static TARGET("ssse3") void
+reverse_32_ssse3(void *dst, const void *src, int count)
+{
+	const __m128i shuf = _mm_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m128i v;
+
+	for (; count >= 4; count -= 4, in += 16, out += 16) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, shuf));
+	}
+	reverse_32_generic(out, in, count);
+}
+
+/* Build a pshufb control for pixels pixels of 4 source bytes each,
+ * size destination bytes per pixel.
+ */
+static void
+shuffle_control(uint8_t *ctl, int bytes, const uint8_t *shuffle,
+	int pixels, int size)
+{
+	int i, j;
+
+	memset(ctl, 0x80, bytes);
+	for (j = 0; j < pixels; ++j) {
+		for (i = 0; i < size; ++i) {
+			if (!(shuffle[i] & 0x80))
+				ctl[size * j + i] = 4 * j + shuffle[i];
+		}
+	}
+}
+
+static TARGET("ssse3") void
+shuffle_32_ssse3(void *dst, const void *src, int count,
+	const uint8_t *shuffle)
+{
+	uint8_t ctl[16];
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m128i v, c;
+
+	shuffle_control(ctl, sizeof(ctl), shuffle, 4, 4);
+	c = _mm_loadu_si128((const __m128i *)ctl);
+
+	for (; count >= 4; count -= 4, in += 16, out += 16) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, c));
+	}
+	shuffle_32_generic(out, in, count, shuffle);
+}
+
+/* Four pixels give 12 bytes, but 16 bytes are stored. Stop while the
+ * excess still lands inside the destination.
+ */
+static TARGET("ssse3") void
+shuffle_32_24_ssse3(void *dst, const void *src, int count,
+	const uint8_t *shuffle)
+{
+	uint8_t ctl[16];
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m128i v, c;
+
+	shuffle_control(ctl, sizeof(ctl), shuffle, 4, 3);
+	c = _mm_loadu_si128((const __m128i *)ctl);
+
+	for (; count >= 6; count -= 4, in += 16, out += 12) {
+		v = _mm_loadu_si128((const __m128i *)in);
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, c));
+	}
+	shuffle_32_24_generic(out, in, count, shuffle);
+}
+
+static TARGET("avx2") void
+reverse_16_avx2(void *dst, const void *src, int count)
+{
+	const __m256i shuf = _mm256_set_epi8(
+		14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+		14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m256i v;
+
+	for (; count >= 16; count -= 16, in += 32, out += 32) {
+		v = _mm256_loadu_si256((const __m256i *)in);
+		_mm256_storeu_si256((__m256i *)out,
+			_mm256_shuffle_epi8(v, shuf));
+	}
+	reverse_16_ssse3(out, in, count);
+}
+
+static TARGET("avx2") void
+reverse_32_avx2(void *dst, const void *src, int count)
+{
+	const __m256i shuf = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m256i v;
+
+	for (; count >= 8; count -= 8, in += 32, out += 32) {
+		v = _mm256_loadu_si256((const __m256i *)in);
+		_mm256_storeu_si256((__m256i *)out,
+			_mm256_shuffle_epi8(v, shuf));
+	}
+	reverse_32_ssse3(out, in, count);
+}
+
+/* vpshufb works within each 128-bit lane, so both lanes get the
+ * same control.
+ */
+static TARGET("avx2") void
+shuffle_32_avx2(void *dst, const void *src, int count,
+	const uint8_t *shuffle)
+{
+	uint8_t ctl[32];
+	uint8_t *out = (uint8_t *)dst;
+	const uint8_t *in = (const uint8_t *)src;
+	__m256i v, c;
+
+	shuffle_control(ctl, 16, shuffle, 4, 4);
+	memcpy(ctl + 16, ctl, 16);
+	c = _mm256_loadu_si256((const __m256i *)ctl);
+
+	for (; count >= 8; count -= 8, in += 32, out += 32) {
+		v = _mm256_loadu_si256((const __m256i *)in);
+		_mm256_storeu_si256((__m256i *)out, _mm256_shuffle_epi8(v, c));
+	}
+	shuffle_32_ssse3(out, in, count, shuffle);
+}
+
+/* Expand 8 bits at a time into one vector of eight pixels. */
+static TARGET("avx2") void
+expand_bits_32_avx2(uint32_t *dst, const uint8_t *src,
+	uint32_t bg, uint32_t fg, int count)
+{
+	const __m256i bit = _mm256_set_epi32(
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+	const __m256i vbg = _mm256_set1_epi32(bg);
+	const __m256i diff = _mm256_set1_epi32(bg ^ fg);
+	__m256i v;
+
+	for (; count >= 8; count -= 8, dst += 8) {
+		v = _mm256_set1_epi32(*src++);
+		v = _mm256_cmpeq_epi32(_mm256_and_si256(v, bit), bit);
+		v = _mm256_xor_si256(vbg, _mm256_and_si256(v, diff));
+		_mm256_storeu_si256((__m256i *)dst, v);
+	}
+	expand_bits_32_generic(dst, src, bg, fg, count);
+}
+
+/* Same as the SSE2 variant with eight pixels per load, the lanes hold
+ * four pixels that are folded at the end of each run.
+ */
+static TARGET("avx2") void
+box_32_avx2(uint32_t *sum, const void *src, int count, int factor)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const uint8_t *in = (const uint8_t *)src;
+	__m256i v;
+	__m128i acc, w;
+	int32_t pixel;
+	int i;
+
+	for (; count > 0; --count, sum += 4) {
+		v = zero;
+		for (i = factor; i >= 8; i -= 8, in += 32) {
+			__m256i p = _mm256_loadu_si256((const __m256i *)in);
+			v = _mm256_add_epi16(v, _mm256_unpacklo_epi8(p, zero));
+			v = _mm256_add_epi16(v, _mm256_unpackhi_epi8(p, zero));
+		}
+		acc = _mm_add_epi16(_mm256_castsi256_si128(v),
+			_mm256_extracti128_si256(v, 1));
+		for (; i > 0; --i, in += 4) {
+			memcpy(&pixel, in, 4);
+			w = _mm_cvtsi32_si128(pixel);
+			acc = _mm_add_epi16(acc,
+				_mm_unpacklo_epi8(w, _mm_setzero_si128()));
+		}
+		acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+		acc = _mm_unpacklo_epi16(acc, _mm_setzero_si128());
+		w = _mm_loadu_si128((const __m128i *)sum);
+		_mm_storeu_si128((__m128i *)sum, _mm_add_epi32(w, acc));
+	}
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+struct kernels kernels = {
+	CPU_GENERIC,
+	reverse_16_generic,
+	reverse_32_generic,
+	expand_bits_32_generic,
+	map_32_16_generic,
+	map_32_32_generic,
+	shuffle_32_generic,
+	shuffle_32_24_generic,
+	box_32_generic
+};
+
+int
+cpu_level_detect(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return CPU_AVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return CPU_SSSE3;
+	if (__builtin_cpu_supports("sse2"))
+		return CPU_SSE2;
+#endif
+#ifdef HAVE_VECTOR_KERNELS
+	return CPU_VECTOR;
+#else
+	return CPU_GENERIC;
+#endif
+}
+
+const char *
+cpu_level_name(int level)
+{
+	if (level < 0 || level >= CPU_LEVELS)
+		return "unknown";
+	return level_names[level];
+}
+
+int
+cpu_level_lookup(const char *name)
+{
+	int level;
+
+	for (level = 0; level < CPU_LEVELS; ++level) {
+		if (!strcmp(name, level_names[level]))
+			return level;
+	}
+	return -1;
+}
+
+int
+kernels_bind(int level)
+{
+	struct kernels k;
+
+	if (level < 0 || level > cpu_level_detect())
+		return -1;
+
+	k.level = level;
+	k.reverse_16 = reverse_16_generic;
+	k.reverse_32 = reverse_32_generic;
+	k.expand_bits_32 = expand_bits_32_generic;
+	k.map_32_16 = map_32_16_generic;
+	k.map_32_32 = map_32_32_generic;
+	k.shuffle_32 = shuffle_32_generic;
+	k.shuffle_32_24 = shuffle_32_24_generic;
+	k.box_32 = box_32_generic;
+
+	switch (level) {
+#ifdef HAVE_X86_KERNELS
+	case CPU_AVX2:
+		k.reverse_16 = reverse_16_avx2;
+		k.reverse_32 = reverse_32_avx2;
+		k.expand_bits_32 = expand_bits_32_avx2;
+		k.map_32_16 = map_32_16_sse2;
+		k.map_32_32 = map_32_32_sse2;
+		k.shuffle_32 = shuffle_32_avx2;
+		k.shuffle_32_24 = shuffle_32_24_ssse3;
+		k.box_32 = box_32_avx2;
+		break;
+	case CPU_SSSE3:
+		k.reverse_16 = reverse_16_ssse3;
+		k.reverse_32 = reverse_32_ssse3;
+		k.expand_bits_32 = expand_bits_32_sse2;
+		k.map_32_16 = map_32_16_sse2;
+		k.map_32_32 = map_32_32_sse2;
+		k.shuffle_32 = shuffle_32_ssse3;
+		k.shuffle_32_24 = shuffle_32_24_ssse3;
+		k.box_32 = box_32_sse2;
+		break;
+	case CPU_SSE2:
+		k.reverse_16 = reverse_16_sse2;
+		k.reverse_32 = reverse_32_sse2;
+		k.expand_bits_32 = expand_bits_32_sse2;
+		k.map_32_16 = map_32_16_sse2;
+		k.map_32_32 = map_32_32_sse2;
+		k.box_32 = box_32_sse2;
+		break;
+#endif
+#ifdef HAVE_VECTOR_KERNELS
+	case CPU_VECTOR:
+		k.reverse_16 = reverse_16_vector;
+		k.reverse_32 = reverse_32_vector;
+		k.map_32_32 = map_32_32_vector;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	kernels = k;
+	return 0;
+}
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static int kernels_status;
+
+static void
+kernels_setup(void)
+{
+	int level = cpu_level_detect();
+	const char *env = getenv("GGIVNC_CPU");
+
+	if (env) {
+		int forced = cpu_level_lookup(env);
+
+		if (forced < 0)
+			debug(1, "unknown GGIVNC_CPU \"%s\"\n", env);
+		else if (forced > level)
+			debug(1, "GGIVNC_CPU %s not supported, using %s\n",
+				env, cpu_level_name(level));
+		else
+			level = forced;
+	}
+
+	debug(1, "cpu kernels: %s\n", cpu_level_name(level));
+
+	kernels_status = kernels_bind(level);
+}
+
+int
+kernels_init(void)
+{
+	pthread_once(&kernels_once, kernels_setup);
+	return kernels_status;
+}
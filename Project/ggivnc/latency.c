@@ -0,0 +1,228 @@
+/*
+******************************************************************************
+
+   VNC viewer input to photon latency.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "vnc.h"
+#include "vnc-debug.h"
+#include "vnc-metrics.h"
+
+#define TRACE(cx, ...)							\
+	do {								\
+		if ((cx)->latency.trace)				\
+			fprintf((cx)->latency.trace, __VA_ARGS__);	\
+	} while (0)
+
+int
+latency_trace_open(struct connection *cx, const char *file)
+{
+	if (cx->latency.trace)
+		fclose(cx->latency.trace);
+	cx->latency.trace = fopen(file, "w");
+	if (!cx->latency.trace) {
+		debug(0, "cannot open trace file %s: %s\n",
+			file, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int
+latency_bench_parse(struct connection *cx, const char *arg)
+{
+	char *end;
+	long count, ms = 100;
+
+	count = strtol(arg, &end, 10);
+	if (*end == ',')
+		ms = strtol(end + 1, &end, 10);
+	if (*end || count <= 0 || ms <= 0) {
+		debug(0, "bad latency bench \"%s\" specified\n", arg);
+		return -1;
+	}
+	cx->latency.bench_count = count;
+	cx->latency.bench_period = ms * (uint64_t)1000000;
+	return 0;
+}
+
+void
+latency_end(struct connection *cx)
+{
+	if (cx->latency.trace)
+		fclose(cx->latency.trace);
+	cx->latency.trace = NULL;
+}
+
+void
+latency_input(struct connection *cx, const char *what)
+{
+	struct latency *lat = &cx->latency;
+	uint64_t now = metrics_clock();
+
+	if (!lat->input)
+		lat->input = now;
+	/* As in bandwidth_input, the newest request in flight is likely
+	 * answered with what the input changed, so it counts as sent now.
+	 * Older ones may be answered already.
+	 */
+	if (lat->request_head != lat->request_tail && !lat->request_lost)
+		lat->request[(lat->request_tail - 1) % LATENCY_REQUESTS] = now;
+	TRACE(cx, "%llu input %s\n", (unsigned long long)now, what);
+}
+
+/* Requests are answered in order, so the ring says which request an
+ * update answers. Once it is full, requests are only counted until it
+ * drains, and their updates are not matched to any input.
+ */
+void
+latency_request(struct connection *cx)
+{
+	struct latency *lat = &cx->latency;
+	uint64_t now = metrics_clock();
+
+	if (lat->request_lost ||
+		lat->request_tail - lat->request_head == LATENCY_REQUESTS)
+	{
+		++lat->request_lost;
+	}
+	else
+		lat->request[lat->request_tail++ % LATENCY_REQUESTS] = now;
+	TRACE(cx, "%llu request\n", (unsigned long long)now);
+}
+
+void
+latency_update(struct connection *cx, int rects)
+{
+	struct latency *lat = &cx->latency;
+	uint64_t now = metrics_clock();
+	uint64_t requested = 0;
+
+	++lat->update_count;
+	if (lat->request_head != lat->request_tail) {
+		requested = lat->request[lat->request_head % LATENCY_REQUESTS];
+		++lat->request_head;
+	}
+	else if (lat->request_lost)
+		--lat->request_lost;
+	if (lat->input && requested >= lat->input) {
+		lat->update = lat->input;
+		lat->input = 0;
+		metrics_record(&cx->metrics.input_update_ns,
+			now - lat->update);
+	}
+	TRACE(cx, "%llu update %u rects %d\n", (unsigned long long)now,
+		lat->update_count, rects);
+}
+
+void
+latency_rect(struct connection *cx, int encoding)
+{
+	TRACE(cx, "%llu rect %d %dx%d+%d+%d\n",
+		(unsigned long long)metrics_clock(), encoding,
+		cx->w, cx->h, cx->x, cx->y);
+}
+
+void
+latency_decoded(struct connection *cx)
+{
+	struct latency *lat = &cx->latency;
+	uint64_t now = metrics_clock();
+
+	if (lat->update) {
+		metrics_record(&cx->metrics.input_decode_ns,
+			now - lat->update);
+		if (!lat->frame)
+			lat->frame = lat->update;
+		lat->update = 0;
+	}
+	TRACE(cx, "%llu decoded %u\n", (unsigned long long)now,
+		lat->update_count);
+}
+
+void
+latency_present(struct connection *cx, unsigned int frame)
+{
+	struct latency *lat = &cx->latency;
+	uint64_t now = metrics_clock();
+
+	if (lat->frame) {
+		metrics_record(&cx->metrics.input_present_ns,
+			now - lat->frame);
+		lat->shown = lat->frame;
+		lat->shown_frame = frame;
+		lat->frame = 0;
+	}
+	TRACE(cx, "%llu present %u\n", (unsigned long long)now, frame);
+}
+
+void
+latency_ack(struct connection *cx, unsigned int frame)
+{
+	struct latency *lat = &cx->latency;
+	uint64_t now = metrics_clock();
+
+	if (lat->shown && (int)(frame - lat->shown_frame) >= 0) {
+		metrics_record(&cx->metrics.input_ack_ns, now - lat->shown);
+		lat->shown = 0;
+	}
+	TRACE(cx, "%llu ack %u\n", (unsigned long long)now, frame);
+}
+
+static void
+report_hist(const char *name, const struct metrics_hist *hist)
+{
+	fprintf(stderr, "%-14s %6llu %8.2f %8.2f %8.2f %8.2f\n", name,
+		(unsigned long long)hist->count,
+		metrics_percentile(hist, 0.5) / 1e6,
+		metrics_percentile(hist, 0.9) / 1e6,
+		metrics_percentile(hist, 0.99) / 1e6,
+		hist->max / 1e6);
+}
+
+void
+latency_report(struct connection *cx)
+{
+	struct vnc_metrics m;
+
+	metrics_snapshot(&cx->metrics, &m);
+	fprintf(stderr, "%-14s %6s %8s %8s %8s %8s\n",
+		"input to (ms)", "count", "p50", "p90", "p99", "max");
+	report_hist("update", &m.input_update_ns);
+	report_hist("decoded", &m.input_decode_ns);
+	report_hist("presented", &m.input_present_ns);
+	report_hist("acked", &m.input_ack_ns);
+	if (cx->latency.trace)
+		fflush(cx->latency.trace);
+}
@@ -30,33 +30,86 @@
 
 #include "config.h"
 
+#include <pthread.h>
+
 #include "vnc.h"
 #include "vnc-compat.h"
 #include <ggi/ggi-unix.h>
 
-static struct gg_instance *the_one_instance;
+/* One fdselect instance per visual, there is a visual per session. */
+struct plugged {
+	struct plugged *next;
+	ggi_visual_t stem;
+	struct gg_instance *instance;
+};
+
+static pthread_mutex_t plugged_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct plugged *plugged;
+
+static struct gg_instance *
+find_instance(ggi_visual_t stem)
+{
+	struct plugged *p;
+	struct gg_instance *instance = NULL;
+
+	pthread_mutex_lock(&plugged_lock);
+	for (p = plugged; p; p = p->next) {
+		if (p->stem == stem) {
+			instance = p->instance;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&plugged_lock);
+
+	return instance;
+}
 
 int
 giiEventPoll(ggi_visual_t vis, gii_event_mask mask, struct timeval *tv)
 {
-	observe_cb *cb = the_one_instance->cb;
-	struct connection *cx = the_one_instance->arg;
+	struct gg_instance *instance = find_instance(vis);
+	observe_cb *cb;
+	struct connection *cx;
 	ggi_event_mask mask_orig = mask;
 	struct gii_fdselect_fd fd;
 	fd_set rfds;
 	fd_set wfds;
+	int maxfd;
+
+	if (!instance)
+		return ggiEventPoll(vis, mask, tv);
+	cb = instance->cb;
+	cx = instance->arg;
 
 	do {
 		mask = mask_orig;
 		FD_ZERO(&rfds);
 		if (cx->want_read)
 			FD_SET(cx->sfd, &rfds);
+		maxfd = cx->sfd;
+		if (cx->cancel_fd != -1) {
+			FD_SET(cx->cancel_fd, &rfds);
+			if (cx->cancel_fd > maxfd)
+				maxfd = cx->cancel_fd;
+		}
+		if (cx->input_fd != -1) {
+			FD_SET(cx->input_fd, &rfds);
+			if (cx->input_fd > maxfd)
+				maxfd = cx->input_fd;
+		}
 		FD_ZERO(&wfds);
 		if (cx->want_write)
 			FD_SET(cx->sfd, &wfds);
 
-		ggiEventSelect(vis, &mask, cx->sfd + 1,
-			&rfds, &wfds, NULL, NULL);
+		ggiEventSelect(vis, &mask, maxfd + 1,
+			&rfds, &wfds, NULL, tv);
+
+		/* Left readable, the loop sees it with vnc_cancelled. */
+		if (cx->cancel_fd != -1 && FD_ISSET(cx->cancel_fd, &rfds))
+			break;
+		/* Queued input, the loop sends it. */
+		if (cx->input_fd != -1 && FD_ISSET(cx->input_fd, &rfds))
+			break;
 
 		if (FD_ISSET(cx->sfd, &rfds)) {
 			fd.mode = GII_FDSELECT_READ;
@@ -71,7 +124,8 @@ giiEventPoll(ggi_visual_t vis, gii_event_mask mask, struct timeval *tv)
 
 		if (cx->close_connection)
 			break;
-	} while (!mask);
+		/* With a timeout, one round is all that is asked for. */
+	} while (!mask && !tv);
 
 	return mask;
 }
@@ -80,12 +134,28 @@ struct gg_instance *
 ggPlugModule(void *api, ggi_visual_t stem, const char *name,
 	const char *argstr, void *argptr)
 {
-	the_one_instance = malloc(sizeof(*the_one_instance));
-	if (!the_one_instance)
+	struct gg_instance *instance;
+	struct plugged *p;
+
+	instance = malloc(sizeof(*instance));
+	if (!instance)
+		return NULL;
+	p = malloc(sizeof(*p));
+	if (!p) {
+		free(instance);
 		return NULL;
+	}
 
-	the_one_instance->channel = the_one_instance;
-	return the_one_instance;
+	instance->channel = instance;
+	p->stem = stem;
+	p->instance = instance;
+
+	pthread_mutex_lock(&plugged_lock);
+	p->next = plugged;
+	plugged = p;
+	pthread_mutex_unlock(&plugged_lock);
+
+	return instance;
 }
 
 void
@@ -105,6 +175,19 @@ ggControl(void *channel, uint32_t code, void *arg)
 void
 ggClosePlugin(struct gg_instance *instance)
 {
+	struct plugged **pp;
+	struct plugged *p;
+
+	pthread_mutex_lock(&plugged_lock);
+	for (pp = &plugged; *pp; pp = &(*pp)->next) {
+		if ((*pp)->instance == instance) {
+			p = *pp;
+			*pp = p->next;
+			free(p);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&plugged_lock);
+
 	free(instance);
-	the_one_instance = NULL;
 }
@@ -0,0 +1,210 @@
+/*
+******************************************************************************
+
+   VNC viewer performance metrics.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ggi/gg.h>
+
+#include "vnc.h"
+#include "vnc-metrics.h"
+
+/* The metrics are all uint64_t, so they are walked as an array. */
+#define METRICS_WORDS (int)(sizeof(struct vnc_metrics) / sizeof(uint64_t))
+
+uint64_t
+metrics_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+#endif
+	{
+		struct timeval tv;
+
+		ggCurTime(&tv);
+		return tv.tv_sec * (uint64_t)1000000000 + tv.tv_usec * 1000;
+	}
+}
+
+void
+metrics_reset(struct vnc_metrics *m)
+{
+	uint64_t *word = (uint64_t *)m;
+	int i;
+
+	for (i = 0; i < METRICS_WORDS; ++i)
+		if (&word[i] != &m->session)
+			__atomic_store_n(&word[i], 0, __ATOMIC_RELAXED);
+	metrics_add(&m->session, 1);
+}
+
+void
+metrics_snapshot(const struct vnc_metrics *m, struct vnc_metrics *snapshot)
+{
+	const uint64_t *word = (const uint64_t *)m;
+	uint64_t *copy = (uint64_t *)snapshot;
+	int i;
+
+	for (i = 0; i < METRICS_WORDS; ++i)
+		copy[i] = __atomic_load_n(&word[i], __ATOMIC_RELAXED);
+}
+
+static uint64_t
+bucket_value(int bucket)
+{
+	int shift;
+
+	if (bucket < (2 << METRICS_SUB_BITS))
+		return bucket;
+
+	shift = (bucket >> METRICS_SUB_BITS) - 1;
+	return ((uint64_t)(1 << METRICS_SUB_BITS) +
+		(bucket & ((1 << METRICS_SUB_BITS) - 1))) << shift;
+}
+
+uint64_t
+metrics_percentile(const struct metrics_hist *hist, double q)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	rank = (uint64_t)(q * hist->count);
+	if (rank >= hist->count)
+		rank = hist->count - 1;
+
+	for (i = 0; i < METRICS_BUCKETS; ++i) {
+		seen += hist->bucket[i];
+		if (seen > rank)
+			break;
+	}
+	if (i == METRICS_BUCKETS)
+		return hist->max;
+	if (bucket_value(i) > hist->max)
+		return hist->max;
+	return bucket_value(i);
+}
+
+static int
+format_hist(char *buf, int size, const char *name,
+	const struct metrics_hist *hist)
+{
+	return snprintf(buf, size,
+		"%s.count %llu\n"
+		"%s.mean %llu\n"
+		"%s.p50 %llu\n"
+		"%s.p90 %llu\n"
+		"%s.p99 %llu\n"
+		"%s.max %llu\n",
+		name, (unsigned long long)hist->count,
+		name, (unsigned long long)
+			(hist->count ? hist->sum / hist->count : 0),
+		name, (unsigned long long)metrics_percentile(hist, 0.5),
+		name, (unsigned long long)metrics_percentile(hist, 0.9),
+		name, (unsigned long long)metrics_percentile(hist, 0.99),
+		name, (unsigned long long)hist->max);
+}
+
+#define FORMAT(expr)						\
+	do {							\
+		int res_ = (expr);				\
+		if (res_ < 0)					\
+			return res_;				\
+		len += res_;					\
+	} while (0)
+#define LEFT (len < size ? size - len : 0)
+#define AT (len < size ? buf + len : NULL)
+
+int
+metrics_format(const struct vnc_metrics *m, char *buf, int size)
+{
+	int len = 0;
+	int i;
+
+	FORMAT(snprintf(AT, LEFT,
+		"session %llu\n"
+		"bytes_in %llu\n"
+		"bytes_out %llu\n"
+		"reads %llu\n"
+		"writes %llu\n"
+		"updates %llu\n"
+		"frames %llu\n"
+		"inflate_in %llu\n"
+		"inflate_out %llu\n"
+		"input_high_water %llu\n"
+		"output_high_water %llu\n",
+		(unsigned long long)m->session,
+		(unsigned long long)m->bytes_in,
+		(unsigned long long)m->bytes_out,
+		(unsigned long long)m->reads,
+		(unsigned long long)m->writes,
+		(unsigned long long)m->updates,
+		(unsigned long long)m->frames,
+		(unsigned long long)m->inflate_in,
+		(unsigned long long)m->inflate_out,
+		(unsigned long long)m->input_high_water,
+		(unsigned long long)m->output_high_water));
+	FORMAT(format_hist(AT, LEFT, "update_rtt_ns", &m->update_rtt_ns));
+	FORMAT(format_hist(AT, LEFT, "present_ns", &m->present_ns));
+	FORMAT(format_hist(AT, LEFT, "input_update_ns", &m->input_update_ns));
+	FORMAT(format_hist(AT, LEFT, "input_decode_ns", &m->input_decode_ns));
+	FORMAT(format_hist(AT, LEFT,
+		"input_present_ns", &m->input_present_ns));
+	FORMAT(format_hist(AT, LEFT, "input_ack_ns", &m->input_ack_ns));
+
+	for (i = 0; i < 17; ++i) {
+		const struct metrics_encoding *enc = &m->encoding[i];
+		const char *name = lookup_encoding(i);
+		char prefix[48];
+
+		if (!enc->rects || !name)
+			continue;
+
+		FORMAT(snprintf(AT, LEFT,
+			"%s.rects %llu\n"
+			"%s.pixels %llu\n"
+			"%s.bytes %llu\n",
+			name, (unsigned long long)enc->rects,
+			name, (unsigned long long)enc->pixels,
+			name, (unsigned long long)enc->bytes));
+		snprintf(prefix, sizeof(prefix), "%s.decode_ns", name);
+		FORMAT(format_hist(AT, LEFT, prefix, &enc->decode_ns));
+	}
+
+	return len;
+}
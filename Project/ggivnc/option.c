@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -48,6 +49,7 @@
 #include "vnc.h"
 #include "vnc-compat.h"
 #include "vnc-debug.h"
+#include "vnc-export.h"
 
 
 struct encoding {
@@ -156,6 +158,21 @@ lookup_encoding(int32_t number)
 	return encoding_table[i].name;
 }
 
+int
+find_encoding(const char *name, int32_t *number)
+{
+	int i;
+
+	for (i = 0; encoding_table[i].name; ++i) {
+		if (strcmp(name, encoding_table[i].name))
+			continue;
+		*number = encoding_table[i].number;
+		return 0;
+	}
+
+	return -1;
+}
+
 int
 get_default_encodings(const int32_t **encodings)
 {
@@ -169,7 +186,7 @@ parse_encodings(struct connection *cx, char *encstr)
 {
 	char *enc;
 	char *end;
-	uint16_t i, j;
+	uint16_t i;
 
 	cx->allowed_encodings = 0;
 	for (enc = encstr - 1; enc; enc = strchr(enc + 1, ',')) {
@@ -188,13 +205,7 @@ parse_encodings(struct connection *cx, char *encstr)
 		end = strchr(enc, ',');
 		if (end)
 			*end = '\0';
-		for (j = 0; encoding_table[j].name; ++j) {
-			if (strcmp(enc, encoding_table[j].name))
-				continue;
-			cx->allow_encoding[i] = encoding_table[j].number;
-			break;
-		}
-		if (!encoding_table[j].name)
+		if (find_encoding(enc, &cx->allow_encoding[i]))
 			return -1;
 		enc = end + 1;
 	}
@@ -248,7 +259,7 @@ static int
 read_password(struct connection *cx, const char *file)
 {
 	FILE *f;
-	static char passwd[9];
+	char passwd[9];
 
 	memset(passwd, 0, sizeof(passwd));
 	f = fopen(file, "rt");
@@ -463,6 +474,49 @@ error:
 	return -1;
 }
 
+static int
+parse_file_window(struct connection *cx, const char *arg)
+{
+	char *end;
+	long window = strtol(arg, &end, 10);
+
+	if (*end || window < 1 || window > 64) {
+		debug(0, "bad file window \"%s\" specified\n", arg);
+		return -1;
+	}
+
+	cx->file_window = window;
+	return 0;
+}
+
+static int
+parse_export(struct connection *cx, const char *arg)
+{
+	const char *comma = strchr(arg, ',');
+	size_t len = comma ? (size_t)(comma - arg) : strlen(arg);
+	char *end;
+	long slots = 4;
+
+	if (comma) {
+		slots = strtol(comma + 1, &end, 10);
+		if (*end || slots < 2 || slots > 64)
+			goto error;
+	}
+	if (!len)
+		goto error;
+
+	free(cx->export_name);
+	cx->export_name = export_shm_name(arg, len);
+	if (!cx->export_name)
+		return -1;
+	cx->export_slots = slots;
+	return 0;
+
+error:
+	debug(0, "bad export \"%s\" specified\n", arg);
+	return -1;
+}
+
 static const char * const help_strings[] = {
 "",
 "If 'server' contains a colon or starts with a literal '[', quote it with",
@@ -483,6 +537,10 @@ static const char * const help_strings[] = {
 "      adjust preferred encoding automatically, the default w/o -e",
 "  -b, --bind <interface>",
 "      the interface to listen to.",
+"  --bw-tiers <file>",
+"      encoding tiers for --auto-encoding, from the slowest link up, as",
+"      lines \"tier <bytes/s> <rtt ms> <encodings>\" (0 for no bound, the",
+"      last tier has none), \"alpha <weight>\" and \"hysteresis <percent>\"",
 #ifdef HAVE_OPENSSL
 "  --cert <pem-file>",
 "      file with certificate chain to use",
@@ -496,6 +554,11 @@ static const char * const help_strings[] = {
 "...ENCODINGS...",
 "  -E, --endian <endian>",
 "      specify little or big endian",
+"  --export <name>[,<slots>]",
+"      publish frames in the shared memory object <name> as a ring of",
+"      <slots> frames (default 4) for local processes to map",
+"  --file-window <chunks>",
+"      number of file transfer chunks to keep in flight (1-64, default 4)",
 "  -f, --pixfmt <pixfmt>",
 "      pixfmt is either r<bits>g<bits>b<bits> (in any order, insert p<bits>",
 "      as desired for padding), c<bits>, server or local",
@@ -505,6 +568,14 @@ static const char * const help_strings[] = {
 "      prints this help text and exits",
 "  -i, --no-input",
 "      no input - peek only, don't poke",
+#ifdef HAVE_OPENSSL
+"  --ktls",
+"      let the kernel do the TLS record layer when it can (Linux)",
+#endif
+"  --latency-bench <count>[,<ms>]",
+"      move the pointer count times, every ms milliseconds (default 100),",
+"      then print the input to photon latency and exit. The server has to",
+"      draw the pointer into the framebuffer",
 "  -l, --listen[=<display>|=:<port>]",
 "      operate in reverse, i.e. listen for connections",
 "  -p, --password <password>",
@@ -514,6 +585,12 @@ static const char * const help_strings[] = {
 "  --priv-key <pem-file>",
 "      private key file for certificate",
 #endif
+"  --realtime",
+"      replay at the pace of the recording, not as fast as possible",
+"  --record <file>",
+"      record what the server sends after the handshake to file",
+"  --replay <file>",
+"      replay a recording made with --record instead of connecting",
 "  --rfb <version>",
 "      the maximum rfb protocol version to use (3.3, 3.7 or 3.8)",
 "  -s, --security-types <security-types>",
@@ -530,6 +607,9 @@ static const char * const help_strings[] = {
 "  --verify-dir <pem-dir>",
 "      directory with trusted certificates",
 #endif
+"  --trace <file>",
+"      write a timestamped trace of input sent, update headers, rectangles",
+"      decoded, frames presented and frames acked to file",
 "  -v, --version",
 "      prints the version of this software and exits",
 "  --view <coordinate>",
@@ -619,13 +699,20 @@ print_help(const char *program)
 #define PF_OPTS "4"
 #endif /* PF_INET6 */
 
-int
-parse_options(struct connection *cx, int argc, char * const argv[])
+static int
+parse_args(struct connection *cx, int argc, char * const argv[])
 {
 	int c;
 	int status = -1;
 
+	/* Start over, this runs once for every session. */
 	opterr = 1;
+	optind = 0;
+#if defined(__APPLE__) || defined(__FreeBSD__) || \
+	defined(__NetBSD__) || defined(__OpenBSD__)
+	optind = 1;
+	optreset = 1;
+#endif
 
 	do {
 		int longidx;
@@ -635,21 +722,29 @@ parse_options(struct connection *cx, int argc, char * const argv[])
 			{ "auto-reconnect",0, NULL, '/' },
 			{ "auto-encoding", 0, NULL, 'A' },
 			{ "bind",          1, NULL, 'b' },
+			{ "bw-tiers",      1, NULL, 'T' },
 			{ "debug",         0, NULL, 'd' },
 			{ "encodings",     1, NULL, 'e' },
 			{ "endian",        1, NULL, 'E' },
+			{ "export",        1, NULL, 'X' },
+			{ "file-window",   1, NULL, 'W' },
 			{ "pixfmt",        1, NULL, 'f' },
 			{ "gii",           1, NULL, '%' },
 			{ "help",          0, NULL, 'h' },
 			{ "no-input",      0, NULL, 'i' },
 			{ "listen",        2, NULL, 'l' },
 			{ "password",      1, NULL, 'p' },
+			{ "realtime",      0, NULL, 'r' },
+			{ "record",        1, NULL, 'R' },
+			{ "replay",        1, NULL, 'P' },
 			{ "rfb",           1, NULL, '#' },
 			{ "security-types",1, NULL, 's' },
 			{ "security-type-force",
 			                   0, NULL, '&' },
 			{ "version",       0, NULL, 'v' },
 			{ "view",          1, NULL, 'V' },
+			{ "trace",         1, NULL, 't' },
+			{ "latency-bench", 1, NULL, 'L' },
 			{ "ipv4",          0, NULL, '4' },
 #ifdef HAVE_OPENSSL
 			{ "ssl-method",    1, NULL, 'M' },
@@ -658,6 +753,7 @@ parse_options(struct connection *cx, int argc, char * const argv[])
 			{ "priv-key",      1, NULL, 'K' },
 			{ "verify-file",   1, NULL, 'F' },
 			{ "verify-dir",    1, NULL, 'D' },
+			{ "ktls",          0, NULL, 'k' },
 #endif
 #ifdef PF_INET6
 			{ "ipv6",          0, NULL, '6' },
@@ -685,6 +781,10 @@ parse_options(struct connection *cx, int argc, char * const argv[])
 			if (parse_bind(cx, optarg))
 				status = 2;
 			break;
+		case 'T':
+			if (bandwidth_load(cx, optarg))
+				status = 2;
+			break;
 		case 'd':
 			set_debug_level(get_debug_level() + 1);
 			break;
@@ -729,6 +829,33 @@ parse_options(struct connection *cx, int argc, char * const argv[])
 				status = 2;
 			}
 			break;
+		case 'X':
+			if (parse_export(cx, optarg))
+				status = 2;
+			break;
+		case 'W':
+			if (parse_file_window(cx, optarg))
+				status = 2;
+			break;
+		case 't':
+			if (latency_trace_open(cx, optarg))
+				status = 2;
+			break;
+		case 'L':
+			if (latency_bench_parse(cx, optarg))
+				status = 2;
+			break;
+		case 'R':
+			if (record_open(cx, optarg))
+				status = 2;
+			break;
+		case 'P':
+			if (replay_load(cx, optarg))
+				status = 2;
+			break;
+		case 'r':
+			cx->record.realtime = 1;
+			break;
 		case '%':
 			cx->gii_input = optarg;
 			break;
@@ -798,6 +925,10 @@ parse_options(struct connection *cx, int argc, char * const argv[])
 			if (vencrypt_set_verify_dir(cx, optarg))
 				status = 2;
 			break;
+		case 'k':
+			if (vencrypt_set_ktls(cx))
+				status = 2;
+			break;
 #endif
 		case ':':
 		case '?':
@@ -856,7 +987,14 @@ parse_options(struct connection *cx, int argc, char * const argv[])
 		return 3;
 	}
 
-	if (cx->listen) {
+	if (cx->record.data) {
+		if (optind < argc) {
+			fprintf(stderr,
+				"Bad, both replaying and connecting...\n");
+			status = 2;
+		}
+	}
+	else if (cx->listen) {
 		if (optind < argc) {
 			fprintf(stderr,
 				"Bad, both listening and connecting...\n");
@@ -897,3 +1035,19 @@ parse_options(struct connection *cx, int argc, char * const argv[])
 
 	return -1;
 }
+
+/* getopt keeps its state in globals, so sessions starting in parallel
+ * take turns.
+ */
+int
+parse_options(struct connection *cx, int argc, char * const argv[])
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int status;
+
+	pthread_mutex_lock(&lock);
+	status = parse_args(cx, argc, argv);
+	pthread_mutex_unlock(&lock);
+
+	return status;
+}
@@ -0,0 +1,404 @@
+/*
+******************************************************************************
+
+   Pixel kernels, specialised per wire pixel format.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <ggi/ggi.h>
+
+extern "C" {
+#include "vnc-pixel.h"
+#include "vnc-kernel.h"
+}
+
+namespace {
+
+#ifdef GGI_BIG_ENDIAN
+const bool host_big = true;
+#else
+const bool host_big = false;
+#endif
+
+/* The local type used to hold an unpacked pixel of a given wire size. */
+template <int Size> struct local;
+template <> struct local<1> { typedef uint8_t type; };
+template <> struct local<2> { typedef uint16_t type; };
+template <> struct local<3> { typedef uint32_t type; };
+template <> struct local<4> { typedef uint32_t type; };
+
+/* Read one pixel stored in wire byte order, swapped if the local
+ * byte order differs from it. Sizes 1, 2 and 4.
+ */
+template <int Size, bool Swap>
+struct wire;
+
+template <bool Swap>
+struct wire<1, Swap> {
+	static inline uint32_t load(const uint8_t *src)
+	{
+		return *src;
+	}
+};
+
+template <bool Swap>
+struct wire<2, Swap> {
+	static inline uint32_t load(const uint8_t *src)
+	{
+		uint16_t pixel;
+		memcpy(&pixel, src, sizeof(pixel));
+		return Swap ? GGI_BYTEREV16(pixel) : pixel;
+	}
+};
+
+template <bool Swap>
+struct wire<4, Swap> {
+	static inline uint32_t load(const uint8_t *src)
+	{
+		uint32_t pixel;
+		memcpy(&pixel, src, sizeof(pixel));
+		return Swap ? GGI_BYTEREV32(pixel) : pixel;
+	}
+};
+
+/* The color value of a 3-byte cpixel of ZRLE or TRLE, read as is. */
+template <bool WireBig>
+struct wire24 {
+	static inline uint32_t load(const uint8_t *src)
+	{
+		if (WireBig)
+			return (src[0] << 16) | (src[1] << 8) | src[2];
+		return src[0] | (src[1] << 8) | (src[2] << 16);
+	}
+};
+
+/* Read one wire pixel as a local pixel. A 3-byte cpixel is the 4-byte
+ * wire pixel with the unused byte left out, the low one if Shift is 8,
+ * the high one otherwise. Put that byte back where the wire byte order
+ * has it and read the four bytes as a 4-byte pixel, so that the swap
+ * follows the local byte order, which may differ from the host's.
+ */
+template <int Size, bool WireBig, bool Swap, int Shift>
+struct load {
+	static inline uint32_t pixel(const uint8_t *src)
+	{
+		return wire<Size, Swap>::load(src) << Shift;
+	}
+};
+
+template <bool WireBig, bool Swap, int Shift>
+struct load<3, WireBig, Swap, Shift> {
+	static inline uint32_t pixel(const uint8_t *src)
+	{
+		uint8_t bytes[4];
+
+		if (WireBig == !Shift) {
+			bytes[0] = 0;
+			memcpy(bytes + 1, src, 3);
+		}
+		else {
+			memcpy(bytes, src, 3);
+			bytes[3] = 0;
+		}
+		return wire<4, Swap>::load(bytes);
+	}
+};
+
+template <int Size, bool WireBig, bool Swap, int Shift>
+struct kernel {
+	typedef typename local<Size>::type pixel_t;
+	typedef load<Size, WireBig, Swap, Shift> wire_pixel;
+
+	static ggi_pixel get(const uint8_t *src)
+	{
+		return wire_pixel::pixel(src);
+	}
+
+	static void unpack(void *dst, const uint8_t *src, int count)
+	{
+		pixel_t *out = (pixel_t *)dst;
+
+		if (!Swap && Size == sizeof(pixel_t)) {
+			if (dst != src)
+				memmove(dst, src, Size * count);
+			return;
+		}
+		if (Swap && Size == 2) {
+			kernels.reverse_16(dst, src, count);
+			return;
+		}
+		if (Swap && Size == 4) {
+			kernels.reverse_32(dst, src, count);
+			return;
+		}
+
+		for (; count > 0; --count, src += Size)
+			*out++ = wire_pixel::pixel(src);
+	}
+
+	static void get_palette(ggi_pixel *palette,
+		const uint8_t *src, int count)
+	{
+		for (; count > 0; --count, src += Size)
+			*palette++ = wire_pixel::pixel(src);
+	}
+
+	static void unpack_palette(void *dst, const uint8_t *src,
+		const ggi_pixel *palette, int w, int h, int bits)
+	{
+		pixel_t *out = (pixel_t *)dst;
+		const uint8_t mask = 0xff >> (8 - bits);
+		int shift;
+		int x;
+
+		if (bits == 8) {
+			for (x = w * h; x > 0; --x)
+				*out++ = palette[*src++];
+			return;
+		}
+		if (bits == 1 && sizeof(pixel_t) == 4) {
+			for (; h > 0; --h) {
+				kernels.expand_bits_32((uint32_t *)out, src,
+					palette[0], palette[1], w);
+				out += w;
+				src += (w + 7) / 8;
+			}
+			return;
+		}
+
+		for (; h > 0; --h) {
+			shift = 8 - bits;
+			for (x = 0; x < w; ++x) {
+				*out++ = palette[(*src >> shift) & mask];
+				shift -= bits;
+				if (shift < 0) {
+					shift = 8 - bits;
+					++src;
+				}
+			}
+			if (shift != 8 - bits)
+				++src;
+		}
+	}
+
+	static void fill(void *dst, ggi_pixel pixel, int count)
+	{
+		pixel_t *out = (pixel_t *)dst;
+		const pixel_t value = pixel;
+
+		while (count-- > 0)
+			*out++ = value;
+	}
+
+	static const struct pixel_ops ops;
+};
+
+template <int Size, bool WireBig, bool Swap, int Shift>
+const struct pixel_ops kernel<Size, WireBig, Swap, Shift>::ops = {
+	Size,
+	sizeof(typename local<Size>::type),
+	!Swap && Size == sizeof(typename local<Size>::type),
+	kernel<Size, WireBig, Swap, Shift>::get,
+	kernel<Size, WireBig, Swap, Shift>::unpack,
+	kernel<Size, WireBig, Swap, Shift>::get_palette,
+	kernel<Size, WireBig, Swap, Shift>::unpack_palette,
+	kernel<Size, WireBig, Swap, Shift>::fill
+};
+
+/* Kernels for a packed 24-bit local visual. The wire pixels are 32-bit
+ * (or the 3-byte compressed pixels of ZRLE and TRLE) with the color in
+ * the low three bytes, as with the pixel format the viewer asks for
+ * when the local visual is packed. 24-bit pixels are always stored
+ * little endian by GGI, so only the wire byte order matters.
+ */
+template <int Size, bool WireBig>
+struct color {
+	static inline uint32_t load(const uint8_t *src)
+	{
+		return wire<Size, WireBig != host_big>::load(src) & 0xffffff;
+	}
+};
+
+template <bool WireBig>
+struct color<3, WireBig> {
+	static inline uint32_t load(const uint8_t *src)
+	{
+		return wire24<WireBig>::load(src);
+	}
+};
+
+template <int Size, bool WireBig>
+struct packed {
+	static const bool wire_big = WireBig;
+
+	static inline void store(uint8_t *dst, uint32_t pixel)
+	{
+		dst[0] = pixel;
+		dst[1] = pixel >> 8;
+		dst[2] = pixel >> 16;
+	}
+
+	static ggi_pixel get(const uint8_t *src)
+	{
+		return color<Size, WireBig>::load(src);
+	}
+
+	static void unpack(void *dst, const uint8_t *src, int count)
+	{
+		static const uint8_t shuffle[4] = {
+			wire_big ? 3 : 0, wire_big ? 2 : 1, wire_big ? 1 : 2,
+			0x80
+		};
+		uint8_t *out = (uint8_t *)dst;
+
+		if (Size == 3 && !wire_big) {
+			if (dst != src)
+				memmove(dst, src, 3 * count);
+			return;
+		}
+		if (Size == 4) {
+			kernels.shuffle_32_24(dst, src, count, shuffle);
+			return;
+		}
+
+		for (; count > 0; --count, src += Size, out += 3)
+			store(out, color<Size, WireBig>::load(src));
+	}
+
+	static void get_palette(ggi_pixel *palette,
+		const uint8_t *src, int count)
+	{
+		for (; count > 0; --count, src += Size)
+			*palette++ = color<Size, WireBig>::load(src);
+	}
+
+	static void unpack_palette(void *dst, const uint8_t *src,
+		const ggi_pixel *palette, int w, int h, int bits)
+	{
+		uint8_t *out = (uint8_t *)dst;
+		const uint8_t mask = 0xff >> (8 - bits);
+		int shift;
+		int x;
+
+		if (bits == 8) {
+			for (x = w * h; x > 0; --x, out += 3)
+				store(out, palette[*src++]);
+			return;
+		}
+
+		for (; h > 0; --h) {
+			shift = 8 - bits;
+			for (x = 0; x < w; ++x, out += 3) {
+				store(out, palette[(*src >> shift) & mask]);
+				shift -= bits;
+				if (shift < 0) {
+					shift = 8 - bits;
+					++src;
+				}
+			}
+			if (shift != 8 - bits)
+				++src;
+		}
+	}
+
+	static void fill(void *dst, ggi_pixel pixel, int count)
+	{
+		uint8_t *out = (uint8_t *)dst;
+
+		while (count-- > 0) {
+			store(out, pixel);
+			out += 3;
+		}
+	}
+
+	static const struct pixel_ops ops;
+};
+
+template <int Size, bool WireBig>
+const struct pixel_ops packed<Size, WireBig>::ops = {
+	Size,
+	3,
+	Size == 3 && !packed<Size, WireBig>::wire_big,
+	packed<Size, WireBig>::get,
+	packed<Size, WireBig>::unpack,
+	packed<Size, WireBig>::get_palette,
+	packed<Size, WireBig>::unpack_palette,
+	packed<Size, WireBig>::fill
+};
+
+} /* namespace */
+
+const struct pixel_ops *
+pixel_ops_lookup(int size, int big, int swap, int shift)
+{
+	switch (size) {
+	case 1:
+		return &kernel<1, false, false, 0>::ops;
+	case 2:
+		if (swap)
+			return &kernel<2, false, true, 0>::ops;
+		return &kernel<2, false, false, 0>::ops;
+	case 3:
+		if (shift == 8) {
+			if (big)
+				return swap ? &kernel<3, true, true, 8>::ops
+					: &kernel<3, true, false, 8>::ops;
+			return swap ? &kernel<3, false, true, 8>::ops
+				: &kernel<3, false, false, 8>::ops;
+		}
+		if (big)
+			return swap ? &kernel<3, true, true, 0>::ops
+				: &kernel<3, true, false, 0>::ops;
+		return swap ? &kernel<3, false, true, 0>::ops
+			: &kernel<3, false, false, 0>::ops;
+	case 4:
+		if (swap)
+			return &kernel<4, false, true, 0>::ops;
+		return &kernel<4, false, false, 0>::ops;
+	}
+
+	return NULL;
+}
+
+const struct pixel_ops *
+pixel_ops_lookup_packed(int size, int big)
+{
+	switch (size) {
+	case 3:
+		if (big)
+			return &packed<3, true>::ops;
+		return &packed<3, false>::ops;
+	case 4:
+		if (big)
+			return &packed<4, true>::ops;
+		return &packed<4, false>::ops;
+	}
+
+	return NULL;
+}
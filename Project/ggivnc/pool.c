@@ -0,0 +1,205 @@
+/*
+******************************************************************************
+
+   VNC viewer conversion thread pool.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "vnc-pool.h"
+#include "vnc-debug.h"
+
+#define POOL_THREADS	16
+#define QUEUE_SIZE	256	/* calls queued at once, a power of two */
+
+struct group {
+	pool_fn *fn;
+	void *arg;
+	int pending;		/* under pool.lock */
+};
+
+struct task {
+	struct group *group;
+	int index;
+};
+
+/* All calls go through one queue. The only work is a few bands of pixel
+ * conversion per rectangle, too little to gain from a queue per worker.
+ */
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a call was queued */
+	pthread_cond_t done;	/* some group finished */
+	int workers;
+	unsigned int head;	/* under lock */
+	unsigned int tail;	/* under lock */
+	struct task task[QUEUE_SIZE];
+	struct pool_stats stats;
+} pool = {
+	PTHREAD_ONCE_INIT,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	0,
+	0,
+	0,
+	{ { NULL, 0 } },
+	{ 0, 0 }
+};
+
+/* Take a call off the queue, with pool.lock held. */
+static int
+take(struct task *task)
+{
+	if (pool.tail == pool.head)
+		return -1;
+	*task = pool.task[pool.head++ & (QUEUE_SIZE - 1)];
+	return 0;
+}
+
+static void
+finish(struct task *task)
+{
+	task->group->fn(task->group->arg, task->index);
+	__atomic_add_fetch(&pool.stats.tasks, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&pool.lock);
+	if (!--task->group->pending)
+		pthread_cond_broadcast(&pool.done);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void *
+pool_worker(void *arg)
+{
+	struct task task;
+
+	(void)arg;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		if (take(&task)) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		finish(&task);
+		pthread_mutex_lock(&pool.lock);
+	}
+	return NULL;
+}
+
+static void
+pool_start(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t thread;
+	int i;
+
+	if (cpus > POOL_THREADS)
+		cpus = POOL_THREADS;
+
+	/* The callers of pool_run make up for the last core. */
+	pool.workers = cpus > 1 ? cpus - 1 : 0;
+	for (i = 0; i < pool.workers; ++i) {
+		if (pthread_create(&thread, NULL, pool_worker, NULL)) {
+			debug(1, "pool: cannot start worker %d\n", i);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	debug(1, "pool: %d worker threads\n", pool.workers);
+}
+
+int
+pool_workers(void)
+{
+	pthread_once(&pool.once, pool_start);
+	return pool.workers;
+}
+
+void
+pool_run(pool_fn *fn, void *arg, int count)
+{
+	struct group group;
+	struct task task;
+	int i;
+
+	pthread_once(&pool.once, pool_start);
+
+	group.fn = fn;
+	group.arg = arg;
+	group.pending = count;
+	task.group = &group;
+
+	/* Call 0 is for the caller, queue the rest. */
+	for (i = count - 1; i > 0; --i) {
+		task.index = i;
+		pthread_mutex_lock(&pool.lock);
+		if (pool.workers && pool.tail - pool.head < QUEUE_SIZE) {
+			pool.task[pool.tail++ & (QUEUE_SIZE - 1)] = task;
+			pthread_cond_signal(&pool.work);
+			pthread_mutex_unlock(&pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		finish(&task);
+	}
+
+	task.index = 0;
+	finish(&task);
+
+	/* Help out, with any session's calls, until ours are done. */
+	pthread_mutex_lock(&pool.lock);
+	while (group.pending) {
+		if (take(&task)) {
+			pthread_cond_wait(&pool.done, &pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		__atomic_add_fetch(&pool.stats.helped, 1, __ATOMIC_RELAXED);
+		finish(&task);
+		pthread_mutex_lock(&pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void
+pool_stats(struct pool_stats *stats)
+{
+	stats->tasks = __atomic_load_n(&pool.stats.tasks, __ATOMIC_RELAXED);
+	stats->helped = __atomic_load_n(&pool.stats.helped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,481 @@
+/*
+******************************************************************************
+
+   VNC viewer session recording and replay.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "vnc.h"
+#include "vnc-debug.h"
+#include "vnc-endian.h"
+#include "vnc-metrics.h"
+
+#define RECORD_MAGIC "GGIVNCR\1"
+#define RECORD_MAGIC_SIZE 8
+
+enum {
+	RECORD_DATA,
+	RECORD_ENCODINGS
+};
+
+#ifdef HAVE_ZLIB
+#define record_fopen(file)		gzopen(file, "wb1")
+#define record_fwrite(f, buf, len)	(gzwrite((gzFile)(f), buf, len) == (int)(len))
+#define record_fclose(f)		gzclose((gzFile)(f))
+#else
+#define record_fopen(file)		fopen(file, "wb")
+#define record_fwrite(f, buf, len)	(fwrite(buf, 1, len, (FILE *)(f)) == (len))
+#define record_fclose(f)		fclose((FILE *)(f))
+#endif
+
+int
+record_open(struct connection *cx, const char *file)
+{
+	if (cx->record.file)
+		record_fclose(cx->record.file);
+	cx->record.file = record_fopen(file);
+	if (!cx->record.file) {
+		debug(0, "cannot open recording %s: %s\n",
+			file, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+put_varint(uint8_t *buf, uint64_t value)
+{
+	int len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = 0x80 | (value & 0x7f);
+		value >>= 7;
+	}
+	buf[len++] = value;
+	return len;
+}
+
+/* A record header, the type and the time since the last record. */
+static int
+put_record(struct connection *cx, uint8_t *buf, int type)
+{
+	uint64_t now = metrics_clock();
+	int len;
+
+	buf[0] = type;
+	len = 1 + put_varint(buf + 1, (now - cx->record.last) / 1000);
+	cx->record.last = now;
+	return len;
+}
+
+static void
+record_write(struct connection *cx, const void *buf, size_t len)
+{
+	if (!cx->record.recording)
+		return;
+	if (record_fwrite(cx->record.file, buf, len))
+		return;
+
+	debug(0, "recording failed, stopped\n");
+	record_fclose(cx->record.file);
+	cx->record.file = NULL;
+	cx->record.recording = 0;
+}
+
+int
+record_start(struct connection *cx)
+{
+	uint8_t buf[32];
+	size_t server_len = strlen(cx->server_pixfmt);
+	size_t wire_len = strlen(cx->wire_pixfmt);
+	size_t name_len = cx->name ? strlen(cx->name) : 0;
+
+	if (!cx->record.file || cx->record.recording)
+		return 0;
+
+	memcpy(buf, RECORD_MAGIC, RECORD_MAGIC_SIZE);
+	insert16_hilo(&buf[8], cx->width);
+	insert16_hilo(&buf[10], cx->height);
+	buf[12] = cx->protocol;
+	buf[13] = cx->server_endian;
+	buf[14] = cx->wire_endian;
+	cx->record.recording = 1;
+	record_write(cx, buf, 15);
+
+	buf[0] = server_len;
+	record_write(cx, buf, 1);
+	record_write(cx, cx->server_pixfmt, server_len);
+	buf[0] = wire_len;
+	record_write(cx, buf, 1);
+	record_write(cx, cx->wire_pixfmt, wire_len);
+	insert32_hilo(buf, name_len);
+	record_write(cx, buf, 4);
+	if (name_len)
+		record_write(cx, cx->name, name_len);
+
+	cx->record.last = metrics_clock();
+
+	/* What came along with the end of the handshake. */
+	if (cx->input.wpos > cx->input.rpos)
+		record_data(cx, cx->input.data + cx->input.rpos,
+			cx->input.wpos - cx->input.rpos);
+
+	return cx->record.recording ? 0 : -1;
+}
+
+void
+record_data(struct connection *cx, const uint8_t *data, int len)
+{
+	uint8_t buf[32];
+	int hdr;
+
+	if (!cx->record.recording)
+		return;
+
+	hdr = put_record(cx, buf, RECORD_DATA);
+	hdr += put_varint(buf + hdr, len);
+	record_write(cx, buf, hdr);
+	if (cx->record.recording)
+		record_write(cx, data, len);
+}
+
+void
+record_encodings(struct connection *cx)
+{
+	uint8_t buf[32];
+	int hdr;
+	uint16_t i;
+
+	if (!cx->record.recording)
+		return;
+
+	hdr = put_record(cx, buf, RECORD_ENCODINGS);
+	hdr += put_varint(buf + hdr, cx->encoding_count);
+	record_write(cx, buf, hdr);
+	for (i = 0; i < cx->encoding_count && cx->record.recording; ++i) {
+		insert32_hilo(buf, cx->encoding[i]);
+		record_write(cx, buf, 4);
+	}
+}
+
+/* Read all of a recording into memory, so that reading the file does
+ * not get in the way of replaying it.
+ */
+int
+replay_load(struct connection *cx, const char *file)
+{
+	struct record *rec = &cx->record;
+	uint8_t *data;
+	size_t size = 0;
+	size_t alloc = 1 << 20;
+	int len;
+#ifdef HAVE_ZLIB
+	gzFile f = gzopen(file, "rb");	/* also reads plain files */
+#else
+	FILE *f = fopen(file, "rb");
+#endif
+
+	if (!f) {
+		debug(0, "cannot open recording %s: %s\n",
+			file, strerror(errno));
+		return -1;
+	}
+
+	free(rec->data);
+	rec->data = NULL;
+	for (;;) {
+		if (size == alloc || !rec->data) {
+			if (rec->data)
+				alloc *= 2;
+			data = (uint8_t *)realloc(rec->data, alloc);
+			if (!data) {
+				debug(0, "out of memory\n");
+				goto fail;
+			}
+			rec->data = data;
+		}
+#ifdef HAVE_ZLIB
+		len = gzread(f, rec->data + size, alloc - size);
+#else
+		len = fread(rec->data + size, 1, alloc - size, f);
+		if (!len && ferror(f))
+			len = -1;
+#endif
+		if (len < 0) {
+			debug(0, "cannot read recording %s\n", file);
+			goto fail;
+		}
+		if (!len)
+			break;
+		size += len;
+	}
+	rec->size = size;
+
+#ifdef HAVE_ZLIB
+	gzclose(f);
+#else
+	fclose(f);
+#endif
+
+	if (size < RECORD_MAGIC_SIZE
+		|| memcmp(rec->data, RECORD_MAGIC, RECORD_MAGIC_SIZE))
+	{
+		debug(0, "%s is not a recording\n", file);
+		free(rec->data);
+		rec->data = NULL;
+		return -1;
+	}
+	return 0;
+
+fail:
+#ifdef HAVE_ZLIB
+	gzclose(f);
+#else
+	fclose(f);
+#endif
+	free(rec->data);
+	rec->data = NULL;
+	return -1;
+}
+
+void
+record_end(struct connection *cx)
+{
+	if (cx->record.file)
+		record_fclose(cx->record.file);
+	cx->record.file = NULL;
+	cx->record.recording = 0;
+	free(cx->record.data);
+	cx->record.data = NULL;
+}
+
+static int
+get_varint(struct record *rec, uint64_t *value)
+{
+	int shift = 0;
+	uint8_t byte;
+
+	*value = 0;
+	do {
+		if (rec->pos == rec->size || shift > 56)
+			return -1;
+		byte = rec->data[rec->pos++];
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return 0;
+}
+
+static int
+get_string(struct record *rec, char *str, size_t size)
+{
+	size_t len;
+
+	if (rec->pos == rec->size)
+		return -1;
+	len = rec->data[rec->pos++];
+	if (len >= size || rec->size - rec->pos < len)
+		return -1;
+	memcpy(str, rec->data + rec->pos, len);
+	str[len] = '\0';
+	rec->pos += len;
+	return 0;
+}
+
+/* Work out when the record at pos is due. */
+static int
+replay_peek(struct connection *cx)
+{
+	struct record *rec = &cx->record;
+	size_t pos = rec->pos;
+	uint64_t us;
+
+	if (rec->pos == rec->size)
+		return 0;
+
+	++rec->pos;
+	if (get_varint(rec, &us)) {
+		debug(1, "recording cut short\n");
+		rec->pos = rec->size;
+		return -1;
+	}
+	rec->pos = pos;
+	rec->due += us * 1000;
+	return 0;
+}
+
+static int
+replay_write(struct connection *cx, const void *buf, int count)
+{
+	(void)cx;
+	(void)buf;
+
+	return count;
+}
+
+int
+replay_open(struct connection *cx)
+{
+	struct record *rec = &cx->record;
+	uint32_t name_len;
+
+	rec->pos = RECORD_MAGIC_SIZE;
+	if (rec->size - rec->pos < 7)
+		goto bad;
+
+	cx->width = get16_hilo(&rec->data[rec->pos]);
+	cx->height = get16_hilo(&rec->data[rec->pos + 2]);
+	cx->protocol = rec->data[rec->pos + 4];
+	cx->server_endian = !!rec->data[rec->pos + 5];
+	cx->wire_endian = !!rec->data[rec->pos + 6];
+	rec->pos += 7;
+
+	if (get_string(rec, cx->server_pixfmt, sizeof(cx->server_pixfmt)))
+		goto bad;
+	if (get_string(rec, cx->wire_pixfmt, sizeof(cx->wire_pixfmt)))
+		goto bad;
+
+	if (rec->size - rec->pos < 4)
+		goto bad;
+	name_len = get32_hilo(&rec->data[rec->pos]);
+	rec->pos += 4;
+	if (rec->size - rec->pos < name_len)
+		goto bad;
+	cx->name = (char *)malloc(name_len + 1);
+	if (!cx->name)
+		return -1;
+	memcpy(cx->name, rec->data + rec->pos, name_len);
+	cx->name[name_len] = '\0';
+	rec->pos += name_len;
+
+	debug(1, "replaying %dx%d \"%s\", wire pixfmt %s\n",
+		cx->width, cx->height, cx->name, cx->wire_pixfmt);
+
+	/* Nothing goes to the server, and nothing is waited for. */
+	cx->safe_write = replay_write;
+	cx->want_read = 0;
+	cx->want_write = 0;
+	cx->close_connection = 0;
+	cx->input.rpos = cx->input.wpos = 0;
+	cx->output.rpos = cx->output.wpos = 0;
+
+	rec->start = 0;
+	rec->due = 0;
+	return replay_peek(cx);
+
+bad:
+	debug(0, "bad recording header\n");
+	return -1;
+}
+
+uint64_t
+replay_deadline(struct connection *cx)
+{
+	struct record *rec = &cx->record;
+
+	if (!rec->data)
+		return 0;
+	if (!rec->realtime || !rec->start)
+		return 1;
+	return rec->start + rec->due;
+}
+
+static void
+replay_data(struct connection *cx, const uint8_t *data, size_t len)
+{
+	if (cx->input.wpos + len > (size_t)cx->input.size) {
+		if (buffer_reserve(&cx->input, cx->input.wpos + len + 65536)) {
+			close_connection(cx, -1);
+			return;
+		}
+	}
+	memcpy(cx->input.data + cx->input.wpos, data, len);
+	vnc_received(cx, len);
+}
+
+int
+replay_tick(struct connection *cx)
+{
+	struct record *rec = &cx->record;
+	uint64_t now = metrics_clock();
+	uint64_t us, value;
+	uint8_t type;
+
+	if (!rec->data)
+		return 0;
+	if (!rec->start)
+		rec->start = now;
+
+	while (!cx->close_connection) {
+		if (rec->pos == rec->size)
+			return 1;
+		if (rec->realtime && rec->start + rec->due > now)
+			return 0;
+
+		type = rec->data[rec->pos++];
+		if (get_varint(rec, &us) || get_varint(rec, &value))
+			goto bad;
+
+		switch (type) {
+		case RECORD_DATA:
+			if (rec->size - rec->pos < value)
+				goto bad;
+			replay_data(cx, rec->data + rec->pos, value);
+			rec->pos += value;
+			break;
+		case RECORD_ENCODINGS:
+			if ((rec->size - rec->pos) / 4 < value)
+				goto bad;
+			rec->pos += 4 * value;
+			break;
+		default:
+			goto bad;
+		}
+
+		if (replay_peek(cx))
+			return 1;
+
+		/* Let the loop look at input and acks in between. */
+		if (!rec->realtime && type == RECORD_DATA)
+			return 0;
+	}
+	return 0;
+
+bad:
+	debug(1, "bad record at %lu\n", (unsigned long)rec->pos);
+	close_connection(cx, -1);
+	return 0;
+}
@@ -56,6 +56,7 @@ scrollbar_process(struct connection *cx, gii_event *event)
 		return 0;
 
 	ggiWidgetRedrawWidgets(visualanchor);
+	damage_all(cx);
 	ggiCrossBlit(cx->wire_stem,
 		cx->slide.x, cx->slide.y,
 		cx->area.x, cx->area.y,
@@ -56,6 +56,8 @@
 #include "vnc-compat.h"
 #include "vnc-endian.h"
 #include "vnc-debug.h"
+#include "vnc-metrics.h"
+#include "vnc-tls.h"
 
 #ifdef HAVE_WIDGETS
 #include "dialog.h"
@@ -68,6 +70,20 @@ struct options {
 	char *priv_key;
 	char *verify_file;
 	char *verify_dir;
+	int ktls;
+	struct tls_cache *cache;
+};
+
+/* What survives a reconnect to the same server, so that the TLS session
+ * can be resumed and a certificate the user has already accepted does
+ * not have to be confirmed again.
+ */
+struct tls_cache {
+	struct tls_cache *next;
+	char *server;
+	int port;
+	SSL_SESSION *session;
+	char *fingerprint;
 };
 
 struct vencrypt {
@@ -76,8 +92,14 @@ struct vencrypt {
 	BIO *ssl_bio;
 	int write_wants_read;
 	int read_wants_write;
+	int ktls_checked;
 	action_t *action;
 
+	/* The plain socket handlers, for when the kernel does TLS. */
+	int (*read_ready)(struct connection *cx);
+	int (*write_ready)(struct connection *cx);
+	int (*safe_write)(struct connection *cx, const void *buf, int count);
+
 	uint32_t subtype;
 	struct options *opt;
 };
@@ -383,6 +405,60 @@ log_error(void)
 	}
 }
 
+/* Once the handshake is done, see if OpenSSL managed to hand the keys
+ * to the kernel TLS ULP in both directions. If so, and OpenSSL has
+ * nothing buffered, the socket is left to the plain handlers and the
+ * data no longer goes through OpenSSL at all.
+ *
+ * Only TLS 1.2 is moved over. A TLS 1.3 server sends session tickets
+ * and key updates after the handshake, and a plain read() fails on
+ * such records, so there the kernel does the crypto but the records
+ * still go through SSL_read and SSL_write.
+ */
+#ifdef SSL_OP_ENABLE_KTLS
+static void
+ktls_check(struct connection *cx, SSL *ssl)
+{
+	struct vencrypt *vencrypt = cx->vencrypt;
+	int send, recv;
+
+	if (vencrypt->ktls_checked || !vencrypt->opt->ktls)
+		return;
+	if (!SSL_is_init_finished(ssl))
+		return;
+	vencrypt->ktls_checked = 1;
+
+	send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+	recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+	debug(1, "ktls send %s, receive %s\n",
+		send ? "on" : "off", recv ? "on" : "off");
+
+	if (!send || !recv)
+		return;
+	if (SSL_version(ssl) != TLS1_2_VERSION) {
+		debug(1, "ktls: keeping SSL_read/SSL_write for %s\n",
+			SSL_get_version(ssl));
+		return;
+	}
+	if (SSL_has_pending(ssl) ||
+		vencrypt->write_wants_read || vencrypt->read_wants_write)
+	{
+		debug(1, "ktls: OpenSSL has pending data, not switching\n");
+		return;
+	}
+
+	cx->read_ready = vencrypt->read_ready;
+	cx->write_ready = vencrypt->write_ready;
+	cx->safe_write = vencrypt->safe_write;
+	debug(1, "ktls: plain socket i/o\n");
+}
+#else
+static inline void
+ktls_check(struct connection *cx, SSL *ssl)
+{
+}
+#endif /* SSL_OP_ENABLE_KTLS */
+
 static int
 tls_safe_write(struct connection *cx, const void *buf, int count)
 {
@@ -401,9 +477,14 @@ tls_safe_write(struct connection *cx, const void *buf, int count)
 
 again:
 	res = SSL_write(ssl, buf, count);
+	metrics_add(&cx->metrics.writes, 1);
+	if (res > 0)
+		metrics_add(&cx->metrics.bytes_out, res);
 
-	if (res == count)
+	if (res == count) {
+		ktls_check(cx, ssl);
 		return res + written;
+	}
 
 	if (res > 0) {
 		count -= res;
@@ -473,6 +554,7 @@ again:
 	else
 		request = cx->input.size - cx->input.wpos;
 	len = SSL_read(ssl, cx->input.data + cx->input.wpos, request);
+	metrics_add(&cx->metrics.reads, 1);
 
 	switch (SSL_get_error(ssl, len)) {
 	case SSL_ERROR_NONE:
@@ -504,6 +586,8 @@ again:
 
 	debug(3, "len=%li\n", len);
 
+	cx->cost.received += len;
+	metrics_add(&cx->metrics.bytes_in, len);
 	if (cx->bw.counting) {
 		if (!cx->bw.count)
 			bandwidth_start(cx, len);
@@ -512,10 +596,14 @@ again:
 	}
 
 	cx->input.wpos += len;
+	metrics_max(&cx->metrics.input_high_water,
+		cx->input.wpos - cx->input.rpos);
 
 	if (SSL_pending(ssl))
 		goto again;
 
+	ktls_check(cx, ssl);
+
 run_actions:
 	while (cx->action(cx));
 
@@ -683,6 +771,87 @@ msg_callback(int write_p, int version, int content_type,
 	debug(2, "msg %s: %s %s: len %d\n", str, ver, content, len);
 }
 
+static struct tls_cache *
+cache_lookup(struct connection *cx, int create)
+{
+	struct vencrypt *vencrypt = cx->vencrypt;
+	struct options *opt = vencrypt->opt;
+	struct tls_cache *entry;
+
+	if (!cx->server)
+		return NULL;
+
+	for (entry = opt->cache; entry; entry = entry->next) {
+		if (entry->port == cx->port && !strcmp(entry->server, cx->server))
+			return entry;
+	}
+
+	if (!create)
+		return NULL;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return NULL;
+	memset(entry, 0, sizeof(*entry));
+	entry->server = strdup(cx->server);
+	if (!entry->server) {
+		free(entry);
+		return NULL;
+	}
+	entry->port = cx->port;
+	entry->next = opt->cache;
+	opt->cache = entry;
+	return entry;
+}
+
+static void
+cache_free(struct options *opt)
+{
+	struct tls_cache *entry;
+
+	while (opt->cache) {
+		entry = opt->cache;
+		opt->cache = entry->next;
+		if (entry->session)
+			SSL_SESSION_free(entry->session);
+		if (entry->fingerprint)
+			free(entry->fingerprint);
+		free(entry->server);
+		free(entry);
+	}
+}
+
+/* Called by OpenSSL for every session the server hands out, which with
+ * TLS 1.3 may be after the handshake is finished. Keep the newest one.
+ */
+static int
+new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+	struct connection *cx = SSL_get_app_data(ssl);
+	struct tls_cache *entry;
+
+	if (!cx || !cx->vencrypt)
+		return 0;
+	entry = cache_lookup(cx, 1);
+	if (!entry)
+		return 0;
+
+	debug(2, "tls session cached\n");
+	if (entry->session)
+		SSL_SESSION_free(entry->session);
+	entry->session = session;
+	return 1;
+}
+
+static void
+handshake_done(SSL *ssl)
+{
+	if (SSL_session_reused(ssl))
+		debug(1, "tls session resumed\n");
+	else
+		debug(1, "full tls handshake\n");
+}
+
 static struct vencrypt *
 get_vencrypt(struct connection *cx)
 {
@@ -739,15 +908,21 @@ start_tls(struct connection *cx, const char *ciphers)
 	ERR_load_BIO_strings();
 	SSL_library_init();
 
+	/* Recent OpenSSL has no SSLv2, and often no SSLv3. */
+	ssl_ctx = NULL;
 	switch (opt->method) {
 	case 1:
 		ssl_ctx = SSL_CTX_new(TLSv1_client_method());
 		break;
 	case 2:
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined OPENSSL_NO_SSL2
 		ssl_ctx = SSL_CTX_new(SSLv2_client_method());
+#endif
 		break;
 	case 3:
+#ifndef OPENSSL_NO_SSL3_METHOD
 		ssl_ctx = SSL_CTX_new(SSLv3_client_method());
+#endif
 		break;
 	case -1:
 		ssl_ctx = SSL_CTX_new(SSLv23_client_method());
@@ -771,6 +946,21 @@ start_tls(struct connection *cx, const char *ciphers)
 	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
 	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
+	/* The SSL_CTX does not outlive the connection, keep the sessions
+	 * in opt instead of in the internal cache.
+	 */
+	SSL_CTX_set_session_cache_mode(ssl_ctx,
+		SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, new_session_cb);
+
+	if (opt->ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+		debug(1, "ktls not supported by this OpenSSL\n");
+#endif
+	}
+
 	if (opt->cert) {
 		if (!SSL_CTX_use_certificate_chain_file(ssl_ctx, opt->cert)) {
 			debug(1, "Failed to load certificate chain\n");
@@ -826,6 +1016,17 @@ start_tls(struct connection *cx, const char *ciphers)
 		goto err_ctx;
 	}
 
+	SSL_set_app_data(ssl, cx);
+	{
+		struct tls_cache *entry = cache_lookup(cx, 0);
+
+		if (entry && entry->session) {
+			debug(1, "trying to resume tls session\n");
+			if (!SSL_set_session(ssl, entry->session))
+				log_error();
+		}
+	}
+
 	socket_bio = BIO_new_socket(cx->sfd, BIO_NOCLOSE);
 	if (!socket_bio) {
 		debug(1, "Failed to create socket BIO\n");
@@ -838,6 +1039,13 @@ start_tls(struct connection *cx, const char *ciphers)
 
 		debug(1, "premature data (%d bytes) received w/o ssl\n",
 			cx->input.wpos - cx->input.rpos);
+#ifdef SSL_OP_ENABLE_KTLS
+		/* The kernel would not see the buffered records. */
+		if (opt->ktls) {
+			debug(1, "no ktls with premature data\n");
+			SSL_clear_options(ssl, SSL_OP_ENABLE_KTLS);
+		}
+#endif
 
 		if (!fbio) {
 			debug(1, "Failed to create buffer BIO\n");
@@ -868,6 +1076,9 @@ start_tls(struct connection *cx, const char *ciphers)
 		goto err_socket_bio;
 	}
 
+	vencrypt->write_ready = cx->write_ready;
+	vencrypt->read_ready = cx->read_ready;
+	vencrypt->safe_write = cx->safe_write;
 	cx->write_ready = tls_write_ready;
 	cx->read_ready = tls_read_ready;
 	cx->safe_write = tls_safe_write;
@@ -932,6 +1143,7 @@ vnc_security_vencrypt_verify_no_peer(struct connection *cx)
 	}
 	if (!SSL_is_init_finished(ssl))
 		return 0;
+	handshake_done(ssl);
 	/* Handshake done, check that the connection is really anonymous. */
 	peer = SSL_get_peer_certificate(ssl);
 	if (peer) {
@@ -970,7 +1182,6 @@ cert_fingerprint(X509 *cert)
 	unsigned char *der = NULL;
 	unsigned char *tmp;
 	int der_len;
-	EVP_MD_CTX ctx;
 	unsigned char fp[EVP_MAX_MD_SIZE];
 	unsigned int fp_len;
 	unsigned int i;
@@ -992,23 +1203,8 @@ cert_fingerprint(X509 *cert)
 		goto cleanup;
 	}
 
-	EVP_MD_CTX_init(&ctx);
-	if (!EVP_DigestInit_ex(&ctx, EVP_sha1(), NULL)) {
-		debug(1, "Failed to initialize digest.\n");
-		goto cleanup;
-	}
-	if (!EVP_DigestUpdate(&ctx, der, der_len)) {
-		debug(1, "Failed to update digest.\n");
-		EVP_MD_CTX_cleanup(&ctx);
-		goto cleanup;
-	}
-	if (!EVP_DigestFinal_ex(&ctx, fp, &fp_len)) {
-		debug(1, "Failed to finalize digest.\n");
-		EVP_MD_CTX_cleanup(&ctx);
-		goto cleanup;
-	}
-	if (!EVP_MD_CTX_cleanup(&ctx)) {
-		debug(1, "Failed to cleanup digest.\n");
+	if (!EVP_Digest(der, der_len, fp, &fp_len, EVP_sha1(), NULL)) {
+		debug(1, "Failed to digest cert.\n");
 		goto cleanup;
 	}
 
@@ -1066,6 +1262,8 @@ vnc_security_vencrypt_verify_peer(struct connection *cx)
 	STACK_OF(X509) *sk;
 	X509 *peer;
 	char *fingerprint;
+	char *peer_fp;
+	struct tls_cache *entry;
 	BIO *mem;
 	char *buf;
 	const char nul = '\0';
@@ -1083,6 +1281,7 @@ vnc_security_vencrypt_verify_peer(struct connection *cx)
 	}
 	if (!SSL_is_init_finished(ssl))
 		return 0;
+	handshake_done(ssl);
 	/* Handshake done, check the peer certificate. */
 	peer = SSL_get_peer_certificate(ssl);
 	if (!peer) {
@@ -1090,10 +1289,25 @@ vnc_security_vencrypt_verify_peer(struct connection *cx)
 		return close_connection(cx, -1);
 	}
 	if (SSL_get_verify_result(ssl) == X509_V_OK) {
+		X509_free(peer);
 		cx->action = vencrypt->action;
 		return 1;
 	}
 
+	/* Don't ask again about a certificate that was accepted before. */
+	entry = cache_lookup(cx, 1);
+	fingerprint = cert_fingerprint(peer);
+	X509_free(peer);
+	if (entry && entry->fingerprint && fingerprint &&
+		!strcmp(entry->fingerprint, fingerprint))
+	{
+		debug(1, "certificate accepted before\n");
+		free(fingerprint);
+		cx->action = vencrypt->action;
+		return 1;
+	}
+	peer_fp = fingerprint;
+
 	mem = BIO_new(BIO_s_mem());
 	BIO_set_close(mem, BIO_CLOSE);
 
@@ -1165,7 +1379,15 @@ vnc_security_vencrypt_verify_peer(struct connection *cx)
 	}
 
 	result = show_cert_chain(cx, GG_SIMPLEQ_FIRST(&chain));
+	if (!result && entry && peer_fp) {
+		if (entry->fingerprint)
+			free(entry->fingerprint);
+		entry->fingerprint = peer_fp;
+		peer_fp = NULL;
+	}
 out:
+	if (peer_fp)
+		free(peer_fp);
 	while (!GG_SIMPLEQ_EMPTY(&chain)) {
 		struct cert_level *level = GG_SIMPLEQ_FIRST(&chain);
 		GG_SIMPLEQ_REMOVE_HEAD(&chain, next_cert);
@@ -1381,6 +1603,12 @@ vnc_security_vencrypt_end(struct connection *cx, int keep_opt)
 	if (!vencrypt)
 		return;
 
+	if (vencrypt->ssl_bio) {
+		SSL *ssl = NULL;
+
+		BIO_get_ssl(vencrypt->ssl_bio, &ssl);
+		tls_keep_session(ssl);
+	}
 	BIO_free_all(vencrypt->ssl_bio);
 	SSL_CTX_free(vencrypt->ssl_ctx);
 	opt = vencrypt->opt;
@@ -1401,6 +1629,7 @@ vnc_security_vencrypt_end(struct connection *cx, int keep_opt)
 		free(opt->verify_file);
 	if (opt->verify_dir)
 		free(opt->verify_dir);
+	cache_free(opt);
 	free(opt);
 	free(cx->vencrypt);
 	cx->vencrypt = NULL;
@@ -1562,6 +1791,21 @@ vencrypt_set_verify_file(struct connection *cx, const char *verify_file)
 	return 0;
 }
 
+int
+vencrypt_set_ktls(struct connection *cx)
+{
+	struct vencrypt *vencrypt;
+
+	vencrypt = get_vencrypt(cx);
+	if (!vencrypt)
+		return -1;
+	cx->vencrypt = vencrypt;
+
+	vencrypt->opt->ktls = 1;
+
+	return 0;
+}
+
 int
 vencrypt_set_verify_dir(struct connection *cx, const char *verify_dir)
 {
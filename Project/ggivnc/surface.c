@@ -0,0 +1,80 @@
+/*
+******************************************************************************
+
+   VNC viewer pixel-linear drawing surface.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <ggi/ggi.h>
+
+#include "vnc-surface.h"
+#include "vnc-debug.h"
+
+/* Look up the direct buffer of the current write frame. Only simple
+ * pixel-linear buffers that need no resource locking are drawn to
+ * directly, anything else goes through libggi.
+ */
+void
+surface_bind(struct surface *sf, ggi_visual_t stem)
+{
+	const ggi_directbuffer *db;
+	ggi_mode mode;
+	int frame;
+	int i;
+
+	sf->stem = stem;
+	sf->base = NULL;
+
+	if (!stem)
+		return;
+
+	frame = ggiGetWriteFrame(stem);
+	for (i = ggiDBGetNumBuffers(stem); i--;) {
+		db = ggiDBGetBuffer(stem, i);
+		if (db && db->frame == frame)
+			break;
+	}
+	if (i < 0)
+		return;
+
+	if (!(db->type & GGI_DB_SIMPLE_PLB))
+		return;
+	if (db->layout != blPixelLinearBuffer || db->resource || !db->write)
+		return;
+	if (db->buffer.plb.pixelformat->size & 7)
+		return;
+
+	ggiGetMode(stem, &mode);
+
+	sf->stride = db->buffer.plb.stride;
+	sf->bpp = db->buffer.plb.pixelformat->size / 8;
+	sf->width = mode.virt.x;
+	sf->height = mode.virt.y;
+	sf->base = (uint8_t *)db->write;
+}
@@ -0,0 +1,146 @@
+/*
+******************************************************************************
+
+   Input queue wakeup test.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "vnc-inputq.h"
+
+int ggivnc_debug_level;
+
+/* Pushes an event while inputq_rearm runs, and checks that the next
+ * event still wakes the consumer. The push is done from read(), which
+ * the rearm calls to drain the pipe, so it lands just before or just
+ * after the drain, every time. A wakeup lost there leaves the signal
+ * up with the pipe empty, and no later push writes to the pipe again.
+ */
+enum { PUSH_NONE, PUSH_BEFORE_READ, PUSH_AFTER_READ };
+
+static struct inputq q;
+static int push_in_read;
+
+static void
+push(void)
+{
+	static const uint8_t msg[6] = { 5 };
+
+	if (inputq_push(&q, msg, sizeof(msg)) < 0)
+		fprintf(stderr, "queue full\n");
+}
+
+ssize_t
+read(int fd, void *buf, size_t count)
+{
+	int when = fd == q.fd[0] ? push_in_read : PUSH_NONE;
+	ssize_t res;
+
+	push_in_read = PUSH_NONE;
+	if (when == PUSH_BEFORE_READ)
+		push();
+	res = syscall(SYS_read, fd, buf, count);
+	if (when == PUSH_AFTER_READ)
+		push();
+	return res;
+}
+
+static int
+readable(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = q.fd[0];
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/* The loop, woken up: rearm and take everything. */
+static int
+consume(int when)
+{
+	uint8_t buf[256];
+	int len, keys;
+	int events = 0;
+
+	push_in_read = when;
+	inputq_rearm(&q);
+	while ((len = inputq_pop(&q, buf, sizeof(buf), &keys)) > 0)
+		events += len / 6;
+	return events;
+}
+
+static int
+check(const char *name, int when)
+{
+	int events;
+
+	/* A woken loop, with one event waiting. */
+	push();
+	if (!readable()) {
+		fprintf(stderr, "%s: first push did not wake\n", name);
+		return 1;
+	}
+
+	events = consume(when);
+	if (readable())
+		events += consume(PUSH_NONE);
+	if (events != 2) {
+		fprintf(stderr, "%s: took %d events, not 2\n", name, events);
+		return 1;
+	}
+
+	push();
+	if (!readable()) {
+		fprintf(stderr, "%s: lost wakeup\n", name);
+		return 1;
+	}
+	consume(PUSH_NONE);
+	return 0;
+}
+
+int
+main(void)
+{
+	int res = 0;
+
+	if (inputq_init(&q)) {
+		fprintf(stderr, "cannot create the queue pipe\n");
+		return 1;
+	}
+
+	res |= check("push before the drain", PUSH_BEFORE_READ);
+	res |= check("push after the drain", PUSH_AFTER_READ);
+
+	inputq_fini(&q);
+	return res;
+}
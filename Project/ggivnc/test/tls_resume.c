@@ -0,0 +1,212 @@
+/*
+******************************************************************************
+
+   TLS session resumption test.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "vnc-tls.h"
+
+/* Connects twice to a local TLS server, set up like the VeNCrypt
+ * client: sessions kept outside of the SSL_CTX by a new session
+ * callback, the connection dropped without a close_notify. The second
+ * connection has to resume the session of the first, with TLS 1.2 and
+ * with TLS 1.3.
+ */
+static SSL_CTX *server_ctx;
+static SSL_SESSION *cached;
+
+static int
+new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+	(void)ssl;
+	if (cached)
+		SSL_SESSION_free(cached);
+	cached = session;
+	return 1;
+}
+
+static EVP_PKEY *
+make_key(void)
+{
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	EVP_PKEY *key = NULL;
+
+	if (ctx && EVP_PKEY_keygen_init(ctx) > 0
+		&& EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+			NID_X9_62_prime256v1) > 0)
+	{
+		EVP_PKEY_keygen(ctx, &key);
+	}
+	EVP_PKEY_CTX_free(ctx);
+	return key;
+}
+
+static int
+server_setup(void)
+{
+	EVP_PKEY *key = make_key();
+	X509 *cert = X509_new();
+	int ok;
+
+	server_ctx = SSL_CTX_new(TLS_server_method());
+	ok = key && cert && server_ctx
+		&& ASN1_INTEGER_set(X509_get_serialNumber(cert), 1)
+		&& X509_gmtime_adj(X509_getm_notBefore(cert), 0)
+		&& X509_gmtime_adj(X509_getm_notAfter(cert), 3600)
+		&& X509_set_pubkey(cert, key)
+		&& X509_NAME_add_entry_by_txt(X509_get_subject_name(cert),
+			"CN", MBSTRING_ASC, (const unsigned char *)"ggivnc",
+			-1, -1, 0)
+		&& X509_set_issuer_name(cert, X509_get_subject_name(cert))
+		&& X509_sign(cert, key, EVP_sha256())
+		&& SSL_CTX_use_certificate(server_ctx, cert) == 1
+		&& SSL_CTX_use_PrivateKey(server_ctx, key) == 1;
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ok ? 0 : -1;
+}
+
+/* One connection: handshake, one byte to the client, which gives a
+ * TLS 1.3 client its tickets, then wait for the client to go away.
+ */
+static void *
+serve(void *arg)
+{
+	int fd = *(int *)arg;
+	SSL *ssl = SSL_new(server_ctx);
+	char byte = 0;
+
+	SSL_set_fd(ssl, fd);
+	if (SSL_accept(ssl) == 1 && SSL_write(ssl, &byte, 1) == 1)
+		SSL_read(ssl, &byte, 1);
+	SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_free(ssl);
+	close(fd);
+	return NULL;
+}
+
+/* Returns 1 if the session was resumed, 0 if not, -1 on failure. */
+static int
+client_connect(int version)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	pthread_t server;
+	SSL *ssl = NULL;
+	int fd[2];
+	char byte;
+	int res = -1;
+
+	if (!ctx || socketpair(AF_UNIX, SOCK_STREAM, 0, fd))
+		return -1;
+	if (pthread_create(&server, NULL, serve, &fd[1])) {
+		close(fd[0]);
+		close(fd[1]);
+		SSL_CTX_free(ctx);
+		return -1;
+	}
+
+	/* As in vencrypt.c, a new SSL_CTX for every connection. */
+	SSL_CTX_set_min_proto_version(ctx, version);
+	SSL_CTX_set_max_proto_version(ctx, version);
+	SSL_CTX_set_session_cache_mode(ctx,
+		SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+
+	ssl = SSL_new(ctx);
+	if (ssl) {
+		SSL_set_fd(ssl, fd[0]);
+		if (cached)
+			SSL_set_session(ssl, cached);
+		if (SSL_connect(ssl) == 1 && SSL_read(ssl, &byte, 1) == 1)
+			res = SSL_session_reused(ssl);
+		tls_keep_session(ssl);
+		SSL_free(ssl);
+	}
+	shutdown(fd[0], SHUT_RDWR);
+	close(fd[0]);
+	pthread_join(server, NULL);
+	SSL_CTX_free(ctx);
+	return res;
+}
+
+static int
+check(const char *name, int version)
+{
+	int first, second;
+
+	if (cached)
+		SSL_SESSION_free(cached);
+	cached = NULL;
+
+	first = client_connect(version);
+	second = client_connect(version);
+	if (first < 0 || second < 0) {
+		fprintf(stderr, "%s: connection failed\n", name);
+		return 1;
+	}
+	if (first || !second) {
+		fprintf(stderr, "%s: session %s\n", name,
+			first ? "resumed on the first connection"
+			: "not resumed on reconnect");
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(void)
+{
+	int res = 0;
+
+	/* A side that gives up writes to a closed socket. */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (server_setup()) {
+		fprintf(stderr, "cannot set up the server\n");
+		return 1;
+	}
+
+	res |= check("TLS 1.2", TLS1_2_VERSION);
+	res |= check("TLS 1.3", TLS1_3_VERSION);
+
+	if (cached)
+		SSL_SESSION_free(cached);
+	SSL_CTX_free(server_ctx);
+	return res;
+}
@@ -0,0 +1,232 @@
+/*
+******************************************************************************
+
+   VNC viewer thumbnails.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ggi/ggi.h>
+
+#include "vnc-thumbnail.h"
+#include "vnc-kernel.h"
+#include "vnc-debug.h"
+
+#define MAX_FACTOR 256
+
+int
+thumbnail_resize(struct thumbnail *th, int width, int height)
+{
+	int factor, fx, fy;
+	int cols, rows;
+
+	fx = (width + th->max_width - 1) / th->max_width;
+	fy = (height + th->max_height - 1) / th->max_height;
+	factor = fx > fy ? fx : fy;
+	if (factor < 1)
+		factor = 1;
+	if (factor > MAX_FACTOR)
+		factor = MAX_FACTOR;
+	cols = (width + factor - 1) / factor;
+	rows = (height + factor - 1) / factor;
+
+	free(th->pixels);
+	free(th->sum);
+	free(th->span);
+	th->pixels = (uint32_t *)calloc(cols * rows, sizeof(*th->pixels));
+	th->sum = (uint32_t *)malloc(4 * cols * sizeof(*th->sum));
+	th->span = (int *)malloc(2 * rows * sizeof(*th->span));
+	if (!th->pixels || !th->sum || !th->span) {
+		thumbnail_free(th);
+		return -1;
+	}
+
+	th->src_width = width;
+	th->src_height = height;
+	th->factor = factor;
+	th->width = cols;
+	th->height = rows;
+	th->damaged = 0;
+	for (fy = 0; fy < rows; ++fy) {
+		th->span[2 * fy] = cols;
+		th->span[2 * fy + 1] = 0;
+	}
+	thumbnail_damage(th, 0, 0, width, height);
+
+	debug(1, "thumbnail %dx%d, 1/%d of %dx%d\n",
+		cols, rows, factor, width, height);
+	return 0;
+}
+
+void
+thumbnail_damage(struct thumbnail *th, int x, int y, int w, int h)
+{
+	int x0, x1, y0, y1;
+	int *span;
+
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > th->src_width)
+		w = th->src_width - x;
+	if (y + h > th->src_height)
+		h = th->src_height - y;
+	if (w <= 0 || h <= 0 || !th->span)
+		return;
+
+	x0 = x / th->factor;
+	x1 = (x + w - 1) / th->factor + 1;
+	y0 = y / th->factor;
+	y1 = (y + h - 1) / th->factor + 1;
+
+	for (; y0 < y1; ++y0) {
+		span = &th->span[2 * y0];
+		if (span[0] >= span[1])
+			++th->damaged;
+		if (span[0] > x0)
+			span[0] = x0;
+		if (span[1] < x1)
+			span[1] = x1;
+	}
+}
+
+/* Average one row of thumbnail pixels, columns x0 up to x1. */
+static void
+render_span(struct thumbnail *th, const uint8_t *src, int stride,
+	int ty, int x0, int x1)
+{
+	int f = th->factor;
+	int rows = th->src_height - ty * f;
+	int full = th->src_width / f;
+	int tail = th->src_width % f;
+	int count = (x1 < full ? x1 : full) - x0;
+	uint32_t *sum = th->sum;
+	uint8_t *out = (uint8_t *)&th->pixels[ty * th->width + x0];
+	uint32_t n, half;
+	int i, r;
+
+	if (rows > f)
+		rows = f;
+	memset(sum, 0, 4 * (x1 - x0) * sizeof(*sum));
+
+	src += (size_t)ty * f * stride + (size_t)x0 * f * 4;
+	for (r = 0; r < rows; ++r, src += stride) {
+		if (count > 0)
+			kernels.box_32(sum, src, count, f);
+		if (x1 > full && tail)
+			kernels.box_32(sum + 4 * (x1 - x0 - 1),
+				src + (size_t)(x1 - 1 - x0) * f * 4, 1, tail);
+	}
+
+	for (i = x0; i < x1; ++i, sum += 4, out += 4) {
+		n = rows * (i < full ? f : tail);
+		half = n / 2;
+		out[0] = (sum[0] + half) / n;
+		out[1] = (sum[1] + half) / n;
+		out[2] = (sum[2] + half) / n;
+		out[3] = (sum[3] + half) / n;
+	}
+}
+
+void
+thumbnail_render(struct thumbnail *th, const uint8_t *src, int stride,
+	ggi_coord *tl, ggi_coord *br)
+{
+	int ty;
+	int *span;
+
+	tl->x = th->width;
+	tl->y = th->height;
+	br->x = br->y = 0;
+
+	for (ty = 0; th->damaged && ty < th->height; ++ty) {
+		span = &th->span[2 * ty];
+		if (span[0] >= span[1])
+			continue;
+
+		render_span(th, src, stride, ty, span[0], span[1]);
+
+		if (tl->x > span[0])
+			tl->x = span[0];
+		if (br->x < span[1])
+			br->x = span[1];
+		if (tl->y > ty)
+			tl->y = ty;
+		br->y = ty + 1;
+
+		span[0] = th->width;
+		span[1] = 0;
+		--th->damaged;
+	}
+	if (tl->x > br->x)
+		*tl = *br;
+}
+
+void
+thumbnail_free(struct thumbnail *th)
+{
+	free(th->pixels);
+	free(th->sum);
+	free(th->span);
+	th->pixels = NULL;
+	th->sum = NULL;
+	th->span = NULL;
+	th->width = th->height = 0;
+	th->src_width = th->src_height = 0;
+	th->damaged = 0;
+}
+
+static int
+byte_channel(ggi_pixel mask)
+{
+	int shift;
+
+	if (!mask)
+		return 1;
+	for (shift = 0; shift < 32; shift += 8) {
+		if (!(mask & ~((ggi_pixel)0xff << shift)))
+			return 1;
+	}
+	return 0;
+}
+
+int
+thumbnail_supported(const ggi_pixelformat *pf)
+{
+	return pf->size == 32 &&
+		byte_channel(pf->red_mask) &&
+		byte_channel(pf->green_mask) &&
+		byte_channel(pf->blue_mask);
+}
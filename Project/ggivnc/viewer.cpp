@@ -0,0 +1,304 @@
+/*
+******************************************************************************
+
+   VNC viewer library interface.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <pthread.h>
+#include <boost/signals2/signal.hpp>
+
+#include "vnc-viewer.h"
+#include "vnc-engine.h"
+#include "vnc-debug.h"
+
+typedef boost::signals2::signal
+    <void( const ggivnc::Frame& )> FrameRenderedSignalType;
+typedef boost::signals2::signal<void( int )> SessionEndedSignalType;
+
+extern struct vnc_session* createGgivncSession();
+extern void destroyGgivncSession( struct vnc_session* session );
+extern int runGgivncSession( struct vnc_session* session,
+    int argc, char *argv[] );
+extern int stepGgivncSession( struct vnc_session* session,
+    struct timeval* tv );
+extern int endGgivncSession( struct vnc_session* session, int result );
+extern void setGgivncSessionHosted( struct vnc_session* session,
+    bool hosted );
+extern void setGgivncTargetFrameBuffer( struct vnc_session* session,
+    unsigned char* buf );
+extern void setGgivncPixFormat( struct vnc_session* session,
+    const std::string& pixformat );
+extern void setGgivncDefMode( struct vnc_session* session,
+    const std::string& defmode );
+extern void setGgivncRenderStop( struct vnc_session* session, bool stop );
+extern void setGgivncHoldUpdates( struct vnc_session* session, bool hold );
+extern void ackGgivncFrame( struct vnc_session* session, unsigned int frame );
+extern int sendGgivncInput( struct vnc_session* session,
+    const ggivnc::Input* events, int count );
+extern bool sendGgivncKey( struct vnc_session* session, bool down,
+    uint32_t keysym );
+extern bool sendGgivncPointer( struct vnc_session* session,
+    int buttons, int x, int y );
+extern void setGgivncExport( struct vnc_session* session,
+    const std::string& name, int slots );
+extern int getGgivncExportFd( struct vnc_session* session );
+extern int getGgivncExportEventFd( struct vnc_session* session );
+extern void getGgivncMetrics( struct vnc_session* session,
+    struct vnc_metrics& snapshot );
+extern boost::signals2::connection connectToGgivncBufferRenderedSignal
+    (
+    struct vnc_session* session,
+    const FrameRenderedSignalType::slot_type& aSlot
+    );
+extern void setGgivncThumbnail( struct vnc_session* session,
+    int width, int height, unsigned int interval );
+extern boost::signals2::connection connectToGgivncThumbnailSignal
+    (
+    struct vnc_session* session,
+    const FrameRenderedSignalType::slot_type& aSlot
+    );
+extern boost::signals2::connection connectToGgivncSessionEndedSignal
+    (
+    struct vnc_session* session,
+    const SessionEndedSignalType::slot_type& aSlot
+    );
+
+namespace ggivnc {
+
+Viewer::Viewer()
+    : mSession( createGgivncSession() )
+    , mEngine( NULL )
+    , mThreadRunning( false )
+    , mOpen( false )
+{
+}
+
+Viewer::~Viewer()
+{
+    close();
+    mFrameConnection.disconnect();
+    mThumbnailConnection.disconnect();
+    mEndConnection.disconnect();
+    destroyGgivncSession( mSession );
+}
+
+void Viewer::setFormat( const std::string& format )
+{
+    setGgivncPixFormat( mSession, format );
+}
+
+void Viewer::setMode( const std::string& mode )
+{
+    setGgivncDefMode( mSession, mode );
+}
+
+void Viewer::setFrameBuffer( unsigned char* buffer )
+{
+    setGgivncTargetFrameBuffer( mSession, buffer );
+}
+
+void Viewer::setHoldUpdates( bool hold )
+{
+    setGgivncHoldUpdates( mSession, hold );
+}
+
+void Viewer::setExport( const std::string& name, int slots )
+{
+    setGgivncExport( mSession, name, slots );
+}
+
+void Viewer::setFrameHandler( const FrameHandler& handler )
+{
+    mFrameConnection.disconnect();
+    if( handler )
+    {
+        mFrameConnection =
+            connectToGgivncBufferRenderedSignal( mSession, handler );
+    }
+}
+
+void Viewer::setThumbnail( int maxWidth, int maxHeight,
+    unsigned int intervalMs )
+{
+    setGgivncThumbnail( mSession, maxWidth, maxHeight, intervalMs );
+}
+
+void Viewer::setThumbnailHandler( const FrameHandler& handler )
+{
+    mThumbnailConnection.disconnect();
+    if( handler )
+    {
+        mThumbnailConnection =
+            connectToGgivncThumbnailSignal( mSession, handler );
+    }
+}
+
+void Viewer::setEndHandler( const EndHandler& handler )
+{
+    mEndConnection.disconnect();
+    if( handler )
+    {
+        mEndConnection =
+            connectToGgivncSessionEndedSignal( mSession, handler );
+    }
+}
+
+int Viewer::open( const std::string& server, struct vnc_engine* engine )
+{
+    char* argv[] =
+    {
+        const_cast<char*>( "ggivnc" ),
+        const_cast<char*>( server.c_str() )
+    };
+
+    return open( 2, argv, engine );
+}
+
+int Viewer::open( int argc, char* argv[], struct vnc_engine* engine )
+{
+    int status;
+
+    if( mOpen )
+    {
+        close();
+    }
+
+    if( engine )
+    {
+        status = addGgivncEngineSession( engine, mSession, argc, argv );
+        if( status )
+        {
+            return status;
+        }
+        mEngine = engine;
+        mOpen = true;
+        return 0;
+    }
+
+    // Set up on the calling thread, so that failing to connect is
+    // reported here, then run the loop on a thread of its own.
+    setGgivncSessionHosted( mSession, true );
+    status = runGgivncSession( mSession, argc, argv );
+    if( status != -1 )
+    {
+        setGgivncSessionHosted( mSession, false );
+        return status;
+    }
+
+    if( pthread_create( &mThread, NULL, run, this ) )
+    {
+        debug( 1, "cannot start the viewer thread\n" );
+        endGgivncSession( mSession, 1 );
+        setGgivncSessionHosted( mSession, false );
+        return 2;
+    }
+    mThreadRunning = true;
+    mOpen = true;
+    return 0;
+}
+
+void* Viewer::run( void* arg )
+{
+    Viewer* viewer = static_cast<Viewer*>( arg );
+    int res;
+
+    do
+    {
+        res = stepGgivncSession( viewer->mSession, NULL );
+    }
+    while( res == -1 );
+
+    endGgivncSession( viewer->mSession, res );
+    return NULL;
+}
+
+void Viewer::close()
+{
+    if( !mOpen )
+    {
+        return;
+    }
+
+    setGgivncRenderStop( mSession, true );
+    if( mEngine )
+    {
+        removeGgivncEngineSession( mEngine, mSession );
+        mEngine = NULL;
+    }
+    if( mThreadRunning )
+    {
+        pthread_join( mThread, NULL );
+        mThreadRunning = false;
+        setGgivncSessionHosted( mSession, false );
+    }
+    mOpen = false;
+}
+
+bool Viewer::isOpen() const
+{
+    return mOpen;
+}
+
+void Viewer::ackFrame( unsigned int number )
+{
+    ackGgivncFrame( mSession, number );
+}
+
+bool Viewer::sendKey( bool down, uint32_t keysym )
+{
+    return sendGgivncKey( mSession, down, keysym );
+}
+
+bool Viewer::sendPointer( int buttons, int x, int y )
+{
+    return sendGgivncPointer( mSession, buttons, x, y );
+}
+
+int Viewer::sendInput( const Input* events, int count )
+{
+    return sendGgivncInput( mSession, events, count );
+}
+
+void Viewer::getMetrics( struct vnc_metrics& snapshot ) const
+{
+    getGgivncMetrics( mSession, snapshot );
+}
+
+int Viewer::exportFd() const
+{
+    return getGgivncExportFd( mSession );
+}
+
+int Viewer::exportEventFd() const
+{
+    return getGgivncExportEventFd( mSession );
+}
+
+} /* End of namespace ggivnc */
@@ -0,0 +1,62 @@
+/*
+******************************************************************************
+
+   VNC viewer pixel format conversion.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_CONVERT_H
+#define VNC_CONVERT_H
+
+#include <ggi/ggi.h>
+
+#include "vnc-kernel.h"
+
+/* Conversion from the wire stem to the local stem. The plan is worked
+ * out from the two pixel formats on first use and kept until either
+ * format changes. Formats without a plan are left to ggiCrossBlit.
+ */
+struct convert {
+	ggi_pixelformat src;	/* formats the plan was made for */
+	ggi_pixelformat dst;
+	int kind;
+	int src_size;		/* bytes per pixel */
+	int dst_size;
+	int reverse;		/* byte swap the mapped pixels */
+	struct channel_map map;
+	uint8_t shuffle[4];
+	uint32_t *lut;		/* indexed by 8-bit or 16-bit source pixel */
+};
+
+/* Convert a w x h box at sx,sy in src to dx,dy in dst. */
+void convert_blit(struct convert *cv,
+	ggi_visual_t src, int sx, int sy, int w, int h,
+	ggi_visual_t dst, int dx, int dy);
+
+/* Forget the plan and free its tables. */
+void convert_reset(struct convert *cv);
+
+#endif /* VNC_CONVERT_H */
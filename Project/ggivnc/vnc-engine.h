@@ -0,0 +1,92 @@
+/*
+******************************************************************************
+
+   VNC viewer engine, many sessions on a few threads.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_ENGINE_H
+#define VNC_ENGINE_H
+
+#include <stdint.h>
+
+extern "C" {
+#include "vnc-pool.h"
+}
+
+/* Runs many sessions on one event loop thread per core. Sessions are
+ * placed on the least loaded loop and moved when loops get uneven.
+ * Heavy pixel work is split over the shared pool in vnc-pool.h.
+ */
+struct vnc_engine;
+struct vnc_session;
+
+struct engine_stats {
+	int threads;
+	int sessions;		/* still running */
+	uint64_t migrations;	/* sessions moved to another loop */
+	double load;		/* cores busy running sessions */
+	double bytes_per_sec;	/* from the servers, all sessions */
+	double frames_per_sec;	/* to the consumers, all sessions */
+	double fairness;	/* Jain's index of the session frame rates */
+	struct pool_stats pool;
+};
+
+struct engine_session_stats {
+	int thread;		/* the loop running the session */
+	int running;
+	double load;		/* fraction of a core */
+	double bytes_per_sec;
+	double frames_per_sec;
+	double max_wait_ms;	/* longest wait for the turn, last second */
+};
+
+/* threads loops, or one per core if threads is 0. */
+struct vnc_engine* createGgivncEngine( int threads );
+
+/* Stops and ends all sessions still running, then the loops. */
+void destroyGgivncEngine( struct vnc_engine* engine );
+
+/* Connect and set up session on the calling thread, with the arguments
+ * of ggivnc_main, then hand it to a loop. Returns 0 when it runs,
+ * otherwise the status runGgivncSession returned.
+ */
+int addGgivncEngineSession( struct vnc_engine* engine,
+    struct vnc_session* session, int argc, char *argv[] );
+
+/* Stop session if it still runs and wait until it is ended. Returns
+ * what the session ended with, 0 for a clean end.
+ */
+int removeGgivncEngineSession( struct vnc_engine* engine,
+    struct vnc_session* session );
+
+/* Updated once a second. */
+void getGgivncEngineStats( struct vnc_engine* engine,
+    struct engine_stats* stats );
+int getGgivncEngineSessionStats( struct vnc_engine* engine,
+    struct vnc_session* session, struct engine_session_stats* stats );
+
+#endif /* VNC_ENGINE_H */
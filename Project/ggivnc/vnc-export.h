@@ -0,0 +1,144 @@
+/*
+******************************************************************************
+
+   VNC viewer frame export to shared memory.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_EXPORT_H
+#define VNC_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Frames published to shared memory, so that local processes can
+ * consume them without a connection of their own and without copying.
+ *
+ * The memory starts with a struct export_header, followed by slots
+ * slot_size bytes apart, each a struct export_slot with the pixels
+ * EXPORT_SLOT_HEADER bytes into the slot. Frame n (from 1) goes to
+ * slot n % slots. A slot is under a sequence lock: version is odd
+ * while the slot is written, so a consumer reads version, then the
+ * frame, then version again, and drops what it read if the two differ.
+ * With more than two slots a consumer has the time of slots - 1
+ * frames to do so.
+ *
+ * Consumers wait for seq to change, on Linux with FUTEX_WAIT on the
+ * futex word (not a private futex), or by reading the eventfd the
+ * producer hands them. The mapping grows when the remote desktop
+ * does. generation is odd while the slots are laid out anew, and size
+ * and slot_size may differ afterwards.
+ */
+
+#define EXPORT_MAGIC		0x636e7667	/* "gvnc" */
+#define EXPORT_VERSION		1
+#define EXPORT_BOXES		16
+#define EXPORT_SLOT_HEADER	4096
+
+struct export_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t generation;	/* bumped when the layout changes */
+	uint64_t slot_size;
+	uint64_t size;		/* of the whole mapping */
+	uint64_t seq;		/* last frame published, 0 if none yet */
+	uint32_t futex;		/* low half of seq */
+	uint32_t closed;	/* the producer is gone */
+};
+
+struct export_rect {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+struct export_slot {
+	uint64_t version;	/* odd while written */
+	uint64_t seq;		/* the frame in the slot */
+	uint64_t timestamp;	/* ns, when the frame was drawn */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;	/* bytes per line */
+	uint32_t bpp;		/* bytes per pixel */
+	char format[32];	/* ggivnc pixel format, as "p8r8g8b8" */
+	int32_t boxes;		/* changed since frame seq - 1, -1 all */
+	struct export_rect box[EXPORT_BOXES];
+};
+
+struct frame_export;
+
+/* The shared memory object name for the first len bytes of name, with
+ * the single leading slash shm_open wants. Returns a string to free,
+ * or NULL if out of memory.
+ */
+char *export_shm_name(const char *name, size_t len);
+
+/* Producer side. name is that of a POSIX shared memory object, for
+ * consumers to shm_open, or NULL for an anonymous memfd to be passed
+ * on with export_fd. The memory is set up with the first frame.
+ */
+struct frame_export *export_create(const char *name, int slots);
+void export_destroy(struct frame_export *ex);
+
+/* Copy what changed to the next slot and wake the consumers. boxes is
+ * -1 if all of the frame changed.
+ */
+int export_publish(struct frame_export *ex, const uint8_t *buffer,
+	int width, int height, int stride, int bpp, const char *format,
+	const struct export_rect *box, int boxes, uint64_t timestamp);
+
+int export_fd(struct frame_export *ex);
+int export_event_fd(struct frame_export *ex);	/* -1 if there is none */
+
+/* Consumer side, read-only. Attach by name or by a received fd, which
+ * export_detach then closes.
+ */
+struct frame_export *export_attach(const char *name, int fd);
+void export_detach(struct frame_export *ex);
+
+/* Wait up to timeout_ms (-1 forever) for a frame after seq. Returns the
+ * last frame published, seq again on timeout, or 0 if the producer
+ * is gone.
+ */
+uint64_t export_wait(struct frame_export *ex, uint64_t seq, int timeout_ms);
+
+/* The slot of frame seq, NULL if it is already overwritten. Check the
+ * frame with export_still_valid after using its pixels.
+ */
+const struct export_slot *export_slot(struct frame_export *ex,
+	uint64_t seq, uint64_t *version);
+int export_still_valid(struct frame_export *ex,
+	const struct export_slot *slot, uint64_t version);
+
+static inline const uint8_t *
+export_pixels(const struct export_slot *slot)
+{
+	return (const uint8_t *)slot + EXPORT_SLOT_HEADER;
+}
+
+#endif /* VNC_EXPORT_H */
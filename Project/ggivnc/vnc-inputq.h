@@ -0,0 +1,85 @@
+/*
+******************************************************************************
+
+   VNC viewer input queue.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_INPUTQ_H
+#define VNC_INPUTQ_H
+
+#include <stdint.h>
+
+/* Input events for the server, queued from any thread and sent by the
+ * viewer loop. A bounded lock-free queue with a sequence number per
+ * cell, any number of producers and the viewer loop as the only
+ * consumer. The cells hold the events as RFB client messages, so the
+ * loop sends whatever is queued with a single write.
+ *
+ * The fd is readable while there is something to send. Only the first
+ * event after the loop has emptied the queue writes to it, so a burst
+ * of events costs the producers one system call.
+ */
+#define INPUTQ_SIZE 4096	/* power of two */
+#define INPUTQ_MSG 8		/* longest message, a KeyEvent */
+
+struct inputq_cell {
+	uint64_t seq;
+	uint8_t size;
+	uint8_t msg[INPUTQ_MSG];
+};
+
+struct inputq {
+	struct inputq_cell cell[INPUTQ_SIZE];
+	uint64_t head;		/* next cell to fill, shared by producers */
+	uint64_t tail;		/* next cell to send, the loop only */
+	int signalled;
+	int fd[2];
+};
+
+int inputq_init(struct inputq *q);
+void inputq_fini(struct inputq *q);
+
+/* Queue a message of at most INPUTQ_MSG bytes. Returns -1 if the queue
+ * is full, 1 if the loop was idle and has to be woken up, else 0.
+ */
+int inputq_push(struct inputq *q, const void *msg, int size);
+
+/* Take the signal down, before taking what is queued. */
+void inputq_rearm(struct inputq *q);
+
+/* Move whole messages into buf, at most size bytes. Returns the bytes
+ * stored, 0 once the queue is empty. keys counts the KeyEvents.
+ */
+int inputq_pop(struct inputq *q, uint8_t *buf, int size, int *keys);
+
+static inline int
+inputq_signalled(struct inputq *q)
+{
+	return __atomic_load_n(&q->signalled, __ATOMIC_ACQUIRE);
+}
+
+#endif /* VNC_INPUTQ_H */
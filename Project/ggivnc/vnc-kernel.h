@@ -0,0 +1,108 @@
+/*
+******************************************************************************
+
+   VNC viewer CPU specific kernels.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_KERNEL_H
+#define VNC_KERNEL_H
+
+#include <ggi/ggi.h>
+
+enum cpu_level {
+	CPU_GENERIC,	/* plain C */
+	CPU_VECTOR,	/* compiler vector extensions, any arch */
+	CPU_SSE2,
+	CPU_SSSE3,
+	CPU_AVX2,
+	CPU_LEVELS
+};
+
+/* Shift and mask description of a true color conversion. Destination
+ * channel i is ((pixel << lshift[i]) >> rshift[i]) & mask[i].
+ */
+struct channel_map {
+	int lshift[3];
+	int rshift[3];
+	uint32_t mask[3];
+};
+
+/* The hot loops that benefit from SIMD. The table always holds a
+ * usable set, plain C until kernels_init has been called.
+ */
+struct kernels {
+	int level;
+
+	/* Byte swap count 16-bit or 32-bit pixels, dst may equal src. */
+	void (*reverse_16)(void *dst, const void *src, int count);
+	void (*reverse_32)(void *dst, const void *src, int count);
+
+	/* Expand count 1-bit indices, msb first, into 32-bit pixels. */
+	void (*expand_bits_32)(uint32_t *dst, const uint8_t *src,
+		uint32_t bg, uint32_t fg, int count);
+
+	/* Convert count 32-bit pixels channel by channel. */
+	void (*map_32_16)(uint16_t *dst, const uint32_t *src, int count,
+		const struct channel_map *map);
+	void (*map_32_32)(uint32_t *dst, const uint32_t *src, int count,
+		const struct channel_map *map);
+
+	/* Rearrange the bytes of count 4-byte pixels. Byte i of each
+	 * destination pixel is byte shuffle[i] of the source pixel, or
+	 * zero if shuffle[i] is 0x80. The 24 variant stores only the
+	 * first three bytes of each destination pixel, and may work in
+	 * place.
+	 */
+	void (*shuffle_32)(void *dst, const void *src, int count,
+		const uint8_t *shuffle);
+	void (*shuffle_32_24)(void *dst, const void *src, int count,
+		const uint8_t *shuffle);
+
+	/* Box filter step. Add up count runs of factor 4-byte pixels
+	 * byte by byte, adding the four byte sums of each run to sum[0..3]
+	 * of that run. factor is at most 256.
+	 */
+	void (*box_32)(uint32_t *sum, const void *src, int count, int factor);
+};
+
+extern struct kernels kernels;
+
+/* Bind the best kernels for the running CPU. The GGIVNC_CPU environment
+ * variable (generic, vector, sse2, ssse3 or avx2) caps the level, so
+ * that all variants can be compared on one machine. Only the first
+ * call binds, so that sessions starting in parallel may all call it.
+ */
+int kernels_init(void);
+
+/* Bind the kernels for a specific level. Fails if the CPU lacks it. */
+int kernels_bind(int level);
+
+int cpu_level_detect(void);
+const char *cpu_level_name(int level);
+int cpu_level_lookup(const char *name);
+
+#endif /* VNC_KERNEL_H */
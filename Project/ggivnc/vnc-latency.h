@@ -0,0 +1,86 @@
+/*
+******************************************************************************
+
+   VNC viewer input to photon latency.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_LATENCY_H
+#define VNC_LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct connection;
+
+#define LATENCY_REQUESTS 8
+
+/* The oldest input not yet answered is followed through the first
+ * update requested after it, that update's decoding and the frame it
+ * ends up in, into the input_*_ns histograms of the metrics. Updates
+ * to requests sent before the input may not show it, so they are
+ * passed over, except for the newest request in flight when the input
+ * is sent. Merged frames go by their oldest input. With --trace, every
+ * step is also written to a file as "<ns> <event> <details>" lines,
+ * ns on the metrics_clock.
+ */
+struct latency {
+	uint64_t input;		/* sent, no update requested after it yet */
+	uint64_t request[LATENCY_REQUESTS];	/* in flight, a ring */
+	unsigned int request_head;
+	unsigned int request_tail;
+	unsigned int request_lost;	/* in flight after the ring filled */
+	uint64_t update;	/* ...of the update being received */
+	uint64_t frame;		/* ...of the frame being put together */
+	uint64_t shown;		/* ...of the frame handed out last */
+	unsigned int shown_frame;
+	unsigned int update_count;
+	FILE *trace;
+
+	/* --latency-bench, pointer moves at a steady pace */
+	int bench_count;
+	int bench_sent;
+	uint64_t bench_period;
+	uint64_t bench_next;
+};
+
+int latency_trace_open(struct connection *cx, const char *file);
+int latency_bench_parse(struct connection *cx, const char *arg);
+void latency_end(struct connection *cx);
+
+/* The steps, called as they happen. */
+void latency_input(struct connection *cx, const char *what);
+void latency_request(struct connection *cx);
+void latency_update(struct connection *cx, int rects);
+void latency_rect(struct connection *cx, int encoding);
+void latency_decoded(struct connection *cx);
+void latency_present(struct connection *cx, unsigned int frame);
+void latency_ack(struct connection *cx, unsigned int frame);
+
+/* Print the latency percentiles so far to stderr. */
+void latency_report(struct connection *cx);
+
+#endif /* VNC_LATENCY_H */
@@ -0,0 +1,162 @@
+/*
+******************************************************************************
+
+   VNC viewer performance metrics.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_METRICS_H
+#define VNC_METRICS_H
+
+#include <stdint.h>
+
+/* Metrics of a session. Only the viewer thread writes them,
+ * so updates are plain relaxed loads and stores, and any thread may
+ * take a snapshot at any time without stopping the session. The
+ * snapshot is not a consistent cut, counters may be one update apart.
+ */
+
+/* Log-linear histogram. Values below 16 get a bucket each, above that
+ * each power of two is split in 8 buckets (12.5% resolution). Values
+ * are clamped to 2^36, a bit over a minute in ns.
+ */
+#define METRICS_SUB_BITS 3
+#define METRICS_MAX_BITS 36
+#define METRICS_BUCKETS \
+	((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+struct metrics_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[METRICS_BUCKETS];
+};
+
+struct metrics_encoding {
+	uint64_t rects;
+	uint64_t pixels;
+	uint64_t bytes;			/* on the wire */
+	struct metrics_hist decode_ns;	/* per rectangle, thread cpu time */
+};
+
+struct vnc_metrics {
+	uint64_t session;		/* counts sessions started */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t reads;			/* read system calls */
+	uint64_t writes;		/* write system calls */
+	uint64_t updates;		/* framebuffer updates received */
+	uint64_t frames;		/* frames handed to the consumer */
+	uint64_t inflate_in;
+	uint64_t inflate_out;
+	uint64_t input_high_water;	/* most bytes read but not parsed */
+	uint64_t output_high_water;	/* most bytes queued for writing */
+	struct metrics_hist update_rtt_ns;
+	struct metrics_hist present_ns;	/* rendering a finished update */
+
+	/* Input to photon latency, from the oldest input not yet answered
+	 * to the header of the first update requested after it, to that
+	 * update being decoded, to its frame being handed out and to the
+	 * consumer acking that frame. See vnc-latency.h.
+	 */
+	struct metrics_hist input_update_ns;
+	struct metrics_hist input_decode_ns;
+	struct metrics_hist input_present_ns;
+	struct metrics_hist input_ack_ns;
+	struct metrics_encoding encoding[17];	/* by encoding number */
+};
+
+static inline void
+metrics_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter,
+		__atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+		__ATOMIC_RELAXED);
+}
+
+static inline void
+metrics_max(uint64_t *mark, uint64_t value)
+{
+	if (value > __atomic_load_n(mark, __ATOMIC_RELAXED))
+		__atomic_store_n(mark, value, __ATOMIC_RELAXED);
+}
+
+static inline int
+metrics_bucket(uint64_t value)
+{
+	int msb;
+
+	if (value < (2 << METRICS_SUB_BITS))
+		return (int)value;
+	if (value >= (uint64_t)1 << METRICS_MAX_BITS)
+		return METRICS_BUCKETS - 1;
+
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) +
+		(int)((value >> (msb - METRICS_SUB_BITS)) &
+			((1 << METRICS_SUB_BITS) - 1));
+}
+
+static inline void
+metrics_record(struct metrics_hist *hist, uint64_t value)
+{
+	metrics_add(&hist->count, 1);
+	metrics_add(&hist->sum, value);
+	metrics_max(&hist->max, value);
+	metrics_add(&hist->bucket[metrics_bucket(value)], 1);
+}
+
+#ifdef ZLIB_VERSION
+/* inflate(), counting the bytes going in and out. */
+static inline int
+metrics_inflate(struct vnc_metrics *m, z_streamp strm, int flush)
+{
+	uLong total_in = strm->total_in;
+	uLong total_out = strm->total_out;
+	int res = inflate(strm, flush);
+
+	metrics_add(&m->inflate_in, strm->total_in - total_in);
+	metrics_add(&m->inflate_out, strm->total_out - total_out);
+	return res;
+}
+#endif /* ZLIB_VERSION */
+
+/* Monotonic time in ns, for intervals. */
+uint64_t metrics_clock(void);
+
+/* Start a new session, zeroing everything but the session count. */
+void metrics_reset(struct vnc_metrics *m);
+
+void metrics_snapshot(const struct vnc_metrics *m,
+	struct vnc_metrics *snapshot);
+
+/* The value below which a fraction q of the recorded values fall. */
+uint64_t metrics_percentile(const struct metrics_hist *hist, double q);
+
+/* Print a snapshot as "name value" lines. Returns what snprintf would. */
+int metrics_format(const struct vnc_metrics *snapshot, char *buf, int size);
+
+#endif /* VNC_METRICS_H */
@@ -0,0 +1,85 @@
+/*
+******************************************************************************
+
+   VNC viewer pixel kernels.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_PIXEL_H
+#define VNC_PIXEL_H
+
+#include <ggi/ggi.h>
+
+/* Pixel kernels for one negotiated wire pixel format. The kernels are
+ * instantiated from templates in pixel.cpp, one set for each
+ * combination of wire pixel size, byte order and (for the 24-bit
+ * "cpixel" of ZRLE and TRLE) position of the color bytes. The decoders
+ * pick up the set bound to the connection, so that no per-pixel
+ * endian test remains in the inner loops.
+ */
+struct pixel_ops {
+	int size;       /* bytes per pixel on the wire */
+	int local_size; /* bytes per pixel in unpacked local buffers */
+	int native;     /* wire pixels can be used as local pixels as is */
+
+	/* Read one wire pixel. */
+	ggi_pixel (*get)(const uint8_t *src);
+
+	/* Convert count wire pixels into local pixels. May be done in
+	 * place when size == local_size.
+	 */
+	void (*unpack)(void *dst, const uint8_t *src, int count);
+
+	/* Read count wire pixels into a palette. */
+	void (*get_palette)(ggi_pixel *palette, const uint8_t *src, int count);
+
+	/* Expand a w x h block of palette indices, packed bits per index
+	 * with each row starting on a byte boundary, into local pixels.
+	 * bits is one of 1, 2, 4 or 8.
+	 */
+	void (*unpack_palette)(void *dst, const uint8_t *src,
+		const ggi_pixel *palette, int w, int h, int bits);
+
+	/* Store count copies of a local pixel. */
+	void (*fill)(void *dst, ggi_pixel pixel, int count);
+};
+
+/* Find the kernels for size bytes per wire pixel (1, 2, 3 or 4), with
+ * big set if the wire is big endian and swap set if the wire byte order
+ * differs from the local one. The local byte order is that of the
+ * visual, which need not be the host's. shift is 8 for 3-byte pixels
+ * with the color in the high 24 bits of the wire pixel, else zero.
+ * Returns NULL if there is no such combination.
+ */
+const struct pixel_ops *pixel_ops_lookup(int size, int big, int swap,
+	int shift);
+
+/* Same, but for local pixels packed in 3 bytes. Only 3-byte and 4-byte
+ * wire pixels with the color in the low 24 bits are supported.
+ */
+const struct pixel_ops *pixel_ops_lookup_packed(int size, int big);
+
+#endif /* VNC_PIXEL_H */
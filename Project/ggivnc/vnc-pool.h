@@ -0,0 +1,58 @@
+/*
+******************************************************************************
+
+   VNC viewer conversion thread pool.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_POOL_H
+#define VNC_POOL_H
+
+#include <stdint.h>
+
+/* A pool of worker threads shared by all sessions in the process. It
+ * only runs the bands of pixel conversion (convert.c); decoding stays
+ * on the loop of the session, as its streams must be decoded in order.
+ */
+
+typedef void (pool_fn)(void *arg, int index);
+
+/* Call fn(arg, i) for i in 0..count-1, spread over the pool, and return
+ * when all calls are done. The caller runs calls too while it waits.
+ */
+void pool_run(pool_fn *fn, void *arg, int count);
+
+/* The number of worker threads, not counting callers of pool_run. */
+int pool_workers(void);
+
+struct pool_stats {
+	uint64_t tasks;		/* calls run */
+	uint64_t helped;	/* calls run by a waiting caller */
+};
+
+void pool_stats(struct pool_stats *stats);
+
+#endif /* VNC_POOL_H */
@@ -0,0 +1,87 @@
+/*
+******************************************************************************
+
+   VNC viewer session recording and replay.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_RECORD_H
+#define VNC_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct connection;
+
+/* With --record, what the server sends after the handshake is written
+ * to a file, gzip compressed when zlib is available. --replay feeds
+ * such a file through the decoders instead of a server, as fast as
+ * possible or, with --realtime, at the pace it was recorded.
+ *
+ * The file starts with a header, all numbers big endian:
+ *   "GGIVNCR\1"
+ *   u16 width, u16 height, u8 protocol minor version
+ *   u8 server big endian, u8 wire big endian
+ *   u8 length, server pixfmt, u8 length, wire pixfmt
+ *   u32 length, desktop name
+ * followed by records, each a u8 type and the microseconds since the
+ * previous record (a varint, 7 bits per byte, low bits first):
+ *   0, data: varint length, bytes from the server
+ *   1, encodings: varint count, s32 encodings as sent to the server
+ */
+struct record {
+	void *file;		/* being recorded to */
+	int recording;		/* the header is written */
+	uint64_t last;		/* metrics_clock() of the last record */
+
+	uint8_t *data;		/* the recording being replayed */
+	size_t size;
+	size_t pos;		/* of the next record */
+	int realtime;
+	uint64_t start;		/* metrics_clock() when replay started */
+	uint64_t due;		/* ns after start, of the record at pos */
+};
+
+int record_open(struct connection *cx, const char *file);
+int replay_load(struct connection *cx, const char *file);
+void record_end(struct connection *cx);
+
+/* Start recording a connection that is done with the handshake. The
+ * file holds one connection, the viewer does not offer to reconnect
+ * while recording.
+ */
+int record_start(struct connection *cx);
+void record_data(struct connection *cx, const uint8_t *data, int len);
+void record_encodings(struct connection *cx);
+
+/* Set up the connection as the recorded handshake left it. */
+int replay_open(struct connection *cx);
+/* When the next record is due, 0 if not replaying. */
+uint64_t replay_deadline(struct connection *cx);
+/* Feed what is due to the decoders. Returns 1 once all is replayed. */
+int replay_tick(struct connection *cx);
+
+#endif /* VNC_RECORD_H */
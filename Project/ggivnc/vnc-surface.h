@@ -0,0 +1,211 @@
+/*
+******************************************************************************
+
+   VNC viewer pixel-linear drawing surface.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_SURFACE_H
+#define VNC_SURFACE_H
+
+#include <string.h>
+#include <ggi/ggi.h>
+
+/* The visual the decoders draw to. When the write frame of the visual
+ * is a plain pixel-linear buffer (as with display-memory) the drawing
+ * primitives below work on the memory directly, otherwise they fall
+ * back to the libggi calls.
+ */
+struct surface {
+	ggi_visual_t stem;
+	uint8_t *base;	/* NULL if libggi must be used */
+	int stride;	/* bytes per line */
+	int bpp;	/* bytes per pixel */
+	int width;
+	int height;
+};
+
+void surface_bind(struct surface *sf, ggi_visual_t stem);
+
+static inline uint8_t *
+surface_at(const struct surface *sf, int x, int y)
+{
+	return sf->base + y * sf->stride + x * sf->bpp;
+}
+
+/* Clip a box to the surface, adjusting the source position with it.
+ * Returns zero if nothing remains.
+ */
+static inline int
+surface_clip(const struct surface *sf,
+	int *x, int *y, int *w, int *h, int *sx, int *sy)
+{
+	if (*x < 0) {
+		*w += *x;
+		*sx -= *x;
+		*x = 0;
+	}
+	if (*y < 0) {
+		*h += *y;
+		*sy -= *y;
+		*y = 0;
+	}
+	if (*x + *w > sf->width)
+		*w = sf->width - *x;
+	if (*y + *h > sf->height)
+		*h = sf->height - *y;
+	return *w > 0 && *h > 0;
+}
+
+static inline void
+surface_fill_row(const struct surface *sf, uint8_t *dst, int w,
+	ggi_pixel pixel)
+{
+	switch (sf->bpp) {
+	case 1:
+		memset(dst, pixel, w);
+		break;
+	case 2: {
+		uint16_t *dst16 = (uint16_t *)dst;
+		while (w--)
+			*dst16++ = pixel;
+		break;
+	}
+	case 4: {
+		uint32_t *dst32 = (uint32_t *)dst;
+		while (w--)
+			*dst32++ = pixel;
+		break;
+	}
+	default:
+		/* 24-bit modes are always little endian in GGI */
+		while (w--) {
+			*dst++ = pixel;
+			*dst++ = pixel >> 8;
+			*dst++ = pixel >> 16;
+		}
+		break;
+	}
+}
+
+static inline void
+surface_fill(const struct surface *sf, int x, int y, int w, int h,
+	ggi_pixel pixel)
+{
+	int sx = 0, sy = 0;
+	uint8_t *dst;
+
+	if (!sf->base) {
+		ggiSetGCForeground(sf->stem, pixel);
+		ggiDrawBox(sf->stem, x, y, w, h);
+		return;
+	}
+
+	if (!surface_clip(sf, &x, &y, &w, &h, &sx, &sy))
+		return;
+
+	dst = surface_at(sf, x, y);
+	surface_fill_row(sf, dst, w, pixel);
+	for (; --h; dst += sf->stride)
+		memcpy(dst + sf->stride, dst, w * sf->bpp);
+}
+
+static inline void
+surface_hline(const struct surface *sf, int x, int y, int w,
+	ggi_pixel pixel)
+{
+	surface_fill(sf, x, y, w, 1, pixel);
+}
+
+static inline void
+surface_pixel(const struct surface *sf, int x, int y, ggi_pixel pixel)
+{
+	if (!sf->base) {
+		ggiPutPixel(sf->stem, x, y, pixel);
+		return;
+	}
+
+	if (x < 0 || y < 0 || x >= sf->width || y >= sf->height)
+		return;
+
+	surface_fill_row(sf, surface_at(sf, x, y), 1, pixel);
+}
+
+/* Put a w x h box of tightly packed local pixels. */
+static inline void
+surface_put(const struct surface *sf, int x, int y, int w, int h,
+	const void *buf)
+{
+	const uint8_t *src;
+	uint8_t *dst;
+	int sx = 0, sy = 0;
+	int pitch = w * sf->bpp;
+
+	if (!sf->base) {
+		ggiPutBox(sf->stem, x, y, w, h, buf);
+		return;
+	}
+
+	if (!surface_clip(sf, &x, &y, &w, &h, &sx, &sy))
+		return;
+
+	src = (const uint8_t *)buf + sy * pitch + sx * sf->bpp;
+	dst = surface_at(sf, x, y);
+	for (; h--; src += pitch, dst += sf->stride)
+		memcpy(dst, src, w * sf->bpp);
+}
+
+static inline void
+surface_copy(const struct surface *sf, int sx, int sy, int w, int h,
+	int x, int y)
+{
+	const uint8_t *src;
+	uint8_t *dst;
+	int stride = sf->stride;
+
+	if (!sf->base) {
+		ggiCopyBox(sf->stem, sx, sy, w, h, x, y);
+		return;
+	}
+
+	if (!surface_clip(sf, &sx, &sy, &w, &h, &x, &y))
+		return;
+	if (!surface_clip(sf, &x, &y, &w, &h, &sx, &sy))
+		return;
+
+	src = surface_at(sf, sx, sy);
+	dst = surface_at(sf, x, y);
+	if (y > sy) {
+		/* overlapping downwards, go bottom up */
+		src += (h - 1) * stride;
+		dst += (h - 1) * stride;
+		stride = -stride;
+	}
+	for (; h--; src += stride, dst += stride)
+		memmove(dst, src, w * sf->bpp);
+}
+
+#endif /* VNC_SURFACE_H */
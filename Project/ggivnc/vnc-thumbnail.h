@@ -0,0 +1,82 @@
+/*
+******************************************************************************
+
+   VNC viewer thumbnails.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_THUMBNAIL_H
+#define VNC_THUMBNAIL_H
+
+#include <stdint.h>
+#include <ggi/ggi.h>
+
+/* A downscaled copy of the remote desktop, kept up to date from the
+ * damage of each update but only resampled when it is handed out. The
+ * scale is a whole factor, so that each thumbnail pixel is the plain
+ * average of a factor x factor box of desktop pixels, and the
+ * thumbnail keeps the aspect of the desktop within the requested
+ * bounds. Only 4-byte pixels with a channel per byte are supported,
+ * the thumbnail then has the pixel format of the desktop.
+ */
+struct thumbnail {
+	int max_width;
+	int max_height;
+	uint64_t interval;	/* ns between thumbnails, 0 if off */
+
+	int src_width;
+	int src_height;
+	int factor;
+	int width;
+	int height;
+	uint32_t *pixels;	/* width x height */
+	uint32_t *sum;		/* 4 per thumbnail pixel of one row */
+	int *span;		/* damaged columns per row, first and end */
+	int damaged;		/* rows with damage */
+
+	uint64_t next;		/* earliest time for the next thumbnail */
+	unsigned int number;
+	int held;		/* an update request waits for next */
+};
+
+/* Fit the thumbnail to a desktop of width x height, all damaged. */
+int thumbnail_resize(struct thumbnail *th, int width, int height);
+
+/* Note that a box of the desktop has changed. */
+void thumbnail_damage(struct thumbnail *th, int x, int y, int w, int h);
+
+/* Resample the damaged part from the desktop at src. The bounds of
+ * what changed, in thumbnail pixels, are stored in tl and br.
+ */
+void thumbnail_render(struct thumbnail *th, const uint8_t *src, int stride,
+	ggi_coord *tl, ggi_coord *br);
+
+void thumbnail_free(struct thumbnail *th);
+
+/* Whether the box filter works on pixels of this format. */
+int thumbnail_supported(const ggi_pixelformat *pf);
+
+#endif /* VNC_THUMBNAIL_H */
@@ -0,0 +1,168 @@
+/*
+******************************************************************************
+
+   VNC viewer library interface.
+
+   The MIT License
+
+   Copyright (C) 2014-2015 Garmin Ltd. or its subsidiaries.
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+******************************************************************************
+*/
+
+#ifndef VNC_VIEWER_H
+#define VNC_VIEWER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <boost/function.hpp>
+#include <boost/signals2/connection.hpp>
+
+struct vnc_session;
+struct vnc_engine;
+struct vnc_metrics;
+
+// The viewer as a library, without windows and without Qt. It draws
+// the remote desktop into memory and hands out frames to a callback.
+namespace ggivnc {
+
+struct Rect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+//! A frame handed to the consumer, on the thread running the viewer.
+//! The viewer draws into buffer again once the callback returns, so
+//! copy out what is needed, or ack frames to have updates held back.
+struct Frame
+{
+    unsigned int number;
+    const uint8_t* buffer;
+    int width;
+    int height;
+    int stride;             //!< bytes per line
+    const char* format;     //!< ggivnc pixel format, as "p8r8g8b8"
+    const Rect* dirty;      //!< what changed since the last frame
+    int dirtyCount;
+    uint64_t timestamp;     //!< ns, when the last update was drawn
+};
+
+//! A key or pointer event for the server.
+struct Input
+{
+    enum Kind { Key, Pointer } kind;
+    bool down;              //!< Key: pressed or released
+    uint32_t keysym;        //!< Key: an X keysym, as in the RFB protocol
+    int buttons;            //!< Pointer: as in the RFB protocol
+    int x;                  //!< Pointer: in remote desktop pixels
+    int y;
+};
+
+class Viewer
+{
+public:
+    typedef boost::function<void( const Frame& )> FrameHandler;
+    typedef boost::function<void( int )> EndHandler;
+
+    Viewer();
+    //! Closes the viewer if it is open.
+    ~Viewer();
+
+    //! The local pixel format, as for -pixfmt. Set before open.
+    void setFormat( const std::string& format );
+    //! The mode of the visual, as for GGI_DEFMODE, e.g. "800x600 [GT_16BIT]".
+    //! Empty, the default, leaves it to GGI_DEFMODE. Set before open.
+    void setMode( const std::string& mode );
+    //! Draw into buffer, which must hold the whole remote desktop.
+    //! NULL, the default, lets the viewer allocate it. Set before open.
+    void setFrameBuffer( unsigned char* buffer );
+    //! Also hold back update requests while frames are not acked.
+    void setHoldUpdates( bool hold );
+    //! Also publish frames to the shared memory object name (an
+    //! anonymous memfd if empty) as a ring of slots frames, for other
+    //! processes to map with export_attach. Set before open.
+    void setExport( const std::string& name, int slots = 4 );
+    void setFrameHandler( const FrameHandler& handler );
+    //! Downscale the desktop to at most maxWidth x maxHeight (keeping
+    //! its aspect) and pass it to handler, in the pixel format of the
+    //! frames, at most every intervalMs ms. Without a frame handler
+    //! or export, updates are also requested no faster than that.
+    //! Zero intervalMs turns it off. Set before open.
+    void setThumbnail( int maxWidth, int maxHeight,
+        unsigned int intervalMs );
+    void setThumbnailHandler( const FrameHandler& handler );
+    //! Called once the viewer is gone, with 0 for a clean end.
+    void setEndHandler( const EndHandler& handler );
+
+    //! Connect to server ("host", "host:display" or "host::port") and
+    //! keep the viewer running, on engine or else on a thread of its
+    //! own. Returns 0 once connected, otherwise the exit status of
+    //! ggivnc.
+    int open( const std::string& server, struct vnc_engine* engine = NULL );
+    //! Same, with the command line options of ggivnc.
+    int open( int argc, char* argv[], struct vnc_engine* engine = NULL );
+    //! Stop the viewer and wait for it to be gone. Returns at once if
+    //! it is not open.
+    void close();
+    bool isOpen() const;
+
+    //! These may be called from any thread.
+    void ackFrame( unsigned int number );
+    //! keysym is an X keysym, as in the RFB protocol.
+    bool sendKey( bool down, uint32_t keysym );
+    //! buttons as in the RFB protocol, 1 left, 2 middle, 4 right, 8
+    //! and 16 the wheel. x and y are in remote desktop pixels.
+    bool sendPointer( int buttons, int x, int y );
+    //! Queue a batch of events without taking locks. They are sent in
+    //! one write. Returns how many were queued, fewer than count once
+    //! the queue is full. sendKey and sendPointer queue one event.
+    int sendInput( const Input* events, int count );
+    void getMetrics( struct vnc_metrics& snapshot ) const;
+    //! The export ring and its eventfd, to pass on to consumers. -1
+    //! until the viewer is open, or without setExport.
+    int exportFd() const;
+    int exportEventFd() const;
+
+    struct vnc_session* session() const { return mSession; }
+
+private:
+    Viewer( const Viewer& );
+    Viewer& operator=( const Viewer& );
+
+    static void* run( void* arg );
+
+    struct vnc_session* mSession;
+    struct vnc_engine* mEngine;
+    pthread_t mThread;
+    bool mThreadRunning;
+    bool mOpen;
+    boost::signals2::connection mFrameConnection;
+    boost::signals2::connection mThumbnailConnection;
+    boost::signals2::connection mEndConnection;
+};
+
+} /* End of namespace ggivnc */
+
+#endif /* VNC_VIEWER_H */
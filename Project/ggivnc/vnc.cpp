@@ -30,6 +30,7 @@
 
 #include "config.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #ifdef HAVE_UNISTD_H
@@ -57,6 +58,7 @@
 #include <fcntl.h>
 #endif
 #include <errno.h>
+#include <pthread.h>
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
@@ -105,45 +107,422 @@ extern "C" {
 #include "vnc.h"
 #include "handshake.h"
 #include "vnc-compat.h"
+#include "vnc-kernel.h"
+#include "vnc-metrics.h"
+#include "vnc-export.h"
+#include "vnc-inputq.h"
 }
 #include "vnc-endian.h"
 #include "vnc-debug.h"
 #include "scrollbar.h"
 
-#include <QDebug>
-#include <QImage>
-#include "../MLVNC/MLVNC.h"
+#include "vnc-viewer.h"
 
-typedef boost::signals2::signal <void()> BufferRenderedSignalType;
+#include <boost/signals2/signal.hpp>
 
-static BufferRenderedSignalType gBufferRenderedEvent;
-static unsigned char* gTargetFrameBuffer = NULL;
-static std::string gPixformat = "p8b8g8r8";
-bool gGgiVncRenderStop = true;
+typedef boost::signals2::signal
+    <void( const ggivnc::Frame& )> FrameRenderedSignalType;
+typedef boost::signals2::signal<void( int )> SessionEndedSignalType;
+
+// Holds a mutex for the rest of the scope.
+class MutexLocker
+{
+public:
+    explicit MutexLocker( pthread_mutex_t* mutex )
+        : mMutex( mutex )
+    {
+        pthread_mutex_lock( mMutex );
+    }
+
+    ~MutexLocker()
+    {
+        pthread_mutex_unlock( mMutex );
+    }
+
+private:
+    pthread_mutex_t* mMutex;
+};
+
+// Everything one viewer needs besides what struct connection holds.
+// Sessions are independent, each one runs runGgivncSession on a thread
+// of its own, so any number of viewers can share the process.
+struct vnc_session
+{
+    vnc_session()
+        : target_frame_buffer( NULL )
+        , pixformat( "p8b8g8r8" )
+        , render_stop( false )
+        , running( false )
+        , hold_updates( false )
+        , hosted( false )
+        , present_stem( NULL )
+        , wake( NULL )
+        , wake_data( NULL )
+        , export_slots( 0 )
+        , thumb_width( 0 )
+        , thumb_height( 0 )
+        , thumb_interval( 0 )
+    {
+        memset( &cx, 0, sizeof( cx ) );
+        pthread_mutex_init( &present_lock, NULL );
+        inputq_init( &input );
+        if( pipe( cancel ) )
+        {
+            cancel[0] = cancel[1] = -1;
+        }
+        else
+        {
+            for( int i = 0; i < 2; ++i )
+            {
+                fcntl( cancel[i], F_SETFL, O_NONBLOCK );
+                fcntl( cancel[i], F_SETFD, FD_CLOEXEC );
+            }
+        }
+    }
+
+    ~vnc_session()
+    {
+        if( cancel[0] != -1 )
+        {
+            close( cancel[0] );
+            close( cancel[1] );
+        }
+        inputq_fini( &input );
+        pthread_mutex_destroy( &present_lock );
+    }
+
+    struct connection cx;
+    FrameRenderedSignalType rendered;
+    SessionEndedSignalType ended;
+    unsigned char* target_frame_buffer;
+    std::string pixformat;
+    // The mode of the visual, as for GGI_DEFMODE, which is only read
+    // when this is empty. See setGgivncDefMode.
+    std::string defmode;
+    bool render_stop;
+    // From runGgivncSession until the session has ended, under
+    // present_lock. A stop only clears while no session runs.
+    bool running;
+    bool hold_updates;
+    bool hosted;
+
+    // Readable while render_stop is set, so that whatever the viewer
+    // waits for, it wakes up to stop.
+    int cancel[2];
+
+    // Key and pointer events from other threads, see sendGgivncInput.
+    struct inputq input;
+
+    // present_stem is set while the viewer loop runs, and is what
+    // other threads post frame acks to.
+    pthread_mutex_t present_lock;
+    ggi_visual_t present_stem;
+    void (*wake)( void* data );
+    void* wake_data;
+
+    // Frame export asked for through the API, see setGgivncExport.
+    std::string export_name;
+    int export_slots;
+
+    // Thumbnails, see setGgivncThumbnail.
+    FrameRenderedSignalType thumbnailed;
+    int thumb_width;
+    int thumb_height;
+    unsigned int thumb_interval;
+};
 
 int ggivnc_debug_level;
 
+struct vnc_session* createGgivncSession()
+{
+    return new vnc_session;
+}
+
+void destroyGgivncSession( struct vnc_session* session )
+{
+    delete session;
+}
+
 boost::signals2::connection connectToGgivncBufferRenderedSignal
     (
-    const BufferRenderedSignalType::slot_type& aSlot
+    struct vnc_session* session,
+    const FrameRenderedSignalType::slot_type& aSlot
     )
 {
-    return gBufferRenderedEvent.connect( aSlot );
+    return session->rendered.connect( aSlot );
+}
+
+boost::signals2::connection connectToGgivncThumbnailSignal
+    (
+    struct vnc_session* session,
+    const FrameRenderedSignalType::slot_type& aSlot
+    )
+{
+    return session->thumbnailed.connect( aSlot );
+}
+
+boost::signals2::connection connectToGgivncSessionEndedSignal
+    (
+    struct vnc_session* session,
+    const SessionEndedSignalType::slot_type& aSlot
+    )
+{
+    return session->ended.connect( aSlot );
+}
+
+// Forget a stop left from an earlier session, under present_lock.
+static void clear_render_stop( struct vnc_session* session )
+{
+    char buf[16];
+
+    __atomic_store_n( &session->render_stop, false, __ATOMIC_RELEASE );
+    while( session->cancel[0] != -1 &&
+        read( session->cancel[0], buf, sizeof( buf ) ) > 0 );
+}
+
+// The session has ended, a stop left over may be cleared again.
+static void set_ended( struct vnc_session* session )
+{
+    MutexLocker lock( &session->present_lock );
+
+    session->running = false;
+}
+
+// Ask the viewer to stop, from any thread. The viewer drops the
+// connection without waiting for the server and reports the end with
+// the ended signal. A stop is only cleared while no session runs, so
+// one that comes in while the viewer starts up is not lost.
+// runGgivncSession clears a stale one itself.
+void setGgivncRenderStop( struct vnc_session* session, bool stop )
+{
+    MutexLocker lock( &session->present_lock );
+
+    if( !stop )
+    {
+        if( !session->running )
+        {
+            clear_render_stop( session );
+        }
+        return;
+    }
+
+    __atomic_store_n( &session->render_stop, true, __ATOMIC_RELEASE );
+
+    if( session->cancel[1] != -1 &&
+        write( session->cancel[1], "", 1 ) < 0 )
+    {
+        debug( 1, "cannot wake the viewer to stop\n" );
+    }
+    if( session->wake )
+    {
+        session->wake( session->wake_data );
+    }
+}
+
+void setGgivncTargetFrameBuffer( struct vnc_session* session,
+    unsigned char* buf )
+{
+    session->target_frame_buffer = buf;
+}
+
+void setGgivncPixFormat( struct vnc_session* session,
+    const std::string& pixformat )
+{
+    session->pixformat = pixformat;
+}
+
+void setGgivncDefMode( struct vnc_session* session,
+    const std::string& defmode )
+{
+    session->defmode = defmode;
+}
+
+void setGgivncHoldUpdates( struct vnc_session* session, bool hold )
+{
+    session->hold_updates = hold;
+}
+
+// Publish frames to a shared memory ring as well, see vnc-export.h.
+// An empty name makes it an anonymous memfd, to be handed over with
+// getGgivncExportFd. Zero slots turns it off. Set before running the
+// session, the --export option takes precedence.
+void setGgivncExport( struct vnc_session* session,
+    const std::string& name, int slots )
+{
+    session->export_name = name;
+    session->export_slots = slots;
+}
+
+// Hand out a downscaled desktop of at most width x height, at most
+// every interval ms and only when it has changed. When nothing else
+// takes the frames, the server is also asked for updates no more often
+// than that. Zero interval turns it off. Set before running the session.
+void setGgivncThumbnail( struct vnc_session* session,
+    int width, int height, unsigned int interval )
+{
+    session->thumb_width = width > 0 ? width : 1;
+    session->thumb_height = height > 0 ? height : 1;
+    session->thumb_interval = interval;
+}
+
+// The fd of the export ring and the eventfd that is bumped for every
+// frame, -1 while there is none.
+int getGgivncExportFd( struct vnc_session* session )
+{
+    MutexLocker lock( &session->present_lock );
+
+    return session->cx.frame_export ?
+        export_fd( session->cx.frame_export ) : -1;
+}
+
+int getGgivncExportEventFd( struct vnc_session* session )
+{
+    MutexLocker lock( &session->present_lock );
+
+    return session->cx.frame_export ?
+        export_event_fd( session->cx.frame_export ) : -1;
+}
+
+// Copy the metrics of the session, from any thread.
+void getGgivncMetrics( struct vnc_session* session,
+    struct vnc_metrics& snapshot )
+{
+    metrics_snapshot( &session->cx.metrics, &snapshot );
+}
+
+// Open the connection to the server ahead of ggivnc_main, which picks
+// it up if it is asked to connect to the same server.
+int preconnectGgivnc( const std::string& host, int port )
+{
+    return net_preconnect( host.c_str(), port, 0 );
+}
+
+// Commands from other threads are queued as events, so that the
+// connection state is only ever touched by the thread running the
+// viewer loop. Dropped while the loop is not running.
+static void post_command( struct vnc_session* session, uint32_t code,
+    const void* data, size_t size )
+{
+    MutexLocker lock( &session->present_lock );
+    gii_event ev;
+
+    if( !session->present_stem )
+    {
+        return;
+    }
+
+    ev.any.target = GII_EV_TARGET_QUEUE;
+    ev.any.size = sizeof( gii_cmd_nodata_event ) + size;
+    ev.any.type = evCommand;
+    ev.cmd.code = code;
+    memcpy( ev.cmd.data, data, size );
+
+    giiEventSend( session->present_stem, &ev );
+    if( session->wake )
+    {
+        session->wake( session->wake_data );
+    }
+}
+
+// Called by the frame consumer, from any thread, once a frame has been
+// presented.
+void ackGgivncFrame( struct vnc_session* session, unsigned int frame )
+{
+    post_command( session, PRESENT_ACK_CMD, &frame, sizeof( frame ) );
+}
+
+// The loop waits for the input queue itself, a hosted one waits for
+// the engine, which has to be told.
+static void wake_for_input( struct vnc_session* session )
+{
+    MutexLocker lock( &session->present_lock );
+
+    if( session->wake )
+    {
+        session->wake( session->wake_data );
+    }
+}
+
+static int queue_input( struct vnc_session* session,
+    const ggivnc::Input& in, bool* wake )
+{
+    uint8_t msg[INPUTQ_MSG];
+    int size;
+    int res;
+
+    if( in.kind == ggivnc::Input::Key )
+    {
+        msg[0] = 4;
+        msg[1] = in.down;
+        insert16_hilo( &msg[2], 0 );
+        insert32_hilo( &msg[4], in.keysym );
+        size = 8;
+    }
+    else
+    {
+        msg[0] = 5;
+        msg[1] = in.buttons;
+        insert16_hilo( &msg[2], in.x );
+        insert16_hilo( &msg[4], in.y );
+        size = 6;
+    }
+
+    res = inputq_push( &session->input, msg, size );
+    if( res > 0 )
+    {
+        *wake = true;
+    }
+    return res;
 }
 
-void setGgivncRenderStop( bool stop )
+// Queue key and pointer events for the server, from any thread and
+// without taking locks. They go out together, in one write, the next
+// time the viewer loop comes around. Returns how many were queued,
+// fewer than count if the queue is full. Events queued while the
+// viewer is not running are dropped when it starts.
+int sendGgivncInput( struct vnc_session* session,
+    const ggivnc::Input* events, int count )
 {
-    gGgiVncRenderStop = stop;
+    bool wake = false;
+    int i;
+
+    for( i = 0; i < count; ++i )
+    {
+        if( queue_input( session, events[i], &wake ) < 0 )
+        {
+            break;
+        }
+    }
+    if( wake )
+    {
+        wake_for_input( session );
+    }
+    return i;
 }
 
-void setGgivncTargetFrameBuffer( unsigned char* buf )
+// Send a key (an X keysym) or pointer state to the server, from any
+// thread. Pointer positions are in remote desktop pixels. False if the
+// input queue is full.
+bool sendGgivncKey( struct vnc_session* session, bool down, uint32_t keysym )
 {
-    gTargetFrameBuffer = buf;
+    ggivnc::Input in;
+
+    in.kind = ggivnc::Input::Key;
+    in.down = down;
+    in.keysym = keysym;
+    return sendGgivncInput( session, &in, 1 ) == 1;
 }
 
-void setGgivncPixFormat( const std::string& pixformat )
+bool sendGgivncPointer( struct vnc_session* session,
+    int buttons, int x, int y )
 {
-    gPixformat = pixformat;
+    ggivnc::Input in;
+
+    in.kind = ggivnc::Input::Pointer;
+    in.buttons = buttons;
+    in.x = x;
+    in.y = y;
+    return sendGgivncInput( session, &in, 1 ) == 1;
 }
 
 
@@ -452,6 +831,44 @@ weird_pixfmt:
 	return -1;
 }
 
+/* A packed 24-bit visual has no RFB pixel format of its own, but the
+ * 32-bit format with the same channels and the pad byte on top can be
+ * unpacked straight into it.
+ */
+static int
+packed_pixfmt(char *pixfmt, int count, const ggi_pixelformat *ggi_pf)
+{
+	const char color[3] = { 'r', 'g', 'b' };
+	ggi_pixel mask[3];
+	int idx;
+	int i, c;
+
+	if (ggi_pf->size != 24 || ggi_pf->depth != 24)
+		return -1;
+	if (ggi_pf->clut_mask || ggi_pf->flags)
+		return -1;
+
+	mask[0] = ggi_pf->red_mask;
+	mask[1] = ggi_pf->green_mask;
+	mask[2] = ggi_pf->blue_mask;
+
+	idx = my_snprintf(pixfmt, count, "p8");
+	for (i = 2; i >= 0; --i) {
+		for (c = 0; c < 3; ++c) {
+			if (mask[c] == (ggi_pixel)0xff << (8 * i))
+				break;
+		}
+		if (c == 3) {
+			snprintf(pixfmt, count, "weird");
+			return -1;
+		}
+		idx += my_snprintf(&pixfmt[idx], count - idx,
+			"%c8", color[c]);
+	}
+
+	return 0;
+}
+
 /* Given a pixfmt string from the user, add missing padding bits
  * etc so that a string compare can be used to find compatible
  * pixel formats.
@@ -530,6 +947,62 @@ close_connection(struct connection *cx, int code)
 	return 0;
 }
 
+void
+damage_add(struct connection *cx, int x, int y, int w, int h)
+{
+	struct damage *damage = &cx->damage;
+	int i;
+
+	if (damage->full || w <= 0 || h <= 0)
+		return;
+
+	for (i = 0; i < damage->count; ++i) {
+		if (x >= damage->box[i].tl.x && y >= damage->box[i].tl.y &&
+			x + w <= damage->box[i].br.x &&
+			y + h <= damage->box[i].br.y)
+		{
+			return;
+		}
+	}
+
+	if (damage->count == DAMAGE_BOXES) {
+		/* Out of boxes, collapse everything into one. */
+		for (i = 1; i < damage->count; ++i) {
+			if (damage->box[0].tl.x > damage->box[i].tl.x)
+				damage->box[0].tl.x = damage->box[i].tl.x;
+			if (damage->box[0].tl.y > damage->box[i].tl.y)
+				damage->box[0].tl.y = damage->box[i].tl.y;
+			if (damage->box[0].br.x < damage->box[i].br.x)
+				damage->box[0].br.x = damage->box[i].br.x;
+			if (damage->box[0].br.y < damage->box[i].br.y)
+				damage->box[0].br.y = damage->box[i].br.y;
+		}
+		damage->count = 1;
+		if (damage->box[0].tl.x > x)
+			damage->box[0].tl.x = x;
+		if (damage->box[0].tl.y > y)
+			damage->box[0].tl.y = y;
+		if (damage->box[0].br.x < x + w)
+			damage->box[0].br.x = x + w;
+		if (damage->box[0].br.y < y + h)
+			damage->box[0].br.y = y + h;
+		return;
+	}
+
+	damage->box[damage->count].tl.x = x;
+	damage->box[damage->count].tl.y = y;
+	damage->box[damage->count].br.x = x + w;
+	damage->box[damage->count].br.y = y + h;
+	++damage->count;
+}
+
+void
+damage_all(struct connection *cx)
+{
+	cx->damage.full = 1;
+	cx->damage.count = 0;
+}
+
 /* Set the title of the window, normally "<remote host> - ggivnc", but
  * simply "ggivnc" if the remote hostname is not yet known.
  */
@@ -627,6 +1100,9 @@ vnc_safe_write(struct connection *cx, const void *buf, int count)
 
 again:
 	res = write(cx->sfd, buf, count);
+	metrics_add(&cx->metrics.writes, 1);
+	if (res > 0)
+		metrics_add(&cx->metrics.bytes_out, res);
 
 	if (res == count)
 		return res + written;
@@ -694,6 +1170,7 @@ safe_write(struct connection *cx, const void *buf, int count)
 	}
 	memcpy(cx->output.data + cx->output.wpos, buf, count);
 	cx->output.wpos += count;
+	metrics_max(&cx->metrics.output_high_water, cx->output.wpos);
 
 	return 0;
 }
@@ -725,6 +1202,7 @@ vnc_read_ready(struct connection *cx)
 	else
 		request = cx->input.size - cx->input.wpos;
 	len = read(cx->sfd, cx->input.data + cx->input.wpos, request);
+	metrics_add(&cx->metrics.reads, 1);
 
 	if (len <= 0) {
 		debug(1, "read error %d \"%s\"\n", errno, strerror(errno));
@@ -734,6 +1212,21 @@ vnc_read_ready(struct connection *cx)
 
 	debug(3, "len=%li\n", len);
 
+	vnc_received(cx, len);
+
+	return 0;
+}
+
+/* Act on len bytes from the server, just added after the end of the
+ * input buffer. They come from the socket, or from a recording.
+ */
+void
+vnc_received(struct connection *cx, int len)
+{
+	record_data(cx, cx->input.data + cx->input.wpos, len);
+
+	cx->cost.received += len;
+	metrics_add(&cx->metrics.bytes_in, len);
 	if (cx->bw.counting) {
 		if (!cx->bw.count)
 			bandwidth_start(cx, len);
@@ -742,10 +1235,10 @@ vnc_read_ready(struct connection *cx)
 	}
 
 	cx->input.wpos += len;
+	metrics_max(&cx->metrics.input_high_water,
+		cx->input.wpos - cx->input.rpos);
 
 	while (cx->action(cx));
-
-	return 0;
 }
 
 /* Called when the socket is ready for writing */
@@ -790,6 +1283,7 @@ destroy_wire_stem(struct connection *cx)
 #endif
 	cx->wire_stem = NULL;
 	memcpy(&cx->wire_mode, &cx->mode, sizeof(ggi_mode));
+	convert_reset(&cx->convert);
 }
 
 static int
@@ -869,6 +1363,25 @@ create_wire_stem(struct connection *cx)
 	return 0;
 }
 
+static int bind_pixel_ops(struct connection *cx);
+
+/* Point the decoders at the stem that currently receives wire pixels
+ * and let the active encoding pick up the change.
+ */
+static int
+stem_changed(struct connection *cx)
+{
+	surface_bind(&cx->surface, cx->wire_stem ? cx->wire_stem : cx->stem);
+
+	if (bind_pixel_ops(cx))
+		return -1;
+
+	if (cx->stem_change)
+		return cx->stem_change(cx);
+
+	return 0;
+}
+
 static int
 delete_wire_stem(struct connection *cx)
 {
@@ -895,10 +1408,7 @@ delete_wire_stem(struct connection *cx)
 
 	destroy_wire_stem(cx);
 
-	if (cx->stem_change)
-		return cx->stem_change(cx);
-
-	return 0;
+	return stem_changed(cx);
 }
 
 static int
@@ -918,10 +1428,7 @@ add_wire_stem(struct connection *cx)
 	ggiSetWriteFrame(cx->stem, ggiGetDisplayFrame(cx->stem));
 	ggiSetReadFrame(cx->stem, ggiGetDisplayFrame(cx->stem));
 
-	if (cx->stem_change)
-		return cx->stem_change(cx);
-
-	return 0;
+	return stem_changed(cx);
 }
 
 static int
@@ -961,6 +1468,62 @@ need_wire_stem(struct connection *cx, const char *pixfmt)
 	return 0;
 }
 
+/* Bind the pixel kernels matching the wire pixel format. cpixel_ops
+ * is the "compressed pixel" flavor used by ZRLE and TRLE, where a
+ * 32-bit pixel is sent as 3 bytes if the color fits in 24 bits.
+ * Without a wire stem, a packed local visual gets kernels that write
+ * 3-byte pixels.
+ */
+static int
+bind_pixel_ops(struct connection *cx)
+{
+	int c_max;
+	int r_max, g_max, b_max;
+	int r_shift, g_shift, b_shift;
+	int size, depth;
+	int swap;
+	uint32_t mask;
+
+	if (parse_pixfmt(cx->wire_pixfmt, &c_max,
+		&r_max, &g_max, &b_max,
+		&r_shift, &g_shift, &b_shift,
+		&size, &depth))
+	{
+		return -1;
+	}
+
+	size = (size + 7) & ~7;
+	if (size == 24)
+		size = 32;
+
+	swap = cx->wire_endian != cx->local_endian;
+
+	if (cx->local_packed && !cx->wire_stem) {
+		cx->pixel_ops = pixel_ops_lookup_packed(size / 8,
+			cx->wire_endian);
+		cx->cpixel_ops = pixel_ops_lookup_packed(3, cx->wire_endian);
+		return cx->pixel_ops ? 0 : -1;
+	}
+
+	cx->pixel_ops = pixel_ops_lookup(size / 8, cx->wire_endian, swap, 0);
+	if (!cx->pixel_ops)
+		return -1;
+	cx->cpixel_ops = cx->pixel_ops;
+
+	if (size != 32)
+		return 0;
+
+	mask = ((uint32_t)r_max << r_shift)
+		| ((uint32_t)g_max << g_shift)
+		| ((uint32_t)b_max << b_shift);
+	if (!(mask & 0xff000000))
+		cx->cpixel_ops = pixel_ops_lookup(3, cx->wire_endian, swap, 0);
+	else if (!(mask & 0xff))
+		cx->cpixel_ops = pixel_ops_lookup(3, cx->wire_endian, swap, 8);
+
+	return 0;
+}
+
 static int
 vnc_set_pixel_format(struct connection *cx)
 {
@@ -1007,6 +1570,7 @@ vnc_set_pixel_format(struct connection *cx)
 
 	memcpy(&cx->wire_mode, &cx->mode, sizeof(ggi_mode));
 	destroy_wire_stem(cx);
+	damage_all(cx);
 
 	if (need_wire_stem(cx, cx->wire_pixfmt))
 		crossblit = 1;
@@ -1022,6 +1586,11 @@ vnc_set_pixel_format(struct connection *cx)
 			return -1;
 	}
 
+	if (bind_pixel_ops(cx)) {
+		destroy_wire_stem(cx);
+		return -1;
+	}
+
 	if (safe_write(cx, buf, sizeof(buf))) {
 		destroy_wire_stem(cx);
 		return -1;
@@ -1055,6 +1624,7 @@ vnc_set_encodings(struct connection *cx)
 
 	res = safe_write(cx, buf, 4 + 4 * cx->encoding_count);
 	free(buf);
+	record_encodings(cx);
 
 	return res;
 }
@@ -1074,6 +1644,9 @@ vnc_update_request(struct connection *cx, int incremental)
 		cx->width, cx->height,
 		incremental ? "incr" : "full");
 
+	bandwidth_request(cx);
+	latency_request(cx);
+
 	return safe_write(cx, buf, sizeof(buf));
 }
 
@@ -1091,6 +1664,9 @@ vnc_key(struct connection *cx, int down, uint32_t key)
 
 	debug(2, "key %08x %s\n", key, down ? "down" : "up");
 
+	bandwidth_input(cx);
+	latency_input(cx, "key");
+
 	return safe_write(cx, buf, sizeof(buf));
 }
 
@@ -1107,6 +1683,7 @@ vnc_pointer(struct connection *cx, int buttons, int x, int y)
 		return 0;
 
 	debug(2, "pointer\n");
+	latency_input(cx, "pointer");
 
 	return safe_write(cx, buf, sizeof(buf));
 }
@@ -1197,88 +1774,472 @@ vnc_unexpected(struct connection *cx)
 	return close_connection(cx, -1);
 }
 
-static void
-render_update(struct connection *cx)
+/* Move the damaged parts of the wire stem (if any) to the visible area
+ * and translate the damage to stem coordinates. Returns the number of
+ * damaged boxes, or -1 if everything must be assumed damaged.
+ */
+static int
+render_damage(struct connection *cx)
 {
-	int d_frame, w_frame;
+	struct damage *damage = &cx->damage;
+	int i, n = 0;
+	int x0, y0, x1, y1;
+
+	if (cx->wire_stem)
+		debug(2, "convert\n");
+
+	if (damage->full) {
+		if (cx->wire_stem)
+			convert_blit(&cx->convert, cx->wire_stem,
+				cx->slide.x, cx->slide.y,
+				cx->area.x, cx->area.y,
+				cx->stem,
+				cx->offset.x, cx->offset.y);
+		return -1;
+	}
 
-	d_frame = ggiGetDisplayFrame(cx->stem);
-	w_frame = ggiGetWriteFrame(cx->stem);
+	if (!cx->wire_stem)
+		return damage->count;
+
+	for (i = 0; i < damage->count; ++i) {
+		x0 = damage->box[i].tl.x;
+		y0 = damage->box[i].tl.y;
+		x1 = damage->box[i].br.x;
+		y1 = damage->box[i].br.y;
+		if (x0 < cx->slide.x)
+			x0 = cx->slide.x;
+		if (y0 < cx->slide.y)
+			y0 = cx->slide.y;
+		if (x1 > cx->slide.x + cx->area.x)
+			x1 = cx->slide.x + cx->area.x;
+		if (y1 > cx->slide.y + cx->area.y)
+			y1 = cx->slide.y + cx->area.y;
+		if (x0 >= x1 || y0 >= y1)
+			continue;
 
-	if (cx->wire_stem) {
-		debug(2, "crossblit\n");
-		ggiCrossBlit(cx->wire_stem,
-			cx->slide.x, cx->slide.y,
-			cx->area.x, cx->area.y,
+		convert_blit(&cx->convert, cx->wire_stem,
+			x0, y0, x1 - x0, y1 - y0,
 			cx->stem,
-			cx->offset.x, cx->offset.y);
+			x0 - cx->slide.x + cx->offset.x,
+			y0 - cx->slide.y + cx->offset.y);
+
+		x0 += cx->offset.x - cx->slide.x;
+		y0 += cx->offset.y - cx->slide.y;
+		x1 += cx->offset.x - cx->slide.x;
+		y1 += cx->offset.y - cx->slide.y;
+		damage->box[n].tl.x = x0;
+		damage->box[n].tl.y = y0;
+		damage->box[n].br.x = x1;
+		damage->box[n].br.y = y1;
+		++n;
 	}
-	if (cx->flush_hook)
-		cx->flush_hook(cx->flush_hook_data);
 
-	ggiSetDisplayFrame(cx->stem, w_frame);
+	return n;
+}
 
-	ggiFlush(cx->stem);
+static void
+present_start(struct connection *cx)
+{
+	MutexLocker lock(&cx->session->present_lock);
 
-	// if (d_frame == w_frame)
-	// 	return;
+	memset(&cx->present, 0, sizeof(cx->present));
+	cx->present.hold = cx->session->hold_updates;
+	cx->thumb.held = 0;
+	cx->session->present_stem = cx->stem;
+}
 
-	// ggiSetWriteFrame(cx->stem, d_frame);
-	// ggiCopyBox(cx->stem,
-	// 	cx->offset.x, cx->offset.y,
-	// 	cx->width, cx->height,
-	// 	cx->offset.x, cx->offset.y);
-	// ggiSetReadFrame(cx->stem, d_frame);
+static void
+present_stop(struct connection *cx)
+{
+	MutexLocker lock(&cx->session->present_lock);
 
-	// if (cx->post_flush_hook)
-	// 	cx->post_flush_hook(cx->flush_hook_data);
+	cx->session->present_stem = NULL;
+}
 
-	if (d_frame != w_frame)
-        {
-            ggiSetWriteFrame(cx->stem, d_frame);
-            ggiCopyBox(cx->stem,
-                    cx->offset.x, cx->offset.y,
-                    cx->width, cx->height,
-                    cx->offset.x, cx->offset.y);
-            ggiSetReadFrame(cx->stem, d_frame);
+/* The pixels the consumer gets to see, those of the display frame. */
+static void
+present_buffer(struct connection *cx, ggivnc::Frame *frame)
+{
+	const ggi_directbuffer *db = NULL;
+	int display = ggiGetDisplayFrame(cx->stem);
+	int i;
 
-            if (cx->post_flush_hook)
-                    cx->post_flush_hook(cx->flush_hook_data);
+	for (i = ggiDBGetNumBuffers(cx->stem); i--;) {
+		db = ggiDBGetBuffer(cx->stem, i);
+		if (db && db->frame == display)
+			break;
+	}
 
-        }
+	frame->width = cx->mode.virt.x;
+	frame->height = cx->mode.virt.y;
+	if (i >= 0 && (db->type & GGI_DB_SIMPLE_PLB)) {
+		frame->buffer = (const uint8_t *)db->read;
+		frame->stride = db->buffer.plb.stride;
+	}
+	else {
+		/* The memory target packs the rows of a buffer it is given. */
+		frame->buffer = cx->session->target_frame_buffer;
+		frame->stride = (frame->width
+			* GT_SIZE(cx->mode.graphtype) + 7) / 8;
+	}
+	frame->format = cx->local_pixfmt;
+}
 
-        // static int count = 0;
-        // qDebug() << "update_frame" << ++count;
-        int numbufs = ggiDBGetNumBuffers( cx->stem );
-        const ggi_directbuffer *db;
-        db = ggiDBGetBuffer( cx->stem, 0 );
-        // if( !db->type & GGI_DB_SIMPLE_PLB )
-        // {
-        //     qDebug() << "We don't handle anything but simple pixel-linear buffer";
-        // }
+/* Other processes get the frame from the export ring. Only the parts
+ * that changed are copied, the ring keeps track of what each slot is
+ * missing.
+ */
+static void
+present_export(struct connection *cx, const ggivnc::Frame *frame)
+{
+	struct export_rect box[PRESENT_BOXES];
+	int i;
 
-        // qDebug() << "[vnc.cpp] gBufferRenderedEvent";
-        gBufferRenderedEvent();
+	if (!frame->buffer || !frame->stride)
+		return;
 
+	for (i = 0; i < frame->dirtyCount; ++i) {
+		box[i].x = frame->dirty[i].x;
+		box[i].y = frame->dirty[i].y;
+		box[i].width = frame->dirty[i].width;
+		box[i].height = frame->dirty[i].height;
+	}
+	if (export_publish(cx->frame_export, frame->buffer,
+		frame->width, frame->height, frame->stride,
+		ggiGetPixelFormat(cx->stem)->size / 8, frame->format,
+		box, frame->dirtyCount, frame->timestamp))
+	{
+		debug(1, "export of frame %u failed\n", frame->number);
+	}
 }
 
 static void
-set_scrollbars(struct connection *cx)
+present_notify(struct connection *cx)
 {
-	if (cx->slide.x + cx->area.x > cx->width)
-		cx->slide.x = cx->width - cx->area.x;
-	if (cx->slide.x < 0)
-		cx->slide.x = 0;
-	cx->sx = cx->slide.x;
+	struct present *present = &cx->present;
+	ggivnc::Frame frame;
+	ggivnc::Rect dirty[PRESENT_BOXES];
+	int i;
 
-	if (cx->slide.y + cx->area.y > cx->height)
-		cx->slide.y = cx->height - cx->area.y;
-	if (cx->slide.y < 0)
-		cx->slide.y = 0;
-	cx->sy = cx->slide.y;
+	frame.number = ++present->notified;
+	present_buffer(cx, &frame);
+	if (present->boxes <= 0) {
+		dirty[0].x = present->tl.x;
+		dirty[0].y = present->tl.y;
+		dirty[0].width = present->br.x - present->tl.x;
+		dirty[0].height = present->br.y - present->tl.y;
+		frame.dirtyCount = 1;
+	}
+	else {
+		for (i = 0; i < present->boxes; ++i) {
+			dirty[i].x = present->box[i].tl.x;
+			dirty[i].y = present->box[i].tl.y;
+			dirty[i].width =
+				present->box[i].br.x - present->box[i].tl.x;
+			dirty[i].height =
+				present->box[i].br.y - present->box[i].tl.y;
+		}
+		frame.dirtyCount = present->boxes;
+	}
+	frame.dirty = dirty;
+	frame.timestamp = present->drawn;
+
+	if (present->pending > 1)
+		debug(2, "present %u, %d updates merged\n",
+			frame.number, present->pending);
+
+	present->pending = 0;
+	metrics_add(&cx->metrics.frames, 1);
+	latency_present(cx, frame.number);
+	if (cx->frame_export)
+		present_export(cx, &frame);
+	cx->session->rendered(frame);
 }
 
-static int
+/* Carry the damage of a finished update over to the thumbnail. */
+static void
+thumbnail_update(struct connection *cx, int boxes)
+{
+	struct thumbnail *th = &cx->thumb;
+	int i;
+
+	if (th->src_width != cx->width || th->src_height != cx->height) {
+		if (!thumbnail_supported(ggiGetPixelFormat(cx->stem))) {
+			debug(0, "thumbnail: unsupported pixfmt %s\n",
+				cx->local_pixfmt);
+			th->interval = 0;
+		}
+		else if (thumbnail_resize(th, cx->width, cx->height)) {
+			debug(0, "thumbnail: out of memory\n");
+			th->interval = 0;
+		}
+		return;
+	}
+	if (boxes < 0)
+		thumbnail_damage(th, 0, 0, cx->width, cx->height);
+	for (i = 0; i < boxes; ++i)
+		thumbnail_damage(th,
+			cx->damage.box[i].tl.x - cx->offset.x,
+			cx->damage.box[i].tl.y - cx->offset.y,
+			cx->damage.box[i].br.x - cx->damage.box[i].tl.x,
+			cx->damage.box[i].br.y - cx->damage.box[i].tl.y);
+}
+
+/* Hand out the thumbnail if it has changed and the interval is up, and
+ * send an update request that waited for the interval.
+ */
+static void
+thumbnail_tick(struct connection *cx)
+{
+	struct thumbnail *th = &cx->thumb;
+	ggivnc::Frame frame;
+	ggivnc::Rect dirty;
+	ggi_coord tl, br;
+	uint64_t now;
+
+	if (!th->interval)
+		return;
+	now = metrics_clock();
+	if (now < th->next)
+		return;
+
+	if (th->damaged) {
+		present_buffer(cx, &frame);
+		if (!frame.buffer || !frame.stride) {
+			debug(0, "thumbnail: no direct access to the frame\n");
+			th->interval = 0;
+			return;
+		}
+		thumbnail_render(th, frame.buffer +
+			cx->offset.y * frame.stride + cx->offset.x * 4,
+			frame.stride, &tl, &br);
+
+		dirty.x = tl.x;
+		dirty.y = tl.y;
+		dirty.width = br.x - tl.x;
+		dirty.height = br.y - tl.y;
+		frame.number = ++th->number;
+		frame.buffer = (const uint8_t *)th->pixels;
+		frame.width = th->width;
+		frame.height = th->height;
+		frame.stride = th->width * 4;
+		frame.dirty = &dirty;
+		frame.dirtyCount = 1;
+		frame.timestamp = cx->present.drawn;
+		cx->session->thumbnailed(frame);
+		th->next = now + th->interval;
+	}
+
+	if (th->held) {
+		th->held = 0;
+		if (vnc_update_request(cx, 1))
+			close_connection(cx, -1);
+	}
+}
+
+/* Updates only feed the thumbnail, so they are not needed more often. */
+static inline int
+thumbnail_only(struct connection *cx)
+{
+	return cx->thumb.interval && !cx->frame_export
+		&& cx->session->rendered.empty();
+}
+
+/* When the loop has to wake up next on its own, 0 if never. */
+static uint64_t
+loop_deadline(struct connection *cx)
+{
+	uint64_t deadline = 0;
+
+	if (cx->thumb.interval && (cx->thumb.damaged || cx->thumb.held))
+		deadline = cx->thumb.next;
+	if (cx->latency.bench_count &&
+		(!deadline || cx->latency.bench_next < deadline))
+	{
+		deadline = cx->latency.bench_next;
+	}
+	if (cx->record.data &&
+		(!deadline || replay_deadline(cx) < deadline))
+	{
+		deadline = replay_deadline(cx);
+	}
+	return deadline;
+}
+
+static inline int
+present_busy(struct connection *cx)
+{
+	return cx->present.acking
+		&& cx->present.acked != cx->present.notified;
+}
+
+/* Merge the area of a finished update into the dirty region and hand
+ * it to the consumer, unless the consumer is still busy with the last
+ * frame. boxes is what render_damage returned.
+ */
+static void
+present_frame(struct connection *cx, int boxes)
+{
+	struct present *present = &cx->present;
+	int i;
+
+	if (!present->pending) {
+		present->tl.x = present->tl.y = 0x7fff;
+		present->br.x = present->br.y = 0;
+		present->boxes = 0;
+	}
+	++present->pending;
+	present->drawn = metrics_clock();
+
+	if (boxes < 0) {
+		present->tl.x = cx->offset.x;
+		present->tl.y = cx->offset.y;
+		present->br.x = cx->offset.x + cx->width;
+		present->br.y = cx->offset.y + cx->height;
+		present->boxes = -1;
+	}
+	else if (present->boxes >= 0 &&
+		present->boxes + boxes <= PRESENT_BOXES)
+	{
+		memcpy(&present->box[present->boxes], cx->damage.box,
+			boxes * sizeof(present->box[0]));
+		present->boxes += boxes;
+	}
+	else
+		present->boxes = -1;
+	for (i = 0; i < boxes; ++i) {
+		if (present->tl.x > cx->damage.box[i].tl.x)
+			present->tl.x = cx->damage.box[i].tl.x;
+		if (present->tl.y > cx->damage.box[i].tl.y)
+			present->tl.y = cx->damage.box[i].tl.y;
+		if (present->br.x < cx->damage.box[i].br.x)
+			present->br.x = cx->damage.box[i].br.x;
+		if (present->br.y < cx->damage.box[i].br.y)
+			present->br.y = cx->damage.box[i].br.y;
+	}
+	if (present->tl.x > present->br.x)
+		present->tl = present->br;
+
+	if (!present_busy(cx))
+		present_notify(cx);
+
+	if (cx->thumb.interval) {
+		thumbnail_update(cx, boxes);
+		thumbnail_tick(cx);
+	}
+}
+
+static int
+present_ack(struct connection *cx, unsigned int frame)
+{
+	struct present *present = &cx->present;
+
+	debug(3, "present ack %u\n", frame);
+	latency_ack(cx, frame);
+
+	present->acking = 1;
+	if ((int)(frame - present->acked) > 0)
+		present->acked = frame;
+	if (present_busy(cx))
+		return 0;
+
+	if (present->pending)
+		present_notify(cx);
+
+	if (present->held) {
+		present->held = 0;
+		return vnc_update_request(cx, 1);
+	}
+	return 0;
+}
+
+/* Ask for the next incremental update, or note that it is to be asked
+ * for once the consumer has caught up.
+ */
+static int
+present_update_request(struct connection *cx, int incremental)
+{
+	if (incremental && cx->present.hold && present_busy(cx)) {
+		cx->present.held = 1;
+		return 0;
+	}
+	if (incremental && thumbnail_only(cx)
+		&& metrics_clock() < cx->thumb.next)
+	{
+		cx->thumb.held = 1;
+		return 0;
+	}
+	return vnc_update_request(cx, incremental);
+}
+
+static void
+render_update(struct connection *cx)
+{
+	int d_frame, w_frame;
+	int boxes;
+	int i;
+	uint64_t start = metrics_clock();
+
+	d_frame = ggiGetDisplayFrame(cx->stem);
+	w_frame = ggiGetWriteFrame(cx->stem);
+
+	boxes = render_damage(cx);
+
+	if (cx->flush_hook)
+		cx->flush_hook(cx->flush_hook_data);
+
+	ggiSetDisplayFrame(cx->stem, w_frame);
+
+	ggiFlush(cx->stem);
+
+	/* Bring the new write frame up to date. It matched the frame just
+	 * flipped in before this update, so only the damage needs to be
+	 * copied over.
+	 */
+	if (d_frame != w_frame) {
+		ggiSetWriteFrame(cx->stem, d_frame);
+		if (boxes < 0)
+			ggiCopyBox(cx->stem,
+				cx->offset.x, cx->offset.y,
+				cx->width, cx->height,
+				cx->offset.x, cx->offset.y);
+		for (i = 0; i < boxes; ++i)
+			ggiCopyBox(cx->stem,
+				cx->damage.box[i].tl.x, cx->damage.box[i].tl.y,
+				cx->damage.box[i].br.x - cx->damage.box[i].tl.x,
+				cx->damage.box[i].br.y - cx->damage.box[i].tl.y,
+				cx->damage.box[i].tl.x, cx->damage.box[i].tl.y);
+		ggiSetReadFrame(cx->stem, d_frame);
+
+		if (cx->post_flush_hook)
+			cx->post_flush_hook(cx->flush_hook_data);
+	}
+
+	cx->damage.full = 0;
+	cx->damage.count = 0;
+
+	metrics_record(&cx->metrics.present_ns, metrics_clock() - start);
+
+	present_frame(cx, boxes);
+}
+
+static void
+set_scrollbars(struct connection *cx)
+{
+	if (cx->slide.x + cx->area.x > cx->width)
+		cx->slide.x = cx->width - cx->area.x;
+	if (cx->slide.x < 0)
+		cx->slide.x = 0;
+	cx->sx = cx->slide.x;
+
+	if (cx->slide.y + cx->area.y > cx->height)
+		cx->slide.y = cx->height - cx->area.y;
+	if (cx->slide.y < 0)
+		cx->slide.y = 0;
+	cx->sy = cx->slide.y;
+}
+
+static int
 vnc_resize(struct connection *cx, ggi_mode *mode)
 {
 	int del_wire_stem = 0;
@@ -1291,6 +2252,8 @@ vnc_resize(struct connection *cx, ggi_mode *mode)
 	{
 		return 0;
 	}
+
+	damage_all(cx);
 	if ((mode->visible.x < cx->width || mode->visible.y < cx->height) &&
 		cx->mode.visible.x >= cx->width &&
 		cx->mode.visible.y >= cx->height)
@@ -1407,6 +2370,7 @@ wire_mode_switch(struct connection *cx,
 		pixfmt, wire_size.x, wire_size.y, do_need_wire_stem);
 
 	render_update(cx);
+	damage_all(cx);
 
 	if (!(did_need_wire_stem & do_need_wire_stem & 2)) {
 		if (did_need_wire_stem != do_need_wire_stem) {
@@ -1492,6 +2456,8 @@ wire_mode_switch(struct connection *cx,
 	set_scrollbars(cx);
 
 	strcpy(cx->wire_pixfmt, pixfmt);
+	if (bind_pixel_ops(cx))
+		return -1;
 
 	if (cx->wire_stem) {
 		cx->wire_mode.visible.x = cx->width;
@@ -1506,10 +2472,8 @@ wire_mode_switch(struct connection *cx,
 			return -1;
 		}
 
-		if (cx->stem_change) {
-			if (cx->stem_change(cx))
-				return -1;
-		}
+		if (stem_changed(cx))
+			return -1;
 	}
 	else if (add_wire) {
 		if (add_wire_stem(cx))
@@ -1570,14 +2534,20 @@ vnc_update_rect(struct connection *cx)
 
 	debug(2, "update_rect\n");
 
+	if (cx->cost.active) {
+		latency_rect(cx, cx->cost.encoding);
+		cost_rect_end(cx);
+	}
+
 	if (!cx->rects) {
+		latency_decoded(cx);
 		if (cx->bw.count) {
 			if (bandwidth_end(cx))
 				return close_connection(cx, -1);
 		}
 		cx->bw.counting = 0;
 
-		if (vnc_update_request(cx, !cx->desktop_size))
+		if (present_update_request(cx, !cx->desktop_size))
 			return close_connection(cx, -1);
 		cx->desktop_size = 0;
 		render_update(cx);
@@ -1606,7 +2576,15 @@ vnc_update_rect(struct connection *cx)
 	debug(2, "encoding %d, x=%d y=%d w=%d h=%d\n",
 		encoding, cx->x, cx->y, cx->w, cx->h);
 
-	switch (encoding) {
+	/* Pseudo encodings are negative or large, they draw nothing. */
+	if (encoding <= 16) {
+		damage_add(cx, cx->x, cx->y, cx->w, cx->h);
+		surface_bind(&cx->surface,
+			cx->wire_stem ? cx->wire_stem : cx->stem);
+		cost_rect_start(cx, encoding, cx->w * cx->h);
+	}
+
+	switch ((int32_t)encoding) {
 	case 0:
 		cx->action = vnc_raw;
 		break;
@@ -1684,6 +2662,9 @@ vnc_update(struct connection *cx)
 
 	cx->input.rpos += 4;
 
+	metrics_add(&cx->metrics.updates, 1);
+	latency_update(cx, cx->rects);
+	bandwidth_response(cx);
 	cx->bw.counting = cx->auto_encoding;
 	cx->bw.count = 0;
 
@@ -1721,6 +2702,7 @@ vnc_palette(struct connection *cx)
 	ggiSetPalette(cx->wire_stem, first, count, clut);
 
 	debug(3, "palette crossblit\n");
+	damage_all(cx);
 	render_update(cx);
 	remove_dead_data(&cx->input);
 	cx->action = vnc_wait;
@@ -2048,32 +3030,137 @@ auto_scroll(struct connection *cx, uint8_t buttons, int x, int y)
 		return;
 
 	debug(3, "auto_scroll crossblit\n");
+	damage_all(cx);
 	render_update(cx);
 	if (vnc_pointer(cx, buttons, x + cx->slide.x, y + cx->slide.y))
 		close_connection(cx, -1);
 }
 #endif /* HAVE_WIDGETS */
 
+/* --latency-bench. Move the pointer across the desktop at a steady
+ * pace, so that a server that draws the pointer into the framebuffer
+ * answers each move with an update. Returns 1 once done, after a grace
+ * period for the last answer.
+ */
 static int
-loop(struct connection *cx)
+latency_bench_tick(struct connection *cx)
+{
+	struct latency *lat = &cx->latency;
+	uint64_t now = metrics_clock();
+	int x, y;
+
+	if (!lat->bench_count || now < lat->bench_next)
+		return 0;
+	if (lat->bench_sent == lat->bench_count) {
+		latency_report(cx);
+		return 1;
+	}
+
+	x = lat->bench_sent * 7 % (cx->width > 1 ? cx->width : 1);
+	y = lat->bench_sent * 5 % (cx->height > 1 ? cx->height : 1);
+	if (vnc_pointer(cx, 0, x, y))
+		close_connection(cx, -1);
+	++lat->bench_sent;
+	lat->bench_next = now + (lat->bench_sent == lat->bench_count ?
+		1000000000 : lat->bench_period);
+	return 0;
+}
+
+/* Send what other threads have queued with sendGgivncInput. */
+static void
+input_send(struct connection *cx)
+{
+	struct inputq *q = &cx->session->input;
+	uint8_t buf[4096];
+	int len, keys;
+
+	inputq_rearm(q);
+	while ((len = inputq_pop(q, buf, sizeof(buf), &keys)) > 0) {
+		if (cx->no_input)
+			continue;
+		debug(2, "input, %d bytes\n", len);
+		if (keys)
+			bandwidth_input(cx);
+		latency_input(cx, "queued");
+		if (safe_write(cx, buf, len)) {
+			close_connection(cx, -1);
+			return;
+		}
+	}
+}
+
+static void
+loop_start(struct connection *cx)
+{
+	struct inputq *q = &cx->session->input;
+	uint8_t buf[256];
+	int keys;
+
+	memset(&cx->pointer, 0, sizeof(cx->pointer));
+	cx->latency.bench_sent = 0;
+	cx->latency.bench_next = metrics_clock() + 1000000000;
+
+	/* Stale input, from before the viewer ran. */
+	inputq_rearm(q);
+	while (inputq_pop(q, buf, sizeof(buf), &keys));
+
+#ifdef HAVE_WMH
+	ggiWmhAllowResize(cx->stem, 40, 40, cx->width, cx->height, 1, 1);
+#endif
+}
+
+/* One round of the viewer loop: wait at most tv (forever if NULL) for
+ * the server or for input, and handle what arrived. Returns -1 to go
+ * on, otherwise what loop() returns.
+ */
+static int
+loop_step(struct connection *cx, struct timeval *tv)
 {
-	static uint8_t buttons;
-	static int x, y, wheel;
+	uint8_t buttons = cx->pointer.buttons;
+	int x = cx->pointer.x, y = cx->pointer.y;
+	int wheel = cx->pointer.wheel;
 	int done = 0;
 	int n;
 	int res;
 	gii_event event;
 	gii_event req_event;
 	ggi_cmddata_switchrequest swreq;
+	struct timeval until;
+	uint64_t deadline, now, wait;
 
-#ifdef HAVE_WMH
-	ggiWmhAllowResize(cx->stem, 40, 40, cx->width, cx->height, 1, 1);
-#endif
-
-again:
 	req_event.any.size = 0;
 
-	giiEventPoll(cx->stem, emAll, NULL);
+	deadline = loop_deadline(cx);
+	if (deadline) {
+		now = metrics_clock();
+		wait = deadline > now ? deadline - now : 0;
+		if (!tv || (uint64_t)tv->tv_sec * 1000000000 +
+			tv->tv_usec * 1000 > wait)
+		{
+			until.tv_sec = wait / 1000000000;
+			until.tv_usec = wait % 1000000000 / 1000;
+			tv = &until;
+		}
+	}
+
+	/* Never block with input waiting to be sent. */
+	if (inputq_signalled(&cx->session->input)) {
+		until.tv_sec = until.tv_usec = 0;
+		tv = &until;
+	}
+
+	giiEventPoll(cx->stem, emAll, tv);
+	if (vnc_cancelled(cx))
+		return 0;
+	if (inputq_signalled(&cx->session->input))
+		input_send(cx);
+	if (deadline) {
+		thumbnail_tick(cx);
+		if (latency_bench_tick(cx))
+			done = 1;
+		if (replay_tick(cx))
+			done = 1;
+	}
 	n = giiEventsQueued(cx->stem, emAll);
 
 	while (n-- && !cx->close_connection) {
@@ -2284,6 +3371,17 @@ again:
 					break;
 				}
 				break;
+			case PRESENT_ACK_CMD:
+				if (event.cmd.origin != GII_EV_ORIGIN_SENDEVENT)
+					break;
+				{
+					unsigned int frame;
+					memcpy(&frame, event.cmd.data,
+						sizeof(frame));
+					if (present_ack(cx, frame))
+						close_connection(cx, -1);
+				}
+				break;
 			case GGICMD_REQUEST_SWITCH:
 				memcpy(&swreq, event.cmd.data, sizeof(swreq));
 				if (swreq.request == GGI_REQSW_MODE)
@@ -2332,6 +3430,11 @@ again:
 #endif
 	}
 
+	cx->pointer.buttons = buttons;
+	cx->pointer.x = x;
+	cx->pointer.y = y;
+	cx->pointer.wheel = wheel;
+
 	if (cx->close_connection)
 		return cx->close_connection;
 	if (done)
@@ -2345,13 +3448,33 @@ again:
 		}
 	}
 
-	goto again;
+	return -1;
+}
+
+static int
+loop(struct connection *cx)
+{
+	int res;
+
+	loop_start(cx);
+	do
+		res = loop_step(cx, NULL);
+	while (res == -1);
+
+	return res;
 }
 
 void
 select_mode(struct connection *cx)
 {
-	const char *str = getenv("GGI_DEFMODE");
+	const std::string &defmode = cx->session->defmode;
+	const char *str;
+
+	/* The environment is for the process, the session may say more. */
+	if (!defmode.empty())
+		str = defmode.c_str();
+	else
+		str = getenv("GGI_DEFMODE");
 
 	if (!str) {
 		cx->mode.frames = 2;
@@ -2388,61 +3511,31 @@ select_mode(struct connection *cx)
 		cx->mode.frames = 2;
 }
 
+int
+vnc_cancelled(struct connection *cx)
+{
+	return cx->session &&
+		__atomic_load_n(&cx->session->render_stop, __ATOMIC_ACQUIRE);
+}
+
 static int
 vnc_connect(struct connection *cx)
 {
-	struct addrinfo *ai, *gai;
-	struct addrinfo hints;
-	int res;
-	char port[20];
-
-	memset(&hints, '\0', sizeof(hints));
-#ifdef AI_ADDRCONFIG
-	hints.ai_flags = AI_ADDRCONFIG;
-#endif
-	hints.ai_socktype = SOCK_STREAM;
-	switch (cx->net_family) {
-	case 4:
-		debug(1, "Using IPv4 only\n");
-		hints.ai_family = PF_INET;
-		break;
-#ifdef PF_INET6
-	case 6:
-		debug(1, "Using IPv6 only\n");
-		hints.ai_family = PF_INET6;
-		break;
-#endif
-	}
-
-	snprintf(port, sizeof(port), "%d", cx->port);
-
-	res = getaddrinfo(cx->server, port, &hints, &gai);
-	if (res) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
-		return res;
-	}
+	if (vnc_cancelled(cx))
+		return -1;
 
-	ai = gai;
-	for (ai = gai; ai; ai = ai->ai_next) {
-		res = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (res == -1) {
-			debug(1, "socket\n");
-			continue;
-		}
-		cx->sfd = res;
-		res = connect(cx->sfd, ai->ai_addr, ai->ai_addrlen);
-		if (!res)
-			break;
-		close(cx->sfd);
-		cx->sfd = -1;
-		debug(1, "connect\n");
-	}
+	cx->sfd = net_take_preconnected(cx->server, cx->port, cx->net_family);
+	if (cx->sfd != -1)
+		return 0;
 
-	if (!ai)
+	cx->sfd = net_connect(cx->server, cx->port, cx->net_family,
+		cx->cancel_fd);
+	if (cx->sfd == -1) {
 		fprintf(stderr, "cannot reach %s\n", cx->server);
+		return -1;
+	}
 
-	freeaddrinfo(gai);
-	return res;
+	return 0;
 }
 
 #define MAXSOCK	3
@@ -2539,6 +3632,19 @@ vnc_listen(struct connection *cx)
 	return cx->sfd == -1 ? -1 : 0;
 }
 
+// The viewer draws to memory, into the buffer of the session if it has
+// one, see display-memory(7). There is no window, the consumer of the
+// frames shows them if they are to be seen.
+static std::string memory_display( struct connection* cx )
+{
+    std::string display = "display-memory:-pixfmt=";
+
+    display += cx->session->pixformat;
+    display += " pointer";
+    debug( 1, "display: %s\n", display.c_str() );
+    return display;
+}
+
 #ifdef HAVE_GGNEWSTEM
 
 #ifndef HAVE_WMH
@@ -2556,8 +3662,11 @@ open_visual(struct connection *cx)
 	cx->stem = ggNewStem(libgii, libggi, libggiwmh, NULL);
 	if (!cx->stem)
 		goto err_ggexit;
-	if (ggiOpen(cx->stem, NULL) < 0)
+	if (ggiOpen(cx->stem, memory_display(cx).c_str(),
+		cx->session->target_frame_buffer) < 0)
+	{
 		goto err_ggdelstem;
+	}
 
 	if (cx->gii_input) {
 		if (giiOpen(cx->stem, cx->gii_input, NULL) <= 0)
@@ -2599,14 +3708,8 @@ open_visual(struct connection *cx)
 
 	if (ggiInit() < 0)
 		return -1;
-        // Assign target frame buffer to ggi
-        // Reference from http://manpages.ubuntu.com/manpages/intrepid/man7/display-memory.7.html
-        std::string display = "display-memory:-pixfmt=";
-        display += gPixformat;
-        display += " pointer";
-        //g.stem = e"display-memory:-pixfmt=r5g6b5 pointer", gTargetFrameBuffer );
-        qDebug() << "Display: " << display.c_str();
-        cx->stem = ggiOpen( display.c_str(), gTargetFrameBuffer );
+        cx->stem = ggiOpen( memory_display( cx ).c_str(),
+            cx->session->target_frame_buffer );
 	if (!cx->stem)
 		goto err_ggiexit;
 
@@ -2668,17 +3771,94 @@ close_visual(struct connection *cx)
 #endif
 }
 
-int ggivnc_main( int argc, char *argv[] )
+/* Free what belongs to one connection to the server. */
+static void
+connection_end(struct connection *cx)
 {
-	struct connection g;
-	struct connection *cx = &g;
 	int i;
-	int status;
-	struct gg_instance *fdselect;
 
+	if (cx->fdselect) {
+		ggClosePlugin((struct vnc_gg_instance*)cx->fdselect);
+		cx->fdselect = NULL;
+	}
+	if (cx->name)
+		free(cx->name);
+	cx->name = NULL;
+	destroy_wire_stem(cx);
+	for (i = encoding_defs - 1; i >= 0; --i) {
+		if (cx->encoding_def[i].end)
+			cx->encoding_def[i].end(cx);
+	}
+	if (cx->work.data)
+		free(cx->work.data);
+	memset(&cx->work, 0, sizeof(cx->work));
+	if (cx->vencrypt)
+		vnc_security_vencrypt_end(cx, 1);
+	if (cx->sfd != -1)
+		close(cx->sfd);
+	cx->sfd = -1;
+	bandwidth_fini(cx);
+}
+
+/* Free what is kept across reconnects. */
+static void
+session_end(struct connection *cx)
+{
+	if (cx->vencrypt)
+		vnc_security_vencrypt_end(cx, 0);
+	close_visual(cx);
+	if (cx->allow_security)
+		free(cx->allow_security);
+	if (cx->bind)
+		free(cx->bind);
+	if (cx->server)
+		free(cx->server);
+	if (cx->passwd)
+		free(cx->passwd);
+	if (cx->username)
+		free(cx->username);
+	bandwidth_unload(cx);
+	if (cx->frame_export) {
+		MutexLocker lock(&cx->session->present_lock);
+		export_destroy(cx->frame_export);
+		cx->frame_export = NULL;
+	}
+	if (cx->export_name)
+		free(cx->export_name);
+	thumbnail_free(&cx->thumb);
+	latency_end(cx);
+	record_end(cx);
+	socket_cleanup();
+}
+
+/* The locale is per process, set it up once. */
+static pthread_once_t locale_once = PTHREAD_ONCE_INIT;
+
+static void
+set_locale(void)
+{
 	setlocale(LC_ALL, "");
+}
+
+static int
+run_session(struct vnc_session *session, int argc, char *argv[])
+{
+	struct connection *cx = &session->cx;
+	int status;
+	struct gg_instance *fdselect;
 
-	memset(cx, 0, sizeof(*cx));
+	pthread_once(&locale_once, set_locale);
+
+	/* getGgivncMetrics may be reading the metrics from another thread,
+	 * so they are left to metrics_reset and its atomic stores.
+	 */
+	memset(cx, 0, offsetof(struct connection, metrics));
+	memset((char *)&cx->metrics + sizeof(cx->metrics), 0,
+		sizeof(*cx) - offsetof(struct connection, metrics)
+		- sizeof(cx->metrics));
+	cx->session = session;
+	cx->cancel_fd = session->cancel[0];
+	cx->input_fd = session->input.fd[0];
 	cx->port = 5900;
 	cx->shared = 1;
 	cx->sfd = -1;
@@ -2694,10 +3874,41 @@ int ggivnc_main( int argc, char *argv[] )
 	if (status >= 0)
 		return status;
 
+	kernels_init();
+
+	if (!cx->export_slots && session->export_slots) {
+		cx->export_slots = session->export_slots;
+		if (!session->export_name.empty()) {
+			cx->export_name = export_shm_name(
+				session->export_name.c_str(),
+				session->export_name.size());
+		}
+	}
+	if (session->thumb_interval) {
+		cx->thumb.max_width = session->thumb_width;
+		cx->thumb.max_height = session->thumb_height;
+		cx->thumb.interval = session->thumb_interval * 1000000ULL;
+	}
+
+	if (cx->export_slots) {
+		struct frame_export *ex =
+			export_create(cx->export_name, cx->export_slots);
+		if (!ex) {
+			session_end(cx);
+			return 1;
+		}
+		MutexLocker lock(&session->present_lock);
+		cx->frame_export = ex;
+	}
+
 	cx->encoding_count = cx->allowed_encodings;
 	cx->encoding = cx->allow_encoding;
 
 reconnect:
+	metrics_reset(&cx->metrics);
+	/* Requests to the last connection are never answered. */
+	cx->latency.request_head = cx->latency.request_tail = 0;
+	cx->latency.request_lost = 0;
 	if (bandwidth_init(cx)) {
 		fprintf(stderr, "out of memory\n");
 		status = 5;
@@ -2713,6 +3924,15 @@ reconnect:
 	cx->write_ready = vnc_write_ready;
 	cx->safe_write = vnc_safe_write;
 
+	if (cx->record.data) {
+		/* The recording stands in for the server. */
+		if (open_visual(cx))
+			goto err;
+		if (replay_open(cx))
+			goto err;
+		goto handshaken;
+	}
+
 	if (cx->listen) {
 		if (vnc_listen(cx))
 			goto err;
@@ -2733,6 +3953,10 @@ reconnect:
 
 			if (!vnc_connect(cx))
 				break;
+			if (vnc_cancelled(cx)) {
+				status = 0;
+				goto err;
+			}
 
 reconnect2:
 			status = get_connection(cx);
@@ -2768,6 +3992,10 @@ reconnect2:
 	cx->output.wpos = 0;
 	if (vnc_handshake(cx)) {
 		debug(1, "vnc_handshake\n");
+		if (vnc_cancelled(cx)) {
+			status = 0;
+			goto err;
+		}
 		if (cx->listen)
 			goto err;
 		if (cx->name)
@@ -2797,6 +4025,7 @@ reconnect2:
 		}
 	}
 
+handshaken:
 	select_mode(cx);
 
 	ggiCheckMode(cx->stem, &cx->mode);
@@ -2844,6 +4073,9 @@ reconnect2:
 
 	generate_pixfmt(cx->local_pixfmt, sizeof(cx->local_pixfmt),
 		ggiGetPixelFormat(cx->stem));
+	cx->local_packed = !strcmp(cx->local_pixfmt, "weird")
+		&& !packed_pixfmt(cx->local_pixfmt, sizeof(cx->local_pixfmt),
+			ggiGetPixelFormat(cx->stem));
 #ifdef GGI_BIG_ENDIAN
 	cx->local_endian = 1;
 #else
@@ -2894,6 +4126,9 @@ reconnect2:
 		cx->wire_pixfmt,
 		cx->wire_endian ? "big" : "little");
 
+	if (record_start(cx))
+		goto err;
+
 	if (vnc_set_pixel_format(cx))
 		goto err;
 
@@ -2932,49 +4167,127 @@ reconnect2:
 		ggiSetReadFrame(cx->stem, 1);
 	}
 
-	if (loop(cx))
-		goto err_closefdselect;
-
-	status = 0;
+	present_start(cx);
+	if (session->hosted) {
+		/* The engine runs the loop, see stepGgivncSession. */
+		loop_start(cx);
+		return -1;
+	}
+	if (!loop(cx))
+		status = 0;
+	present_stop(cx);
 
-err_closefdselect:
-    ggClosePlugin((struct vnc_gg_instance*)cx->fdselect);
 err:
-	if (cx->name)
-		free(cx->name);
-	destroy_wire_stem(cx);
-	for (i = encoding_defs - 1; i >= 0; --i) {
-		if (cx->encoding_def[i].end)
-			cx->encoding_def[i].end(cx);
-	}
-	if (cx->work.data)
-		free(cx->work.data);
-	if (cx->vencrypt)
-		vnc_security_vencrypt_end(cx, 1);
-	if (cx->sfd != -1)
-		close(cx->sfd);
-	bandwidth_fini(cx);
-	if (cx->close_connection) {
+	connection_end(cx);
+	/* A recording or a replay is of one connection. */
+	if (cx->close_connection && !vnc_cancelled(cx)
+		&& !cx->record.data && !cx->record.file)
+	{
 		cx->close_connection = 0;
 		if (show_reconnect(cx, 1) == 1) {
 			debug(1, "reconnect\n");
 			goto reconnect;
 		}
 	}
-	if (cx->vencrypt)
-		vnc_security_vencrypt_end(cx, 0);
-	close_visual(cx);
-	if (cx->allow_security)
-		free(cx->allow_security);
-	if (cx->bind)
-		free(cx->bind);
-	if (cx->server)
-		free(cx->server);
-	if (cx->passwd)
-		free(cx->passwd);
-	if (cx->username)
-		free(cx->username);
-	socket_cleanup();
+	session_end(cx);
+
+	return status;
+}
+
+// Run a viewer on the calling thread until it is done. A hosted session
+// returns -1 once it is connected and set up instead, and is then run
+// with stepGgivncSession. Either way the ended signal tells when the
+// viewer is gone.
+int runGgivncSession( struct vnc_session* session, int argc, char *argv[] )
+{
+	int status;
+
+	{
+		MutexLocker lock( &session->present_lock );
+
+		if( !session->running )
+		{
+			clear_render_stop( session );
+			session->running = true;
+		}
+	}
+
+	status = run_session( session, argc, argv );
+	if( status != -1 )
+	{
+		set_ended( session );
+		session->ended( status );
+	}
+	return status;
+}
+
+// Run one round of the loop of a hosted session, waiting at most tv
+// for something to happen. Returns -1 as long as the session goes on.
+int stepGgivncSession( struct vnc_session* session, struct timeval* tv )
+{
+	int res;
+
+	// Time a rectangle only while this session runs, see cost_pause.
+	cost_resume( &session->cx );
+	res = loop_step( &session->cx, tv );
+	cost_pause( &session->cx );
+	return res;
+}
+
+// Tear down a hosted session once stepGgivncSession has returned
+// something else than -1. There is no offer to reconnect.
+int endGgivncSession( struct vnc_session* session, int result )
+{
+	struct connection *cx = &session->cx;
+
+	present_stop(cx);
+	connection_end(cx);
+	session_end(cx);
+
+	result = result ? 1 : 0;
+	set_ended( session );
+	session->ended( result );
+	return result;
+}
+
+// When a hosted session has to be stepped even if its socket is quiet,
+// on the metrics_clock, or 0 if it only waits for the socket.
+uint64_t getGgivncSessionDeadline( struct vnc_session* session )
+{
+    return loop_deadline( &session->cx );
+}
+
+// The socket of a hosted session and what the loop waits for on it.
+int getGgivncSessionFd( struct vnc_session* session,
+    int* want_read, int* want_write )
+{
+    *want_read = session->cx.want_read;
+    *want_write = session->cx.want_write;
+    return session->cx.sfd;
+}
+
+void setGgivncSessionHosted( struct vnc_session* session, bool hosted )
+{
+    session->hosted = hosted;
+}
+
+// Called with the frame ack queued, so that a loop waiting for the
+// socket of another session gets to see it.
+void setGgivncSessionWake( struct vnc_session* session,
+    void (*wake)( void* data ), void* data )
+{
+    MutexLocker lock( &session->present_lock );
+
+    session->wake = wake;
+    session->wake_data = data;
+}
+
+// Run one viewer to completion on the calling thread.
+int ggivnc_main( int argc, char *argv[] )
+{
+	struct vnc_session* session = createGgivncSession();
+	int status = runGgivncSession( session, argc, argv );
 
+	destroyGgivncSession( session );
 	return status;
 }
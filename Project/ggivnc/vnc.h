@@ -37,6 +37,14 @@
 #endif
 #include <ggi/ggi.h>
 
+#include "vnc-convert.h"
+#include "vnc-metrics.h"
+#include "vnc-pixel.h"
+#include "vnc-surface.h"
+#include "vnc-thumbnail.h"
+#include "vnc-latency.h"
+#include "vnc-record.h"
+
 #ifdef HAVE_GGNEWSTEM
 typedef struct device_list {
 	GG_LIST_ENTRY(device_list) others;
@@ -50,26 +58,71 @@ struct bw_sample {
 	double interval;
 };
 
-struct bw_history {
-	struct bw_sample sample[16];
-	struct bw_sample total;
-	int index;
-};
-
+/* One encoding tier. The tier is used while the throughput estimate
+ * stays below bandwidth (Bps) or the round trip time exceeds rtt (ms).
+ * Zero means no bound; the last tier has neither.
+ */
 struct bw_table {
 	int bandwidth;
+	int rtt;
 	int32_t *encoding;
 	uint16_t count;
 };
 
+struct bw_config {
+	double alpha;		/* EWMA weight of a new throughput sample */
+	double hysteresis;	/* fraction a bound must be passed by */
+	struct bw_table *tiers;	/* from --bw-tiers, NULL for the defaults */
+};
+
 struct bandwidth {
 	int counting;
 	int count;
 	struct timeval start;
+	struct bw_sample pending;	/* too small to be a sample yet */
+	double rate;			/* EWMA throughput, Bps */
+	int requested;			/* update request in flight */
+	struct timeval request;		/* when it, or input after it, was sent */
+	double rtt_sample[8];		/* ms, windowed minimum */
+	int rtt_index;
+	double rtt;
 	int estimate;
 	int idx;
 };
 
+/* Decode cost of one encoding, as decayed sums over the rectangles
+ * decoded with it, for a least squares fit of
+ * time = ns_per_pixel * pixels + ns_per_byte * bytes.
+ */
+struct enc_cost {
+	double pp, pb, bb;	/* pixels^2, pixels*bytes, bytes^2 */
+	double tp, tb;		/* ns*pixels, ns*bytes */
+	double pixels, bytes;
+	int samples;
+	struct timeval last;	/* last sample */
+	struct timeval probed;	/* last put first to get samples */
+};
+
+struct decode_cost {
+	double received;	/* bytes read from the server */
+	int active;		/* timing a rectangle */
+	int encoding;
+	int pixels;
+	double consumed;	/* bytes parsed when the rectangle started */
+	double start;		/* thread cpu time, ns */
+	double spent;		/* in earlier steps of a hosted session */
+	int paused;		/* between steps of a hosted session */
+	double update_ns;	/* decode time in the current update */
+	struct enc_cost enc[17];	/* by encoding number */
+	int32_t front;		/* encoding put first, or -1 */
+	int probing;		/* updates left trying a probed encoding */
+	int next_probe;
+	int updates;
+	int32_t *order;
+	int32_t *next;
+	int capacity;
+};
+
 struct buffer {
 	uint8_t *data;
 	int size;
@@ -77,6 +130,43 @@ struct buffer {
 	int rpos;
 };
 
+/* Areas of the frame buffer drawn since the last render_update, in the
+ * coordinates of the visual the decoders draw to. Falls back to a single
+ * bounding box when there are more than DAMAGE_BOXES areas.
+ */
+#define DAMAGE_BOXES 16
+
+struct damage {
+	int full;
+	int count;
+	struct {
+		ggi_coord tl;
+		ggi_coord br;
+	} box[DAMAGE_BOXES];
+};
+
+/* Frames handed to the frame consumer. While the consumer has not
+ * acknowledged the last frame, further updates are merged into one
+ * dirty region and handed over with the acknowledgement.
+ */
+#define PRESENT_BOXES 16
+
+struct present {
+	int acking;		/* the consumer acknowledges frames */
+	int hold;		/* delay update requests while it is busy */
+	int held;		/* an update request waits for an ack */
+	unsigned int notified;	/* last frame handed out */
+	unsigned int acked;	/* last frame presented by the consumer */
+	int pending;		/* updates merged since last handed out */
+	ggi_coord tl, br;	/* dirty region, local visual coordinates */
+	int boxes;		/* dirty boxes, -1 if only tl, br is known */
+	struct {
+		ggi_coord tl;
+		ggi_coord br;
+	} box[PRESENT_BOXES];
+	uint64_t drawn;		/* metrics_clock() of the last update */
+};
+
 struct connection;
 
 typedef int (action_t)(struct connection *cx);
@@ -110,6 +200,15 @@ struct security {
 
 extern const struct security security_types[];
 
+struct vnc_session;
+
+/* Pointer state kept between events, which only carry part of it. */
+struct pointer_state {
+	uint8_t buttons;
+	int x, y;
+	int wheel;
+};
+
 struct connection {
 	ggi_visual_t stem;
 	const char *gii_input;
@@ -138,10 +237,13 @@ struct connection {
 	char *name;
 	char server_pixfmt[30];
 	char local_pixfmt[30];
+	int local_packed;
 	char wire_pixfmt[30];
 	int server_endian;
 	int local_endian;
 	int wire_endian;
+	const struct pixel_ops *pixel_ops;
+	const struct pixel_ops *cpixel_ops;
 	ggi_mode mode;
 	uint16_t width;
 	uint16_t height;
@@ -167,6 +269,11 @@ struct connection {
 	ggi_visual_t wire_stem;
 	ggi_mode wire_mode;
 	int wire_stem_flags;
+	struct convert convert;
+	struct damage damage;
+	struct present present;
+	struct pointer_state pointer;
+	struct surface surface;
 	int (*stem_change)(struct connection *cx);
 	int no_input;
 	int auto_encoding;
@@ -186,16 +293,42 @@ struct connection {
 	int F8_allow_release;
 	void *fdselect;
 	int file_transfer;
+	int file_window;
 	int expert;
 
 	struct bandwidth bw;
-	struct bw_history history;
+	struct bw_config bw_config;
 	struct bw_table *bw_table;
+	struct decode_cost cost;
+	struct vnc_metrics metrics;
 
 	void *visualanchor;
+
+	/* The viewer this connection belongs to, see vnc.cpp. */
+	struct vnc_session *session;
+
+	/* Readable once the viewer is asked to stop, -1 if there is none.
+	 * Everything that waits for the server waits for this too.
+	 */
+	int cancel_fd;
+
+	/* Readable while other threads have queued input. */
+	int input_fd;
+
+	/* Frames are published to this ring for other local processes,
+	 * see vnc-export.h. export_name is NULL for an anonymous memfd.
+	 */
+	char *export_name;
+	int export_slots;
+	struct frame_export *frame_export;
+
+	struct thumbnail thumb;
+	struct latency latency;
+	struct record record;
 };
 
 #define UPLOAD_FILE_FRAGMENT_CMD (GII_CMDFLAG_PRIVATE | 42)
+#define PRESENT_ACK_CMD          (GII_CMDFLAG_PRIVATE | 43)
 
 #ifndef HAVE_WIDGETS
 int show_about(struct connection *cx);
@@ -207,10 +340,12 @@ int show_reconnect(struct connection *cx, int popup);
 #endif
 
 void vnc_want_read(struct connection *cx);
+int vnc_cancelled(struct connection *cx);
 void vnc_want_write(struct connection *cx);
 void vnc_stop_read(struct connection *cx);
 void vnc_stop_write(struct connection *cx);
 int safe_write(struct connection *cx, const void *buf, int count);
+void vnc_received(struct connection *cx, int len);
 void select_mode(struct connection *cx);
 int parse_port(struct connection *cx);
 int open_visual(struct connection *cx);
@@ -221,6 +356,7 @@ int get_password(struct connection *cx, const char *uprompt, int ulen,
 int get_connection(struct connection *cx);
 int canonicalize_pixfmt(char *pixfmt, int count);
 const char *lookup_encoding(int32_t number);
+int find_encoding(const char *name, int32_t *number);
 int get_default_encodings(const int32_t **encodings);
 int color_bits(uint16_t max);
 int generate_pixfmt(char *pixfmt, int count, const ggi_pixelformat *ggi_pf);
@@ -230,6 +366,8 @@ int wire_mode_switch(struct connection *cx,
 void remove_dead_data(struct buffer *buf);
 int buffer_reserve(struct buffer *buf, int size);
 int close_connection(struct connection *cx, int code);
+void damage_add(struct connection *cx, int x, int y, int w, int h);
+void damage_all(struct connection *cx);
 int vnc_update_request(struct connection *cx, int incremental);
 int vnc_set_encodings(struct connection *cx);
 int vnc_update_rect(struct connection *cx);
@@ -268,6 +406,23 @@ void bandwidth_fini(struct connection *cx);
 void bandwidth_start(struct connection *cx, ssize_t len);
 void bandwidth_update(struct connection *cx, ssize_t len);
 int bandwidth_end(struct connection *cx);
+void bandwidth_request(struct connection *cx);
+void bandwidth_input(struct connection *cx);
+void bandwidth_response(struct connection *cx);
+int bandwidth_load(struct connection *cx, const char *file);
+void bandwidth_unload(struct connection *cx);
+
+int cost_init(struct connection *cx);
+void cost_fini(struct connection *cx);
+void cost_rect_start(struct connection *cx, int encoding, int pixels);
+void cost_rect_end(struct connection *cx);
+void cost_pause(struct connection *cx);
+void cost_resume(struct connection *cx);
+int cost_select(struct connection *cx, const struct bw_table *tier, int force);
+
+int net_connect(const char *server, int port, int family, int cancel_fd);
+int net_preconnect(const char *server, int port, int family);
+int net_take_preconnected(const char *server, int port, int family);
 
 int parse_options(struct connection *cx, int argc, char * const argv[]);
 int vencrypt_set_method(struct connection *cx, const char *method);
@@ -276,6 +431,7 @@ int vencrypt_set_ciphers(struct connection *cx, const char *ciphers);
 int vencrypt_set_priv_key(struct connection *cx, const char *priv_key);
 int vencrypt_set_verify_file(struct connection *cx, const char *verify_file);
 int vencrypt_set_verify_dir(struct connection *cx, const char *verify_dir);
+int vencrypt_set_ktls(struct connection *cx);
 
 void set_icon(void);
 int socket_init(void);